@@ -21,15 +21,27 @@ typedef enum {
 	RES_PARERR		/* 4: Invalid Parameter */
 } DRESULT;
 
+/* Sector cache counters (DISK_GET_CACHE_STATS) */
+typedef struct {
+	DWORD	hits;			/* Sector reads/writes served by the cache */
+	DWORD	misses;			/* Sector reads/writes that needed a new cache entry */
+	DWORD	coalesced;		/* Writes to a sector that was already dirty, saved a card write */
+	DWORD	writebacks;		/* Dirty sectors written to the card */
+	DWORD	lost;			/* Dirty sectors dropped as the card was swapped before they were written */
+} DISK_CACHE_STATS;
+
 
 /*---------------------------------------*/
 /* Prototypes for disk control functions */
 
 
+int ff_init_syncobj (void);		/* Create the volume mutexes, in ffsystem.c, call before the scheduler starts */
+int disk_init_lock (void);
 DSTATUS disk_initialize (BYTE pdrv);
 DSTATUS disk_status (BYTE pdrv);
 DRESULT disk_read (BYTE pdrv, BYTE* buff, DWORD sector, UINT count);
 DRESULT disk_write (BYTE pdrv, const BYTE* buff, DWORD sector, UINT count);
+DRESULT disk_write_uncached (BYTE pdrv, const BYTE* buff, DWORD sector, UINT count);
 DRESULT disk_ioctl (BYTE pdrv, BYTE cmd, void* buff);
 
 
@@ -65,6 +77,9 @@ DRESULT disk_ioctl (BYTE pdrv, BYTE cmd, void* buff);
 #define ISDIO_WRITE			56	/* Write data to SD iSDIO register */
 #define ISDIO_MRITE			57	/* Masked write data to SD iSDIO register */
 
+/* Application specific ioctl command */
+#define DISK_GET_CACHE_STATS	60	/* Get sector cache counters (DISK_CACHE_STATS) */
+
 /* ATA/CF specific ioctl command */
 #define ATA_GET_REV			20	/* Get F/W revision */
 #define ATA_GET_MODEL		21	/* Get model name */
@@ -7,20 +7,188 @@
 /* storage control modules to the FatFs module with a defined API.       */
 /*-----------------------------------------------------------------------*/
 
+#include <string.h>
+
 #include "ff.h"			/* Obtains integer types */
 #include "diskio.h"		/* Declarations of disk functions */
 
+#include "task.h"
+
 #include "sd.h"
 
+/*-----------------------------------------------------------------------*/
+/* Sector cache                                                          */
+/*-----------------------------------------------------------------------*/
+/* Single sector accesses (FAT, directory and partial file sectors) go   */
+/* through a small LRU write-back cache. Dirty sectors are written to    */
+/* the card when they are evicted or on CTRL_SYNC, so repeated updates   */
+/* of the same sector cost one card write. Multiple sector transfers     */
+/* bypass the cache and keep any cached copies up to date, and so do the */
+/* writes of disk_write_uncached, for data that has to reach the card in */
+/* the order it is written.                                              */
+/*-----------------------------------------------------------------------*/
+
+#define CACHE_RAM_BUDGET	4096						/* RAM for cached sector data [bytes] */
+#define CACHE_SECTORS		(CACHE_RAM_BUDGET / FF_MAX_SS)	/* Number of cached sectors */
+
+typedef struct {
+	DWORD	sector;			/* Cached sector in LBA */
+	DWORD	last_used;		/* Access stamp for LRU replacement */
+	BYTE	valid;
+	BYTE	dirty;
+} CACHE_ENTRY;
+
+static BYTE CacheData[CACHE_SECTORS][FF_MAX_SS] __attribute__((aligned(4)));
+static CACHE_ENTRY Cache[CACHE_SECTORS];
+static DWORD CacheClock;
+static DISK_CACHE_STATS CacheStats;
+static DWORD CacheCID[4];	/* CID of the card the cached sectors belong to */
+
+
+static CACHE_ENTRY* cache_find (
+	DWORD sector
+)
+{
+	UINT i;
+
+	for (i = 0; i < CACHE_SECTORS; i++) {
+		if (Cache[i].valid && Cache[i].sector == sector) return &Cache[i];
+	}
+	return 0;
+}
+
+
+static int cache_writeback (	/* 1:OK, 0:Card error */
+	CACHE_ENTRY* ent
+)
+{
+	if (!ent->valid || !ent->dirty) return 1;
+	if (!SD_WriteBlock(ent->sector, CacheData[ent - Cache])) return 0;
+	ent->dirty = 0;
+	CacheStats.writebacks++;
+	return 1;
+}
+
+
+static CACHE_ENTRY* cache_alloc (	/* Returns a free entry for the sector, null on card error */
+	DWORD sector
+)
+{
+	UINT i;
+	CACHE_ENTRY *ent = &Cache[0];
+
+	/* Take a free entry, or else the least recently used one */
+	for (i = 0; i < CACHE_SECTORS; i++) {
+		if (!Cache[i].valid) { ent = &Cache[i]; break; }
+		if (Cache[i].last_used < ent->last_used) ent = &Cache[i];
+	}
+	if (!cache_writeback(ent)) return 0;
+
+	ent->sector = sector;
+	ent->valid = 1;
+	ent->dirty = 0;
+	return ent;
+}
+
+
+static int cache_flush (void)	/* 1:OK, 0:Card error */
+{
+	UINT i, j;
+	CACHE_ENTRY *ent;
+
+	/* Write dirty sectors back in ascending order */
+	for (i = 0; i < CACHE_SECTORS; i++) {
+		ent = 0;
+		for (j = 0; j < CACHE_SECTORS; j++) {
+			if (Cache[j].valid && Cache[j].dirty && (!ent || Cache[j].sector < ent->sector)) ent = &Cache[j];
+		}
+		if (!ent) break;
+		if (!cache_writeback(ent)) return 0;
+	}
+	return 1;
+}
+
+
+static void cache_invalidate (void)
+{
+	memset(Cache, 0, sizeof Cache);
+}
+
+
+static void cache_drop (void)	/* Invalidate the cache without writing back, dirty sectors are lost */
+{
+	UINT i;
+
+	for (i = 0; i < CACHE_SECTORS; i++) {
+		if (Cache[i].valid && Cache[i].dirty) CacheStats.lost++;
+	}
+	cache_invalidate();
+}
+
+
+static void cache_discard (	/* Drop cached sectors in a range without writing them back */
+	DWORD start,
+	DWORD end
+)
+{
+	UINT i;
+
+	for (i = 0; i < CACHE_SECTORS; i++) {
+		if (Cache[i].valid && Cache[i].sector >= start && Cache[i].sector <= end) Cache[i].valid = 0;
+	}
+}
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Card lock                                                             */
+/*-----------------------------------------------------------------------*/
+/* FatFs holds the volume mutex through a whole file function, but the   */
+/* logger also writes its extent and syncs through the disk functions    */
+/* directly. Each disk function takes the card for itself, so the cache  */
+/* and the SD driver serve one task at a time, and a task waits for no   */
+/* more than one disk function of another task.                          */
+/*-----------------------------------------------------------------------*/
+
+static SemaphoreHandle_t CardMutex;
+
+
+/* Call once before the scheduler starts, so no two tasks race to create it */
+int disk_init_lock (void)	/* 1:OK, 0:Could not create the mutex */
+{
+	if (!CardMutex) CardMutex = xSemaphoreCreateMutex();
+	return CardMutex != NULL;
+}
+
+
+static int card_lock (void)	/* 1:OK, 0:Timeout or no mutex */
+{
+	return CardMutex && xSemaphoreTake(CardMutex, FF_FS_TIMEOUT) == pdTRUE;
+}
+
+
+static void card_unlock (void)
+{
+	xSemaphoreGive(CardMutex);
+
+	/* A waiting task of the same priority is not switched to on its own, */
+	/* and this task would take the card right back with its next access */
+	taskYIELD();
+}
+
+
+
 /*-----------------------------------------------------------------------*/
 /* Get Drive Status                                                      */
 /*-----------------------------------------------------------------------*/
 
-DSTATUS disk_status (
+static DSTATUS card_status (
 	BYTE pdrv		/* Physical drive nmuber to identify the drive */
 )
 {
 	SDCardState state = SD_GetStatus();
+
+	(void)pdrv;
 	if (state != SD_CARD_ERROR && state >= SD_CARD_TRANSFER )
 		return RES_OK;
 
@@ -28,23 +196,63 @@ DSTATUS disk_status (
 }
 
 
+DSTATUS disk_status (
+	BYTE pdrv		/* Physical drive nmuber to identify the drive */
+)
+{
+	DSTATUS res;
+
+	if (!card_lock()) return STA_NOINIT;
+	res = card_status(pdrv);
+	card_unlock();
+	return res;
+}
+
+
 
 /*-----------------------------------------------------------------------*/
 /* Inidialize a Drive                                                    */
 /*-----------------------------------------------------------------------*/
 
-DSTATUS disk_initialize (
+static DSTATUS card_initialize (
 	BYTE pdrv				/* Physical drive nmuber to identify the drive */
 )
 {
-	uint8_t num_tries = 10;
-	while (!SD_Initialize() && num_tries)
-		--num_tries;
+	DWORD cid[4];
 
-	if (num_tries > 0)
-		return RES_OK;
+	(void)pdrv;
 
-	return STA_NOINIT;
+	/* A card brought up with SD_InitializeStep is used as it is, retries are up to the caller */
+	if (SD_GetStatus() != SD_CARD_TRANSFER && !SD_Initialize())
+		return STA_NOINIT;
+
+	/* Dirty sectors are file system updates that have not made it to the card yet, they stay */
+	/* cached until they do, so the volume is only mounted again once nothing is lost. Updates */
+	/* of a card that was swapped out would corrupt the one now in the slot, they are dropped. */
+	SD_GetCID(cid);
+	if (memcmp(cid, CacheCID, sizeof CacheCID) == 0) {
+		if (!cache_flush())
+			return STA_NOINIT;
+		cache_invalidate();
+	} else {
+		cache_drop();
+		memcpy(CacheCID, cid, sizeof CacheCID);
+	}
+
+	return RES_OK;
+}
+
+
+DSTATUS disk_initialize (
+	BYTE pdrv				/* Physical drive nmuber to identify the drive */
+)
+{
+	DSTATUS res;
+
+	if (!card_lock()) return STA_NOINIT;
+	res = card_initialize(pdrv);
+	card_unlock();
+	return res;
 }
 
 
@@ -53,24 +261,66 @@ DSTATUS disk_initialize (
 /* Read Sector(s)                                                        */
 /*-----------------------------------------------------------------------*/
 
-DRESULT disk_read (
+static DRESULT card_read (
 	BYTE pdrv,		/* Physical drive nmuber to identify the drive */
 	BYTE *buff,		/* Data buffer to store read data */
 	DWORD sector,	/* Start sector in LBA */
 	UINT count		/* Number of sectors to read */
 )
 {
+	CACHE_ENTRY *ent;
 	UINT i;
-	for (i = 0; i < count; ++i)
-	{
-		if (!SD_ReadBlock(sector+i,buff+(512*i)))
-			return RES_ERROR;
+
+	(void)pdrv;
+	if (count == 1) {
+		ent = cache_find(sector);
+		if (ent) {
+			CacheStats.hits++;
+		} else {
+			CacheStats.misses++;
+			ent = cache_alloc(sector);
+			if (!ent) return RES_ERROR;
+			if (!SD_ReadBlock(sector, CacheData[ent - Cache])) {
+				ent->valid = 0;
+				return RES_ERROR;
+			}
+		}
+		ent->last_used = ++CacheClock;
+		memcpy(buff, CacheData[ent - Cache], FF_MAX_SS);
+		return RES_OK;
+	}
+
+	if (!SD_ReadBlocks(sector,buff,count))
+		return RES_ERROR;
+
+	/* Sectors that are dirty in the cache are newer than what is on the card */
+	for (i = 0; i < CACHE_SECTORS; i++) {
+		ent = &Cache[i];
+		if (ent->valid && ent->dirty && ent->sector >= sector && ent->sector < sector + count) {
+			memcpy(buff + (ent->sector - sector) * FF_MAX_SS, CacheData[i], FF_MAX_SS);
+		}
 	}
 
 	return RES_OK;
 }
 
 
+DRESULT disk_read (
+	BYTE pdrv,		/* Physical drive nmuber to identify the drive */
+	BYTE *buff,		/* Data buffer to store read data */
+	DWORD sector,	/* Start sector in LBA */
+	UINT count		/* Number of sectors to read */
+)
+{
+	DRESULT res;
+
+	if (!card_lock()) return RES_ERROR;
+	res = card_read(pdrv, buff, sector, count);
+	card_unlock();
+	return res;
+}
+
+
 
 /*-----------------------------------------------------------------------*/
 /* Write Sector(s)                                                       */
@@ -78,24 +328,94 @@ DRESULT disk_read (
 
 #if FF_FS_READONLY == 0
 
-DRESULT disk_write (
+static DRESULT card_write_direct (
 	BYTE pdrv,			/* Physical drive nmuber to identify the drive */
 	const BYTE *buff,	/* Data to be written */
 	DWORD sector,		/* Start sector in LBA */
 	UINT count			/* Number of sectors to write */
 )
 {
-
+	CACHE_ENTRY *ent;
 	UINT i;
-	for (i = 0; i < count; ++i)
-	{
-		if (!SD_WriteBlock(sector+i,buff+(512*i)))
-			return RES_ERROR;
+
+	(void)pdrv;
+	if (!SD_WriteBlocks(sector,buff,count))
+		return RES_ERROR;
+
+	/* Cached copies of the sectors are now the same as the card */
+	for (i = 0; i < CACHE_SECTORS; i++) {
+		ent = &Cache[i];
+		if (ent->valid && ent->sector >= sector && ent->sector < sector + count) {
+			memcpy(CacheData[i], buff + (ent->sector - sector) * FF_MAX_SS, FF_MAX_SS);
+			ent->dirty = 0;
+		}
 	}
 
 	return RES_OK;
 }
 
+
+static DRESULT card_write (
+	BYTE pdrv,			/* Physical drive nmuber to identify the drive */
+	const BYTE *buff,	/* Data to be written */
+	DWORD sector,		/* Start sector in LBA */
+	UINT count			/* Number of sectors to write */
+)
+{
+	CACHE_ENTRY *ent;
+
+	if (count == 1) {
+		ent = cache_find(sector);
+		if (ent) {
+			CacheStats.hits++;
+			if (ent->dirty) CacheStats.coalesced++;
+		} else {
+			CacheStats.misses++;
+			ent = cache_alloc(sector);
+			if (!ent) return RES_ERROR;
+		}
+		memcpy(CacheData[ent - Cache], buff, FF_MAX_SS);
+		ent->dirty = 1;
+		ent->last_used = ++CacheClock;
+		return RES_OK;
+	}
+
+	return card_write_direct(pdrv, buff, sector, count);
+}
+
+
+DRESULT disk_write (
+	BYTE pdrv,			/* Physical drive nmuber to identify the drive */
+	const BYTE *buff,	/* Data to be written */
+	DWORD sector,		/* Start sector in LBA */
+	UINT count			/* Number of sectors to write */
+)
+{
+	DRESULT res;
+
+	if (!card_lock()) return RES_ERROR;
+	res = card_write(pdrv, buff, sector, count);
+	card_unlock();
+	return res;
+}
+
+
+/* Sectors are on the card when this returns, in the order they were written */
+DRESULT disk_write_uncached (
+	BYTE pdrv,			/* Physical drive nmuber to identify the drive */
+	const BYTE *buff,	/* Data to be written */
+	DWORD sector,		/* Start sector in LBA */
+	UINT count			/* Number of sectors to write */
+)
+{
+	DRESULT res;
+
+	if (!card_lock()) return RES_ERROR;
+	res = card_write_direct(pdrv, buff, sector, count);
+	card_unlock();
+	return res;
+}
+
 #endif
 
 
@@ -103,15 +423,69 @@ DRESULT disk_write (
 /* Miscellaneous Functions                                               */
 /*-----------------------------------------------------------------------*/
 
-DRESULT disk_ioctl (
+static DRESULT card_ioctl (
 	BYTE pdrv,		/* Physical drive nmuber (0..) */
 	BYTE cmd,		/* Control code */
 	void *buff		/* Buffer to send/receive control data */
 )
 {
-	if (cmd == CTRL_SYNC)
+	struct SD_Geometry geometry;
+
+	(void)pdrv;
+	switch (cmd) {
+	case CTRL_SYNC:
+		/* Everything written so far is on the card when this returns */
+		if (!cache_flush())
+			return RES_ERROR;
+		return RES_OK;
+
+	case GET_SECTOR_COUNT:
+		SD_GetGeometry(&geometry);
+		if (!buff || geometry.sectors == 0)
+			return RES_PARERR;
+		*(DWORD*)buff = geometry.sectors;
+		return RES_OK;
+
+	case GET_BLOCK_SIZE:
+		/* Erase block size is the allocation unit of the card, 1 if it is not known */
+		SD_GetGeometry(&geometry);
+		if (!buff)
+			return RES_PARERR;
+		*(DWORD*)buff = geometry.au_sectors ? geometry.au_sectors : 1;
+		return RES_OK;
+
+#if FF_USE_TRIM
+	case CTRL_TRIM:
+		/* The sectors are free, so pending writes to them are of no use */
+		if (!buff)
+			return RES_PARERR;
+		cache_discard(((DWORD*)buff)[0], ((DWORD*)buff)[1]);
+		if (!SD_Erase(((DWORD*)buff)[0], ((DWORD*)buff)[1]))
+			return RES_ERROR;
+		return RES_OK;
+#endif
+
+	case DISK_GET_CACHE_STATS:
+		if (!buff)
+			return RES_PARERR;
+		*(DISK_CACHE_STATS*)buff = CacheStats;
 		return RES_OK;
+	}
 
 	return RES_PARERR;
 }
 
+
+DRESULT disk_ioctl (
+	BYTE pdrv,		/* Physical drive nmuber (0..) */
+	BYTE cmd,		/* Control code */
+	void *buff		/* Buffer to send/receive control data */
+)
+{
+	DRESULT res;
+
+	if (!card_lock()) return RES_ERROR;
+	res = card_ioctl(pdrv, cmd, buff);
+	card_unlock();
+	return res;
+}
@@ -1,10 +1,11 @@
 /*------------------------------------------------------------------------*/
-/* Sample Code of OS Dependent Functions for FatFs                        */
+/* OS Dependent Functions for FatFs on FreeRTOS                           */
 /* (C)ChaN, 2018                                                          */
 /*------------------------------------------------------------------------*/
 
 
 #include "ff.h"
+#include "diskio.h"
 
 
 #if FF_USE_LFN == 3	/* Dynamic memory allocation */
@@ -38,43 +39,48 @@ void ff_memfree (
 
 #if FF_FS_REENTRANT	/* Mutal exclusion */
 
+/*------------------------------------------------------------------------*/
+/* Create the Synchronization Objects of all Volumes                      */
+/*------------------------------------------------------------------------*/
+/* Call once before the scheduler starts. The volume is mounted again
+/  whenever the card has to be brought up again, while another task may
+/  be waiting for it, so the FreeRTOS mutex of a volume is made here and
+/  kept for good, no two tasks race to create it on the first mount.
+*/
+
+static SemaphoreHandle_t Mutex[FF_VOLUMES];	/* FreeRTOS mutex of each volume */
+
+
+int ff_init_syncobj (void)	/* 1:Function succeeded, 0:Could not create the sync objects */
+{
+	BYTE vol;
+
+	for (vol = 0; vol < FF_VOLUMES; vol++) {
+		if (!Mutex[vol]) Mutex[vol] = xSemaphoreCreateMutex();
+		if (!Mutex[vol]) return 0;
+	}
+	return 1;
+}
+
+
 /*------------------------------------------------------------------------*/
 /* Create a Synchronization Object                                        */
 /*------------------------------------------------------------------------*/
 /* This function is called in f_mount() function to create a new
 /  synchronization object for the volume, such as semaphore and mutex.
 /  When a 0 is returned, the f_mount() function fails with FR_INT_ERR.
+/
+/  Hands out the mutex ff_init_syncobj() made for the volume, mounting
+/  fails if it was not called.
 */
 
-//const osMutexDef_t Mutex[FF_VOLUMES];	/* Table of CMSIS-RTOS mutex */
-
-
 int ff_cre_syncobj (	/* 1:Function succeeded, 0:Could not create the sync object */
 	BYTE vol,			/* Corresponding volume (logical drive number) */
 	FF_SYNC_t* sobj		/* Pointer to return the created sync object */
 )
 {
-	/* Win32 */
-	*sobj = CreateMutex(NULL, FALSE, NULL);
-	return (int)(*sobj != INVALID_HANDLE_VALUE);
-
-	/* uITRON */
-//	T_CSEM csem = {TA_TPRI,1,1};
-//	*sobj = acre_sem(&csem);
-//	return (int)(*sobj > 0);
-
-	/* uC/OS-II */
-//	OS_ERR err;
-//	*sobj = OSMutexCreate(0, &err);
-//	return (int)(err == OS_NO_ERR);
-
-	/* FreeRTOS */
-//	*sobj = xSemaphoreCreateMutex();
-//	return (int)(*sobj != NULL);
-
-	/* CMSIS-RTOS */
-//	*sobj = osMutexCreate(&Mutex[vol]);
-//	return (int)(*sobj != NULL);
+	*sobj = Mutex[vol];
+	return (int)(*sobj != NULL);
 }
 
 
@@ -84,29 +90,20 @@ int ff_cre_syncobj (	/* 1:Function succeeded, 0:Could not create the sync object
 /* This function is called in f_mount() function to delete a synchronization
 /  object that created with ff_cre_syncobj() function. When a 0 is returned,
 /  the f_mount() function fails with FR_INT_ERR.
+/
+/  Nothing is deleted, the mutex is reused by the next mount of the volume.
+/  f_mount() does not take it, so a task may be waiting for it or even
+/  hold it while the volume is unmounted. Deleting it then would leave
+/  that task with a freed mutex. It gets the grant instead, and the file
+/  function finds the volume gone or mounts it again.
 */
 
 int ff_del_syncobj (	/* 1:Function succeeded, 0:Could not delete due to an error */
 	FF_SYNC_t sobj		/* Sync object tied to the logical drive to be deleted */
 )
 {
-	/* Win32 */
-	return (int)CloseHandle(sobj);
-
-	/* uITRON */
-//	return (int)(del_sem(sobj) == E_OK);
-
-	/* uC/OS-II */
-//	OS_ERR err;
-//	OSMutexDel(sobj, OS_DEL_ALWAYS, &err);
-//	return (int)(err == OS_NO_ERR);
-
-	/* FreeRTOS */
-//  vSemaphoreDelete(sobj);
-//	return 1;
-
-	/* CMSIS-RTOS */
-//	return (int)(osMutexDelete(sobj) == osOK);
+	(void)sobj;
+	return 1;
 }
 
 
@@ -121,22 +118,7 @@ int ff_req_grant (	/* 1:Got a grant to access the volume, 0:Could not get a gran
 	FF_SYNC_t sobj	/* Sync object to wait */
 )
 {
-	/* Win32 */
-	return (int)(WaitForSingleObject(sobj, FF_FS_TIMEOUT) == WAIT_OBJECT_0);
-
-	/* uITRON */
-//	return (int)(wai_sem(sobj) == E_OK);
-
-	/* uC/OS-II */
-//	OS_ERR err;
-//	OSMutexPend(sobj, FF_FS_TIMEOUT, &err));
-//	return (int)(err == OS_NO_ERR);
-
-	/* FreeRTOS */
-//	return (int)(xSemaphoreTake(sobj, FF_FS_TIMEOUT) == pdTRUE);
-
-	/* CMSIS-RTOS */
-//	return (int)(osMutexWait(sobj, FF_FS_TIMEOUT) == osOK);
+	return (int)(xSemaphoreTake(sobj, FF_FS_TIMEOUT) == pdTRUE);
 }
 
 
@@ -150,21 +132,7 @@ void ff_rel_grant (
 	FF_SYNC_t sobj	/* Sync object to be signaled */
 )
 {
-	/* Win32 */
-	ReleaseMutex(sobj);
-
-	/* uITRON */
-//	sig_sem(sobj);
-
-	/* uC/OS-II */
-//	OSMutexPost(sobj);
-
-	/* FreeRTOS */
-//	xSemaphoreGive(sobj);
-
-	/* CMSIS-RTOS */
-//	osMutexRelease(sobj);
+	xSemaphoreGive(sobj);
 }
 
 #endif
-
@@ -12,4 +12,6 @@ uint8_t AMG_GetMagnetometerValues(int16_t *mag_x, int16_t *mag_y, int16_t *mag_z
 
 uint8_t AMG_GetGyroscopeValues(int16_t *gyro_x, int16_t *gyro_y, int16_t *gyro_z);
 
+uint8_t AMG_GetRawValues(int16_t *acc, int16_t *mag, int16_t *gyro);
+
 #endif
@@ -3,12 +3,51 @@
 
 #include <time.h>
 
+#include "FreeRTOS.h"
+
+struct GPS_Stats
+{
+	uint32_t sentences; // sentences received whole
+	uint32_t dropped_sentences; // sentences cut short, too long, or lost to an overrun while partly received
+	uint32_t bad_sentences; // sentences received whole but with a bad or no checksum, or a field that does not scan
+	uint32_t overruns; // times the DMA went all the way around the receive buffer before the task looked
+	uint16_t max_pending_bytes; // high-water mark of the receive buffer, bytes waiting to be framed or parsed
+	uint8_t max_queued_sentences; // high-water mark of the sentences waiting to be parsed
+};
+
+// the last fix in fixed point
+struct GPS_Fix
+{
+	int32_t latitude; // 1e-7 deg, north positive
+	int32_t longitude; // 1e-7 deg, east positive
+	int32_t altitude; // 0.01 altitude_units
+	char altitude_units;
+	int32_t track; // 0.01 deg true
+	int32_t variation; // 0.01 deg, east positive
+	int32_t speed; // 0.01 kt
+	int num_sats;
+};
+
 uint8_t GPS_Initialize();
 
+uint8_t GPS_WaitForData(uint32_t timeout_ms);
+
 uint8_t GPS_CheckForNewData();
 
+uint32_t GPS_GetBaudRate();
+
+uint8_t GPS_SetUpdateRate(uint8_t rate_hz);
+
+uint8_t GPS_GetUpdateRate();
+
+uint8_t GPS_GetFixTick(TickType_t *tick);
+
 uint8_t GPS_GetLastNMEA(char *buf);
 
+void GPS_GetStats(struct GPS_Stats *stats);
+
+uint8_t GPS_GetFix(struct GPS_Fix *fix);
+
 uint8_t GPS_GetCoords(float *latitude, float *longitude);
 
 uint8_t GPS_GetHeading(float *true_heading, float *mag_heading);
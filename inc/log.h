@@ -0,0 +1,57 @@
+/* log.h
+ * Flight data logger */
+
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdint.h>
+
+#include "FreeRTOS.h"
+
+#include "logfmt.h"
+
+#define LOG_BLOCK_SIZE LOGFMT_BLOCK_SIZE // staging buffer size, one SD sector
+
+struct Log_Stats
+{
+	uint32_t records;
+	uint32_t dropped_records; // records thrown away because both staging buffers were full
+	uint32_t dropped_submissions; // submitted records thrown away because their channel buffer was full
+	uint32_t dropped_blocks; // staged blocks thrown away because the backlog filled up before the log was opened
+	uint32_t syncs;
+	uint32_t sectors_written; // sectors written to the card since the log file was opened
+	uint32_t max_write_us; // longest block write, including the wait for another task to be done with the card
+	uint16_t max_staged_bytes; // high-water mark of the staging buffers, out of 2 * LOG_BLOCK_SIZE
+	uint16_t max_channel_bytes[LOGFMT_NUM_CHANNELS]; // high-water mark of each channel message buffer
+};
+
+void Log_Init();
+
+uint8_t Log_Start();
+
+// nominal time between the records of a channel in place of the period of the schema
+uint8_t Log_SetChannelPeriod(uint8_t channel, uint16_t period_ms);
+
+uint8_t Log_Open(const char *filename, uint32_t start_time);
+
+uint8_t Log_Recover();
+
+uint8_t Log_Close();
+
+uint8_t Log_IsOpen();
+
+uint8_t Log_Append(const struct LogFmt_Record *record);
+
+uint8_t Log_Submit(uint8_t channel, const int32_t *values, uint8_t num_values);
+
+uint8_t Log_SubmitAt(uint8_t channel, const int32_t *values, uint8_t num_values, TickType_t tick);
+
+uint8_t Log_SubmitFromISR(uint8_t channel, const int32_t *values, uint8_t num_values, BaseType_t *higher_priority_task_woken);
+
+uint8_t Log_Process();
+
+uint8_t Log_Sync();
+
+void Log_GetStats(struct Log_Stats *stats);
+
+#endif
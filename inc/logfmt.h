@@ -0,0 +1,232 @@
+/* logfmt.h
+ * Compact flight log encoding */
+
+#ifndef LOGFMT_H
+#define LOGFMT_H
+
+#include <stdint.h>
+
+#define LOGFMT_VERSION 3
+#define LOGFMT_MAGIC "AMLG" // file header block
+#define LOGFMT_BLOCK_MAGIC "AMLB" // data block
+
+// A log is a file header block followed by data blocks, all LOGFMT_BLOCK_SIZE bytes long. The file header
+// describes the session and the schema of every channel. A data block carries whole records only and
+// every channel starts over with a keyframe in each block, so any valid block can be decoded on its own.
+#define LOGFMT_BLOCK_SIZE 512
+#define LOGFMT_BLOCK_HEADER_LEN 20
+#define LOGFMT_BLOCK_PAYLOAD_LEN (LOGFMT_BLOCK_SIZE - LOGFMT_BLOCK_HEADER_LEN)
+#define LOGFMT_BLOCK_CRC_START 8 // block CRC covers the block from here to the end of the used payload
+#define LOGFMT_HEADER_CRC_OFFSET (LOGFMT_BLOCK_SIZE - 4) // file header CRC covers everything before it
+
+#define LOGFMT_MAX_CHANNELS 8
+#define LOGFMT_MAX_FIELDS 9
+#define LOGFMT_MAX_RECORD_LEN (1 + 5 + 5 * LOGFMT_MAX_FIELDS) // tag, time and a varint per field, worst case
+
+#define LOGFMT_INDEX_MAGIC "AMLI" // time index sidecar
+#define LOGFMT_INDEX_HEADER_LEN 20
+#define LOGFMT_INDEX_ENTRY_LEN 8
+
+#define LOGFMT_KEYFRAME_INTERVAL 64 // records between keyframes of a channel
+
+#define LOGFMT_NAME_LEN 8
+#define LOGFMT_UNIT_LEN 4
+#define LOGFMT_FIRMWARE_LEN 16
+
+enum LogFmt_Channel
+{
+	LOGFMT_CHANNEL_FIX = 0, // GPS fix
+	LOGFMT_CHANNEL_BARO, // barometric sensor
+	LOGFMT_CHANNEL_IMU, // raw accelerometer, magnetometer and gyroscope samples
+	LOGFMT_CHANNEL_EVENT, // things that happen now and then, see LogFmt_Event
+	LOGFMT_NUM_CHANNELS
+};
+
+// fields of the fix channel
+enum LogFmt_FixField
+{
+	LOGFMT_FIX_LATITUDE = 0, // 1e-7 deg
+	LOGFMT_FIX_LONGITUDE, // 1e-7 deg
+	LOGFMT_FIX_ALTITUDE, // GPS altitude, ft
+	LOGFMT_FIX_HEADING, // 0.1 deg
+	LOGFMT_FIX_SPEED, // 0.1 kt
+	LOGFMT_FIX_NUM_FIELDS
+};
+
+// fields of the baro channel
+enum LogFmt_BaroField
+{
+	LOGFMT_BARO_PRESSURE = 0, // Pa
+	LOGFMT_BARO_TEMPERATURE, // 0.01 deg C
+	LOGFMT_BARO_ALTITUDE, // pressure altitude for the altimeter setting, ft
+	LOGFMT_BARO_NUM_FIELDS
+};
+
+// fields of the IMU channel, all in sensor counts
+enum LogFmt_ImuField
+{
+	LOGFMT_IMU_ACC_X = 0,
+	LOGFMT_IMU_ACC_Y,
+	LOGFMT_IMU_ACC_Z,
+	LOGFMT_IMU_MAG_X,
+	LOGFMT_IMU_MAG_Y,
+	LOGFMT_IMU_MAG_Z,
+	LOGFMT_IMU_GYRO_X,
+	LOGFMT_IMU_GYRO_Y,
+	LOGFMT_IMU_GYRO_Z,
+	LOGFMT_IMU_NUM_FIELDS
+};
+
+// fields of the event channel
+enum LogFmt_EventField
+{
+	LOGFMT_EVENT_CODE = 0,
+	LOGFMT_EVENT_ARG,
+	LOGFMT_EVENT_VALUE,
+	LOGFMT_EVENT_NUM_FIELDS
+};
+
+enum LogFmt_Event
+{
+	LOGFMT_EVENT_LOW_VOLTAGE = 1, // supply voltage dropped below the PVD threshold
+	LOGFMT_EVENT_BUFFER_PEAK, // new high-water mark, arg: channel, or LOGFMT_NUM_CHANNELS for the staging buffers, value: bytes
+	LOGFMT_EVENT_CARD_GEOMETRY, // SD card found at boot, arg: allocation unit, sectors, value: capacity, sectors
+	LOGFMT_EVENT_CARD_SPEED, // SD card found at boot, arg: speed class, value: bus clock, Hz
+	LOGFMT_EVENT_WRITE_PEAK, // new longest block write, value: us
+	LOGFMT_EVENT_GPS_RX_PEAK, // new high-water mark of the GPS receive buffer, arg: sentences dropped so far, value: bytes
+	LOGFMT_EVENT_GPS_BAUD_RATE, // GPS receiver set up at boot, logged at the start of every session, arg: fixes a second, value: baud rate, 0 if it was not heard
+	LOGFMT_EVENT_CARD_ERROR // the card failed the logger, arg: LogFmt_CardOp, value: failures in a row
+};
+
+// what the card failed, the arg of LOGFMT_EVENT_CARD_ERROR
+enum LogFmt_CardOp
+{
+	LOGFMT_CARD_OP_RECOVER = 0, // recovering the logs of sessions cut short after the card was mounted
+	LOGFMT_CARD_OP_OPEN,
+	LOGFMT_CARD_OP_WRITE, // writing full blocks
+	LOGFMT_CARD_OP_SYNC
+};
+
+enum LogFmt_Type
+{
+	LOGFMT_TYPE_INT32 = 0 // zig-zag varint
+};
+
+struct LogFmt_FieldDef
+{
+	char name[LOGFMT_NAME_LEN];
+	char unit[LOGFMT_UNIT_LEN];
+	uint8_t type;
+	int8_t scale; // stored value times 10^scale is the value in unit
+	uint8_t order; // 0: values stored as they are, 1: as differences, 2: as differences of differences
+};
+
+struct LogFmt_ChannelDef
+{
+	char name[LOGFMT_NAME_LEN];
+	uint8_t num_fields;
+	uint16_t period_ms; // nominal time between records, a record at this spacing does not store its time
+	struct LogFmt_FieldDef field[LOGFMT_MAX_FIELDS];
+};
+
+struct LogFmt_ChannelState
+{
+	uint8_t has_keyframe;
+	uint16_t since_keyframe;
+	uint32_t time_ms;
+	int32_t value[LOGFMT_MAX_FIELDS];
+	int32_t delta[LOGFMT_MAX_FIELDS];
+};
+
+// encoder and decoder keep the same state, so one type serves both
+struct LogFmt_State
+{
+	const struct LogFmt_ChannelDef *defs; // schema the records are coded with
+	uint8_t num_channels;
+	struct LogFmt_ChannelState channel[LOGFMT_MAX_CHANNELS];
+};
+
+struct LogFmt_Record
+{
+	uint8_t channel;
+	uint32_t time_ms; // since the start of the session
+	uint8_t num_fields;
+	int32_t value[LOGFMT_MAX_FIELDS];
+};
+
+struct LogFmt_Header
+{
+	uint8_t version;
+	char firmware[LOGFMT_FIRMWARE_LEN];
+	uint32_t start_time; // UNIX time of the start of the session
+	uint32_t session; // tags every data block of the session
+	uint8_t num_channels;
+	struct LogFmt_ChannelDef channel[LOGFMT_MAX_CHANNELS];
+};
+
+struct LogFmt_BlockHeader
+{
+	uint32_t crc; // over the block from the session field to the end of the used payload
+	uint32_t session;
+	uint32_t seq; // data blocks are numbered from 0 in the order they were filled
+	uint16_t used; // payload bytes holding records
+};
+
+// The time index sidecar is the index header, the entries and a CRC of both. Entries point at data
+// blocks spread over the session in increasing order of time, so a reader can binary search them and
+// only decode from the block found onwards. Without the sidecar the same entries can be rebuilt from the
+// log by taking the time of the first record of each valid block.
+struct LogFmt_IndexHeader
+{
+	uint32_t session;
+	uint32_t base; // file offset of the file header block of the session
+	uint32_t count;
+	uint32_t interval; // data blocks between entries
+};
+
+struct LogFmt_IndexEntry
+{
+	uint32_t time_ms; // time of the first record in the block
+	uint32_t offset; // file offset of the block
+};
+
+// reads data block index of a log into block, returns 1 on success
+typedef uint8_t (*LogFmt_ReadBlock)(void *context, uint32_t index, uint8_t *block);
+
+const struct LogFmt_ChannelDef *LogFmt_GetChannelDef(uint8_t channel);
+
+void LogFmt_Init(struct LogFmt_State *state, const struct LogFmt_Header *header);
+
+void LogFmt_Reset(struct LogFmt_State *state);
+
+void LogFmt_InitHeader(struct LogFmt_Header *header, const char *firmware, uint32_t start_time, uint32_t session);
+
+uint16_t LogFmt_EncodeHeader(const struct LogFmt_Header *header, uint8_t *block);
+
+uint16_t LogFmt_DecodeHeader(struct LogFmt_Header *header, const uint8_t *block);
+
+void LogFmt_EncodeBlockHeader(const struct LogFmt_BlockHeader *header, uint8_t *block);
+
+uint8_t LogFmt_DecodeBlockHeader(struct LogFmt_BlockHeader *header, const uint8_t *block);
+
+uint32_t LogFmt_Crc32(const uint8_t *data, uint32_t len);
+
+uint8_t LogFmt_CheckBlock(const uint8_t *block, uint32_t session, struct LogFmt_BlockHeader *header);
+
+uint32_t LogFmt_FindEnd(LogFmt_ReadBlock read, void *context, uint32_t session, uint32_t num_blocks, uint8_t *block);
+
+uint8_t LogFmt_GetBlockTime(const uint8_t *block, uint32_t *time_ms);
+
+void LogFmt_EncodeIndexHeader(const struct LogFmt_IndexHeader *header, uint8_t *out);
+
+uint8_t LogFmt_DecodeIndexHeader(struct LogFmt_IndexHeader *header, const uint8_t *in);
+
+void LogFmt_DecodeIndexEntry(struct LogFmt_IndexEntry *entry, const uint8_t *in);
+
+uint32_t LogFmt_FindIndexEntry(const struct LogFmt_IndexEntry *entries, uint32_t count, uint32_t time_ms);
+
+uint16_t LogFmt_Encode(struct LogFmt_State *state, const struct LogFmt_Record *record, uint8_t *out);
+
+uint16_t LogFmt_Decode(struct LogFmt_State *state, struct LogFmt_Record *record, const uint8_t *in, uint16_t len);
+
+#endif
@@ -0,0 +1,40 @@
+/* logread.h
+ * Flight log reader */
+
+#ifndef LOGREAD_H
+#define LOGREAD_H
+
+#include <stdint.h>
+
+#include "logfmt.h"
+
+struct LogRead_Summary
+{
+	uint32_t start_time; // UNIX time of the start of the session
+	uint32_t duration_ms; // time of the last record
+	uint32_t blocks;
+	uint32_t bad_blocks; // blocks that failed their check and were skipped
+	uint32_t records[LOGFMT_NUM_CHANNELS];
+	int32_t max_altitude; // highest GPS altitude, ft
+	int32_t max_speed; // highest ground speed, 0.1 kt
+	int32_t min_pressure; // lowest pressure, Pa
+	uint32_t events;
+};
+
+uint8_t LogRead_Open(const char *filename);
+
+uint8_t LogRead_Close();
+
+uint8_t LogRead_IsFastSeek();
+
+const struct LogFmt_Header *LogRead_GetHeader();
+
+uint32_t LogRead_GetNumBlocks();
+
+uint8_t LogRead_ReadBlock(uint32_t index, uint8_t *block);
+
+uint8_t LogRead_FindTime(uint32_t time_ms, uint32_t *index);
+
+uint8_t LogRead_Summarize(struct LogRead_Summary *summary);
+
+#endif
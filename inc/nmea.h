@@ -0,0 +1,75 @@
+/* nmea.h
+ * NMEA sentence framing and parsing */
+
+#ifndef NMEA_H
+#define NMEA_H
+
+#include <stdint.h>
+
+#define NMEA_BUF_LEN 128 // NMEA sentences evidently have a max length of 82 characters, but give some extra just in case
+
+// Sentences are framed where they are, in a ring buffer the bytes are received into. A sentence starts at
+// a '$' and ends at the line feed, the line feed and a carriage return before it are not part of it. Bytes
+// outside of a sentence are skipped, so the framer finds its way into a stream that was picked up halfway
+// through a sentence. A sentence that is cut short by the start of the next one, or that is not done
+// within NMEA_BUF_LEN - 1 bytes, is dropped.
+struct NMEA_Framer
+{
+	uint16_t start; // ring offset of the '$' of the last sentence started
+	uint8_t len; // bytes of the sentence so far, 0 while waiting for the start of one
+	uint32_t sentences;
+	uint32_t dropped;
+};
+
+// The sentences a fix is made of, RMC, GGA and VTG from any talker, are parsed in a single pass that
+// checks the checksum on the way and gives integers. Any other sentence is left to a general parser.
+enum NMEA_Sentence
+{
+	NMEA_SENTENCE_INVALID = 0, // bad checksum, or a field that does not scan
+	NMEA_SENTENCE_OTHER, // not one of those below
+	NMEA_SENTENCE_RMC,
+	NMEA_SENTENCE_GGA,
+	NMEA_SENTENCE_VTG
+};
+
+// fields a sentence carried, empty ones are left out
+#define NMEA_HAS_TIME 0x0001
+#define NMEA_HAS_DATE 0x0002
+#define NMEA_HAS_LATITUDE 0x0004
+#define NMEA_HAS_LONGITUDE 0x0008
+#define NMEA_HAS_POSITION (NMEA_HAS_LATITUDE | NMEA_HAS_LONGITUDE)
+#define NMEA_HAS_SPEED 0x0010
+#define NMEA_HAS_TRACK 0x0020
+#define NMEA_HAS_VARIATION 0x0040
+#define NMEA_HAS_ALTITUDE 0x0080
+#define NMEA_HAS_SATELLITES 0x0100
+
+struct NMEA_Fix
+{
+	uint16_t fields; // NMEA_HAS_ flags
+	uint8_t valid; // RMC: status active, GGA: a fix, VTG: always
+	uint32_t time_ms; // UTC time of day
+	uint8_t day;
+	uint8_t month;
+	uint8_t year; // years since 2000
+	int32_t latitude; // 1e-7 deg, north positive
+	int32_t longitude; // 1e-7 deg, east positive
+	int32_t speed; // 0.01 kt
+	int32_t track; // 0.01 deg true
+	int32_t variation; // 0.01 deg, east positive
+	int32_t altitude; // 0.01 altitude_units above mean sea level
+	char altitude_units;
+	uint8_t satellites;
+};
+
+void NMEA_InitFramer(struct NMEA_Framer *framer);
+
+void NMEA_ResetFramer(struct NMEA_Framer *framer);
+
+uint8_t NMEA_Frame(struct NMEA_Framer *framer, const uint8_t *ring, uint16_t ring_len, uint16_t *pos, uint16_t head);
+
+uint8_t NMEA_CheckSentence(const char *sentence, uint8_t len);
+
+uint8_t NMEA_ParseSentence(const char *sentence, uint8_t len, struct NMEA_Fix *fix);
+
+#endif
@@ -17,12 +17,63 @@ typedef enum
   SD_CARD_ERROR                  = ((uint32_t)0x000000FF)
 } SDCardState;
 
+typedef enum
+{
+  SD_INIT_BUSY,
+  SD_INIT_DONE,
+  SD_INIT_FAILED
+} SDInitStatus;
+
+struct SD_Geometry
+{
+	uint32_t sectors; // capacity in 512 byte sectors
+	uint32_t au_sectors; // allocation unit, 0 if the card does not report it
+	uint8_t speed_class; // sequential write speed the card is rated for, MB/s, 0 if not rated
+	uint8_t uhs_speed_grade; // UHS speed grade, 0 if not rated
+};
+
+struct SD_Stats
+{
+	uint32_t commands; // commands sent to the card, including those of the initialization
+	uint32_t sectors_read;
+	uint32_t sectors_written;
+	uint32_t read_us; // time spent in SD_ReadBlocks
+	uint32_t write_us; // time spent in SD_WriteBlocks, including busy time
+	uint32_t sectors_erased;
+	uint32_t erase_us; // time spent in SD_Erase
+	uint32_t busy_us; // time the card spent programming after writes and erases
+	uint32_t errors; // failed block transfers
+};
+
+SDInitStatus SD_InitializeStep();
+
 uint8_t SD_Initialize();
 
+uint8_t SD_GetBusWidth();
+
+uint32_t SD_GetBusClockHz();
+
+void SD_GetGeometry(struct SD_Geometry *geometry);
+
+// card identification register as read at the last initialization, it tells one card from another
+void SD_GetCID(uint32_t cid[4]);
+
+uint32_t SD_GetNumSectorsWritten();
+
+void SD_GetStats(struct SD_Stats *stats);
+
+void SD_ResetStats();
+
 SDCardState SD_GetStatus();
 
 uint8_t SD_ReadBlock(uint32_t addr, uint8_t *buf);
 
 uint8_t SD_WriteBlock(uint32_t addr, const uint8_t *buf);
 
+uint8_t SD_ReadBlocks(uint32_t addr, uint8_t *buf, uint32_t count);
+
+uint8_t SD_WriteBlocks(uint32_t addr, const uint8_t *buf, uint32_t count);
+
+uint8_t SD_Erase(uint32_t start, uint32_t end);
+
 #endif
@@ -3,6 +3,8 @@
 
 #include "stm32f4xx.h"
 
+#define FIRMWARE_VERSION "1.0"
+
 void Util_DelayMs(uint32_t msec);
 
 #endif
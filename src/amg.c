@@ -133,3 +133,30 @@ uint8_t AMG_GetGyroscopeValues(int16_t *gyro_x, int16_t *gyro_y, int16_t *gyro_z
 
 	return 1;
 }
+
+// accelerometer and magnetometer come in one burst in hybrid mode, then the gyroscope, each argument points to x, y and z
+uint8_t AMG_GetRawValues(int16_t *acc, int16_t *mag, int16_t *gyro)
+{
+	if (acc == NULL || mag == NULL || gyro == NULL)
+		return 0;
+
+	uint8_t buf[13];
+	if (I2C_ReadRegs(ACCMAG_ADDRESS, FXOS8700CQ_STATUS, buf, 13) != 0)
+		return 0;
+
+	acc[0] = (int16_t)(buf[1] << 8 | buf[2]) >> 2;
+	acc[1] = (int16_t)(buf[3] << 8 | buf[4]) >> 2;
+	acc[2] = (int16_t)(buf[5] << 8 | buf[6]) >> 2;
+	mag[0] = (int16_t)(buf[7] << 8 | buf[8]);
+	mag[1] = (int16_t)(buf[9] << 8 | buf[10]);
+	mag[2] = (int16_t)(buf[11] << 8 | buf[12]);
+
+	if (I2C_ReadRegs(GYRO_ADDRESS, FXAS21002_STATUS, buf, 7) != 0)
+		return 0;
+
+	gyro[0] = (int16_t)(buf[1] << 8 | buf[2]);
+	gyro[1] = (int16_t)(buf[3] << 8 | buf[4]);
+	gyro[2] = (int16_t)(buf[5] << 8 | buf[6]);
+
+	return 1;
+}
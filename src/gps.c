@@ -4,9 +4,10 @@
 #include "stm32f4xx.h"
 #include "FreeRTOS.h"
 #include "task.h"
-#include "queue.h"
+#include "semphr.h"
 
 #include "gps.h"
+#include "nmea.h"
 #include "minmea.h"
 
 #define GPS_RX_PORT GPIOA
@@ -16,6 +17,50 @@
 #define GPS_TX_PIN GPIO_Pin_9
 #define GPS_TX_PINSOURCE GPIO_PinSource9
 
+// Received bytes are written by DMA into a circular buffer. The USART interrupts when the line goes idle
+// after a burst of sentences, and the DMA stream at the half and at the end of the buffer, so a burst that
+// is longer than half the buffer is picked up before it is overwritten. Either one wakes the GPS task,
+// which frames the new bytes into sentences.
+//
+// Sentences are not copied out of the receive buffer. The framer queues the offset and length of every
+// complete sentence, with the time of the interrupt that brought it in, and terminates it in place over its
+// carriage return. It is parsed right there. A sentence that runs past the end of the buffer has its part
+// from the start of the buffer copied to the room behind the end, so it is in one piece too.
+//
+// Every receive interrupt leaves a mark of where the DMA was and when. A sentence gets the time of the
+// first mark at or past its end, so when the task is late and finds several fixes, each keeps its own time.
+//
+// At 10 Hz an RMC and a GGA sentence are about 150 bytes a fix, so the buffer holds a third of a second of
+// them. The task has to look within 250 ms of being woken, tools/gpsreplay replays a stream with the task
+// that late and later.
+#define GPS_RX_DMA_STREAM DMA2_Stream2
+#define GPS_RX_DMA_CHANNEL DMA_Channel_4
+#define GPS_RX_DMA_HT_INT DMA_IT_HTIF2
+#define GPS_RX_DMA_TC_INT DMA_IT_TCIF2
+#define GPS_RX_BUF_LEN 512
+#define GPS_SENTENCE_QUEUE_LEN 8
+#define GPS_RX_MARKS 8 // receive interrupts remembered until the task looks, a power of 2
+
+// The receiver comes up at 9600 baud from a cold start, but keeps a rate it was switched to through a warm
+// restart. Its rate is found by listening at every candidate until a sentence with a good checksum comes
+// in, starting with the rate it is switched to, and then it is switched there if it is not already.
+#define GPS_BAUD_RATE 115200 // 57600 or 115200, 9600 baud is too slow for more than one fix a second
+#define GPS_DEFAULT_BAUD_RATE 9600
+#define GPS_BAUD_DETECT_MS 1500 // longest wait for a good sentence at a candidate rate
+#define GPS_BAUD_DETECT_ERRORS 4 // bad sentences that rule a candidate rate out early
+
+// fixes a second, 1, 5 or 10. GPS_Initialize sets the receiver up for it, or for 1 if it is stuck at a rate
+// too slow for more
+#define GPS_UPDATE_RATE_HZ 10
+
+// The receiver sends an RMC and a GGA sentence for every fix, with the same UTC time. A fix is complete
+// once both are in, and GPS_CheckForNewData stops right there, so at high update rates a burst that holds
+// more than one fix gives every fix to the caller with the time of the interrupt that brought it in.
+#define GPS_FIX_RMC 0x01
+#define GPS_FIX_GGA 0x02
+#define GPS_FIX_COMPLETE (GPS_FIX_RMC | GPS_FIX_GGA)
+#define GPS_FIX_TAKEN 0x80 // the fix was handed out, more sentences of the same time do not make another
+
 // Defines taken from Adafruit GPS library:
 
 // different commands to set the update rate from once a second (1 Hz) to 10 times a second (10Hz)
@@ -35,6 +80,7 @@
 // Can't fix position faster than 5 times a second!
 
 
+#define PMTK_SET_BAUD_115200 "$PMTK251,115200*1F\r\n"
 #define PMTK_SET_BAUD_57600 "$PMTK251,57600*2C\r\n"
 #define PMTK_SET_BAUD_9600 "$PMTK251,9600*17\r\n"
 
@@ -75,66 +121,150 @@
 
 // ------- end of Adafruit defines
 
-#define BUF_LEN 128 // NMEA sentences evidently have a max length of 82 characters, but give some extra just in case
-#define QUEUE_LEN 8
-static char _sentence[BUF_LEN] = {0};
-static QueueHandle_t _rx_queue = NULL;
-static volatile uint8_t _rx_queue_full = 0;
+#if GPS_BAUD_RATE == 115200
+#define PMTK_SET_BAUD PMTK_SET_BAUD_115200
+#elif GPS_BAUD_RATE == 57600
+#define PMTK_SET_BAUD PMTK_SET_BAUD_57600
+#else
+#error "GPS_BAUD_RATE has to be 57600 or 115200"
+#endif
+
+// rates the receiver is looked for at, in order
+static const uint32_t _baud_rates[] = {GPS_BAUD_RATE, GPS_DEFAULT_BAUD_RATE, 115200, 57600, 38400, 19200, 4800};
 
-static char _rx_buf[BUF_LEN] = {0};
-static volatile uint8_t _rx_index = 0;
-static volatile uint8_t _rx_len = 0;
+// a complete sentence, waiting in the receive buffer to be parsed
+struct GPS_Sentence
+{
+	uint16_t offset;
+	uint8_t len;
+	TickType_t time; // time of the receive interrupt that brought in its end
+};
+
+// where the DMA was at a receive interrupt, and when
+struct GPS_RxMark
+{
+	uint16_t head;
+	TickType_t time;
+};
+
+static uint8_t _rx_buf[GPS_RX_BUF_LEN + NMEA_BUF_LEN] = {0}; // DMA only writes the first GPS_RX_BUF_LEN bytes
+static uint16_t _rx_tail = 0; // next byte to be framed
+static uint16_t _rx_head = 0; // where the DMA was when the task last looked
+static volatile uint8_t _rx_halves = 0; // half buffers filled by the DMA since the task last looked
+static struct GPS_RxMark _rx_marks[GPS_RX_MARKS];
+static volatile uint8_t _rx_marks_written = 0; // marks left by the interrupts, counts on around
+static uint8_t _rx_marks_read = 0;
+static SemaphoreHandle_t _rx_ready = NULL;
+static struct NMEA_Framer _framer;
+
+static struct GPS_Sentence _queue[GPS_SENTENCE_QUEUE_LEN];
+static uint8_t _queue_first = 0;
+static uint8_t _queue_count = 0;
+static struct GPS_Sentence _last = {0, 0, 0};
+
+static struct GPS_Stats _stats = {0};
+static uint32_t _baud_rate = 0; // rate the receiver was heard at, 0 if it was not
+static uint8_t _update_rate_hz = 1;
 
 static volatile uint8_t _is_transmitting = 0;
-static uint8_t _tx_buf[BUF_LEN] = {0};
-
-static struct minmea_float _latitude = {0,0};
-static struct minmea_float _longitude = {0,0};
-static struct minmea_float _track_true = {0,0};
-static struct minmea_float _gs_knots = {0,0};
-static struct minmea_float _mag_variation = {0,0};
-static struct minmea_float _altitude = {0,0};
+static uint8_t _tx_buf[NMEA_BUF_LEN] = {0};
+
+static int32_t _latitude = 0; // 1e-7 deg
+static int32_t _longitude = 0;
+static int32_t _track_true = 0; // 0.01 deg
+static int32_t _gs_knots = 0; // 0.01 kt
+static int32_t _mag_variation = 0; // 0.01 deg, east positive
+static int32_t _altitude = 0; // 0.01 _altitude_units
 static struct minmea_date _current_date = {-1, -1, -1};
 static struct minmea_time _current_time = {-1, -1, -1, -1};
 static int _num_sats = -1;
 
 static char _altitude_units = '*';
 
-static uint8_t _interpret_nmea(char *sentence)
+static uint32_t _fix_time_ms = 0xFFFFFFFF; // UTC time of the fix being put together
+static uint8_t _fix_parts = 0;
+static uint8_t _fix_complete = 0;
+static TickType_t _fix_tick = 0;
+
+static void _gps_add_to_fix(uint8_t part, uint32_t time_ms)
+{
+	if (time_ms != _fix_time_ms)
+	{
+		_fix_time_ms = time_ms;
+		_fix_parts = 0;
+	}
+
+	_fix_parts |= part;
+	if (_fix_parts == GPS_FIX_COMPLETE)
+	{
+		_fix_complete = 1;
+		_fix_parts |= GPS_FIX_TAKEN;
+	}
+}
+
+// a minmea value in hundredths
+static int32_t _gps_hundredths(const struct minmea_float *f)
+{
+	if (f->scale == 0)
+		return 0;
+
+	return (int32_t)((int64_t)f->value * 100 / f->scale);
+}
+
+// take what a sentence carried into the state
+static void _gps_apply(const struct NMEA_Fix *fix)
+{
+	if (fix->fields & NMEA_HAS_TIME)
+	{
+		_current_time.hours = fix->time_ms / 3600000;
+		_current_time.minutes = fix->time_ms / 60000 % 60;
+		_current_time.seconds = fix->time_ms / 1000 % 60;
+		_current_time.microseconds = fix->time_ms % 1000 * 1000;
+	}
+
+	if (fix->fields & NMEA_HAS_DATE)
+	{
+		_current_date.day = fix->day;
+		_current_date.month = fix->month;
+		_current_date.year = fix->year;
+	}
+
+	if (fix->fields & NMEA_HAS_POSITION)
+	{
+		_latitude = fix->latitude;
+		_longitude = fix->longitude;
+	}
+
+	if (fix->fields & NMEA_HAS_SPEED)
+		_gs_knots = fix->speed;
+
+	if (fix->fields & NMEA_HAS_TRACK)
+		_track_true = fix->track;
+
+	if (fix->fields & NMEA_HAS_VARIATION)
+		_mag_variation = fix->variation;
+
+	if (fix->fields & NMEA_HAS_ALTITUDE)
+	{
+		_altitude = fix->altitude;
+		_altitude_units = fix->altitude_units;
+	}
+
+	if (fix->fields & NMEA_HAS_SATELLITES)
+		_num_sats = fix->satellites;
+}
+
+// sentences that are not part of a fix, and the old VTG without unit letters, go to minmea
+static uint8_t _interpret_other(char *sentence)
 {
 	enum minmea_sentence_id sentence_id = minmea_sentence_id(sentence, 0);
 	switch(sentence_id)
 	{
 	case MINMEA_INVALID:
 	case MINMEA_UNKNOWN:
-		return 0;
 	case MINMEA_SENTENCE_RMC:
-	{
-		struct minmea_sentence_rmc rmc_sentence;
-		if (!minmea_parse_rmc(&rmc_sentence, sentence) || !rmc_sentence.valid)
-			return 0;
-		_latitude = rmc_sentence.latitude;
-		_longitude = rmc_sentence.longitude;
-		_gs_knots = rmc_sentence.speed;
-		_mag_variation = rmc_sentence.variation;
-		_track_true = rmc_sentence.course;
-		_current_date = rmc_sentence.date;
-		_current_time = rmc_sentence.time;
-		break;
-	}
 	case MINMEA_SENTENCE_GGA:
-	{
-		struct minmea_sentence_gga gga_sentence;
-		if (!minmea_parse_gga(&gga_sentence, sentence))
-			return 0;
-		_latitude = gga_sentence.latitude;
-		_longitude = gga_sentence.longitude;
-		_altitude = gga_sentence.altitude;
-		_altitude_units = gga_sentence.altitude_units;
-		_num_sats = gga_sentence.satellites_tracked;
-		_current_time = gga_sentence.time;
-		break;
-	}
+		return 0;
 	case MINMEA_SENTENCE_GSA:
 	{
 		struct minmea_sentence_gsa gsa_sentence;
@@ -160,8 +290,8 @@ static uint8_t _interpret_nmea(char *sentence)
 		struct minmea_sentence_vtg vtg_sentence;
 		if (!minmea_parse_vtg(&vtg_sentence, sentence))
 			return 0;
-		_track_true = vtg_sentence.true_track_degrees;
-		_gs_knots = vtg_sentence.speed_knots;
+		_track_true = _gps_hundredths(&vtg_sentence.true_track_degrees);
+		_gs_knots = _gps_hundredths(&vtg_sentence.speed_knots);
 		break;
 	}
 	case MINMEA_SENTENCE_ZDA:
@@ -171,41 +301,82 @@ static uint8_t _interpret_nmea(char *sentence)
 	return 1;
 }
 
-void USART1_IRQHandler(void)
+// parse a sentence, the ones a fix is made of right here. Returns 0 if it is bad
+static uint8_t _interpret_nmea(char *sentence, uint8_t len)
 {
-	if (USART_GetITStatus(USART1, USART_IT_RXNE) == SET)
+	struct NMEA_Fix fix;
+
+	switch (NMEA_ParseSentence(sentence, len, &fix))
 	{
-		char c = (char)USART_ReceiveData(USART1);
+	case NMEA_SENTENCE_INVALID:
+		return 0;
+	case NMEA_SENTENCE_RMC:
+		if (!fix.valid)
+			break;
+		_gps_apply(&fix);
+		if (fix.fields & NMEA_HAS_TIME)
+			_gps_add_to_fix(GPS_FIX_RMC, fix.time_ms);
+		break;
+	case NMEA_SENTENCE_GGA:
+		_gps_apply(&fix);
+		if (fix.fields & NMEA_HAS_TIME)
+			_gps_add_to_fix(GPS_FIX_GGA, fix.time_ms);
+		break;
+	case NMEA_SENTENCE_VTG:
+		_gps_apply(&fix);
+		break;
+	default:
+		if (!NMEA_CheckSentence(sentence, len))
+			return 0;
+		_interpret_other(sentence);
+		break;
+	}
 
-		// zero the buffer if this is the first piece of data we are receiving
-		if (_rx_index == 0)
-		{
-			_rx_len = 0;
-			memset(_rx_buf,0,BUF_LEN);
-		}
+	return 1;
+}
 
-		// process the byte
-		if (c == '\r')
-		{
-			// eat
-		}
-		else if (c == '\n') // this indicates the end of a sentence
-		{
-			_rx_len = _rx_index + 1;
-			_rx_index = 0;
+// the DMA counts down the bytes left until it wraps around to the start of the buffer
+static uint16_t _gps_rx_head()
+{
+	return (GPS_RX_BUF_LEN - DMA_GetCurrDataCounter(GPS_RX_DMA_STREAM)) % GPS_RX_BUF_LEN;
+}
 
-			if (xQueueSendToBackFromISR(_rx_queue, _rx_buf, NULL) == errQUEUE_FULL)
-			{
-				// TODO: give error response
-				_rx_queue_full = 1;
-			}
-		}
-		else // put the byte into the receive buffer
-		{
-			_rx_buf[_rx_index++] = c;
-		}
+static void _gps_signal_from_isr()
+{
+	BaseType_t higher_priority_task_woken = pdFALSE;
+	struct GPS_RxMark *mark = &_rx_marks[_rx_marks_written % GPS_RX_MARKS];
+
+	mark->head = _gps_rx_head();
+	mark->time = xTaskGetTickCountFromISR();
+	++_rx_marks_written;
+	xSemaphoreGiveFromISR(_rx_ready, &higher_priority_task_woken);
+	portYIELD_FROM_ISR(higher_priority_task_woken);
+}
+
+void DMA2_Stream2_IRQHandler(void)
+{
+	if (DMA_GetITStatus(GPS_RX_DMA_STREAM, GPS_RX_DMA_HT_INT) == SET)
+	{
+		++_rx_halves;
+		DMA_ClearITPendingBit(GPS_RX_DMA_STREAM, GPS_RX_DMA_HT_INT);
+		_gps_signal_from_isr();
+	}
 
-		USART_ClearITPendingBit(USART1, USART_IT_RXNE);
+	if (DMA_GetITStatus(GPS_RX_DMA_STREAM, GPS_RX_DMA_TC_INT) == SET)
+	{
+		++_rx_halves;
+		DMA_ClearITPendingBit(GPS_RX_DMA_STREAM, GPS_RX_DMA_TC_INT);
+		_gps_signal_from_isr();
+	}
+}
+
+void USART1_IRQHandler(void)
+{
+	if (USART_GetITStatus(USART1, USART_IT_IDLE) == SET)
+	{
+		// the flag is cleared by reading the status register, which was just done, and then the data register
+		USART_ReceiveData(USART1);
+		_gps_signal_from_isr();
 	}
 
 	if (USART_GetITStatus(USART1, USART_IT_TC) == SET)
@@ -232,12 +403,95 @@ static uint8_t _gps_send_command(char *cmd, uint8_t len)
 	return 1;
 }
 
+static void _gps_set_baud_rate(uint32_t baud_rate)
+{
+	USART_InitTypeDef UARTStruct;
+
+	USART_Cmd(USART1, DISABLE);
+	USART_StructInit(&UARTStruct);
+	UARTStruct.USART_BaudRate = baud_rate;
+	USART_Init(USART1, &UARTStruct);
+	USART_Cmd(USART1, ENABLE);
+}
+
+// forget about the bytes received so far
+static void _gps_skip_received()
+{
+	taskENTER_CRITICAL();
+	_rx_halves = 0;
+	_rx_marks_read = _rx_marks_written;
+	taskEXIT_CRITICAL();
+
+	NMEA_ResetFramer(&_framer);
+	_rx_tail = _rx_head = _gps_rx_head();
+	_queue_count = 0;
+}
+
+// listen at a rate until a sentence with a good checksum comes in, returns 1 if one did
+static uint8_t _gps_try_baud_rate(uint32_t baud_rate)
+{
+	TickType_t start, elapsed;
+	uint32_t good, errors;
+
+	_gps_set_baud_rate(baud_rate);
+	_gps_skip_received();
+	good = _framer.sentences - _stats.bad_sentences;
+	errors = _framer.dropped + _stats.bad_sentences;
+
+	start = xTaskGetTickCount();
+	while ((elapsed = xTaskGetTickCount() - start) < pdMS_TO_TICKS(GPS_BAUD_DETECT_MS))
+	{
+		GPS_WaitForData(GPS_BAUD_DETECT_MS - elapsed * portTICK_PERIOD_MS);
+		GPS_CheckForNewData();
+		if (_framer.sentences - _stats.bad_sentences != good)
+			return 1;
+		// at the wrong rate there is garbage, or nothing at all
+		if (_framer.dropped + _stats.bad_sentences - errors >= GPS_BAUD_DETECT_ERRORS)
+			return 0;
+	}
+
+	return 0;
+}
+
+// returns the rate the receiver is sending at, 0 if it is not heard at any
+static uint32_t _gps_detect_baud_rate()
+{
+	uint8_t i;
+
+	for (i = 0; i < sizeof(_baud_rates) / sizeof(_baud_rates[0]); ++i)
+	{
+		if (i > 0 && _baud_rates[i] == GPS_BAUD_RATE)
+			continue;
+		if (_gps_try_baud_rate(_baud_rates[i]))
+			return _baud_rates[i];
+	}
+
+	return 0;
+}
+
+// wait until the last command is out, the rate is not to be changed under it
+static void _gps_wait_for_send()
+{
+	while (_is_transmitting)
+		vTaskDelay(pdMS_TO_TICKS(1));
+}
+
 uint8_t GPS_Initialize()
 {
-	_rx_queue = xQueueCreate(QUEUE_LEN, BUF_LEN);
-	if (_rx_queue == NULL)
+	_rx_ready = xSemaphoreCreateBinary();
+	if (_rx_ready == NULL)
 		return 0;
 
+	NMEA_InitFramer(&_framer);
+	_rx_tail = _rx_head = 0;
+	_rx_halves = 0;
+	_rx_marks_read = _rx_marks_written;
+	_queue_first = _queue_count = 0;
+	memset(&_stats, 0, sizeof(_stats));
+	_fix_parts = 0;
+	_fix_complete = 0;
+	_update_rate_hz = 1;
+
 	RCC_AHB1PeriphClockCmd(RCC_AHB1Periph_GPIOA, ENABLE);
 	GPIO_InitTypeDef GPIOStruct;
 	GPIO_StructInit(&GPIOStruct);
@@ -254,11 +508,7 @@ uint8_t GPS_Initialize()
 	GPIO_PinAFConfig(GPS_TX_PORT, GPS_TX_PINSOURCE, GPIO_AF_USART1);
 
 	RCC_APB2PeriphClockCmd(RCC_APB2Periph_USART1, ENABLE);
-	USART_InitTypeDef UARTStruct;
-	USART_StructInit(&UARTStruct);
-	USART_Init(USART1, &UARTStruct);
-
-	USART_Cmd(USART1, ENABLE);
+	_gps_set_baud_rate(GPS_DEFAULT_BAUD_RATE);
 
 	NVIC_InitTypeDef NVICStruct;
 	NVICStruct.NVIC_IRQChannelCmd = ENABLE;
@@ -266,45 +516,273 @@ uint8_t GPS_Initialize()
 	NVICStruct.NVIC_IRQChannelPreemptionPriority = 6;
 	NVIC_Init(&NVICStruct);
 
-	USART_ITConfig(USART1, USART_IT_RXNE, ENABLE);
+	USART_ITConfig(USART1, USART_IT_IDLE, ENABLE);
 
 	RCC_AHB1PeriphClockCmd(RCC_AHB1Periph_DMA2, ENABLE);
 	DMA_InitTypeDef DMAStruct;
 	DMA_StructInit(&DMAStruct);
 	DMAStruct.DMA_Channel = DMA_Channel_4;
-	DMAStruct.DMA_PeripheralBaseAddr = (uint32_t) (&(USART1->DR));
-	DMAStruct.DMA_Memory0BaseAddr = (uint32_t)_tx_buf;
+	DMAStruct.DMA_PeripheralBaseAddr = (uint32_t)(uintptr_t)&USART1->DR;
+	DMAStruct.DMA_Memory0BaseAddr = (uint32_t)(uintptr_t)_tx_buf;
 	DMAStruct.DMA_DIR = DMA_DIR_MemoryToPeripheral;
-	DMAStruct.DMA_BufferSize = BUF_LEN;
+	DMAStruct.DMA_BufferSize = NMEA_BUF_LEN;
 	DMAStruct.DMA_Priority = DMA_Priority_High;
 	DMAStruct.DMA_MemoryInc = DMA_MemoryInc_Enable;
 	DMA_Init(DMA2_Stream7, &DMAStruct);
 
+	// reception runs for good, around and around the receive buffer
+	DMA_StructInit(&DMAStruct);
+	DMAStruct.DMA_Channel = GPS_RX_DMA_CHANNEL;
+	DMAStruct.DMA_PeripheralBaseAddr = (uint32_t)(uintptr_t)&USART1->DR;
+	DMAStruct.DMA_Memory0BaseAddr = (uint32_t)(uintptr_t)_rx_buf;
+	DMAStruct.DMA_DIR = DMA_DIR_PeripheralToMemory;
+	DMAStruct.DMA_BufferSize = GPS_RX_BUF_LEN;
+	DMAStruct.DMA_Priority = DMA_Priority_High;
+	DMAStruct.DMA_MemoryInc = DMA_MemoryInc_Enable;
+	DMAStruct.DMA_Mode = DMA_Mode_Circular;
+	DMA_Init(GPS_RX_DMA_STREAM, &DMAStruct);
+	DMA_ITConfig(GPS_RX_DMA_STREAM, DMA_IT_HT | DMA_IT_TC, ENABLE);
+
+	NVICStruct.NVIC_IRQChannel = DMA2_Stream2_IRQn;
+	NVIC_Init(&NVICStruct);
+
+	DMA_Cmd(GPS_RX_DMA_STREAM, ENABLE);
+	USART_DMACmd(USART1, USART_DMAReq_Rx, ENABLE);
+
 	USART_ClearFlag(USART1, USART_FLAG_TC);
 	USART_ITConfig(USART1, USART_IT_TC, ENABLE);
 
-	while(!_gps_send_command(PMTK_SET_NMEA_UPDATE_1HZ, strlen(PMTK_SET_NMEA_UPDATE_1HZ)));
+	_baud_rate = _gps_detect_baud_rate();
+	if (_baud_rate == 0)
+	{
+		// not heard at all, it may still come up from a cold start later
+		_gps_set_baud_rate(GPS_DEFAULT_BAUD_RATE);
+	}
+	else if (_baud_rate != GPS_BAUD_RATE)
+	{
+		while(!_gps_send_command(PMTK_SET_BAUD, strlen(PMTK_SET_BAUD)));
+		_gps_wait_for_send();
+		if (_gps_try_baud_rate(GPS_BAUD_RATE))
+			_baud_rate = GPS_BAUD_RATE;
+		else
+			_baud_rate = _gps_detect_baud_rate(); // did not take, find it again
+	}
+
+	// the garbage heard at the wrong rates is not worth counting
+	NMEA_InitFramer(&_framer);
+	memset(&_stats, 0, sizeof(_stats));
+	_gps_skip_received();
+
 	while(!_gps_send_command(PMTK_SET_NMEA_OUTPUT_RMCGGA, strlen(PMTK_SET_NMEA_OUTPUT_RMCGGA)));
+	if (!GPS_SetUpdateRate(GPS_UPDATE_RATE_HZ))
+		GPS_SetUpdateRate(1);
 
 	return 1;
 }
 
 uint8_t GPS_GetLastNMEA(char *buf)
 {
-	memcpy(buf,_sentence,strlen(_sentence));
+	memcpy(buf,&_rx_buf[_last.offset],_last.len);
+
+	return 1;
+}
+
+uint32_t GPS_GetBaudRate()
+{
+	return _baud_rate;
+}
+
+// switch the receiver to 1, 5 or 10 fixes a second. It works out a position no more than 5 times a
+// second, at 10 Hz every other fix is extrapolated. More than one fix a second needs the receiver at
+// GPS_BAUD_RATE, returns 0 if it is not
+uint8_t GPS_SetUpdateRate(uint8_t rate_hz)
+{
+	char *update;
+	char *fix_ctl;
+
+	switch (rate_hz)
+	{
+	case 1:
+		update = PMTK_SET_NMEA_UPDATE_1HZ;
+		fix_ctl = PMTK_API_SET_FIX_CTL_1HZ;
+		break;
+	case 5:
+		update = PMTK_SET_NMEA_UPDATE_5HZ;
+		fix_ctl = PMTK_API_SET_FIX_CTL_5HZ;
+		break;
+	case 10:
+		update = PMTK_SET_NMEA_UPDATE_10HZ;
+		fix_ctl = PMTK_API_SET_FIX_CTL_5HZ;
+		break;
+	default:
+		return 0;
+	}
+
+	if (rate_hz > 1 && _baud_rate != GPS_BAUD_RATE)
+		return 0;
+
+	while(!_gps_send_command(update, strlen(update)));
+	while(!_gps_send_command(fix_ctl, strlen(fix_ctl)));
+	_update_rate_hz = rate_hz;
+
+	return 1;
+}
+
+uint8_t GPS_GetUpdateRate()
+{
+	return _update_rate_hz;
+}
+
+// time of the receive interrupt that brought in the last complete fix
+uint8_t GPS_GetFixTick(TickType_t *tick)
+{
+	if (tick == NULL)
+		return 0;
+
+	*tick = _fix_tick;
 
 	return 1;
 }
 
+void GPS_GetStats(struct GPS_Stats *stats)
+{
+	if (stats == NULL)
+		return;
+
+	taskENTER_CRITICAL();
+	*stats = _stats;
+	taskEXIT_CRITICAL();
+}
+
+uint8_t GPS_WaitForData(uint32_t timeout_ms)
+{
+	if (_rx_ready == NULL)
+		return 0;
+
+	return xSemaphoreTake(_rx_ready, pdMS_TO_TICKS(timeout_ms)) == pdTRUE;
+}
+
+// time of the first receive interrupt at or past a sentence end, of those up to the marks count. The marks
+// before it are not needed by the sentences after it either
+static TickType_t _gps_rx_time(uint16_t end, uint16_t head, uint8_t marks, TickType_t now)
+{
+	uint16_t after_end = (head + GPS_RX_BUF_LEN - end) % GPS_RX_BUF_LEN; // bytes received since the end
+	struct GPS_RxMark *mark;
+
+	for (; _rx_marks_read != marks; ++_rx_marks_read)
+	{
+		mark = &_rx_marks[_rx_marks_read % GPS_RX_MARKS];
+		if ((head + GPS_RX_BUF_LEN - mark->head) % GPS_RX_BUF_LEN <= after_end)
+			return mark->time;
+	}
+
+	// the interrupt for it has not come yet, it is in just now
+	return now;
+}
+
+// frame received bytes up to head into the sentence queue, until it is full
+static void _gps_frame(uint16_t head, uint8_t marks, TickType_t now)
+{
+	struct GPS_Sentence *sentence;
+	uint8_t len;
+
+	while (_queue_count < GPS_SENTENCE_QUEUE_LEN
+		&& (len = NMEA_Frame(&_framer, _rx_buf, GPS_RX_BUF_LEN, &_rx_tail, head)) > 0)
+	{
+		// a sentence, with its terminator, that runs past the end continues from the start of the buffer
+		if (_framer.start + len >= GPS_RX_BUF_LEN)
+			memcpy(&_rx_buf[GPS_RX_BUF_LEN], _rx_buf, _framer.start + len - GPS_RX_BUF_LEN);
+		_rx_buf[_framer.start + len] = '\0';
+
+		sentence = &_queue[(_queue_first + _queue_count) % GPS_SENTENCE_QUEUE_LEN];
+		sentence->offset = _framer.start;
+		sentence->len = len;
+		sentence->time = _gps_rx_time(_rx_tail, head, marks, now);
+		++_queue_count;
+	}
+
+	if (_queue_count > _stats.max_queued_sentences)
+		_stats.max_queued_sentences = _queue_count;
+}
+
+// frame and parse what came in, returns 1 when a fix was completed. The sentences after it are left for
+// the next call, so call again until it returns 0
 uint8_t GPS_CheckForNewData()
 {
 	uint8_t ret = 0;
-	while (xQueueReceive(_rx_queue, _sentence, 0) == pdPASS)
+	uint16_t head, received, backlog, pending;
+	int16_t laps;
+	struct GPS_Sentence *sentence;
+
+	taskENTER_CRITICAL();
+	uint8_t halves = _rx_halves;
+	uint8_t marks = _rx_marks_written;
+	_rx_halves = 0;
+	taskEXIT_CRITICAL();
+
+	TickType_t now = xTaskGetTickCount();
+	head = _gps_rx_head();
+	received = (head + GPS_RX_BUF_LEN - _rx_head) % GPS_RX_BUF_LEN; // since the last look, less whole laps
+
+	// bytes the last look still needed, from the oldest sentence it left queued, or else those it left
+	// unframed and those of a partly framed sentence before them
+	if (_queue_count > 0)
+		backlog = (_rx_head + GPS_RX_BUF_LEN - _queue[_queue_first].offset) % GPS_RX_BUF_LEN;
+	else
+		backlog = (_rx_head + GPS_RX_BUF_LEN - _rx_tail) % GPS_RX_BUF_LEN + _framer.len;
+
+	// the marks left by more interrupts than there is room for are gone, the ones after are good enough
+	if ((uint8_t)(marks - _rx_marks_read) > GPS_RX_MARKS)
+		_rx_marks_read = marks - GPS_RX_MARKS;
+
+	// the half buffers filled beyond those the received bytes account for are whole trips of the DMA around
+	// the buffer. Either that or the DMA catching up with the bytes still needed means they were
+	// overwritten, carry on from the newest byte
+	laps = (halves - ((_rx_head + received) / (GPS_RX_BUF_LEN / 2) - _rx_head / (GPS_RX_BUF_LEN / 2))) / 2;
+	_rx_head = head;
+	pending = backlog + received;
+	if (laps > 0 || pending >= GPS_RX_BUF_LEN)
 	{
-		ret = 1;
-		_interpret_nmea(_sentence);
+		NMEA_ResetFramer(&_framer);
+		_framer.dropped += _queue_count; // queued sentences were overwritten too
+		_queue_count = 0;
+		_rx_tail = head;
+		_rx_marks_read = marks;
+		++_stats.overruns;
+		pending = GPS_RX_BUF_LEN;
 	}
 
+	// parse the queued sentences whenever the queue is full, and once all new bytes are framed, up to the
+	// end of a fix. The rest is left for the next call
+	do
+	{
+		_gps_frame(head, marks, now);
+		for (; _queue_count > 0 && !ret; --_queue_count)
+		{
+			sentence = &_queue[_queue_first];
+			_queue_first = (_queue_first + 1) % GPS_SENTENCE_QUEUE_LEN;
+			if (!_interpret_nmea((char *)&_rx_buf[sentence->offset], sentence->len))
+			{
+				++_stats.bad_sentences;
+				continue;
+			}
+			_last = *sentence;
+			if (_fix_complete)
+			{
+				_fix_complete = 0;
+				_fix_tick = _last.time;
+				ret = 1;
+			}
+		}
+	} while (_rx_tail != head && !ret);
+
+	taskENTER_CRITICAL();
+	if (pending > _stats.max_pending_bytes)
+		_stats.max_pending_bytes = pending;
+	_stats.sentences = _framer.sentences;
+	_stats.dropped_sentences = _framer.dropped;
+	taskEXIT_CRITICAL();
+
 	return ret;
 }
 
@@ -314,10 +792,10 @@ uint8_t GPS_GetCoords(float *latitude, float *longitude)
 		return 0;
 
 	if (latitude != NULL)
-		*latitude = minmea_tocoord(&_latitude);
+		*latitude = _latitude / 1e7f;
 
 	if (longitude != NULL)
-		*longitude = minmea_tocoord(&_longitude);
+		*longitude = _longitude / 1e7f;
 
 	return 1;
 }
@@ -328,10 +806,10 @@ uint8_t GPS_GetHeading(float *true_heading, float *mag_heading)
 		return 0;
 
 	if (true_heading != NULL)
-		*true_heading = minmea_tofloat(&_track_true);
+		*true_heading = _track_true / 100.0f;
 
 	if (mag_heading != NULL)
-		*mag_heading = minmea_tofloat(&_track_true) + minmea_tofloat(&_mag_variation);
+		*mag_heading = (_track_true + _mag_variation) / 100.0f;
 
 	return 1;
 }
@@ -342,7 +820,7 @@ uint8_t GPS_GetAltitude(float *altitude, char *altitude_units)
 		return 0;
 
 	if (altitude != NULL)
-		*altitude = minmea_tofloat(&_altitude);
+		*altitude = _altitude / 100.0f;
 
 	if (altitude_units != NULL)
 		*altitude_units = _altitude_units;
@@ -355,7 +833,25 @@ uint8_t GPS_GetGroundSpeedKnots(float *gs_knots)
 	if (gs_knots == NULL)
 		return 0;
 
-	*gs_knots = minmea_tofloat(&_gs_knots);
+	*gs_knots = _gs_knots / 100.0f;
+
+	return 1;
+}
+
+// the fix in the integers it was parsed to, no float rounding
+uint8_t GPS_GetFix(struct GPS_Fix *fix)
+{
+	if (fix == NULL)
+		return 0;
+
+	fix->latitude = _latitude;
+	fix->longitude = _longitude;
+	fix->altitude = _altitude;
+	fix->altitude_units = _altitude_units;
+	fix->track = _track_true;
+	fix->variation = _mag_variation;
+	fix->speed = _gs_knots;
+	fix->num_sats = _num_sats;
 
 	return 1;
 }
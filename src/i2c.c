@@ -1,13 +1,32 @@
 #include "stm32f4xx.h"
+
+#include "FreeRTOS.h"
+#include "semphr.h"
+
 #include "i2c.h"
 
 static volatile uint8_t _is_init = 0;
+static SemaphoreHandle_t _bus_mutex = NULL; // one transfer at a time, the sensors on the bus are used by several tasks
+
+static void _lock()
+{
+	if (_bus_mutex != NULL)
+		xSemaphoreTake(_bus_mutex, portMAX_DELAY);
+}
+
+static void _unlock()
+{
+	if (_bus_mutex != NULL)
+		xSemaphoreGive(_bus_mutex);
+}
 
+// call once before the scheduler starts, so tasks never race to initialize the bus
 uint8_t I2C_Initialize()
 {
-	// TODO: make sure this is protected by a mutex
 	if (!_is_init)
 	{
+		_bus_mutex = xSemaphoreCreateMutex();
+
 		RCC_AHB1PeriphClockCmd(RCC_AHB1Periph_GPIOB, ENABLE);
 		GPIO_InitTypeDef GPIOStruct;
 		GPIOStruct.GPIO_Mode = GPIO_Mode_AF;
@@ -27,7 +46,7 @@ uint8_t I2C_Initialize()
 		RCC_APB1PeriphClockCmd(RCC_APB1Periph_I2C1, ENABLE);
 		I2C_InitTypeDef I2CStruct;
 		I2C_StructInit(&I2CStruct);
-		I2CStruct.I2C_ClockSpeed = 100000;
+		I2CStruct.I2C_ClockSpeed = 400000; // fast mode, all sensors on the bus support it and the IMU samples at 200 Hz
 		I2CStruct.I2C_Ack = I2C_Ack_Enable;
 		I2C_Init(I2C1, &I2CStruct);
 
@@ -51,6 +70,8 @@ int8_t I2C_Transmit(uint8_t address, uint8_t *data, uint16_t len)
 		I2C_Initialize();
 	}
 
+	_lock();
+
 	while (I2C_GetFlagStatus(I2C1, I2C_FLAG_BUSY) == SET)
 		; // wait until any previous communications are finished
 
@@ -84,6 +105,7 @@ int8_t I2C_Transmit(uint8_t address, uint8_t *data, uint16_t len)
 
 	I2C_GenerateSTOP(I2C1, ENABLE);
 
+	_unlock();
 	return 0;
 }
 
@@ -94,6 +116,8 @@ int8_t I2C_Receive(uint8_t address, uint8_t *data, uint16_t num_bytes)
 		I2C_Initialize();
 	}
 
+	_lock();
+
 	while (I2C_GetFlagStatus(I2C1, I2C_FLAG_BUSY) == SET)
 		; // wait until any previous communications are finished
 
@@ -123,6 +147,7 @@ int8_t I2C_Receive(uint8_t address, uint8_t *data, uint16_t num_bytes)
 
 	I2C_GenerateSTOP(I2C1, ENABLE);
 
+	_unlock();
 	return 0;
 }
 
@@ -133,6 +158,8 @@ int8_t I2C_ReadRegs(uint8_t address, uint8_t reg, uint8_t *data, uint16_t num_by
 		I2C_Initialize();
 	}
 
+	_lock();
+
 	while (I2C_GetFlagStatus(I2C1, I2C_FLAG_BUSY) == SET)
 		; // wait until any previous communications are finished
 
@@ -175,6 +202,7 @@ int8_t I2C_ReadRegs(uint8_t address, uint8_t reg, uint8_t *data, uint16_t num_by
 
 	I2C_GenerateSTOP(I2C1, ENABLE);
 
+	_unlock();
 	return 0;
 }
 
@@ -185,6 +213,8 @@ int8_t I2C_WriteRegs(uint8_t address, uint8_t reg, uint8_t *data, uint16_t num_b
 		I2C_Initialize();
 	}
 
+	_lock();
+
 	while (I2C_GetFlagStatus(I2C1, I2C_FLAG_BUSY) == SET)
 		; // wait until any previous communications are finished
 
@@ -222,6 +252,7 @@ int8_t I2C_WriteRegs(uint8_t address, uint8_t reg, uint8_t *data, uint16_t num_b
 
 	I2C_GenerateSTOP(I2C1, ENABLE);
 
+	_unlock();
 	return 0;
 }
 
@@ -232,6 +263,8 @@ int8_t I2C_WriteRegNoAck(uint8_t address, uint8_t reg, uint8_t *data)
 		I2C_Initialize();
 	}
 
+	_lock();
+
 	while (I2C_GetFlagStatus(I2C1, I2C_FLAG_BUSY) == SET)
 		; // wait until any previous communications are finished
 
@@ -255,5 +288,6 @@ int8_t I2C_WriteRegNoAck(uint8_t address, uint8_t reg, uint8_t *data)
 
 	I2C_GenerateSTOP(I2C1, ENABLE);
 
+	_unlock();
 	return 0;
 }
@@ -0,0 +1,888 @@
+#include <string.h>
+
+#include "stm32f4xx.h"
+
+#include "FreeRTOS.h"
+#include "task.h"
+#include "message_buffer.h"
+
+#include "ff.h"
+#include "diskio.h"
+#include "sd.h"
+#include "util.h"
+#include "log.h"
+
+// Records are encoded straight into two block sized staging buffers. Producers append to the filling
+// buffer, and once the next record does not fit it is handed over to the SD task, which writes it out as
+// one whole sector while the other buffer fills up. Records never span two blocks and the encoder starts
+// over at every block, so each block decodes on its own. The block header, with the sequence number and
+// the CRC from the CRC unit, is filled in by the SD task right before the block is written.
+//
+// Producers hand in records with Log_Submit, from tasks or interrupts, at whatever rate they sample. Each
+// channel has a message buffer of its own, so every channel has a single writer as message buffers need,
+// and a stalled card only ever costs the records that do not fit the buffer, the producer never waits.
+// The SD task drains the message buffers in Log_Process and encodes the records into the staging buffers.
+//
+// A session starts with the file header block, followed by the data blocks in sequence order.
+//
+// While logging, the time of the first record of every LOG_INDEX_INTERVAL-th block goes into a time index
+// in RAM. When the index fills up every other entry is dropped and the interval doubles, so it covers a
+// session of any length. The index is written to a sidecar file next to the log when it is closed, and
+// built again from the blocks of a log recovered after a power cut.
+//
+// A new log file is pre-allocated as one contiguous extent with f_expand. While the extent lasts the
+// buffers are written straight to their sectors through the disk layer, with no FAT or directory updates,
+// and the file is truncated to the logged length when it is closed. If the extent cannot be allocated, or
+// once it is used up, the buffers are written through f_write instead.
+//
+// Records are taken from Log_Start on, which can be well before the card is mounted and the log file can be
+// opened. Until then full staging buffers are moved to a backlog in RAM that keeps the latest
+// LOG_BACKLOG_BLOCKS blocks, and Log_Open writes them as the first data blocks of the session.
+//
+// Cards write fastest when they fill their allocation units from the first sector to the last, so the
+// extent is placed at the start of an allocation unit when a free run of clusters there can be found. The
+// blocks go around the sector cache of the disk layer, so they reach the card in order the moment they are
+// written. No sector of a unit is left behind in the cache to be written after the card has moved on to the
+// next one, and after a power cut the valid blocks of the extent are always the ones before some block.
+//
+// Other tasks can use the file system next to the logger. The disk layer hands the card to one disk
+// function at a time, so a block write waits for no more than one read or write of another task. The
+// longest block write is kept in the stats.
+#define NUM_BUFFERS 2
+#define LOG_EXTENT_SIZE ((FSIZE_t)16 * 1024 * 1024)
+#define LOG_INDEX_INTERVAL 8
+#define LOG_INDEX_MAX_ENTRIES 256
+#define LOG_MAX_FILENAME 13 // 8.3 name
+#define LOG_BACKLOG_BLOCKS 16 // 8 KB, about 6 s of all channels with the IMU at full rate
+#define LOG_ALIGN_TRIES 16 // free runs of clusters looked at for an extent starting on an allocation unit
+
+// Per channel message buffer size, enough for what the channel submits while the SD task is busy with the
+// card, and decimation, only every n-th submitted record is logged. The channel period in the file header
+// is the period in the schema times the decimation.
+struct Log_ChannelConfig
+{
+	uint16_t buffer_size;
+	uint8_t decimation;
+};
+
+static const struct Log_ChannelConfig _channel_config[LOGFMT_NUM_CHANNELS] =
+{
+	[LOGFMT_CHANNEL_FIX] = {256, 1}, // up to 10 Hz, 28 bytes a record in the buffer, about 900 ms
+	[LOGFMT_CHANNEL_BARO] = {256, 1},
+	[LOGFMT_CHANNEL_IMU] = {4096, 1}, // 200 Hz, 44 bytes a record in the buffer, about 450 ms
+	[LOGFMT_CHANNEL_EVENT] = {256, 1},
+};
+
+// submitted record as kept in a channel message buffer, only as many values as the channel has are stored
+struct Log_Message
+{
+	TickType_t tick;
+	int32_t value[LOGFMT_MAX_FIELDS];
+};
+
+static uint8_t _buf[NUM_BUFFERS][LOG_BLOCK_SIZE] __attribute__((aligned(4)));
+static volatile uint16_t _buf_len[NUM_BUFFERS] = {0}; // payload bytes appended to each buffer
+static volatile uint8_t _buf_full[NUM_BUFFERS] = {0}; // buffer is waiting to be written by the SD task
+static volatile uint32_t _buf_seq[NUM_BUFFERS] = {0}; // data block each buffer holds
+static volatile uint32_t _buf_time[NUM_BUFFERS] = {0}; // time of the first record in each buffer
+static volatile uint8_t _fill = 0; // buffer producers are appending to
+static struct LogFmt_State _fmt;
+
+static uint8_t _backlog[LOG_BACKLOG_BLOCKS][LOG_BLOCK_SIZE] __attribute__((aligned(4)));
+static uint16_t _backlog_len[LOG_BACKLOG_BLOCKS] = {0};
+static uint32_t _backlog_seq[LOG_BACKLOG_BLOCKS] = {0};
+static uint32_t _backlog_time[LOG_BACKLOG_BLOCKS] = {0};
+static uint8_t _backlog_first = 0;
+static uint8_t _backlog_count = 0;
+static uint8_t _scratch[LOG_BLOCK_SIZE] __attribute__((aligned(4))); // file header, the staging buffers may be in use
+static struct LogFmt_Header _header;
+static uint32_t _session = 0;
+
+static MessageBufferHandle_t _channel_buf[LOGFMT_NUM_CHANNELS] = {0};
+static uint8_t _channel_skip[LOGFMT_NUM_CHANNELS] = {0}; // records skipped since the last logged one
+static volatile uint16_t _channel_period_ms[LOGFMT_NUM_CHANNELS] = {0}; // 0 for the period of the schema
+static uint8_t _channel_logged[LOGFMT_NUM_CHANNELS] = {0}; // the session has encoded a record of the channel
+static TickType_t _session_tick = 0; // tick count when the log was opened, record times count from here
+
+static FIL _file;
+static volatile uint8_t _is_started = 0; // records are taken, into the backlog while the log is not open
+static volatile uint8_t _is_open = 0;
+static uint8_t _is_raw = 0; // buffers are written straight to the pre-allocated extent
+static FSIZE_t _base = 0; // file offset of the file header block of the session
+static DWORD _extent_lba = 0;
+static uint32_t _extent_sectors = 0;
+static DWORD _au_sectors = 1; // allocation unit of the card
+static uint32_t _sectors_at_open = 0;
+static struct Log_Stats _stats = {0};
+
+static struct LogFmt_IndexEntry _index[LOG_INDEX_MAX_ENTRIES];
+static uint16_t _index_count = 0;
+static uint32_t _index_interval = LOG_INDEX_INTERVAL;
+static char _index_name[LOG_MAX_FILENAME] = {0};
+
+// CRC unit over len bytes, a last partial word is padded with zeros like LogFmt_Crc32 does
+static uint32_t _crc(const uint8_t *data, uint32_t len)
+{
+	uint32_t tail = 0;
+
+	CRC_ResetDR();
+	CRC_CalcBlockCRC((uint32_t *)data, len / 4);
+	if (len % 4 == 0)
+		return CRC_GetCRC();
+
+	memcpy(&tail, &data[len & ~3], len % 4);
+	return CRC_CalcCRC(tail);
+}
+
+// first cluster at or after clst that starts an allocation unit, 0 if units and clusters do not line up
+static DWORD _au_cluster(FATFS *fs, DWORD clst)
+{
+	DWORD lba = fs->database + (clst - 2) * fs->csize;
+	DWORD offset = (_au_sectors - lba % _au_sectors) % _au_sectors;
+
+	if (offset % fs->csize != 0)
+		return 0;
+
+	return clst + offset / fs->csize;
+}
+
+// allocate the extent on an allocation unit boundary. f_expand in prepare mode finds the first free run
+// long enough from the suggested cluster on and leaves it as the next suggestion, if it does not start on
+// the boundary the search goes on from the next boundary after it.
+static uint8_t _expand_aligned()
+{
+	FATFS *fs = _file.obj.fs;
+	DWORD clst = fs->last_clst + 1;
+	uint8_t i;
+
+	if (_au_sectors <= 1)
+		return 0;
+
+	for (i = 0; i < LOG_ALIGN_TRIES; ++i)
+	{
+		clst = _au_cluster(fs, clst < 2 ? 2 : clst);
+		if (clst == 0 || clst >= fs->n_fatent)
+			return 0;
+
+		fs->last_clst = clst;
+		if (f_expand(&_file, LOG_EXTENT_SIZE, 0) != FR_OK)
+			return 0;
+
+		if (fs->last_clst + 1 == clst)
+		{
+			fs->last_clst = clst;
+			return f_expand(&_file, LOG_EXTENT_SIZE, 1) == FR_OK;
+		}
+		clst = fs->last_clst + 1;
+	}
+
+	return 0;
+}
+
+// reserve one contiguous run of clusters for a new file and work out where it starts on the card
+static uint8_t _expand()
+{
+	FATFS *fs = _file.obj.fs;
+
+	if (f_size(&_file) != 0)
+		return 0;
+
+	if (disk_ioctl(fs->pdrv, GET_BLOCK_SIZE, &_au_sectors) != RES_OK || _au_sectors == 0)
+		_au_sectors = 1;
+
+	if (!_expand_aligned() && f_expand(&_file, LOG_EXTENT_SIZE, 1) != FR_OK)
+		return 0;
+
+	// get the allocation into the FAT and directory entry right away, the data never touches them
+	if (f_sync(&_file) != FR_OK)
+		return 0;
+
+	_extent_lba = fs->database + (_file.obj.sclust - 2) * fs->csize;
+	_extent_sectors = (uint32_t)(LOG_EXTENT_SIZE / LOG_BLOCK_SIZE);
+
+	return 1;
+}
+
+// write a block to its place in the session, counted from the file header block
+static uint8_t _write_block(const uint8_t *block, uint32_t index)
+{
+	UINT num_written = 0;
+
+	if (_is_raw && index < _extent_sectors)
+		return disk_write_uncached(_file.obj.fs->pdrv, block, _extent_lba + index, 1) == RES_OK;
+
+	// the extent is used up or could not be allocated, carry on through the file system
+	_is_raw = 0;
+	if (f_lseek(&_file, _base + (FSIZE_t)index * LOG_BLOCK_SIZE) != FR_OK)
+		return 0;
+
+	if (f_write(&_file, block, LOG_BLOCK_SIZE, &num_written) != FR_OK || num_written != LOG_BLOCK_SIZE)
+		return 0;
+
+	return 1;
+}
+
+// fill in the block header of a buffer holding len payload bytes and write it out, a partially filled
+// buffer is written again once it is full
+static uint8_t _write_buffer(uint8_t *block, uint32_t seq, uint16_t len)
+{
+	struct LogFmt_BlockHeader header = {0, _session, seq, len};
+
+	LogFmt_EncodeBlockHeader(&header, block);
+	header.crc = _crc(&block[LOGFMT_BLOCK_CRC_START], LOGFMT_BLOCK_HEADER_LEN - LOGFMT_BLOCK_CRC_START + len);
+	LogFmt_EncodeBlockHeader(&header, block);
+
+	uint32_t start = DWT->CYCCNT;
+	uint8_t ret = _write_block(block, 1 + seq);
+	uint32_t write_us = (DWT->CYCCNT - start) / (SystemCoreClock / 1000000);
+	if (write_us > _stats.max_write_us)
+		_stats.max_write_us = write_us;
+
+	return ret;
+}
+
+// add a written block to the time index
+static void _index_block(uint32_t seq, uint32_t time_ms)
+{
+	uint16_t i;
+
+	if (seq % _index_interval != 0)
+		return;
+
+	if (_index_count == LOG_INDEX_MAX_ENTRIES)
+	{
+		// keep the entries that fall on the doubled interval, which are the even ones
+		for (i = 0; i < LOG_INDEX_MAX_ENTRIES / 2; ++i)
+			_index[i] = _index[2 * i];
+		_index_count = LOG_INDEX_MAX_ENTRIES / 2;
+		_index_interval *= 2;
+
+		if (seq % _index_interval != 0)
+			return;
+	}
+
+	_index[_index_count].time_ms = time_ms;
+	_index[_index_count].offset = (uint32_t)(_base + (FSIZE_t)(1 + seq) * LOG_BLOCK_SIZE);
+	++_index_count;
+}
+
+// the sidecar has the name of the log file with the extension .idx
+static void _index_filename(const char *filename)
+{
+	char *dot;
+
+	strncpy(_index_name, filename, LOG_MAX_FILENAME - 1);
+	_index_name[LOG_MAX_FILENAME - 1] = '\0';
+	dot = strrchr(_index_name, '.');
+	if (dot == NULL)
+		dot = &_index_name[strlen(_index_name)];
+	if (dot + 4 >= &_index_name[LOG_MAX_FILENAME])
+		dot = &_index_name[LOG_MAX_FILENAME - 5];
+	strcpy(dot, ".idx");
+}
+
+// write the time index to the sidecar, the log file has to be closed already as its FIL is reused
+static uint8_t _write_index()
+{
+	struct LogFmt_IndexHeader header = {_session, (uint32_t)_base, _index_count, _index_interval};
+	uint8_t buf[LOGFMT_INDEX_HEADER_LEN] __attribute__((aligned(4)));
+	UINT num_written = 0;
+	uint32_t crc;
+	uint8_t ret = 1;
+
+	LogFmt_EncodeIndexHeader(&header, buf);
+
+	// the entries are stored little endian like the Cortex-M keeps them in RAM
+	CRC_ResetDR();
+	CRC_CalcBlockCRC((uint32_t *)buf, LOGFMT_INDEX_HEADER_LEN / 4);
+	crc = CRC_CalcBlockCRC((uint32_t *)_index, _index_count * LOGFMT_INDEX_ENTRY_LEN / 4);
+
+	if (f_open(&_file, _index_name, FA_WRITE|FA_CREATE_ALWAYS) != FR_OK)
+		return 0;
+
+	if (f_write(&_file, buf, sizeof(buf), &num_written) != FR_OK || num_written != sizeof(buf))
+		ret = 0;
+	if (f_write(&_file, _index, _index_count * LOGFMT_INDEX_ENTRY_LEN, &num_written) != FR_OK
+		|| num_written != _index_count * LOGFMT_INDEX_ENTRY_LEN)
+		ret = 0;
+	if (f_write(&_file, &crc, sizeof(crc), &num_written) != FR_OK || num_written != sizeof(crc))
+		ret = 0;
+
+	if (f_close(&_file) != FR_OK)
+		ret = 0;
+
+	return ret;
+}
+
+static uint8_t _read_block(void *context, uint32_t index, uint8_t *block)
+{
+	UINT num_read = 0;
+
+	(void)context;
+	if (f_lseek(&_file, (FSIZE_t)(1 + index) * LOG_BLOCK_SIZE) != FR_OK)
+		return 0;
+
+	return f_read(&_file, block, LOG_BLOCK_SIZE, &num_read) == FR_OK && num_read == LOG_BLOCK_SIZE;
+}
+
+// index the first num_blocks blocks of a recovered log, like they were indexed while logging, so only
+// the blocks that go into the index are read
+static uint8_t _rebuild_index(const char *filename, uint32_t session, uint32_t num_blocks)
+{
+	uint32_t seq, time_ms;
+
+	_session = session;
+	_base = 0;
+	_index_count = 0;
+	_index_interval = LOG_INDEX_INTERVAL;
+	_index_filename(filename);
+
+	for (seq = 0; seq < num_blocks; seq += _index_interval)
+	{
+		if (!_read_block(NULL, seq, _scratch) || !LogFmt_GetBlockTime(_scratch, &time_ms))
+			return 0;
+		_index_block(seq, time_ms);
+	}
+
+	return 1;
+}
+
+// cut a log that was not closed down to the blocks that made it onto the card
+static uint8_t _recover(const char *filename)
+{
+	struct LogFmt_Header header;
+	UINT num_read = 0;
+	uint32_t end;
+	uint8_t ret = 1;
+
+	if (f_open(&_file, filename, FA_READ|FA_WRITE|FA_OPEN_EXISTING) != FR_OK)
+		return 0;
+
+	// the file header decides which blocks belong to the session, without one nothing was logged
+	if (f_read(&_file, _scratch, LOG_BLOCK_SIZE, &num_read) != FR_OK || num_read != LOG_BLOCK_SIZE
+		|| LogFmt_DecodeHeader(&header, _scratch) == 0)
+	{
+		end = 0;
+		header.session = 0;
+	}
+	else
+	{
+		end = LogFmt_FindEnd(_read_block, NULL, header.session, (uint32_t)(LOG_EXTENT_SIZE / LOG_BLOCK_SIZE) - 1, _scratch);
+	}
+
+	if (f_lseek(&_file, header.session != 0 ? (FSIZE_t)(1 + end) * LOG_BLOCK_SIZE : 0) != FR_OK || f_truncate(&_file) != FR_OK)
+		ret = 0;
+
+	// the log never got to Log_Close, so it has no sidecar
+	if (header.session != 0 && !_rebuild_index(filename, header.session, end))
+		ret = 0;
+
+	if (f_close(&_file) != FR_OK)
+		ret = 0;
+
+	if (header.session != 0 && ret && !_write_index())
+		ret = 0;
+
+	return ret;
+}
+
+// Encode what the producers submitted into the staging buffers. Draining stops as soon as a staging buffer
+// fills up, so records are never taken out of a message buffer while there is no room to append them.
+// Returns 1 if it stopped early.
+static uint8_t _any_full()
+{
+	uint8_t b;
+
+	for (b = 0; b < NUM_BUFFERS; ++b)
+	{
+		if (_buf_full[b])
+			return 1;
+	}
+
+	return 0;
+}
+
+static uint8_t _drain()
+{
+	struct Log_Message msg;
+	struct LogFmt_Record record;
+	size_t len;
+	uint8_t c;
+
+	for (c = 0; c < LOGFMT_NUM_CHANNELS; ++c)
+	{
+		uint16_t pending = _channel_config[c].buffer_size - xMessageBufferSpaceAvailable(_channel_buf[c]);
+		if (pending > _stats.max_channel_bytes[c])
+			_stats.max_channel_bytes[c] = pending;
+
+		while (!_any_full() && (len = xMessageBufferReceive(_channel_buf[c], &msg, sizeof(msg), 0)) > 0)
+		{
+			record.channel = c;
+			record.num_fields = (len - sizeof(msg.tick)) / sizeof(int32_t);
+			// records submitted just before the log was opened count as its start
+			record.time_ms = (int32_t)(msg.tick - _session_tick) > 0 ? (msg.tick - _session_tick) * portTICK_PERIOD_MS : 0;
+			memcpy(record.value, msg.value, record.num_fields * sizeof(int32_t));
+
+			Log_Append(&record);
+		}
+
+		if (_any_full())
+			return 1;
+	}
+
+	return 0;
+}
+
+static uint8_t _check_submission(uint8_t channel, const int32_t *values, uint8_t num_values)
+{
+	const struct LogFmt_ChannelDef *def = LogFmt_GetChannelDef(channel);
+
+	// nothing is taken before Log_Start
+	return _is_started && def != NULL && values != NULL && num_values == def->num_fields && _channel_buf[channel] != NULL;
+}
+
+void Log_Init()
+{
+	uint8_t c;
+
+	for (c = 0; c < LOGFMT_NUM_CHANNELS; ++c)
+		_channel_buf[c] = xMessageBufferCreate(_channel_config[c].buffer_size);
+}
+
+// move full staging buffers to the backlog, once it is full the oldest block in it makes room
+static void _stash()
+{
+	uint8_t i, slot;
+
+	for (i = 1; i <= NUM_BUFFERS; ++i)
+	{
+		uint8_t b = (_fill + i) % NUM_BUFFERS;
+		if (!_buf_full[b])
+			continue;
+
+		if (_backlog_count == LOG_BACKLOG_BLOCKS)
+		{
+			_backlog_first = (_backlog_first + 1) % LOG_BACKLOG_BLOCKS;
+			--_backlog_count;
+			++_stats.dropped_blocks;
+		}
+		slot = (_backlog_first + _backlog_count) % LOG_BACKLOG_BLOCKS;
+		memcpy(_backlog[slot], _buf[b], LOG_BLOCK_SIZE);
+		_backlog_len[slot] = _buf_len[b];
+		_backlog_seq[slot] = _buf_seq[b];
+		_backlog_time[slot] = _buf_time[b];
+		++_backlog_count;
+
+		memset(_buf[b], 0, LOG_BLOCK_SIZE);
+
+		taskENTER_CRITICAL();
+		_buf_full[b] = 0;
+		taskEXIT_CRITICAL();
+	}
+}
+
+// write the backlog as the first data blocks of the session and number the staging buffers on from there
+static uint8_t _write_backlog()
+{
+	uint32_t base;
+	uint8_t i, b;
+
+	_stash();
+
+	base = _backlog_count > 0 ? _backlog_seq[_backlog_first] : _buf_seq[_fill];
+	for (i = 0; i < _backlog_count; ++i)
+	{
+		uint8_t slot = (_backlog_first + i) % LOG_BACKLOG_BLOCKS;
+		if (!_write_buffer(_backlog[slot], i, _backlog_len[slot]))
+			return 0;
+		_index_block(i, _backlog_time[slot]);
+	}
+
+	taskENTER_CRITICAL();
+	for (b = 0; b < NUM_BUFFERS; ++b)
+		_buf_seq[b] -= base;
+	taskEXIT_CRITICAL();
+
+	_backlog_first = _backlog_count = 0;
+	return 1;
+}
+
+// the periods set with Log_SetChannelPeriod, for the channels with no record encoded in the session yet
+static void _set_periods()
+{
+	uint8_t c;
+
+	for (c = 0; c < LOGFMT_NUM_CHANNELS; ++c)
+	{
+		if (_channel_period_ms[c] > 0 && !_channel_logged[c])
+			_header.channel[c].period_ms = _channel_period_ms[c] * _channel_config[c].decimation;
+	}
+}
+
+uint8_t Log_Start()
+{
+	uint8_t c;
+
+	if (_is_started)
+		return 1;
+
+	LogFmt_InitHeader(&_header, FIRMWARE_VERSION, 0, 0);
+	for (c = 0; c < LOGFMT_NUM_CHANNELS; ++c)
+	{
+		_header.channel[c].period_ms *= _channel_config[c].decimation;
+		_channel_logged[c] = 0;
+	}
+	_set_periods();
+	LogFmt_Init(&_fmt, &_header);
+
+	taskENTER_CRITICAL();
+	memset(_buf, 0, sizeof(_buf));
+	memset((void *)_buf_full, 0, sizeof(_buf_full));
+	memset((void *)_buf_len, 0, sizeof(_buf_len));
+	memset((void *)_buf_seq, 0, sizeof(_buf_seq));
+	_fill = 0;
+	taskEXIT_CRITICAL();
+	_backlog_first = _backlog_count = 0;
+
+	// anything left over from the last session would be stamped with the start of this one
+	for (c = 0; c < LOGFMT_NUM_CHANNELS; ++c)
+	{
+		xMessageBufferReset(_channel_buf[c]);
+		_channel_skip[c] = 0;
+	}
+	_session_tick = xTaskGetTickCount();
+	_is_started = 1;
+
+	return 1;
+}
+
+// A channel that runs at a rate only known once its task has set the hardware up, like the fixes of the
+// GPS receiver, stores no time for records at that period. The period goes into the header when the log is
+// opened, so the session started at boot takes it too if the channel has not encoded a record by then.
+uint8_t Log_SetChannelPeriod(uint8_t channel, uint16_t period_ms)
+{
+	if (channel >= LOGFMT_NUM_CHANNELS || period_ms == 0)
+		return 0;
+
+	_channel_period_ms[channel] = period_ms;
+	return 1;
+}
+
+uint8_t Log_Open(const char *filename, uint32_t start_time)
+{
+	if (_is_open)
+		return 1;
+
+	// a log opened without Log_Start starts taking records now
+	if (!Log_Start())
+		return 0;
+
+	if (f_open(&_file, filename, FA_WRITE|FA_OPEN_ALWAYS) != FR_OK)
+		return 0;
+
+	// a session appended to an existing file starts at the next block boundary
+	_is_raw = _expand();
+	_base = _is_raw ? 0 : (f_size(&_file) + LOG_BLOCK_SIZE - 1) / LOG_BLOCK_SIZE * LOG_BLOCK_SIZE;
+
+	// the session id tells the blocks of this session apart from whatever the clusters held before
+	RCC_AHB1PeriphClockCmd(RCC_AHB1Periph_CRC, ENABLE);
+	_session = start_time ^ DWT->CYCCNT;
+
+	// start_time is now, the session started with Log_Start
+	_header.start_time = start_time - (xTaskGetTickCount() - _session_tick) / configTICK_RATE_HZ;
+	_header.session = _session;
+
+	_index_count = 0;
+	_index_interval = LOG_INDEX_INTERVAL;
+	_index_filename(filename);
+
+	_set_periods();
+	if (LogFmt_EncodeHeader(&_header, _scratch) == 0 || !_write_block(_scratch, 0) || !_write_backlog())
+	{
+		f_close(&_file);
+		return 0;
+	}
+
+	_sectors_at_open = SD_GetNumSectorsWritten();
+	_stats.sectors_written = 0;
+	_is_open = 1;
+
+	return 1;
+}
+
+uint8_t Log_Recover()
+{
+	DIR dir;
+	FILINFO info;
+	uint8_t ret = 1;
+
+	if (_is_open)
+		return 0;
+
+	// a log that was closed has been cut down from the pre-allocated extent, one that still has the size
+	// of the extent was still being written when power went away
+	if (f_findfirst(&dir, &info, "", "*.dat") != FR_OK)
+		return 0;
+
+	while (info.fname[0] != '\0')
+	{
+		if (info.fsize == LOG_EXTENT_SIZE && !_recover(info.fname))
+			ret = 0;
+
+		if (f_findnext(&dir, &info) != FR_OK)
+		{
+			ret = 0;
+			break;
+		}
+	}
+
+	f_closedir(&dir);
+	return ret;
+}
+
+uint8_t Log_Close()
+{
+	if (!_is_open)
+		return 1;
+
+	uint8_t ret = Log_Sync();
+
+	// the filling buffer was only synced, it has not been indexed yet
+	if (_buf_len[_fill] > 0)
+		_index_block(_buf_seq[_fill], _buf_time[_fill]);
+
+	if (_is_raw)
+	{
+		// cut the pre-allocated extent down to the blocks actually logged
+		FSIZE_t size = (FSIZE_t)(1 + _buf_seq[_fill] + (_buf_len[_fill] > 0)) * LOG_BLOCK_SIZE;
+		if (f_lseek(&_file, size) != FR_OK || f_truncate(&_file) != FR_OK)
+			ret = 0;
+	}
+
+	if (f_close(&_file) != FR_OK)
+		ret = 0;
+
+	// a missing or stale sidecar can be rebuilt from the log, so this comes last
+	if (!_write_index())
+		ret = 0;
+
+	_is_open = 0;
+	_is_started = 0;
+	return ret;
+}
+
+uint8_t Log_IsOpen()
+{
+	return _is_open;
+}
+
+// Records are appended by one task, the SD task draining the message buffers, so the encoder state and the
+// bytes past the length of the filling buffer are its own. The lock only covers the buffer bookkeeping that
+// Log_Sync and Log_GetStats read, and the record is encoded and copied outside of it.
+uint8_t Log_Append(const struct LogFmt_Record *record)
+{
+	uint8_t encoded[LOGFMT_MAX_RECORD_LEN];
+	uint8_t fill, next, switched = 0;
+	uint16_t len;
+
+	if (record == NULL || !_is_started)
+		return 0;
+
+	len = LogFmt_Encode(&_fmt, record, encoded);
+	if (len == 0)
+		return 0;
+	_channel_logged[record->channel] = 1;
+
+	taskENTER_CRITICAL();
+	fill = _fill;
+	next = (fill + 1) % NUM_BUFFERS;
+	if (len > LOGFMT_BLOCK_PAYLOAD_LEN - _buf_len[fill])
+	{
+		if (_buf_full[next])
+		{
+			++_stats.dropped_records;
+			taskEXIT_CRITICAL();
+
+			// the encoder has already moved on past the dropped record, start its channels over
+			LogFmt_Reset(&_fmt);
+			return 0;
+		}
+
+		_buf_full[fill] = 1;
+		_buf_len[next] = 0;
+		_buf_seq[next] = _buf_seq[fill] + 1;
+		_fill = fill = next;
+		switched = 1;
+	}
+	taskEXIT_CRITICAL();
+
+	if (switched)
+	{
+		// a new block starts with keyframes
+		LogFmt_Reset(&_fmt);
+		len = LogFmt_Encode(&_fmt, record, encoded);
+		_buf_time[fill] = record->time_ms;
+	}
+	else if (_buf_len[fill] == 0)
+	{
+		_buf_time[fill] = record->time_ms;
+	}
+
+	// nothing reads past the length of the filling buffer until it is bumped
+	memcpy(&_buf[fill][LOGFMT_BLOCK_HEADER_LEN + _buf_len[fill]], encoded, len);
+
+	taskENTER_CRITICAL();
+	_buf_len[fill] += len;
+	++_stats.records;
+	taskEXIT_CRITICAL();
+
+	return 1;
+}
+
+uint8_t Log_Submit(uint8_t channel, const int32_t *values, uint8_t num_values)
+{
+	return Log_SubmitAt(channel, values, num_values, xTaskGetTickCount());
+}
+
+// submit a record that was sampled before now, at tick. The records of a channel still have to be
+// submitted in the order of their ticks
+uint8_t Log_SubmitAt(uint8_t channel, const int32_t *values, uint8_t num_values, TickType_t tick)
+{
+	struct Log_Message msg;
+
+	if (!_check_submission(channel, values, num_values))
+		return 0;
+
+	// a channel has a single producer, so the count needs no lock
+	if (++_channel_skip[channel] < _channel_config[channel].decimation)
+		return 1;
+	_channel_skip[channel] = 0;
+
+	msg.tick = tick;
+	memcpy(msg.value, values, num_values * sizeof(int32_t));
+
+	if (xMessageBufferSend(_channel_buf[channel], &msg, sizeof(msg.tick) + num_values * sizeof(int32_t), 0) == 0)
+	{
+		taskENTER_CRITICAL();
+		++_stats.dropped_submissions;
+		taskEXIT_CRITICAL();
+		return 0;
+	}
+
+	return 1;
+}
+
+uint8_t Log_SubmitFromISR(uint8_t channel, const int32_t *values, uint8_t num_values, BaseType_t *higher_priority_task_woken)
+{
+	struct Log_Message msg;
+
+	if (!_check_submission(channel, values, num_values))
+		return 0;
+
+	// a channel has a single producer, so the count needs no lock
+	if (++_channel_skip[channel] < _channel_config[channel].decimation)
+		return 1;
+	_channel_skip[channel] = 0;
+
+	msg.tick = xTaskGetTickCountFromISR();
+	memcpy(msg.value, values, num_values * sizeof(int32_t));
+
+	if (xMessageBufferSendFromISR(_channel_buf[channel], &msg, sizeof(msg.tick) + num_values * sizeof(int32_t), higher_priority_task_woken) == 0)
+	{
+		UBaseType_t state = taskENTER_CRITICAL_FROM_ISR();
+		++_stats.dropped_submissions;
+		taskEXIT_CRITICAL_FROM_ISR(state);
+		return 0;
+	}
+
+	return 1;
+}
+
+uint8_t Log_Process()
+{
+	uint8_t ret = 1;
+	uint8_t i;
+
+	if (!_is_started)
+		return 0;
+
+	// staged bytes are the full buffers waiting for the card and the filling one
+	uint16_t staged = 0;
+	for (i = 0; i < NUM_BUFFERS; ++i)
+		staged += _buf_full[i] || i == _fill ? LOGFMT_BLOCK_HEADER_LEN + _buf_len[i] : 0;
+	if (staged > _stats.max_staged_bytes)
+		_stats.max_staged_bytes = staged;
+
+	do
+	{
+		if (!_is_open)
+		{
+			_stash();
+			continue;
+		}
+
+		// buffers fill up in order, so write them out starting with the one after the filling buffer
+		for (i = 1; i <= NUM_BUFFERS; ++i)
+		{
+			uint8_t b = (_fill + i) % NUM_BUFFERS;
+			if (!_buf_full[b])
+				continue;
+
+			// full buffers belong to the SD task until they are released, so no lock is needed for the write
+			if (!_write_buffer(_buf[b], _buf_seq[b], _buf_len[b]))
+				ret = 0;
+			_index_block(_buf_seq[b], _buf_time[b]);
+
+			// unused payload is left zero
+			memset(_buf[b], 0, LOG_BLOCK_SIZE);
+
+			taskENTER_CRITICAL();
+			_buf_full[b] = 0;
+			taskEXIT_CRITICAL();
+		}
+	} while (_drain());
+
+	if (_is_open)
+		_stats.sectors_written = SD_GetNumSectorsWritten() - _sectors_at_open;
+
+	return ret;
+}
+
+uint8_t Log_Sync()
+{
+	uint8_t ret;
+
+	if (!_is_open)
+		return 0;
+
+	ret = Log_Process();
+
+	// write what the filling buffer holds so far, the block is written again when it fills up. Records
+	// appended meanwhile go past len, which is all the block header and the CRC cover.
+	taskENTER_CRITICAL();
+	uint8_t fill = _fill;
+	uint16_t len = _buf_len[fill];
+	taskEXIT_CRITICAL();
+
+	if (len > 0 && !_write_buffer(_buf[fill], _buf_seq[fill], len))
+		ret = 0;
+
+	// blocks in the extent are on the card as soon as they are written, only the file system needs a sync
+	if (!_is_raw && f_sync(&_file) != FR_OK)
+		ret = 0;
+
+	++_stats.syncs;
+	_stats.sectors_written = SD_GetNumSectorsWritten() - _sectors_at_open;
+
+	return ret;
+}
+
+void Log_GetStats(struct Log_Stats *stats)
+{
+	if (stats == NULL)
+		return;
+
+	taskENTER_CRITICAL();
+	*stats = _stats;
+	taskEXIT_CRITICAL();
+}
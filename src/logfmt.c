@@ -0,0 +1,564 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "logfmt.h"
+
+// Every record starts with a tag byte holding the channel and the record kind. A keyframe stores the
+// time and all values of the channel in full. Any other record stores each value either as it is, for
+// things like event codes, or relative to the previous record of the channel, as a difference or as a
+// difference of differences, which keeps smoothly changing values like position and altitude close to
+// zero. All numbers are zig-zag encoded varints, so small magnitudes of either sign take a single byte.
+// When every stored value of a delta record fits in four bits, the values are packed two to a byte
+// instead.
+#define TAG_KEYFRAME 0x80
+#define TAG_NOMINAL_TIME 0x40 // record is one channel period after the previous one, no time stored
+#define TAG_PACKED 0x20 // delta values are zig-zag nibbles, low nibble first
+#define TAG_CHANNEL_MASK 0x1F
+#define NIBBLE_MAX 0x0F
+
+#define CRC_POLY 0x04C11DB7
+#define CRC_INIT 0xFFFFFFFF
+
+static const struct LogFmt_ChannelDef _channel_defs[LOGFMT_NUM_CHANNELS] =
+{
+	[LOGFMT_CHANNEL_FIX] = {"fix", LOGFMT_FIX_NUM_FIELDS, 1000,
+	{
+		[LOGFMT_FIX_LATITUDE] = {"lat", "deg", LOGFMT_TYPE_INT32, -7, 2},
+		[LOGFMT_FIX_LONGITUDE] = {"lon", "deg", LOGFMT_TYPE_INT32, -7, 2},
+		[LOGFMT_FIX_ALTITUDE] = {"alt", "ft", LOGFMT_TYPE_INT32, 0, 2},
+		[LOGFMT_FIX_HEADING] = {"heading", "deg", LOGFMT_TYPE_INT32, -1, 1},
+		[LOGFMT_FIX_SPEED] = {"speed", "kt", LOGFMT_TYPE_INT32, -1, 1},
+	}},
+	[LOGFMT_CHANNEL_BARO] = {"baro", LOGFMT_BARO_NUM_FIELDS, 500,
+	{
+		[LOGFMT_BARO_PRESSURE] = {"pressure", "Pa", LOGFMT_TYPE_INT32, 0, 1},
+		[LOGFMT_BARO_TEMPERATURE] = {"temp", "C", LOGFMT_TYPE_INT32, -2, 1},
+		[LOGFMT_BARO_ALTITUDE] = {"alt", "ft", LOGFMT_TYPE_INT32, 0, 1},
+	}},
+	[LOGFMT_CHANNEL_IMU] = {"imu", LOGFMT_IMU_NUM_FIELDS, 5,
+	{
+		[LOGFMT_IMU_ACC_X] = {"acc_x", "cnt", LOGFMT_TYPE_INT32, 0, 1},
+		[LOGFMT_IMU_ACC_Y] = {"acc_y", "cnt", LOGFMT_TYPE_INT32, 0, 1},
+		[LOGFMT_IMU_ACC_Z] = {"acc_z", "cnt", LOGFMT_TYPE_INT32, 0, 1},
+		[LOGFMT_IMU_MAG_X] = {"mag_x", "cnt", LOGFMT_TYPE_INT32, 0, 1},
+		[LOGFMT_IMU_MAG_Y] = {"mag_y", "cnt", LOGFMT_TYPE_INT32, 0, 1},
+		[LOGFMT_IMU_MAG_Z] = {"mag_z", "cnt", LOGFMT_TYPE_INT32, 0, 1},
+		[LOGFMT_IMU_GYRO_X] = {"gyro_x", "cnt", LOGFMT_TYPE_INT32, 0, 1},
+		[LOGFMT_IMU_GYRO_Y] = {"gyro_y", "cnt", LOGFMT_TYPE_INT32, 0, 1},
+		[LOGFMT_IMU_GYRO_Z] = {"gyro_z", "cnt", LOGFMT_TYPE_INT32, 0, 1},
+	}},
+	[LOGFMT_CHANNEL_EVENT] = {"event", LOGFMT_EVENT_NUM_FIELDS, 0,
+	{
+		[LOGFMT_EVENT_CODE] = {"code", "", LOGFMT_TYPE_INT32, 0, 0},
+		[LOGFMT_EVENT_ARG] = {"arg", "", LOGFMT_TYPE_INT32, 0, 0},
+		[LOGFMT_EVENT_VALUE] = {"value", "", LOGFMT_TYPE_INT32, 0, 0},
+	}},
+};
+
+static void _put16(uint8_t *out, uint16_t value)
+{
+	out[0] = (uint8_t)value;
+	out[1] = (uint8_t)(value >> 8);
+}
+
+static void _put32(uint8_t *out, uint32_t value)
+{
+	out[0] = (uint8_t)value;
+	out[1] = (uint8_t)(value >> 8);
+	out[2] = (uint8_t)(value >> 16);
+	out[3] = (uint8_t)(value >> 24);
+}
+
+static uint16_t _get16(const uint8_t *in)
+{
+	return (uint16_t)(in[0] | in[1] << 8);
+}
+
+static uint32_t _get32(const uint8_t *in)
+{
+	return (uint32_t)in[0] | (uint32_t)in[1] << 8 | (uint32_t)in[2] << 16 | (uint32_t)in[3] << 24;
+}
+
+static uint8_t _put_varint(uint8_t *out, uint32_t value)
+{
+	uint8_t len = 0;
+
+	while (value >= 0x80)
+	{
+		out[len++] = (uint8_t)(value | 0x80);
+		value >>= 7;
+	}
+	out[len++] = (uint8_t)value;
+
+	return len;
+}
+
+static uint8_t _get_varint(const uint8_t *in, uint16_t len, uint32_t *value)
+{
+	uint8_t i;
+
+	*value = 0;
+	for (i = 0; i < 5 && i < len; ++i)
+	{
+		*value |= (uint32_t)(in[i] & 0x7F) << (7 * i);
+		if (!(in[i] & 0x80))
+			return i + 1;
+	}
+
+	return 0;
+}
+
+static uint32_t _zigzag(int32_t value)
+{
+	return ((uint32_t)value << 1) ^ (uint32_t)(value >> 31);
+}
+
+static int32_t _unzigzag(uint32_t value)
+{
+	return (int32_t)((value >> 1) ^ (0 - (value & 1)));
+}
+
+const struct LogFmt_ChannelDef *LogFmt_GetChannelDef(uint8_t channel)
+{
+	if (channel >= LOGFMT_NUM_CHANNELS)
+		return NULL;
+
+	return &_channel_defs[channel];
+}
+
+void LogFmt_Init(struct LogFmt_State *state, const struct LogFmt_Header *header)
+{
+	// without a header the records are coded with the schema built into this firmware
+	state->defs = header != NULL ? header->channel : _channel_defs;
+	state->num_channels = header != NULL ? header->num_channels : LOGFMT_NUM_CHANNELS;
+	LogFmt_Reset(state);
+}
+
+void LogFmt_Reset(struct LogFmt_State *state)
+{
+	// the next record of every channel will be a keyframe
+	memset(state->channel, 0, sizeof(state->channel));
+}
+
+void LogFmt_InitHeader(struct LogFmt_Header *header, const char *firmware, uint32_t start_time, uint32_t session)
+{
+	memset(header, 0, sizeof(*header));
+	header->version = LOGFMT_VERSION;
+	strncpy(header->firmware, firmware, LOGFMT_FIRMWARE_LEN - 1);
+	header->start_time = start_time;
+	header->session = session;
+	header->num_channels = LOGFMT_NUM_CHANNELS;
+	memcpy(header->channel, _channel_defs, sizeof(_channel_defs));
+}
+
+// The file header block is the magic, the format version, the firmware version, the session start time
+// and id, and the schema. For every channel the schema holds its id, name, number of fields and period,
+// and for every field its id, name, unit, type, scale and delta order. The last four bytes of the block
+// are the CRC of everything before them.
+uint16_t LogFmt_EncodeHeader(const struct LogFmt_Header *header, uint8_t *block)
+{
+	uint16_t pos = 0;
+	uint8_t c, f;
+
+	memset(block, 0, LOGFMT_BLOCK_SIZE);
+	memcpy(&block[pos], LOGFMT_MAGIC, 4);
+	pos += 4;
+	block[pos++] = header->version;
+	memcpy(&block[pos], header->firmware, LOGFMT_FIRMWARE_LEN);
+	pos += LOGFMT_FIRMWARE_LEN;
+	_put32(&block[pos], header->start_time);
+	pos += 4;
+	_put32(&block[pos], header->session);
+	pos += 4;
+	block[pos++] = header->num_channels;
+
+	for (c = 0; c < header->num_channels; ++c)
+	{
+		const struct LogFmt_ChannelDef *def = &header->channel[c];
+
+		if (pos + 1 + LOGFMT_NAME_LEN + 3 + def->num_fields * (3 + LOGFMT_NAME_LEN + LOGFMT_UNIT_LEN + 1) > LOGFMT_HEADER_CRC_OFFSET)
+			return 0;
+
+		block[pos++] = c;
+		memcpy(&block[pos], def->name, LOGFMT_NAME_LEN);
+		pos += LOGFMT_NAME_LEN;
+		block[pos++] = def->num_fields;
+		_put16(&block[pos], def->period_ms);
+		pos += 2;
+
+		for (f = 0; f < def->num_fields; ++f)
+		{
+			block[pos++] = f;
+			memcpy(&block[pos], def->field[f].name, LOGFMT_NAME_LEN);
+			pos += LOGFMT_NAME_LEN;
+			memcpy(&block[pos], def->field[f].unit, LOGFMT_UNIT_LEN);
+			pos += LOGFMT_UNIT_LEN;
+			block[pos++] = def->field[f].type;
+			block[pos++] = (uint8_t)def->field[f].scale;
+			block[pos++] = def->field[f].order;
+		}
+	}
+
+	_put32(&block[LOGFMT_HEADER_CRC_OFFSET], LogFmt_Crc32(block, LOGFMT_HEADER_CRC_OFFSET));
+
+	return LOGFMT_BLOCK_SIZE;
+}
+
+uint16_t LogFmt_DecodeHeader(struct LogFmt_Header *header, const uint8_t *block)
+{
+	uint16_t pos = 0;
+	uint8_t c, f;
+
+	if (memcmp(block, LOGFMT_MAGIC, 4) != 0
+		|| _get32(&block[LOGFMT_HEADER_CRC_OFFSET]) != LogFmt_Crc32(block, LOGFMT_HEADER_CRC_OFFSET))
+		return 0;
+
+	memset(header, 0, sizeof(*header));
+	pos += 4;
+	header->version = block[pos++];
+	memcpy(header->firmware, &block[pos], LOGFMT_FIRMWARE_LEN);
+	pos += LOGFMT_FIRMWARE_LEN;
+	header->start_time = _get32(&block[pos]);
+	pos += 4;
+	header->session = _get32(&block[pos]);
+	pos += 4;
+	header->num_channels = block[pos++];
+
+	if (header->version != LOGFMT_VERSION || header->num_channels > LOGFMT_MAX_CHANNELS)
+		return 0;
+
+	for (c = 0; c < header->num_channels; ++c)
+	{
+		struct LogFmt_ChannelDef *def = &header->channel[c];
+
+		// channels are listed in the order of their ids
+		if (block[pos++] != c)
+			return 0;
+		memcpy(def->name, &block[pos], LOGFMT_NAME_LEN);
+		pos += LOGFMT_NAME_LEN;
+		def->num_fields = block[pos++];
+		def->period_ms = _get16(&block[pos]);
+		pos += 2;
+
+		if (def->num_fields > LOGFMT_MAX_FIELDS)
+			return 0;
+
+		for (f = 0; f < def->num_fields; ++f)
+		{
+			if (block[pos++] != f)
+				return 0;
+			memcpy(def->field[f].name, &block[pos], LOGFMT_NAME_LEN);
+			pos += LOGFMT_NAME_LEN;
+			memcpy(def->field[f].unit, &block[pos], LOGFMT_UNIT_LEN);
+			pos += LOGFMT_UNIT_LEN;
+			def->field[f].type = block[pos++];
+			def->field[f].scale = (int8_t)block[pos++];
+			def->field[f].order = block[pos++];
+		}
+	}
+
+	return LOGFMT_BLOCK_SIZE;
+}
+
+// A data block is the block magic, the CRC, the session id, the sequence number and the number of used
+// payload bytes, followed by the payload. Unused payload bytes are not covered by the CRC.
+void LogFmt_EncodeBlockHeader(const struct LogFmt_BlockHeader *header, uint8_t *block)
+{
+	memcpy(block, LOGFMT_BLOCK_MAGIC, 4);
+	_put32(&block[4], header->crc);
+	_put32(&block[8], header->session);
+	_put32(&block[12], header->seq);
+	_put16(&block[16], header->used);
+	_put16(&block[18], 0);
+}
+
+uint8_t LogFmt_DecodeBlockHeader(struct LogFmt_BlockHeader *header, const uint8_t *block)
+{
+	if (memcmp(block, LOGFMT_BLOCK_MAGIC, 4) != 0)
+		return 0;
+
+	header->crc = _get32(&block[4]);
+	header->session = _get32(&block[8]);
+	header->seq = _get32(&block[12]);
+	header->used = _get16(&block[16]);
+
+	return header->used <= LOGFMT_BLOCK_PAYLOAD_LEN;
+}
+
+// Same CRC as the STM32 CRC unit: CRC-32 with the 0x04C11DB7 polynomial and no reflection, fed with the
+// data as little endian 32 bit words. A last partial word is padded with zeros.
+uint32_t LogFmt_Crc32(const uint8_t *data, uint32_t len)
+{
+	uint32_t crc = CRC_INIT;
+	uint32_t i;
+	uint8_t bit;
+
+	for (i = 0; i < len; i += 4)
+	{
+		uint8_t word[4] = {0};
+		memcpy(word, &data[i], len - i < 4 ? len - i : 4);
+
+		crc ^= _get32(word);
+		for (bit = 0; bit < 32; ++bit)
+			crc = (crc & 0x80000000) ? (crc << 1) ^ CRC_POLY : crc << 1;
+	}
+
+	return crc;
+}
+
+// a block is valid if it has the magic, belongs to the session and its CRC matches
+uint8_t LogFmt_CheckBlock(const uint8_t *block, uint32_t session, struct LogFmt_BlockHeader *header)
+{
+	if (!LogFmt_DecodeBlockHeader(header, block) || header->session != session)
+		return 0;
+
+	return header->crc == LogFmt_Crc32(&block[LOGFMT_BLOCK_CRC_START], LOGFMT_BLOCK_HEADER_LEN - LOGFMT_BLOCK_CRC_START + header->used);
+}
+
+static uint8_t _is_valid(LogFmt_ReadBlock read, void *context, uint32_t session, uint32_t index, uint8_t *block)
+{
+	struct LogFmt_BlockHeader header;
+
+	return read(context, index, block) && LogFmt_CheckBlock(block, session, &header) && header.seq == index;
+}
+
+// Number of data blocks of a session that made it into a pre-allocated extent of num_blocks data blocks.
+// Blocks are written in sequence order, each one on the card before the next, into an extent that holds
+// no blocks of the session otherwise, so the valid blocks are a run from the start and the end of the run
+// is found by binary search.
+uint32_t LogFmt_FindEnd(LogFmt_ReadBlock read, void *context, uint32_t session, uint32_t num_blocks, uint8_t *block)
+{
+	uint32_t lo = 0; // blocks before lo are valid
+	uint32_t hi = num_blocks; // block hi and the ones after it are not
+
+	while (lo < hi)
+	{
+		uint32_t mid = lo + (hi - lo) / 2;
+		if (_is_valid(read, context, session, mid, block))
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+// the first record of a block is always a keyframe, which starts with its time
+uint8_t LogFmt_GetBlockTime(const uint8_t *block, uint32_t *time_ms)
+{
+	uint16_t used = _get16(&block[16]);
+
+	if (used < 2 || !(block[LOGFMT_BLOCK_HEADER_LEN] & TAG_KEYFRAME))
+		return 0;
+
+	return _get_varint(&block[LOGFMT_BLOCK_HEADER_LEN + 1], used - 1, time_ms) != 0;
+}
+
+void LogFmt_EncodeIndexHeader(const struct LogFmt_IndexHeader *header, uint8_t *out)
+{
+	memcpy(out, LOGFMT_INDEX_MAGIC, 4);
+	_put32(&out[4], header->session);
+	_put32(&out[8], header->base);
+	_put32(&out[12], header->count);
+	_put32(&out[16], header->interval);
+}
+
+uint8_t LogFmt_DecodeIndexHeader(struct LogFmt_IndexHeader *header, const uint8_t *in)
+{
+	if (memcmp(in, LOGFMT_INDEX_MAGIC, 4) != 0)
+		return 0;
+
+	header->session = _get32(&in[4]);
+	header->base = _get32(&in[8]);
+	header->count = _get32(&in[12]);
+	header->interval = _get32(&in[16]);
+
+	return 1;
+}
+
+void LogFmt_DecodeIndexEntry(struct LogFmt_IndexEntry *entry, const uint8_t *in)
+{
+	entry->time_ms = _get32(in);
+	entry->offset = _get32(&in[4]);
+}
+
+// index of the last entry at or before time_ms, the first entry if all of them are later
+uint32_t LogFmt_FindIndexEntry(const struct LogFmt_IndexEntry *entries, uint32_t count, uint32_t time_ms)
+{
+	uint32_t lo = 0;
+	uint32_t hi = count;
+
+	while (hi - lo > 1)
+	{
+		uint32_t mid = lo + (hi - lo) / 2;
+		if (entries[mid].time_ms <= time_ms)
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+uint16_t LogFmt_Encode(struct LogFmt_State *state, const struct LogFmt_Record *record, uint8_t *out)
+{
+	if (record->channel >= state->num_channels || record->num_fields != state->defs[record->channel].num_fields)
+		return 0;
+
+	const struct LogFmt_ChannelDef *def = &state->defs[record->channel];
+
+	struct LogFmt_ChannelState *ch = &state->channel[record->channel];
+	uint32_t stored[LOGFMT_MAX_FIELDS];
+	uint8_t packed = 1;
+	uint16_t len = 1;
+	uint8_t i;
+
+	// keyframes are also needed when time goes backwards, deltas of time are unsigned
+	if (!ch->has_keyframe || ch->since_keyframe >= LOGFMT_KEYFRAME_INTERVAL || record->time_ms < ch->time_ms)
+	{
+		out[0] = TAG_KEYFRAME | record->channel;
+		len += _put_varint(&out[len], record->time_ms);
+		for (i = 0; i < def->num_fields; ++i)
+		{
+			len += _put_varint(&out[len], _zigzag(record->value[i]));
+			ch->delta[i] = 0;
+		}
+
+		ch->has_keyframe = 1;
+		ch->since_keyframe = 0;
+	}
+	else
+	{
+		uint32_t dt = record->time_ms - ch->time_ms;
+
+		out[0] = record->channel;
+		if (dt == def->period_ms)
+			out[0] |= TAG_NOMINAL_TIME;
+		else
+			len += _put_varint(&out[len], dt);
+
+		for (i = 0; i < def->num_fields; ++i)
+		{
+			int32_t delta = (int32_t)((uint32_t)record->value[i] - (uint32_t)ch->value[i]);
+			if (def->field[i].order == 0)
+				stored[i] = _zigzag(record->value[i]);
+			else if (def->field[i].order == 1)
+				stored[i] = _zigzag(delta);
+			else
+				stored[i] = _zigzag((int32_t)((uint32_t)delta - (uint32_t)ch->delta[i]));
+			if (stored[i] > NIBBLE_MAX)
+				packed = 0;
+			ch->delta[i] = delta;
+		}
+
+		if (packed)
+		{
+			out[0] |= TAG_PACKED;
+			memset(&out[len], 0, (def->num_fields + 1) / 2);
+			for (i = 0; i < def->num_fields; ++i)
+				out[len + i / 2] |= (uint8_t)(stored[i] << (4 * (i % 2)));
+			len += (def->num_fields + 1) / 2;
+		}
+		else
+		{
+			for (i = 0; i < def->num_fields; ++i)
+				len += _put_varint(&out[len], stored[i]);
+		}
+
+		++ch->since_keyframe;
+	}
+
+	ch->time_ms = record->time_ms;
+	memcpy(ch->value, record->value, def->num_fields * sizeof(int32_t));
+
+	return len;
+}
+
+uint16_t LogFmt_Decode(struct LogFmt_State *state, struct LogFmt_Record *record, const uint8_t *in, uint16_t len)
+{
+	uint16_t pos = 1;
+	uint8_t used;
+	uint32_t value;
+	uint8_t i;
+
+	if (len == 0)
+		return 0;
+
+	if ((in[0] & TAG_CHANNEL_MASK) >= state->num_channels)
+		return 0;
+
+	const struct LogFmt_ChannelDef *def = &state->defs[in[0] & TAG_CHANNEL_MASK];
+	struct LogFmt_ChannelState *ch = &state->channel[in[0] & TAG_CHANNEL_MASK];
+	record->channel = in[0] & TAG_CHANNEL_MASK;
+	record->num_fields = def->num_fields;
+
+	if (in[0] & TAG_KEYFRAME)
+	{
+		if ((used = _get_varint(&in[pos], len - pos, &value)) == 0)
+			return 0;
+		pos += used;
+		record->time_ms = value;
+
+		for (i = 0; i < def->num_fields; ++i)
+		{
+			if ((used = _get_varint(&in[pos], len - pos, &value)) == 0)
+				return 0;
+			pos += used;
+			record->value[i] = _unzigzag(value);
+			ch->delta[i] = 0;
+		}
+
+		ch->has_keyframe = 1;
+	}
+	else
+	{
+		// a delta record can not be decoded without the keyframe it builds on
+		if (!ch->has_keyframe)
+			return 0;
+
+		if (in[0] & TAG_NOMINAL_TIME)
+		{
+			record->time_ms = ch->time_ms + def->period_ms;
+		}
+		else
+		{
+			if ((used = _get_varint(&in[pos], len - pos, &value)) == 0)
+				return 0;
+			pos += used;
+			record->time_ms = ch->time_ms + value;
+		}
+
+		if ((in[0] & TAG_PACKED) && len - pos < (def->num_fields + 1) / 2)
+			return 0;
+
+		for (i = 0; i < def->num_fields; ++i)
+		{
+			if (in[0] & TAG_PACKED)
+			{
+				value = (in[pos + i / 2] >> (4 * (i % 2))) & NIBBLE_MAX;
+			}
+			else
+			{
+				if ((used = _get_varint(&in[pos], len - pos, &value)) == 0)
+					return 0;
+				pos += used;
+			}
+
+			int32_t delta = _unzigzag(value);
+			if (def->field[i].order == 0)
+				delta = (int32_t)((uint32_t)delta - (uint32_t)ch->value[i]);
+			else if (def->field[i].order == 2)
+				delta = (int32_t)((uint32_t)delta + (uint32_t)ch->delta[i]);
+			record->value[i] = (int32_t)((uint32_t)ch->value[i] + (uint32_t)delta);
+			ch->delta[i] = delta;
+		}
+
+		if (in[0] & TAG_PACKED)
+			pos += (def->num_fields + 1) / 2;
+	}
+
+	ch->time_ms = record->time_ms;
+	memcpy(ch->value, record->value, def->num_fields * sizeof(int32_t));
+
+	return pos;
+}
@@ -0,0 +1,200 @@
+#include <string.h>
+
+#include "ff.h"
+#include "logfmt.h"
+#include "logread.h"
+
+// Logs are read back through FatFS in fast seek mode. The cluster link map table of the file is built once
+// when it is opened, and every seek after that looks the cluster up in the table instead of following the
+// FAT chain from the start of the file. A file too fragmented for the table is read with normal seeks.
+//
+// Only the session starting at the beginning of the file is read.
+#define LOGREAD_CLMT_SIZE 32 // room for 15 fragments
+
+static FIL _file;
+static DWORD _clmt[LOGREAD_CLMT_SIZE];
+static uint8_t _is_open = 0;
+static uint8_t _is_fast_seek = 0;
+static struct LogFmt_Header _header;
+static uint32_t _num_blocks = 0;
+static uint8_t _block[LOGFMT_BLOCK_SIZE] __attribute__((aligned(4)));
+
+// time of the first record of a data block, if the block is valid
+static uint8_t _block_time(uint32_t index, uint32_t *time_ms)
+{
+	struct LogFmt_BlockHeader header;
+
+	if (!LogRead_ReadBlock(index, _block))
+		return 0;
+
+	return LogFmt_CheckBlock(_block, _header.session, &header) && LogFmt_GetBlockTime(_block, time_ms);
+}
+
+uint8_t LogRead_Open(const char *filename)
+{
+	UINT num_read = 0;
+
+	if (_is_open)
+		return 0;
+
+	if (f_open(&_file, filename, FA_READ) != FR_OK)
+		return 0;
+
+	_clmt[0] = LOGREAD_CLMT_SIZE;
+	_file.cltbl = _clmt;
+	_is_fast_seek = f_lseek(&_file, CREATE_LINKMAP) == FR_OK;
+	if (!_is_fast_seek)
+		_file.cltbl = NULL;
+
+	if (f_read(&_file, _block, LOGFMT_BLOCK_SIZE, &num_read) != FR_OK || num_read != LOGFMT_BLOCK_SIZE
+		|| LogFmt_DecodeHeader(&_header, _block) == 0)
+	{
+		f_close(&_file);
+		return 0;
+	}
+
+	_num_blocks = (uint32_t)(f_size(&_file) / LOGFMT_BLOCK_SIZE) - 1;
+	_is_open = 1;
+
+	return 1;
+}
+
+uint8_t LogRead_Close()
+{
+	if (!_is_open)
+		return 1;
+
+	_is_open = 0;
+	return f_close(&_file) == FR_OK;
+}
+
+uint8_t LogRead_IsFastSeek()
+{
+	return _is_fast_seek;
+}
+
+const struct LogFmt_Header *LogRead_GetHeader()
+{
+	if (!_is_open)
+		return NULL;
+
+	return &_header;
+}
+
+uint32_t LogRead_GetNumBlocks()
+{
+	return _is_open ? _num_blocks : 0;
+}
+
+uint8_t LogRead_ReadBlock(uint32_t index, uint8_t *block)
+{
+	UINT num_read = 0;
+
+	if (!_is_open || block == NULL || index >= _num_blocks)
+		return 0;
+
+	if (f_lseek(&_file, (FSIZE_t)(1 + index) * LOGFMT_BLOCK_SIZE) != FR_OK)
+		return 0;
+
+	return f_read(&_file, block, LOGFMT_BLOCK_SIZE, &num_read) == FR_OK && num_read == LOGFMT_BLOCK_SIZE;
+}
+
+// last valid data block starting at or before time_ms, found by binary search over the blocks
+uint8_t LogRead_FindTime(uint32_t time_ms, uint32_t *index)
+{
+	uint32_t lo = 0;
+	uint32_t hi = _num_blocks;
+	uint32_t t;
+	uint8_t found = 0;
+
+	if (!_is_open || index == NULL)
+		return 0;
+
+	while (lo < hi)
+	{
+		uint32_t mid = lo + (hi - lo) / 2;
+		uint32_t probe = mid;
+
+		// bad blocks are stepped over, the next valid one stands in for them
+		while (probe < hi && !_block_time(probe, &t))
+			++probe;
+
+		if (probe < hi && t <= time_ms)
+		{
+			*index = probe;
+			found = 1;
+			lo = probe + 1;
+		}
+		else
+		{
+			hi = mid;
+		}
+	}
+
+	return found;
+}
+
+uint8_t LogRead_Summarize(struct LogRead_Summary *summary)
+{
+	struct LogFmt_BlockHeader header;
+	struct LogFmt_State state;
+	struct LogFmt_Record record;
+	uint16_t pos, len;
+	uint32_t i;
+
+	if (!_is_open || summary == NULL)
+		return 0;
+
+	memset(summary, 0, sizeof(*summary));
+	summary->start_time = _header.start_time;
+	summary->max_altitude = INT32_MIN;
+	summary->max_speed = INT32_MIN;
+	summary->min_pressure = INT32_MAX;
+
+	LogFmt_Init(&state, &_header);
+	for (i = 0; i < _num_blocks; ++i)
+	{
+		if (!LogRead_ReadBlock(i, _block) || !LogFmt_CheckBlock(_block, _header.session, &header))
+		{
+			++summary->bad_blocks;
+			continue;
+		}
+
+		++summary->blocks;
+
+		// every block starts over with keyframes
+		LogFmt_Reset(&state);
+		for (pos = 0; pos < header.used; pos += len)
+		{
+			len = LogFmt_Decode(&state, &record, &_block[LOGFMT_BLOCK_HEADER_LEN + pos], header.used - pos);
+			if (len == 0)
+				break;
+
+			if (record.time_ms > summary->duration_ms)
+				summary->duration_ms = record.time_ms;
+			if (record.channel < LOGFMT_NUM_CHANNELS)
+				++summary->records[record.channel];
+
+			switch (record.channel)
+			{
+			case LOGFMT_CHANNEL_FIX:
+				if (record.value[LOGFMT_FIX_ALTITUDE] > summary->max_altitude)
+					summary->max_altitude = record.value[LOGFMT_FIX_ALTITUDE];
+				if (record.value[LOGFMT_FIX_SPEED] > summary->max_speed)
+					summary->max_speed = record.value[LOGFMT_FIX_SPEED];
+				break;
+			case LOGFMT_CHANNEL_BARO:
+				if (record.value[LOGFMT_BARO_PRESSURE] < summary->min_pressure)
+					summary->min_pressure = record.value[LOGFMT_BARO_PRESSURE];
+				break;
+			case LOGFMT_CHANNEL_EVENT:
+				++summary->events;
+				break;
+			default:
+				break;
+			}
+		}
+	}
+
+	return 1;
+}
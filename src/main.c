@@ -26,8 +26,13 @@
 #include "lcd.h"
 #include "gps.h"
 #include "amg.h"
+#include "i2c.h"
 #include "util.h"
+#include "log.h"
+#include "logfmt.h"
 #include "ff.h"
+#include "diskio.h"
+#include "sd.h"
 
 static uint8_t update_display = 1;
 
@@ -77,19 +82,33 @@ struct datetime
 static struct datetime starting_datetime = {-1, -1, -1, -1, -1, -1};
 static struct datetime current_datetime = {-1, -1, -1, -1, -1, -1};
 
-#define RAW_DATA_POINT_SIZE 24
-#define TIMESTAMP_OFFSET 0
-#define TIMESTAMP_LEN 4
-#define LATITUDE_OFFSET 4
-#define LATITUDE_LEN 4
-#define LONGITUDE_OFFSET 8
-#define LONGITUDE_LEN 4
-#define ALTITUDE_OFFSET 12
-#define ALTITUDE_LEN 4
-#define HEADING_OFFSET 16
-#define HEADING_LEN 4
-#define SPEED_OFFSET 20
-#define SPEED_LEN 4
+#define LOG_PROCESS_INTERVAL_MS 100 // how often the SD task drains submitted records
+// the log file stays open for the whole session, it is synced after whichever of these comes first
+#define LOG_SYNC_INTERVAL_MS 30000
+#define LOG_SYNC_RECORDS 6500 // about 30 s of all channels with the IMU at full rate
+
+// card bring-up is stepped by the SD task between draining records, a failed attempt is retried after a
+// wait that doubles from the minimum up to the maximum
+#define CARD_POLL_INTERVAL_MS 5
+#define CARD_RETRY_MIN_MS 50
+#define CARD_RETRY_MAX_MS 2000
+// log operations that fail in a row before the card is taken to be gone and brought up again
+#define CARD_MAX_FAILURES 3
+
+// sample rates of the producers, the logger can decimate each channel further
+#define AMG_SAMPLE_PERIOD_MS 5 // sensors run at 200 Hz
+#define TPH_SAMPLE_PERIOD_MS 500
+
+#define GPS_WAIT_TIMEOUT_MS 1000 // the receiver sends at least once a second
+
+#define FEET_PER_METER 3.28084f
+
+// supply voltage monitor, PVD output goes high when VDD falls below the PVD threshold
+#define PVD_LEVEL PWR_PVDLevel_6
+#define PVD_EXTI_LINE EXTI_Line16
+
+static TaskHandle_t sd_task_handle = NULL;
+static volatile uint8_t low_voltage = 0;
 
 void InitLED()
 {
@@ -208,17 +227,29 @@ void DisplayTask(void *pvParameters)
 
 void GPSTask(void *pvParameters)
 {
+	int32_t fix[LOGFMT_FIX_NUM_FIELDS];
+	float gps_altitude = 0.0f;
+	char gps_altitude_units = 'M';
+	TickType_t fix_tick;
+	struct GPS_Fix gps_fix;
+
+	// sets the receiver up at its update rate. The SD task logs the rates, the date it opens the log with is
+	// only taken from fixes after this
 	if (!GPS_Initialize())
 		for (;;) vTaskDelay(pdMS_TO_TICKS(100));
+	// fixes at the rate the receiver ended up at store no time, the session started at boot included
+	Log_SetChannelPeriod(LOGFMT_CHANNEL_FIX, 1000 / GPS_GetUpdateRate());
 
 	for (;;)
 	{
-		if (GPS_CheckForNewData())
+		// a burst can hold more than one fix, each is logged at the time it came in
+		while (GPS_CheckForNewData())
 		{
 			GPS_GetNumSats(&num_sats);
 			GPS_GetCoords(&latitude,&longitude);
 			GPS_GetHeading(NULL,&mag_heading);
 			GPS_GetGroundSpeedKnots(&gs_knots);
+			GPS_GetAltitude(&gps_altitude,&gps_altitude_units);
 			GPS_GetDateTime(
 				&current_datetime.year,
 				&current_datetime.month,
@@ -232,90 +263,367 @@ void GPSTask(void *pvParameters)
 			if (current_datetime.year != -1 && starting_datetime.year == -1)
 				starting_datetime = current_datetime;
 
+			// log coordinates, GPS altitude, heading, and ground speed as fixed point values
+			GPS_GetFix(&gps_fix);
+			fix[LOGFMT_FIX_LATITUDE] = gps_fix.latitude;
+			fix[LOGFMT_FIX_LONGITUDE] = gps_fix.longitude;
+			fix[LOGFMT_FIX_ALTITUDE] = lroundf(gps_altitude_units == 'M' ? gps_altitude * FEET_PER_METER : gps_altitude);
+			fix[LOGFMT_FIX_HEADING] = lroundf((gps_fix.track + gps_fix.variation) / 10.0f);
+			fix[LOGFMT_FIX_SPEED] = lroundf(gps_fix.speed / 10.0f);
+			GPS_GetFixTick(&fix_tick);
+			Log_SubmitAt(LOGFMT_CHANNEL_FIX,fix,LOGFMT_FIX_NUM_FIELDS,fix_tick);
+
 			update_display = 1;
 		}
 
-		vTaskDelay(pdMS_TO_TICKS(200));
+		// sleep until the receiver has sent a burst of sentences
+		GPS_WaitForData(GPS_WAIT_TIMEOUT_MS);
 	}
 }
 
 void TPHTask(void *pvParameters)
 {
+	int32_t baro[LOGFMT_BARO_NUM_FIELDS];
+	float pressure = 0.0f;
+	float temperature = 0.0f;
+
 	TPH_Initialize();
 
+	TickType_t last_sample = xTaskGetTickCount();
 	for (;;)
 	{
 		TPH_StartMeasurement();
 		while (!TPH_GetAltitude(&altitude, ((float)altimeter_value)/100.0f, TPH_ALTITUDE_FT, TPH_PRESSURE_INHG))
 			vTaskDelay(pdMS_TO_TICKS(5));
 
+		TPH_GetPressure(&pressure,TPH_PRESSURE_HPA);
+		TPH_GetTemperature(&temperature,TPH_TEMP_DEG_C);
+		baro[LOGFMT_BARO_PRESSURE] = lroundf(pressure * 100.0f);
+		baro[LOGFMT_BARO_TEMPERATURE] = lroundf(temperature * 100.0f);
+		baro[LOGFMT_BARO_ALTITUDE] = lroundf(altitude);
+		Log_Submit(LOGFMT_CHANNEL_BARO,baro,LOGFMT_BARO_NUM_FIELDS);
+
 		update_display = 1;
 
-		vTaskDelay(pdMS_TO_TICKS(500));
+		// the measurement time is part of the period
+		vTaskDelayUntil(&last_sample, pdMS_TO_TICKS(TPH_SAMPLE_PERIOD_MS));
+	}
+}
+
+void AMGTask(void *pvParameters)
+{
+	int16_t acc[3], mag[3], gyro[3];
+	int32_t imu[LOGFMT_IMU_NUM_FIELDS];
+	uint8_t i;
+
+	if (!AMG_Initialize())
+		for (;;) vTaskDelay(pdMS_TO_TICKS(100));
+
+	TickType_t last_sample = xTaskGetTickCount();
+	for (;;)
+	{
+		// raw samples go straight to the logger, nothing else uses them yet
+		if (AMG_GetRawValues(acc,mag,gyro))
+		{
+			for (i = 0; i < 3; ++i)
+			{
+				imu[LOGFMT_IMU_ACC_X + i] = acc[i];
+				imu[LOGFMT_IMU_MAG_X + i] = mag[i];
+				imu[LOGFMT_IMU_GYRO_X + i] = gyro[i];
+			}
+			Log_Submit(LOGFMT_CHANNEL_IMU,imu,LOGFMT_IMU_NUM_FIELDS);
+		}
+
+		vTaskDelayUntil(&last_sample, pdMS_TO_TICKS(AMG_SAMPLE_PERIOD_MS));
+	}
+}
+
+// log the high-water marks of the logger buffers and the GPS receive buffer, and the longest block write,
+// that went up since they were last logged
+static void LogBufferPeaks(const struct Log_Stats *stats)
+{
+	static uint16_t logged_staged = 0;
+	static uint16_t logged_channel[LOGFMT_NUM_CHANNELS] = {0};
+	static uint32_t logged_write_us = 0;
+	static uint16_t logged_gps_rx = 0;
+	struct GPS_Stats gps_stats;
+	int32_t event[LOGFMT_EVENT_NUM_FIELDS] = {LOGFMT_EVENT_BUFFER_PEAK, 0, 0};
+	uint8_t c;
+
+	if (stats->max_staged_bytes > logged_staged)
+	{
+		logged_staged = stats->max_staged_bytes;
+		event[LOGFMT_EVENT_ARG] = LOGFMT_NUM_CHANNELS;
+		event[LOGFMT_EVENT_VALUE] = logged_staged;
+		Log_Submit(LOGFMT_CHANNEL_EVENT,event,LOGFMT_EVENT_NUM_FIELDS);
+	}
+
+	for (c = 0; c < LOGFMT_NUM_CHANNELS; ++c)
+	{
+		if (stats->max_channel_bytes[c] > logged_channel[c])
+		{
+			logged_channel[c] = stats->max_channel_bytes[c];
+			event[LOGFMT_EVENT_ARG] = c;
+			event[LOGFMT_EVENT_VALUE] = logged_channel[c];
+			Log_Submit(LOGFMT_CHANNEL_EVENT,event,LOGFMT_EVENT_NUM_FIELDS);
+		}
+	}
+
+	if (stats->max_write_us > logged_write_us)
+	{
+		logged_write_us = stats->max_write_us;
+		event[LOGFMT_EVENT_CODE] = LOGFMT_EVENT_WRITE_PEAK;
+		event[LOGFMT_EVENT_ARG] = 0;
+		event[LOGFMT_EVENT_VALUE] = logged_write_us;
+		Log_Submit(LOGFMT_CHANNEL_EVENT,event,LOGFMT_EVENT_NUM_FIELDS);
+	}
+
+	GPS_GetStats(&gps_stats);
+	if (gps_stats.max_pending_bytes > logged_gps_rx)
+	{
+		logged_gps_rx = gps_stats.max_pending_bytes;
+		event[LOGFMT_EVENT_CODE] = LOGFMT_EVENT_GPS_RX_PEAK;
+		event[LOGFMT_EVENT_ARG] = gps_stats.dropped_sentences;
+		event[LOGFMT_EVENT_VALUE] = logged_gps_rx;
+		Log_Submit(LOGFMT_CHANNEL_EVENT,event,LOGFMT_EVENT_NUM_FIELDS);
 	}
 }
 
+// log what the card told us about itself, the first records of every session
+static void LogCardGeometry()
+{
+	struct SD_Geometry geometry;
+	int32_t event[LOGFMT_EVENT_NUM_FIELDS];
+
+	SD_GetGeometry(&geometry);
+
+	event[LOGFMT_EVENT_CODE] = LOGFMT_EVENT_CARD_GEOMETRY;
+	event[LOGFMT_EVENT_ARG] = geometry.au_sectors;
+	event[LOGFMT_EVENT_VALUE] = geometry.sectors;
+	Log_Submit(LOGFMT_CHANNEL_EVENT,event,LOGFMT_EVENT_NUM_FIELDS);
+
+	event[LOGFMT_EVENT_CODE] = LOGFMT_EVENT_CARD_SPEED;
+	event[LOGFMT_EVENT_ARG] = geometry.speed_class;
+	event[LOGFMT_EVENT_VALUE] = SD_GetBusClockHz();
+	Log_Submit(LOGFMT_CHANNEL_EVENT,event,LOGFMT_EVENT_NUM_FIELDS);
+}
+
+// log the rates the GPS receiver was set up with, GPSTask is done with that before there is a date to
+// open the log with
+static void LogGPSSetup()
+{
+	int32_t event[LOGFMT_EVENT_NUM_FIELDS];
+
+	event[LOGFMT_EVENT_CODE] = LOGFMT_EVENT_GPS_BAUD_RATE;
+	event[LOGFMT_EVENT_ARG] = GPS_GetUpdateRate();
+	event[LOGFMT_EVENT_VALUE] = GPS_GetBaudRate();
+	Log_Submit(LOGFMT_CHANNEL_EVENT,event,LOGFMT_EVENT_NUM_FIELDS);
+}
+
+// log that the card failed an operation of the logger, LogFmt_CardOp
+static void LogCardError(uint8_t operation, uint32_t failures)
+{
+	int32_t event[LOGFMT_EVENT_NUM_FIELDS] = {LOGFMT_EVENT_CARD_ERROR, operation, (int32_t)failures};
+
+	Log_Submit(LOGFMT_CHANNEL_EVENT,event,LOGFMT_EVENT_NUM_FIELDS);
+}
+
+enum CardState
+{
+	CARD_INIT, // card is being brought up
+	CARD_MOUNT, // card is up, the file system has to be mounted
+	CARD_READY
+};
+
+// take card bring-up one step further, returns the time until the next step is due
+static uint32_t BringUpCard(enum CardState *state, FATFS *fs, uint32_t *retry_ms)
+{
+	uint32_t wait;
+
+	switch (*state)
+	{
+	case CARD_INIT:
+		switch (SD_InitializeStep())
+		{
+		case SD_INIT_BUSY:
+			return CARD_POLL_INTERVAL_MS;
+		case SD_INIT_DONE:
+			*state = CARD_MOUNT;
+			return 0;
+		default:
+			break;
+		}
+		break;
+	case CARD_MOUNT:
+		// disk_initialize finds the card in the transfer state and uses it as it is
+		if (f_mount(fs,"",1) != FR_OK)
+		{
+			// unregister the volume, so other tasks get FR_NOT_ENABLED instead of bringing up the card
+			// from under us
+			f_mount(NULL,"",0);
+			*state = CARD_INIT;
+			break;
+		}
+
+		// enter the directory with the measurements, a new card does not have it yet. The current directory
+		// is that of the volume, not of a task, so other tasks use absolute paths.
+		if (f_chdir("/Meas") != FR_OK && (f_mkdir("/Meas") != FR_OK || f_chdir("/Meas") != FR_OK))
+		{
+			f_mount(NULL,"",0);
+			*state = CARD_INIT;
+			break;
+		}
+
+		// logs from a session that ended in a power cut still have the size of their pre-allocated extent.
+		// One that can not be recovered is left as it is, that does not keep us from starting a new one.
+		if (!Log_Recover())
+			LogCardError(LOGFMT_CARD_OP_RECOVER,1);
+
+		*state = CARD_READY;
+		*retry_ms = CARD_RETRY_MIN_MS;
+		return 0;
+	case CARD_READY:
+		return 0;
+	}
+
+	// no card, or one that does not answer, try again after a while
+	wait = *retry_ms;
+	*retry_ms = *retry_ms * 2 > CARD_RETRY_MAX_MS ? CARD_RETRY_MAX_MS : *retry_ms * 2;
+	return wait;
+}
+
+// a log operation failed, returns 1 once CARD_MAX_FAILURES have failed in a row and the card has to be dropped
+static uint8_t CardFailed(uint8_t operation, uint32_t *failures)
+{
+	if (++*failures >= CARD_MAX_FAILURES)
+		return 1;
+
+	LogCardError(operation,*failures);
+	return 0;
+}
+
+// the card was pulled or stopped answering. Records wait in RAM again while it is brought up, once it is
+// mounted the log is recovered and the session goes on in a new one appended to the same file.
+static void DropCard(enum CardState *state, uint8_t operation, uint32_t *failures)
+{
+	Log_Close();
+	// starting over throws away what was submitted and not yet written, the last failure is logged after it
+	Log_Start();
+	LogCardError(operation,*failures);
+	f_mount(NULL,"",0);
+	*state = CARD_INIT;
+	*failures = 0;
+}
+
 void SDTask(void *pvParameters)
 {
-	FRESULT res;
 	FATFS fs;
-	FIL file;
-	UINT num_written = 0;
 	char filename[32] = {0};
-	uint8_t raw_data[RAW_DATA_POINT_SIZE] = {0};
+	struct Log_Stats stats;
+	uint32_t records_at_sync = 0;
+	enum CardState card = CARD_INIT;
+	uint32_t card_retry_ms = CARD_RETRY_MIN_MS;
+	uint32_t card_failures = 0;
+	// events are only ever submitted by this task, the event channel has a single producer like any other
+	const int32_t low_voltage_event[LOGFMT_EVENT_NUM_FIELDS] = {LOGFMT_EVENT_LOW_VOLTAGE, 0, 0};
+
+	TickType_t next_process = xTaskGetTickCount();
+	TickType_t next_card_step = next_process;
+	TickType_t last_sync = next_process;
 
-	do
+	for (;;)
 	{
-		res = f_mount(&fs,"",1);
-		if (res != FR_OK)
-			vTaskDelay(pdMS_TO_TICKS(5000));
-	} while (res != FR_OK);
-
-	// enter the directory with the measurements
-	res = f_chdir("/Meas");
-	if (res != FR_OK)
-		; // TODO: error handling
-
-	// we are going to name the files by the starting datetime, get the date from the GPS, and do not create a file until we have a date
-	while (starting_datetime.year == -1)
-		vTaskDelay(pdMS_TO_TICKS(500));
-
-	//SPRINTF(filename,"20%02d%02d%02d-%02d%02d%02d.dat",
-	SPRINTF(filename,"%02d%02d%02d.dat",
-		//starting_datetime.year,
-		//starting_datetime.month,
-		//starting_datetime.day,
-		starting_datetime.hours,
-		starting_datetime.minutes,
-		starting_datetime.seconds
-	);
+		// sleep until the records are due to be drained or the card is due for its next step, a low
+		// voltage warning wakes us up early
+		TickType_t now = xTaskGetTickCount();
+		TickType_t wake = next_process;
+		if (card != CARD_READY && (int32_t)(next_card_step - wake) < 0)
+			wake = next_card_step;
+		if ((int32_t)(wake - now) > 0)
+			ulTaskNotifyTake(pdTRUE, wake - now);
+
+		if (low_voltage)
+		{
+			// power is going away, close the log so it is cut to length and its index is written. Should the
+			// supply come back, the log is opened again and the next session is appended to the file.
+			low_voltage = 0;
+			Log_Submit(LOGFMT_CHANNEL_EVENT,low_voltage_event,LOGFMT_EVENT_NUM_FIELDS);
+			Log_Close();
+		}
 
-	TickType_t xLastWakeTime = xTaskGetTickCount();
+		now = xTaskGetTickCount();
+		if (card != CARD_READY && (int32_t)(next_card_step - now) <= 0)
+			next_card_step = now + pdMS_TO_TICKS(BringUpCard(&card,&fs,&card_retry_ms));
 
-	for (;;)
-	{
-		vTaskDelayUntil(&xLastWakeTime, pdMS_TO_TICKS(1000));
-
-		// open the file
-		res = f_open(&file,filename,FA_WRITE|FA_OPEN_APPEND);
-		if (res != FR_OK)
-			; // TODO:  error handling
-
-		// write raw UNIX timestamp, coordinates, altitude, heading, and ground speed into file
-		memcpy(raw_data+TIMESTAMP_OFFSET,&ts.tv_sec,TIMESTAMP_LEN);
-		memcpy(raw_data+LATITUDE_OFFSET,&latitude,LATITUDE_LEN);
-		memcpy(raw_data+LONGITUDE_OFFSET,&longitude,LONGITUDE_LEN);
-		memcpy(raw_data+ALTITUDE_OFFSET,&altitude,ALTITUDE_LEN);
-		memcpy(raw_data+HEADING_OFFSET,&mag_heading,HEADING_LEN);
-		memcpy(raw_data+SPEED_OFFSET,&gs_knots,SPEED_LEN);
+		now = xTaskGetTickCount();
+		if ((int32_t)(next_process - now) > 0)
+			continue;
+		next_process += pdMS_TO_TICKS(LOG_PROCESS_INTERVAL_MS);
+
+		// the file is named by the starting datetime, so it is not created until the GPS has given us a date.
+		// It is kept open for the rest of the session, and not opened again while the supply is low.
+		if (!Log_IsOpen() && card == CARD_READY && starting_datetime.year != -1 && PWR_GetFlagStatus(PWR_FLAG_PVDO) == RESET)
+		{
+			//SPRINTF(filename,"20%02d%02d%02d-%02d%02d%02d.dat",
+			SPRINTF(filename,"%02d%02d%02d.dat",
+				//starting_datetime.year,
+				//starting_datetime.month,
+				//starting_datetime.day,
+				starting_datetime.hours,
+				starting_datetime.minutes,
+				starting_datetime.seconds
+			);
+
+			// the file header carries the UNIX time of the session start, records only store the time since then
+			if (Log_Open(filename,(uint32_t)ts.tv_sec))
+			{
+				records_at_sync = 0;
+				last_sync = now;
+				card_failures = 0;
+				LogCardGeometry();
+				LogGPSSetup();
+			}
+			else if (CardFailed(LOGFMT_CARD_OP_OPEN,&card_failures))
+			{
+				DropCard(&card,LOGFMT_CARD_OP_OPEN,&card_failures);
+				next_card_step = now;
+			}
+		}
+
+		// records only land in a staging buffer, the card is written a whole sector at a time or on sync. A
+		// block that fails to be written is lost, the ones after it are tried as usual.
 		SetLED(1);
-		res = f_write(&file,raw_data,RAW_DATA_POINT_SIZE,&num_written);
+		Log_GetStats(&stats);
+		if (Log_IsOpen() && (stats.records - records_at_sync >= LOG_SYNC_RECORDS
+			|| (now - last_sync) >= pdMS_TO_TICKS(LOG_SYNC_INTERVAL_MS)))
+		{
+			if (Log_Sync())
+				card_failures = 0;
+			else if (CardFailed(LOGFMT_CARD_OP_SYNC,&card_failures))
+			{
+				DropCard(&card,LOGFMT_CARD_OP_SYNC,&card_failures);
+				next_card_step = now;
+			}
+
+			Log_GetStats(&stats);
+			records_at_sync = stats.records;
+			LogBufferPeaks(&stats);
+			last_sync = now;
+		}
+		else if (Log_Process())
+		{
+			// there may have been nothing to write, only a block that reached the card shows it is good
+			uint32_t sectors_written = stats.sectors_written;
+			Log_GetStats(&stats);
+			if (Log_IsOpen() && stats.sectors_written != sectors_written)
+				card_failures = 0;
+		}
+		else if (CardFailed(LOGFMT_CARD_OP_WRITE,&card_failures))
+		{
+			DropCard(&card,LOGFMT_CARD_OP_WRITE,&card_failures);
+			next_card_step = now;
+		}
 		SetLED(0);
-		if (res != FR_OK || num_written != RAW_DATA_POINT_SIZE)
-			; // TODO: error handling
-
-		// close file after we finish writing this data point
-		res = f_close(&file);
 	}
 }
 
@@ -350,6 +658,42 @@ void EXTI15_10_IRQHandler(void)
 	}
 }
 
+void PVD_IRQHandler(void)
+{
+	if (EXTI_GetITStatus(PVD_EXTI_LINE) == SET)
+	{
+		BaseType_t higher_priority_task_woken = pdFALSE;
+
+		low_voltage = 1;
+		if (sd_task_handle != NULL)
+			vTaskNotifyGiveFromISR(sd_task_handle, &higher_priority_task_woken);
+
+		EXTI_ClearITPendingBit(PVD_EXTI_LINE);
+		portYIELD_FROM_ISR(higher_priority_task_woken);
+	}
+}
+
+void PVDInit()
+{
+	RCC_APB1PeriphClockCmd(RCC_APB1Periph_PWR, ENABLE);
+	PWR_PVDLevelConfig(PVD_LEVEL);
+
+	NVIC_InitTypeDef NVICStruct;
+	NVICStruct.NVIC_IRQChannel = PVD_IRQn;
+	NVICStruct.NVIC_IRQChannelCmd = ENABLE;
+	NVICStruct.NVIC_IRQChannelPreemptionPriority = 5;
+	NVIC_Init(&NVICStruct);
+
+	EXTI_InitTypeDef EXTIStruct;
+	EXTIStruct.EXTI_LineCmd = ENABLE;
+	EXTIStruct.EXTI_Mode = EXTI_Mode_Interrupt;
+	EXTIStruct.EXTI_Trigger = EXTI_Trigger_Rising;
+	EXTIStruct.EXTI_Line = PVD_EXTI_LINE;
+	EXTI_Init(&EXTIStruct);
+
+	PWR_PVDCmd(ENABLE);
+}
+
 void AltimeterGPIOInit()
 {
 	// init GPIO pins
@@ -394,6 +738,15 @@ int main(void)
 
 	InitLED();
 	AltimeterGPIOInit();
+	PVDInit();
+	I2C_Initialize();
+	// the mutexes of the volume and of the card, made before any task can race to create them
+	ff_init_syncobj();
+	disk_init_lock();
+	Log_Init();
+	// records are taken from boot on, they wait in RAM until the card is mounted and we have a date. Started
+	// here, the producers get to run before the SD task does.
+	Log_Start();
 
 	xTaskCreate(
 		DisplayTask,
@@ -422,13 +775,22 @@ int main(void)
 		NULL
 	);
 
+	xTaskCreate(
+		AMGTask,
+		"AMGTask",
+		256,
+		NULL,
+		4, // highest, the samples are taken on a fixed 5 ms grid
+		NULL
+	);
+
 	xTaskCreate(
 		SDTask,
 		"SDTask",
 		4096,
 		NULL,
 		1,
-		NULL
+		&sd_task_handle
 	);
 
 	vTaskStartScheduler();
@@ -0,0 +1,359 @@
+#include <string.h>
+
+#include "nmea.h"
+
+void NMEA_InitFramer(struct NMEA_Framer *framer)
+{
+	memset(framer, 0, sizeof(*framer));
+}
+
+// throw away a partly received sentence, the framer waits for the start of the next one
+void NMEA_ResetFramer(struct NMEA_Framer *framer)
+{
+	if (framer->len > 0)
+		++framer->dropped;
+	framer->len = 0;
+}
+
+// frame the bytes of the ring from *pos up to head, stopping after a complete sentence. Returns the length
+// of the sentence, from the '$' to the last byte before the carriage return and line feed, or 0 if no
+// sentence was completed. The sentence starts at the start offset of the framer.
+uint8_t NMEA_Frame(struct NMEA_Framer *framer, const uint8_t *ring, uint16_t ring_len, uint16_t *pos, uint16_t head)
+{
+	uint8_t len;
+	char c;
+
+	while (*pos != head)
+	{
+		c = (char)ring[*pos];
+		*pos = (*pos + 1) % ring_len;
+
+		if (c == '$')
+		{
+			NMEA_ResetFramer(framer);
+			framer->start = (*pos + ring_len - 1) % ring_len;
+			framer->len = 1;
+		}
+		else if (framer->len == 0)
+		{
+			// eat
+		}
+		else if (c == '\n') // this indicates the end of a sentence
+		{
+			len = framer->len;
+			if (ring[(framer->start + len - 1) % ring_len] == '\r')
+				--len;
+			framer->len = 0;
+			++framer->sentences;
+			return len;
+		}
+		else if (framer->len < NMEA_BUF_LEN - 1) // leave room for the terminator
+		{
+			++framer->len;
+		}
+		else
+		{
+			NMEA_ResetFramer(framer);
+		}
+	}
+
+	return 0;
+}
+
+static int8_t _hex_digit(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	return -1;
+}
+
+// check the checksum of a framed sentence of len bytes, the two hex digits after the '*' are the exclusive
+// or of the bytes between the '$' and the '*'. A sentence without a checksum does not pass.
+uint8_t NMEA_CheckSentence(const char *sentence, uint8_t len)
+{
+	uint8_t checksum = 0;
+	int8_t high, low;
+	uint8_t i;
+
+	if (len < 4 || sentence[0] != '$' || sentence[len - 3] != '*')
+		return 0;
+
+	for (i = 1; i < len - 3; ++i)
+		checksum ^= (uint8_t)sentence[i];
+
+	high = _hex_digit(sentence[len - 2]);
+	low = _hex_digit(sentence[len - 1]);
+	return high >= 0 && low >= 0 && checksum == (uint8_t)((high << 4) | low);
+}
+
+// what a field of a sentence is, by its position. Numbers come first, then letters
+enum _Field
+{
+	FIELD_SKIP = 0,
+	FIELD_TIME,
+	FIELD_LATITUDE,
+	FIELD_LONGITUDE,
+	FIELD_SPEED,
+	FIELD_TRACK,
+	FIELD_DATE,
+	FIELD_VARIATION,
+	FIELD_QUALITY,
+	FIELD_SATELLITES,
+	FIELD_ALTITUDE,
+	FIELD_STATUS,
+	FIELD_NORTH_SOUTH,
+	FIELD_EAST_WEST,
+	FIELD_VARIATION_EAST_WEST,
+	FIELD_ALTITUDE_UNITS,
+	FIELD_TRUE, // VTG unit letters, the old VTG without them is left to the general parser
+	FIELD_KNOTS
+};
+
+static const uint8_t _rmc_fields[] = {FIELD_TIME, FIELD_STATUS, FIELD_LATITUDE, FIELD_NORTH_SOUTH, FIELD_LONGITUDE,
+	FIELD_EAST_WEST, FIELD_SPEED, FIELD_TRACK, FIELD_DATE, FIELD_VARIATION, FIELD_VARIATION_EAST_WEST};
+static const uint8_t _gga_fields[] = {FIELD_TIME, FIELD_LATITUDE, FIELD_NORTH_SOUTH, FIELD_LONGITUDE, FIELD_EAST_WEST,
+	FIELD_QUALITY, FIELD_SATELLITES, FIELD_SKIP, FIELD_ALTITUDE, FIELD_ALTITUDE_UNITS};
+static const uint8_t _vtg_fields[] = {FIELD_TRACK, FIELD_TRUE, FIELD_SKIP, FIELD_SKIP, FIELD_SPEED, FIELD_KNOTS};
+
+#define FIELD_MAX_DECIMALS 6
+#define FIELD_MAX_DIGITS 9 // of the integer part, so it fits
+
+// a field as scanned, a number is kept as its integer part and its first decimals
+struct _Value
+{
+	char first;
+	uint8_t len;
+	uint8_t is_number;
+	int8_t sign;
+	uint32_t integer;
+	uint32_t fraction; // FIELD_MAX_DECIMALS decimals
+};
+
+static const uint32_t _pow10[] = {1, 10, 100, 1000, 10000, 100000, 1000000};
+
+// a number with the given decimals, the rest are cut off
+static int32_t _fixed(const struct _Value *value, uint8_t decimals)
+{
+	return value->sign * (int32_t)(value->integer * _pow10[decimals]
+		+ value->fraction / _pow10[FIELD_MAX_DECIMALS - decimals]);
+}
+
+// ddmm.mmmmmm to 1e-7 deg
+static int32_t _coordinate(const struct _Value *value)
+{
+	uint32_t minutes = (value->integer % 100) * _pow10[FIELD_MAX_DECIMALS] + value->fraction; // 1e-6 min
+
+	return (int32_t)((value->integer / 100) * 10000000 + (minutes + 3) / 6);
+}
+
+// scan a field, checksumming it, up to and past the ',' or '*' after it. Returns that character, or '\0'
+// if the sentence ends without a checksum
+static char _scan_field(const char **pos, uint8_t *checksum, struct _Value *value)
+{
+	uint8_t decimals = 0;
+	uint8_t digits = 0;
+	uint8_t point = 0;
+	char c;
+
+	value->first = **pos;
+	value->len = 0;
+	value->is_number = 1;
+	value->sign = 1;
+	value->integer = 0;
+	value->fraction = 0;
+
+	while ((c = *(*pos)++) != ',' && c != '*' && c != '\0')
+	{
+		*checksum ^= (uint8_t)c;
+		++value->len;
+
+		if (c >= '0' && c <= '9')
+		{
+			if (point)
+			{
+				if (decimals < FIELD_MAX_DECIMALS)
+					value->fraction += (c - '0') * _pow10[FIELD_MAX_DECIMALS - ++decimals];
+			}
+			else if (++digits <= FIELD_MAX_DIGITS)
+			{
+				value->integer = value->integer * 10 + (c - '0');
+			}
+			else
+			{
+				value->is_number = 0;
+			}
+		}
+		else if (c == '.' && !point)
+			point = 1;
+		else if (c == '-' && value->len == 1)
+			value->sign = -1;
+		else
+			value->is_number = 0;
+	}
+
+	if (c == ',')
+		*checksum ^= (uint8_t)c;
+	if (digits == 0)
+		value->is_number = 0;
+
+	return c;
+}
+
+// parse an RMC, GGA or VTG sentence of len bytes into fix, checking its checksum as it goes
+uint8_t NMEA_ParseSentence(const char *sentence, uint8_t len, struct NMEA_Fix *fix)
+{
+	const uint8_t *fields;
+	uint8_t num_fields;
+	uint8_t type;
+	uint8_t checksum = 0;
+	uint8_t field;
+	int8_t high, low;
+	const char *pos;
+	struct _Value value;
+	uint8_t kind;
+	char end;
+
+	if (sentence[0] != '$')
+		return NMEA_SENTENCE_INVALID;
+
+	// the address is two letters of the talker and three of the sentence. Proprietary sentences have
+	// addresses of other lengths, they are left to the general parser with the rest
+	if (len < 7 || sentence[6] != ',')
+		return NMEA_SENTENCE_OTHER;
+
+	if (sentence[3] == 'R' && sentence[4] == 'M' && sentence[5] == 'C')
+	{
+		type = NMEA_SENTENCE_RMC;
+		fields = _rmc_fields;
+		num_fields = sizeof(_rmc_fields);
+	}
+	else if (sentence[3] == 'G' && sentence[4] == 'G' && sentence[5] == 'A')
+	{
+		type = NMEA_SENTENCE_GGA;
+		fields = _gga_fields;
+		num_fields = sizeof(_gga_fields);
+	}
+	else if (sentence[3] == 'V' && sentence[4] == 'T' && sentence[5] == 'G')
+	{
+		type = NMEA_SENTENCE_VTG;
+		fields = _vtg_fields;
+		num_fields = sizeof(_vtg_fields);
+	}
+	else
+	{
+		return NMEA_SENTENCE_OTHER;
+	}
+
+	for (pos = &sentence[1]; pos < &sentence[7]; ++pos)
+		checksum ^= (uint8_t)*pos;
+
+	memset(fix, 0, sizeof(*fix));
+	fix->valid = type == NMEA_SENTENCE_VTG;
+
+	for (field = 0, end = ','; end == ','; ++field)
+	{
+		end = _scan_field(&pos, &checksum, &value);
+		kind = field < num_fields ? fields[field] : FIELD_SKIP;
+
+		// an empty field is left out, anything else where a number goes spoils the sentence
+		if (kind > FIELD_SKIP && kind < FIELD_STATUS && value.len > 0 && !value.is_number)
+			return NMEA_SENTENCE_INVALID;
+		if (kind < FIELD_STATUS && value.len == 0)
+			continue;
+
+		switch (kind)
+		{
+		case FIELD_TIME:
+			fix->time_ms = ((value.integer / 10000) * 3600 + (value.integer / 100 % 100) * 60 + value.integer % 100) * 1000
+				+ value.fraction / _pow10[FIELD_MAX_DECIMALS - 3];
+			fix->fields |= NMEA_HAS_TIME;
+			break;
+		case FIELD_STATUS:
+			fix->valid = value.len == 1 && value.first == 'A';
+			break;
+		case FIELD_LATITUDE:
+			if (value.integer % 100 >= 60 || value.integer / 100 > 90)
+				return NMEA_SENTENCE_INVALID;
+			fix->latitude = _coordinate(&value);
+			fix->fields |= NMEA_HAS_LATITUDE;
+			break;
+		case FIELD_NORTH_SOUTH:
+			if (value.len == 1 && value.first == 'S')
+				fix->latitude = -fix->latitude;
+			break;
+		case FIELD_LONGITUDE:
+			if (value.integer % 100 >= 60 || value.integer / 100 > 180)
+				return NMEA_SENTENCE_INVALID;
+			fix->longitude = _coordinate(&value);
+			fix->fields |= NMEA_HAS_LONGITUDE;
+			break;
+		case FIELD_EAST_WEST:
+			if (value.len == 1 && value.first == 'W')
+				fix->longitude = -fix->longitude;
+			break;
+		case FIELD_SPEED:
+			fix->speed = _fixed(&value, 2);
+			fix->fields |= NMEA_HAS_SPEED;
+			break;
+		case FIELD_TRACK:
+			fix->track = _fixed(&value, 2);
+			fix->fields |= NMEA_HAS_TRACK;
+			break;
+		case FIELD_DATE:
+			fix->day = value.integer / 10000;
+			fix->month = value.integer / 100 % 100;
+			fix->year = value.integer % 100;
+			fix->fields |= NMEA_HAS_DATE;
+			break;
+		case FIELD_VARIATION:
+			fix->variation = _fixed(&value, 2);
+			fix->fields |= NMEA_HAS_VARIATION;
+			break;
+		case FIELD_VARIATION_EAST_WEST:
+			if (value.len == 1 && value.first == 'W')
+				fix->variation = -fix->variation;
+			break;
+		case FIELD_QUALITY:
+			fix->valid = value.integer > 0;
+			break;
+		case FIELD_SATELLITES:
+			fix->satellites = value.integer;
+			fix->fields |= NMEA_HAS_SATELLITES;
+			break;
+		case FIELD_ALTITUDE:
+			fix->altitude = _fixed(&value, 2);
+			fix->fields |= NMEA_HAS_ALTITUDE;
+			break;
+		case FIELD_ALTITUDE_UNITS:
+			if (value.len > 0)
+				fix->altitude_units = value.first;
+			break;
+		case FIELD_TRUE:
+			if (value.len != 1 || value.first != 'T')
+				type = NMEA_SENTENCE_OTHER;
+			break;
+		case FIELD_KNOTS:
+			if (value.len != 1 || value.first != 'N')
+				type = NMEA_SENTENCE_OTHER;
+			break;
+		}
+	}
+
+	// a position is latitude and longitude both
+	if ((fix->fields & NMEA_HAS_POSITION) != NMEA_HAS_POSITION)
+		fix->fields &= ~NMEA_HAS_POSITION;
+
+	// the checksum closes the sentence
+	if (end != '*' || pos + 2 != &sentence[len])
+		return NMEA_SENTENCE_INVALID;
+	high = _hex_digit(pos[0]);
+	low = _hex_digit(pos[1]);
+	if (high < 0 || low < 0 || checksum != (uint8_t)((high << 4) | low))
+		return NMEA_SENTENCE_INVALID;
+
+	return type;
+}
@@ -1,13 +1,16 @@
 #include <stdlib.h>
+#include <string.h>
 
 #include "FreeRTOS.h"
 #include "task.h"
+#include "semphr.h"
 
 #include "stm32f4xx.h"
 #include "sd.h"
 
+#define SDIO_CLK_HZ 48000000 // SDIOCLK, from PLL48CLK
 #define SDIO_CLK_DIV_INIT 0xe0
-#define SDIO_CLK_DIV_NORMAL 0x00
+#define SDIO_CLK_DIV_NORMAL 0x00 // SDIOCLK / (div + 2), 24 MHz for default speed cards
 
 #define SDIO_CK_PORT GPIOC
 #define SDIO_CK_PIN GPIO_Pin_12
@@ -15,10 +18,22 @@
 #define SDIO_D0_PORT GPIOC
 #define SDIO_D0_PIN GPIO_Pin_8
 #define SDIO_D0_PINSOURCE GPIO_PinSource8
+#define SDIO_D1_PORT GPIOC
+#define SDIO_D1_PIN GPIO_Pin_9
+#define SDIO_D1_PINSOURCE GPIO_PinSource9
+#define SDIO_D2_PORT GPIOC
+#define SDIO_D2_PIN GPIO_Pin_10
+#define SDIO_D2_PINSOURCE GPIO_PinSource10
+#define SDIO_D3_PORT GPIOC
+#define SDIO_D3_PIN GPIO_Pin_11
+#define SDIO_D3_PINSOURCE GPIO_PinSource11
 #define SDIO_CMD_PORT GPIOD
 #define SDIO_CMD_PIN GPIO_Pin_2
 #define SDIO_CMD_PINSOURCE GPIO_PinSource2
 
+// set to 0 if the board only wires up D0, the card will then always be run with a 1-bit bus
+#define SDIO_BOARD_HAS_4B_BUS 1
+
 #define SDIO_DMA_STREAM DMA2_Stream3
 #define SDIO_DMA_TC_INT DMA_IT_TCIF3
 #define DMA_DIR_MASK ((uint32_t)0x000000c0)
@@ -28,14 +43,25 @@ enum SDIO_Command
 	SDIO_GO_IDLE_STATE = 0,
 	SDIO_SEND_ALL_CID = 2,
 	SDIO_SEND_REL_ADDR = 3,
+	SDIO_SWITCH_FUNC = 6,
+	SDIO_APP_SET_BUS_WIDTH = 6,
 	SDIO_SEL_DESEL_CARD = 7,
 	SDIO_SEND_IF_COND = 8,
 	SDIO_SEND_CSD = 9,
+	SDIO_STOP_TRANSMISSION = 12,
 	SDIO_SEND_STATUS = 13,
+	SDIO_APP_SD_STATUS = 13,
 	SDIO_SET_BLOCKLEN = 16,
 	SDIO_READ_SINGLE_BLOCK = 17,
+	SDIO_READ_MULT_BLOCK = 18,
+	SDIO_APP_SET_WR_BLK_ERASE_COUNT = 23,
 	SDIO_WRITE_SINGLE_BLOCK = 24,
+	SDIO_WRITE_MULT_BLOCK = 25,
+	SDIO_ERASE_WR_BLK_START = 32,
+	SDIO_ERASE_WR_BLK_END = 33,
+	SDIO_ERASE = 38,
 	SDIO_APP_OP_COND = 41,
+	SDIO_APP_SEND_SCR = 51,
 	SDIO_APP_CMD = 55
 };
 
@@ -64,14 +90,46 @@ static enum SDIO_CardType _card_type = SDIO_STD_CAPACITY_V1_1;
 #define SDIO_R6_ILLEGAL_CMD               ((uint32_t)0x00004000)
 #define SDIO_R6_COM_CRC_FAILED            ((uint32_t)0x00008000)
 #define SDIO_CMD0_TIMEOUT 10000
+#define SDIO_DATA_TIMEOUT 0x00FFFFFF
+#define SDIO_TRANSFER_TIMEOUT_MS 1000
+#define SDIO_OP_COND_TIMEOUT_MS 1000 // cards have to finish powering up within a second of the first ACMD41
+#define SDIO_OP_COND_POLL_MS 5
+#define SDIO_BUSY_TIMEOUT_MS 500 // maximum write busy time for SDHC/SDXC cards
+#define SDIO_ERASE_TIMEOUT_MS 2000 // busy time allowed for erasing one chunk
+#define SDIO_BUSY_SPIN_US 500 // cards program a block in a few hundred us, that is spun out rather than slept a tick
+#define SDIO_ERASE_CHUNK 8192 // blocks erased with one CMD38, 4 MB, the allocation unit of most cards
+#define SDIO_CSD_ERASE_BLK_EN ((uint32_t)0x00004000) // in _csd[2], set if single blocks can be erased
+#define SDIO_CSD_STRUCTURE(csd) ((csd)[0] >> 30) // 0: standard capacity, 1: high or extended capacity
+#define SDIO_SCR_BUS_WIDTH_4B ((uint32_t)0x00040000)
+#define SDIO_SCR_SD_SPEC ((uint32_t)0x0F000000)
+#define SDIO_SWITCH_CHECK_HIGH_SPEED 0x00FFFFF1
+#define SDIO_SWITCH_SET_HIGH_SPEED 0x80FFFFF1
 
 static uint16_t _rca = 0;
 static uint32_t _cid[4] = {0};
 static uint32_t _csd[4] = {0};
+static uint32_t _scr[2] = {0};
+static struct SD_Geometry _geometry = {0};
+static uint8_t _bus_width = 1;
+static SDIO_InitTypeDef _sdio_init;
+static struct SD_Stats _stats = {0};
 
 static volatile enum SDIO_Error _transfer_error = SDIO_OK;
 static volatile uint8_t _sdio_transfer_complete = 1;
 static volatile uint8_t _dma_transfer_complete = 1;
+static SemaphoreHandle_t _transfer_done = NULL;
+
+// wake the task waiting on the transfer once both the DMA and the SDIO data path are done, or on an error
+static void _sd_signal_from_isr()
+{
+	BaseType_t higher_priority_task_woken = pdFALSE;
+
+	if ((_dma_transfer_complete && _sdio_transfer_complete) || _transfer_error != SDIO_OK)
+	{
+		xSemaphoreGiveFromISR(_transfer_done, &higher_priority_task_woken);
+		portYIELD_FROM_ISR(higher_priority_task_woken);
+	}
+}
 
 void DMA2_Stream3_IRQHandler(void)
 {
@@ -79,6 +137,7 @@ void DMA2_Stream3_IRQHandler(void)
 	{
 		_dma_transfer_complete = 1;
 		DMA_ClearITPendingBit(SDIO_DMA_STREAM, SDIO_DMA_TC_INT);
+		_sd_signal_from_isr();
 	}
 }
 
@@ -114,6 +173,13 @@ void SDIO_IRQHandler(void)
 	SDIO_ITConfig(SDIO_IT_DCRCFAIL | SDIO_IT_DTIMEOUT | SDIO_IT_DATAEND |
 		SDIO_IT_TXFIFOHE | SDIO_IT_RXFIFOHF | SDIO_IT_TXUNDERR |
 		SDIO_IT_RXOVERR, DISABLE);
+
+	_sd_signal_from_isr();
+}
+
+static uint32_t _sd_cycles_to_us(uint32_t cycles)
+{
+	return cycles / (SystemCoreClock / 1000000);
 }
 
 static enum SDIO_Error _sd_cmd_error()
@@ -271,6 +337,8 @@ static enum SDIO_Error _sd_send_command(enum SDIO_Command cmd, uint32_t arg)
 	SDIO_CmdInitTypeDef SDIOCmdStruct;
 	enum SDIO_Error errorstatus = SDIO_ERROR;
 
+	++_stats.commands;
+
 	switch (cmd)
 	{
 	case SDIO_GO_IDLE_STATE: // CMD0
@@ -303,6 +371,16 @@ static enum SDIO_Error _sd_send_command(enum SDIO_Command cmd, uint32_t arg)
 
 		errorstatus = _sd_resp6_error(cmd);
 		break;
+	case SDIO_SWITCH_FUNC: // CMD6, also ACMD6 (SDIO_APP_SET_BUS_WIDTH)
+		SDIOCmdStruct.SDIO_CmdIndex = (uint8_t)cmd;
+		SDIOCmdStruct.SDIO_Argument = arg;
+		SDIOCmdStruct.SDIO_Response = SDIO_Response_Short;
+		SDIOCmdStruct.SDIO_Wait = SDIO_Wait_No;
+		SDIOCmdStruct.SDIO_CPSM = SDIO_CPSM_Enable;
+		SDIO_SendCommand(&SDIOCmdStruct);
+
+		errorstatus = _sd_resp1_error(cmd);
+		break;
 	case SDIO_SEL_DESEL_CARD: // CMD7
 		SDIOCmdStruct.SDIO_CmdIndex = (uint8_t)cmd;
 		SDIOCmdStruct.SDIO_Argument = arg;
@@ -335,7 +413,17 @@ static enum SDIO_Error _sd_send_command(enum SDIO_Command cmd, uint32_t arg)
 		errorstatus = _sd_resp2_error();
 
 		break;
-	case SDIO_SEND_STATUS: // CMD13
+	case SDIO_STOP_TRANSMISSION: // CMD12
+		SDIOCmdStruct.SDIO_CmdIndex = (uint8_t)cmd;
+		SDIOCmdStruct.SDIO_Argument = arg;
+		SDIOCmdStruct.SDIO_Response = SDIO_Response_Short;
+		SDIOCmdStruct.SDIO_Wait = SDIO_Wait_No;
+		SDIOCmdStruct.SDIO_CPSM = SDIO_CPSM_Enable;
+		SDIO_SendCommand(&SDIOCmdStruct);
+
+		errorstatus = _sd_resp1_error(cmd);
+		break;
+	case SDIO_SEND_STATUS: // CMD13, also ACMD13 (SDIO_APP_SD_STATUS)
 		SDIOCmdStruct.SDIO_CmdIndex = (uint8_t)cmd;
 		SDIOCmdStruct.SDIO_Argument = arg;
 		SDIOCmdStruct.SDIO_Response = SDIO_Response_Short;
@@ -363,6 +451,16 @@ static enum SDIO_Error _sd_send_command(enum SDIO_Command cmd, uint32_t arg)
 		SDIOCmdStruct.SDIO_CPSM = SDIO_CPSM_Enable;
 		SDIO_SendCommand(&SDIOCmdStruct);
 
+		errorstatus = _sd_resp1_error(cmd);
+		break;
+	case SDIO_READ_MULT_BLOCK: // CMD18
+		SDIOCmdStruct.SDIO_CmdIndex = (uint8_t)cmd;
+		SDIOCmdStruct.SDIO_Argument = arg;
+		SDIOCmdStruct.SDIO_Response = SDIO_Response_Short;
+		SDIOCmdStruct.SDIO_Wait = SDIO_Wait_No;
+		SDIOCmdStruct.SDIO_CPSM = SDIO_CPSM_Enable;
+		SDIO_SendCommand(&SDIOCmdStruct);
+
 		errorstatus = _sd_resp1_error(cmd);
 		break;
 	case SDIO_WRITE_SINGLE_BLOCK: // CMD24
@@ -373,6 +471,38 @@ static enum SDIO_Error _sd_send_command(enum SDIO_Command cmd, uint32_t arg)
 		SDIOCmdStruct.SDIO_CPSM = SDIO_CPSM_Enable;
 		SDIO_SendCommand(&SDIOCmdStruct);
 
+		errorstatus = _sd_resp1_error(cmd);
+		break;
+	case SDIO_APP_SET_WR_BLK_ERASE_COUNT: // ACMD23
+		SDIOCmdStruct.SDIO_CmdIndex = (uint8_t)cmd;
+		SDIOCmdStruct.SDIO_Argument = arg;
+		SDIOCmdStruct.SDIO_Response = SDIO_Response_Short;
+		SDIOCmdStruct.SDIO_Wait = SDIO_Wait_No;
+		SDIOCmdStruct.SDIO_CPSM = SDIO_CPSM_Enable;
+		SDIO_SendCommand(&SDIOCmdStruct);
+
+		errorstatus = _sd_resp1_error(cmd);
+		break;
+	case SDIO_WRITE_MULT_BLOCK: // CMD25
+		SDIOCmdStruct.SDIO_CmdIndex = (uint8_t)cmd;
+		SDIOCmdStruct.SDIO_Argument = arg;
+		SDIOCmdStruct.SDIO_Response = SDIO_Response_Short;
+		SDIOCmdStruct.SDIO_Wait = SDIO_Wait_No;
+		SDIOCmdStruct.SDIO_CPSM = SDIO_CPSM_Enable;
+		SDIO_SendCommand(&SDIOCmdStruct);
+
+		errorstatus = _sd_resp1_error(cmd);
+		break;
+	case SDIO_ERASE_WR_BLK_START: // CMD32
+	case SDIO_ERASE_WR_BLK_END: // CMD33
+	case SDIO_ERASE: // CMD38, the card signals busy on D0 until the erase is done
+		SDIOCmdStruct.SDIO_CmdIndex = (uint8_t)cmd;
+		SDIOCmdStruct.SDIO_Argument = arg;
+		SDIOCmdStruct.SDIO_Response = SDIO_Response_Short;
+		SDIOCmdStruct.SDIO_Wait = SDIO_Wait_No;
+		SDIOCmdStruct.SDIO_CPSM = SDIO_CPSM_Enable;
+		SDIO_SendCommand(&SDIOCmdStruct);
+
 		errorstatus = _sd_resp1_error(cmd);
 		break;
 	case SDIO_APP_OP_COND: // CMD41
@@ -385,9 +515,19 @@ static enum SDIO_Error _sd_send_command(enum SDIO_Command cmd, uint32_t arg)
 
 		errorstatus = _sd_resp3_error();
 		break;
+	case SDIO_APP_SEND_SCR: // ACMD51
+		SDIOCmdStruct.SDIO_CmdIndex = (uint8_t)cmd;
+		SDIOCmdStruct.SDIO_Argument = arg;
+		SDIOCmdStruct.SDIO_Response = SDIO_Response_Short;
+		SDIOCmdStruct.SDIO_Wait = SDIO_Wait_No;
+		SDIOCmdStruct.SDIO_CPSM = SDIO_CPSM_Enable;
+		SDIO_SendCommand(&SDIOCmdStruct);
+
+		errorstatus = _sd_resp1_error(cmd);
+		break;
 	case SDIO_APP_CMD: // CMD55
 		SDIOCmdStruct.SDIO_CmdIndex = (uint8_t)cmd;
-		SDIOCmdStruct.SDIO_Argument = 0;
+		SDIOCmdStruct.SDIO_Argument = arg; // RCA of the card once it has one, 0 before that
 		SDIOCmdStruct.SDIO_Response = SDIO_Response_Short;
 		SDIOCmdStruct.SDIO_Wait = SDIO_Wait_No;
 		SDIOCmdStruct.SDIO_CPSM = SDIO_CPSM_Enable;
@@ -402,7 +542,229 @@ static enum SDIO_Error _sd_send_command(enum SDIO_Command cmd, uint32_t arg)
 	return errorstatus;
 }
 
-uint8_t SD_Initialize()
+// small register reads (SCR, status blocks) are read straight out of the FIFO instead of using DMA
+static enum SDIO_Error _sd_read_fifo(uint32_t *words, uint32_t num_words)
+{
+	uint32_t status;
+	uint32_t count = 0;
+
+	for (;;)
+	{
+		status = SDIO->STA;
+		if (status & (SDIO_FLAG_DCRCFAIL | SDIO_FLAG_DTIMEOUT | SDIO_FLAG_RXOVERR))
+			break;
+
+		if (status & SDIO_FLAG_RXDAVL)
+		{
+			uint32_t word = SDIO_ReadData();
+			if (count < num_words)
+				words[count++] = word;
+		}
+		else if (status & SDIO_FLAG_DBCKEND)
+		{
+			break;
+		}
+	}
+
+	SDIO_ClearFlag(SDIO_STATIC_FLAGS);
+
+	if (status & SDIO_FLAG_DTIMEOUT)
+		return SDIO_TIMEOUT;
+	else if (status & SDIO_FLAG_DCRCFAIL)
+		return SDIO_CRCFAIL;
+	else if (status & SDIO_FLAG_RXOVERR)
+		return SDIO_RXOVERRUN;
+	else if (count != num_words)
+		return SDIO_ERROR;
+
+	return SDIO_OK;
+}
+
+// set up the data path for a single block read of len bytes that is read back with _sd_read_fifo
+static enum SDIO_Error _sd_setup_polled_read(uint32_t len, uint32_t block_size)
+{
+	enum SDIO_Error errorstatus;
+
+	if ((errorstatus = _sd_send_command(SDIO_SET_BLOCKLEN, len)) != SDIO_OK)
+		return errorstatus;
+
+	SDIO->DCTRL = 0x0;
+	SDIO_DataInitTypeDef SDIODataStruct;
+	SDIODataStruct.SDIO_DataTimeOut = SDIO_DATA_TIMEOUT;
+	SDIODataStruct.SDIO_DataBlockSize = block_size;
+	SDIODataStruct.SDIO_DataLength = len;
+	SDIODataStruct.SDIO_TransferMode = SDIO_TransferMode_Block;
+	SDIODataStruct.SDIO_TransferDir = SDIO_TransferDir_ToSDIO;
+	SDIODataStruct.SDIO_DPSM = SDIO_DPSM_Enable;
+	SDIO_DataConfig(&SDIODataStruct);
+
+	return SDIO_OK;
+}
+
+static enum SDIO_Error _sd_read_scr()
+{
+	uint32_t words[2];
+	enum SDIO_Error errorstatus;
+
+	if ((errorstatus = _sd_setup_polled_read(8, SDIO_DataBlockSize_8b)) != SDIO_OK)
+		return errorstatus;
+
+	if ((errorstatus = _sd_send_command(SDIO_APP_CMD, ((uint32_t)_rca) << 16)) != SDIO_OK
+		|| (errorstatus = _sd_send_command(SDIO_APP_SEND_SCR, 0)) != SDIO_OK
+		|| (errorstatus = _sd_read_fifo(words, 2)) != SDIO_OK)
+	{
+		return errorstatus;
+	}
+
+	// the SCR is sent MSB first, _scr[1] holds bits 63:32 and _scr[0] bits 31:0
+	_scr[0] = __REV(words[1]);
+	_scr[1] = __REV(words[0]);
+
+	return SDIO_OK;
+}
+
+// switch the card and the controller to a 4-bit bus if both ends support it, otherwise stay at 1-bit
+static void _sd_negotiate_bus_width()
+{
+	_bus_width = 1;
+
+	if (!SDIO_BOARD_HAS_4B_BUS)
+		return;
+
+	if (_sd_read_scr() != SDIO_OK || !(_scr[1] & SDIO_SCR_BUS_WIDTH_4B))
+		return;
+
+	if (_sd_send_command(SDIO_APP_CMD, ((uint32_t)_rca) << 16) != SDIO_OK
+		|| _sd_send_command(SDIO_APP_SET_BUS_WIDTH, 0x2) != SDIO_OK)
+	{
+		return;
+	}
+
+	_sdio_init.SDIO_BusWide = SDIO_BusWide_4b;
+	SDIO_Init(&_sdio_init);
+	_bus_width = 4;
+}
+
+static enum SDIO_Error _sd_switch_func(uint32_t arg, uint8_t *status)
+{
+	uint32_t words[16];
+	enum SDIO_Error errorstatus;
+
+	if ((errorstatus = _sd_setup_polled_read(64, SDIO_DataBlockSize_64b)) != SDIO_OK
+		|| (errorstatus = _sd_send_command(SDIO_SWITCH_FUNC, arg)) != SDIO_OK
+		|| (errorstatus = _sd_read_fifo(words, 16)) != SDIO_OK)
+	{
+		return errorstatus;
+	}
+
+	// the switch status comes MSB first, status[0] holds bits 511:504
+	memcpy(status, words, 64);
+
+	return SDIO_OK;
+}
+
+// work out the capacity of the card from the CSD, _csd[0] holds bits 127:96 and _csd[3] bits 31:0
+static void _sd_parse_csd()
+{
+	uint32_t c_size;
+
+	if (SDIO_CSD_STRUCTURE(_csd) == 0)
+	{
+		// (C_SIZE + 1) * 2^(C_SIZE_MULT + 2) blocks of 2^READ_BL_LEN bytes
+		uint32_t read_bl_len = (_csd[1] >> 16) & 0x0F;
+		uint32_t c_size_mult = (_csd[2] >> 15) & 0x07;
+		c_size = ((_csd[1] & 0x03FF) << 2) | (_csd[2] >> 30);
+		_geometry.sectors = (c_size + 1) << (c_size_mult + 2 + read_bl_len - 9);
+	}
+	else
+	{
+		// (C_SIZE + 1) * 512 KB
+		c_size = ((_csd[1] & 0x3F) << 16) | (_csd[2] >> 16);
+		_geometry.sectors = (c_size + 1) << 10;
+	}
+}
+
+// read the 64 byte SD status with ACMD13 for the allocation unit size and the speed class
+static enum SDIO_Error _sd_read_sd_status()
+{
+	static const uint8_t speed_class[] = {0, 2, 4, 6, 10};
+	static const uint8_t large_au_mb[] = {8, 12, 16, 24, 32, 64};
+	uint32_t words[16];
+	uint8_t *status = (uint8_t *)words;
+	uint8_t au_size;
+	enum SDIO_Error errorstatus;
+
+	if ((errorstatus = _sd_setup_polled_read(64, SDIO_DataBlockSize_64b)) != SDIO_OK
+		|| (errorstatus = _sd_send_command(SDIO_APP_CMD, ((uint32_t)_rca) << 16)) != SDIO_OK
+		|| (errorstatus = _sd_send_command(SDIO_APP_SD_STATUS, 0)) != SDIO_OK
+		|| (errorstatus = _sd_read_fifo(words, 16)) != SDIO_OK)
+	{
+		return errorstatus;
+	}
+
+	// the status comes MSB first, status[0] holds bits 511:504. SPEED_CLASS is in bits 447:440, AU_SIZE in
+	// bits 431:428 and UHS_SPEED_GRADE in bits 399:396.
+	_geometry.speed_class = status[8] < sizeof(speed_class) ? speed_class[status[8]] : 0;
+	_geometry.uhs_speed_grade = status[14] >> 4;
+
+	// AU_SIZE 1 to 9 doubles from 16 KB to 4 MB, the sizes after that go 8, 12, 16, 24, 32 and 64 MB
+	au_size = status[10] >> 4;
+	if (au_size == 0)
+		_geometry.au_sectors = 0;
+	else if (au_size <= 9)
+		_geometry.au_sectors = 32 << (au_size - 1);
+	else
+		_geometry.au_sectors = (uint32_t)large_au_mb[au_size - 10] * 2048;
+
+	return SDIO_OK;
+}
+
+// run the SDIO clock without the divider, the card is clocked at the full SDIOCLK
+static void _sd_set_clock_bypass(FunctionalState state)
+{
+	_sdio_init.SDIO_ClockBypass = state == ENABLE ? SDIO_ClockBypass_Enable : SDIO_ClockBypass_Disable;
+	_sdio_init.SDIO_ClockDiv = SDIO_CLK_DIV_NORMAL;
+	SDIO_Init(&_sdio_init);
+}
+
+// move the card to high speed mode with CMD6 and clock it at 48 MHz, cards that cannot do it stay at 24 MHz
+static void _sd_switch_high_speed()
+{
+	uint8_t status[64];
+
+	// CMD6 is only there for cards from spec version 1.10 on
+	if (_scr[1] == 0 && _sd_read_scr() != SDIO_OK)
+		return;
+	if ((_scr[1] & SDIO_SCR_SD_SPEC) == 0)
+		return;
+
+	// check that function group 1 supports high speed (bit 401)
+	if (_sd_switch_func(SDIO_SWITCH_CHECK_HIGH_SPEED, status) != SDIO_OK || !(status[13] & 0x02))
+		return;
+
+	// the function that ended up selected for group 1 is in bits 379:376
+	if (_sd_switch_func(SDIO_SWITCH_SET_HIGH_SPEED, status) != SDIO_OK || (status[16] & 0x0F) != 0x1)
+		return;
+
+	// try a transfer at the new clock, and go back to the divided clock if it does not come through
+	_sd_set_clock_bypass(ENABLE);
+	if (_sd_read_scr() != SDIO_OK)
+		_sd_set_clock_bypass(DISABLE);
+}
+
+// Card bring-up is stepped by SD_InitializeStep so the caller can get on with other work while the card
+// powers up. Every step is a handful of commands, only the wait for ACMD41 to report the card ready spans
+// several steps, bounded by SDIO_OP_COND_TIMEOUT_MS.
+enum SDIO_InitState
+{
+	SDIO_INIT_POWER_UP, // set up the pins and the controller, reset the card and check its voltage range
+	SDIO_INIT_OP_COND, // ACMD41 until the card is out of its power-up sequence
+	SDIO_INIT_IDENTIFY // get the card into the transfer state and set up the bus
+};
+static enum SDIO_InitState _init_state = SDIO_INIT_POWER_UP;
+static TickType_t _init_start = 0;
+
+static uint8_t _sd_power_up()
 {
 	SDIO_DeInit();
 
@@ -423,13 +785,41 @@ uint8_t SD_Initialize()
 
 	GPIO_PinAFConfig(SDIO_CK_PORT, SDIO_CK_PINSOURCE, GPIO_AF_SDIO);
 	GPIO_PinAFConfig(SDIO_D0_PORT, SDIO_D0_PINSOURCE, GPIO_AF_SDIO);
+
+	if (SDIO_BOARD_HAS_4B_BUS)
+	{
+		GPIOStruct.GPIO_Pin = SDIO_D1_PIN;
+		GPIO_Init(SDIO_D1_PORT, &GPIOStruct);
+		GPIOStruct.GPIO_Pin = SDIO_D2_PIN;
+		GPIO_Init(SDIO_D2_PORT, &GPIOStruct);
+		GPIOStruct.GPIO_Pin = SDIO_D3_PIN;
+		GPIO_Init(SDIO_D3_PORT, &GPIOStruct);
+
+		GPIO_PinAFConfig(SDIO_D1_PORT, SDIO_D1_PINSOURCE, GPIO_AF_SDIO);
+		GPIO_PinAFConfig(SDIO_D2_PORT, SDIO_D2_PINSOURCE, GPIO_AF_SDIO);
+		GPIO_PinAFConfig(SDIO_D3_PORT, SDIO_D3_PINSOURCE, GPIO_AF_SDIO);
+	}
 	GPIO_PinAFConfig(SDIO_CMD_PORT, SDIO_CMD_PINSOURCE, GPIO_AF_SDIO);
 
 	RCC_APB2PeriphClockCmd(RCC_APB2Periph_SDIO, ENABLE);
-	SDIO_InitTypeDef SDIOStruct;
-	SDIO_StructInit(&SDIOStruct);
-	SDIOStruct.SDIO_ClockDiv = SDIO_CLK_DIV_INIT; // for initialization, clock should not exceed 400 kHz
-	SDIO_Init(&SDIOStruct);
+	SDIO_StructInit(&_sdio_init);
+	_sdio_init.SDIO_ClockDiv = SDIO_CLK_DIV_INIT; // for initialization, clock should not exceed 400 kHz
+	SDIO_Init(&_sdio_init);
+	_rca = 0;
+	_card_type = SDIO_STD_CAPACITY_V1_1;
+	_scr[0] = _scr[1] = 0;
+	memset(&_geometry, 0, sizeof(_geometry));
+
+	// the cycle counter times transfers for the statistics
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+
+	if (_transfer_done == NULL)
+	{
+		_transfer_done = xSemaphoreCreateBinary();
+		if (_transfer_done == NULL)
+			return 0;
+	}
 
 	SDIO_SetPowerState(SDIO_PowerState_ON);
 	SDIO_ClockCmd(ENABLE);
@@ -444,33 +834,33 @@ uint8_t SD_Initialize()
 		_sd_send_command(SDIO_APP_CMD, 0);
 	}
 
-	if (_sd_send_command(SDIO_APP_CMD, 0) != SDIO_OK)
-		return 0;
+	return _sd_send_command(SDIO_APP_CMD, 0) == SDIO_OK;
+}
 
-	uint8_t validvoltage = 0;
-	uint16_t count = 0;
-	while (!validvoltage && count < 40000)
-	{
-		if (_sd_send_command(SDIO_APP_CMD, 0) != SDIO_OK
-			|| _sd_send_command(SDIO_APP_OP_COND, 0) != SDIO_OK)
-		{
-			return 0;
-		}
+// one ACMD41, ready is set once the card reports that it has powered up, returns 0 if it does not answer
+static uint8_t _sd_op_cond(uint8_t *ready)
+{
+	*ready = 0;
 
-		uint32_t response = SDIO_GetResponse(SDIO_RESP1);
-		if (response & 0x80000000) // power-up status
-		{
-			validvoltage = 1;
-			if (response & 0x40000000) // card capacity status
-				_card_type = SDIO_HIGH_CAPACITY;
-		}
+	if (_sd_send_command(SDIO_APP_CMD, 0) != SDIO_OK
+		|| _sd_send_command(SDIO_APP_OP_COND, 0) != SDIO_OK)
+	{
+		return 0;
+	}
 
-		++count;
+	uint32_t response = SDIO_GetResponse(SDIO_RESP1);
+	if (response & 0x80000000) // power-up status
+	{
+		*ready = 1;
+		if (response & 0x40000000) // card capacity status
+			_card_type = SDIO_HIGH_CAPACITY;
 	}
 
-	if (!validvoltage)
-		return 0;
+	return 1;
+}
 
+static uint8_t _sd_identify()
+{
 	if (_sd_send_command(SDIO_SEND_ALL_CID, 0) != SDIO_OK)
 		return 0;
 	_cid[0] = SDIO_GetResponse(SDIO_RESP1);
@@ -487,20 +877,26 @@ uint8_t SD_Initialize()
 	_csd[1] = SDIO_GetResponse(SDIO_RESP2);
 	_csd[2] = SDIO_GetResponse(SDIO_RESP3);
 	_csd[3] = SDIO_GetResponse(SDIO_RESP4);
+	_sd_parse_csd();
 
 	// set clock to normal rate
-	SDIOStruct.SDIO_ClockDiv = SDIO_CLK_DIV_NORMAL;
-	SDIO_Init(&SDIOStruct);
+	_sdio_init.SDIO_ClockDiv = SDIO_CLK_DIV_NORMAL;
+	SDIO_Init(&_sdio_init);
 
 	if (_sd_send_command(SDIO_SEL_DESEL_CARD, ((uint32_t)_rca) << 16) != SDIO_OK)
 		return 0;
 
+	_sd_negotiate_bus_width();
+	_sd_switch_high_speed();
+
+	// cards that do not answer leave the allocation unit and speed class unknown
+	_sd_read_sd_status();
+
 	if (_sd_send_command(SDIO_SET_BLOCKLEN, 512) != SDIO_OK)
 		return 0;
 
-	// setup global DMA settings/interrupts
+	// setup global DMA settings/interrupts, the transfer complete interrupt is enabled with every transfer
 	RCC_AHB1PeriphClockCmd(RCC_AHB1Periph_DMA2, ENABLE);
-	DMA_ITConfig(SDIO_DMA_STREAM, DMA_IT_TC, ENABLE);
 
 	NVIC_InitTypeDef NVICStruct;
 	NVICStruct.NVIC_IRQChannel = DMA2_Stream3_IRQn;
@@ -514,6 +910,97 @@ uint8_t SD_Initialize()
 	return 1;
 }
 
+// take card bring-up one step further, a call after SD_INIT_DONE or SD_INIT_FAILED starts over
+SDInitStatus SD_InitializeStep()
+{
+	uint8_t ready;
+
+	switch (_init_state)
+	{
+	case SDIO_INIT_POWER_UP:
+		if (!_sd_power_up())
+			return SD_INIT_FAILED;
+
+		_init_start = xTaskGetTickCount();
+		_init_state = SDIO_INIT_OP_COND;
+		// most cards are ready on the first ACMD41 after a warm reset
+		// fall through
+	case SDIO_INIT_OP_COND:
+		if (!_sd_op_cond(&ready))
+			break;
+
+		if (!ready)
+		{
+			if ((xTaskGetTickCount() - _init_start) > pdMS_TO_TICKS(SDIO_OP_COND_TIMEOUT_MS))
+				break;
+			return SD_INIT_BUSY;
+		}
+
+		_init_state = SDIO_INIT_IDENTIFY;
+		return SD_INIT_BUSY;
+	case SDIO_INIT_IDENTIFY:
+		if (!_sd_identify())
+			break;
+
+		_init_state = SDIO_INIT_POWER_UP;
+		return SD_INIT_DONE;
+	}
+
+	_init_state = SDIO_INIT_POWER_UP;
+	return SD_INIT_FAILED;
+}
+
+uint8_t SD_Initialize()
+{
+	SDInitStatus status;
+
+	_init_state = SDIO_INIT_POWER_UP;
+	while ((status = SD_InitializeStep()) == SD_INIT_BUSY)
+		vTaskDelay(pdMS_TO_TICKS(SDIO_OP_COND_POLL_MS));
+
+	return status == SD_INIT_DONE;
+}
+
+uint8_t SD_GetBusWidth()
+{
+	return _bus_width;
+}
+
+uint32_t SD_GetBusClockHz()
+{
+	if (_sdio_init.SDIO_ClockBypass == SDIO_ClockBypass_Enable)
+		return SDIO_CLK_HZ;
+
+	return SDIO_CLK_HZ / (_sdio_init.SDIO_ClockDiv + 2);
+}
+
+void SD_GetGeometry(struct SD_Geometry *geometry)
+{
+	if (geometry != NULL)
+		*geometry = _geometry;
+}
+
+void SD_GetCID(uint32_t cid[4])
+{
+	memcpy(cid, _cid, sizeof(_cid));
+}
+
+uint32_t SD_GetNumSectorsWritten()
+{
+	return _stats.sectors_written;
+}
+
+void SD_GetStats(struct SD_Stats *stats)
+{
+	if (stats != NULL)
+		*stats = _stats;
+}
+
+void SD_ResetStats()
+{
+	memset(&_stats, 0, sizeof(_stats));
+}
+
 SDCardState SD_GetStatus()
 {
 	if (_rca == 0)
@@ -526,20 +1013,26 @@ SDCardState SD_GetStatus()
 	return (SDCardState)((response >> 9) & 0x0F);
 }
 
-uint8_t SD_ReadBlock(uint32_t addr, uint8_t *buf)
+// standard capacity cards are byte addressed, high capacity cards are block addressed
+static uint32_t _sd_block_addr(uint32_t block)
 {
-	SDIO->DCTRL = 0x0;
+	if (_card_type == SDIO_HIGH_CAPACITY)
+		return block;
 
-	// set up DMA for receiving
+	return block << 9;
+}
+
+static void _sd_setup_dma(uint32_t buf, uint32_t dir)
+{
 	DMA_Cmd(SDIO_DMA_STREAM, DISABLE);
 	DMA_DeInit(SDIO_DMA_STREAM);
 	DMA_InitTypeDef DMAStruct;
 	DMA_StructInit(&DMAStruct);
 	DMAStruct.DMA_Channel = DMA_Channel_4;
-	DMAStruct.DMA_PeripheralBaseAddr = (uint32_t)&SDIO->FIFO;
-	DMAStruct.DMA_Memory0BaseAddr = (uint32_t)buf;
-	DMAStruct.DMA_DIR = DMA_DIR_PeripheralToMemory;
-	DMAStruct.DMA_BufferSize = 512;
+	DMAStruct.DMA_PeripheralBaseAddr = (uint32_t)(uintptr_t)&SDIO->FIFO;
+	DMAStruct.DMA_Memory0BaseAddr = buf;
+	DMAStruct.DMA_DIR = dir;
+	DMAStruct.DMA_BufferSize = 512; // ignored, the SDIO peripheral is the flow controller
 	DMAStruct.DMA_MemoryInc = DMA_MemoryInc_Enable;
 	DMAStruct.DMA_PeripheralDataSize = DMA_PeripheralDataSize_Word;
 	DMAStruct.DMA_MemoryDataSize = DMA_MemoryDataSize_Word;
@@ -550,109 +1043,287 @@ uint8_t SD_ReadBlock(uint32_t addr, uint8_t *buf)
 	DMAStruct.DMA_MemoryBurst = DMA_MemoryBurst_INC4;
 	DMA_Init(SDIO_DMA_STREAM, &DMAStruct);
 	DMA_FlowControllerConfig(SDIO_DMA_STREAM, DMA_FlowCtrl_Peripheral);
+	// DMA_DeInit and DMA_Init clear the interrupt enables along with the rest of the stream configuration
+	DMA_ITConfig(SDIO_DMA_STREAM, DMA_IT_TC, ENABLE);
 	DMA_Cmd(SDIO_DMA_STREAM, ENABLE);
+}
 
-	// set up SDIO data config for receiving
+static void _sd_setup_data(uint32_t len, uint32_t dir)
+{
 	SDIO_DataInitTypeDef SDIODataStruct;
 	SDIODataStruct.SDIO_DataTimeOut = 0xFFFFFFFF;
 	SDIODataStruct.SDIO_DataBlockSize = SDIO_DataBlockSize_512b;
-	SDIODataStruct.SDIO_DataLength = 512;
+	SDIODataStruct.SDIO_DataLength = len;
 	SDIODataStruct.SDIO_TransferMode = SDIO_TransferMode_Block;
-	SDIODataStruct.SDIO_TransferDir = SDIO_TransferDir_ToSDIO;
+	SDIODataStruct.SDIO_TransferDir = dir;
 	SDIODataStruct.SDIO_DPSM = SDIO_DPSM_Enable;
 	SDIO_DataConfig(&SDIODataStruct);
+}
+
+static void _sd_start_transfer()
+{
+	// throw away a completion left over from a transfer that was given up on
+	xSemaphoreTake(_transfer_done, 0);
 
+	_transfer_error = SDIO_OK;
 	_dma_transfer_complete = 0;
 	_sdio_transfer_complete = 0;
+}
+
+// stop the data path and the DMA stream so neither touches the buffer after we return, and leave no
+// interrupt enabled or flag set for the next transfer to trip over
+static void _sd_abort_transfer()
+{
+	SDIO_ITConfig(SDIO_IT_DCRCFAIL | SDIO_IT_DTIMEOUT | SDIO_IT_DATAEND |
+		SDIO_IT_TXUNDERR | SDIO_IT_RXOVERR, DISABLE);
+	SDIO->DCTRL = 0x0;
+	SDIO_DMACmd(DISABLE);
+	DMA_Cmd(SDIO_DMA_STREAM, DISABLE);
+	DMA_ClearFlag(SDIO_DMA_STREAM, DMA_FLAG_FEIF3 | DMA_FLAG_DMEIF3 | DMA_FLAG_TEIF3 | DMA_FLAG_HTIF3 | DMA_FLAG_TCIF3);
+	SDIO_ClearFlag(SDIO_STATIC_FLAGS);
+}
+
+static void _sd_wait_transfer()
+{
+	// both the SDIO data path and the DMA stream need to be done before the buffer can be touched,
+	// the interrupt handlers give the semaphore once that is the case
+	while ((!_dma_transfer_complete || !_sdio_transfer_complete) && _transfer_error == SDIO_OK)
+	{
+		if (xSemaphoreTake(_transfer_done, pdMS_TO_TICKS(SDIO_TRANSFER_TIMEOUT_MS)) != pdTRUE)
+		{
+			_sd_abort_transfer();
+			_transfer_error = SDIO_TIMEOUT;
+		}
+	}
+}
+
+// the card holds D0 low while it is programming, so poll the pin instead of sending CMD13 in a loop
+static uint8_t _sd_wait_not_busy(uint32_t timeout_ms)
+{
+	uint32_t spin_start = DWT->CYCCNT;
+	TickType_t start = xTaskGetTickCount();
+
+	while (GPIO_ReadInputDataBit(SDIO_D0_PORT, SDIO_D0_PIN) == Bit_RESET)
+	{
+		// the SD task is the lowest priority task, spinning only takes the CPU from the idle task
+		if (_sd_cycles_to_us(DWT->CYCCNT - spin_start) < SDIO_BUSY_SPIN_US)
+		{
+			taskYIELD();
+			continue;
+		}
+
+		if ((xTaskGetTickCount() - start) > pdMS_TO_TICKS(timeout_ms))
+			return 0;
+
+		vTaskDelay(1);
+	}
+
+	return 1;
+}
+
+static uint8_t _sd_read_blocks(uint32_t addr, uint8_t *buf, uint32_t count)
+{
+	if (count == 0)
+		return 0;
+
+	SDIO->DCTRL = 0x0;
+
+	// set up DMA and SDIO data config for receiving, the whole run of blocks is one transfer
+	_sd_setup_dma((uint32_t)(uintptr_t)buf, DMA_DIR_PeripheralToMemory);
+	_sd_setup_data(count * 512, SDIO_TransferDir_ToSDIO);
+
+	_sd_start_transfer();
 	SDIO_ITConfig(SDIO_IT_DCRCFAIL | SDIO_IT_DTIMEOUT | SDIO_IT_DATAEND | SDIO_IT_RXOVERR, ENABLE);
 	DMA_ClearFlag(SDIO_DMA_STREAM, DMA_FLAG_FEIF3 | DMA_FLAG_DMEIF3 | DMA_FLAG_TEIF3 | DMA_FLAG_HTIF3 | DMA_FLAG_TCIF3);
 	SDIO_DMACmd(ENABLE);
 
-	if (_sd_send_command(SDIO_SET_BLOCKLEN, 512) != SDIO_OK)
+	if (_sd_send_command(count > 1 ? SDIO_READ_MULT_BLOCK : SDIO_READ_SINGLE_BLOCK, _sd_block_addr(addr)) != SDIO_OK)
+	{
+		_sd_abort_transfer();
 		return 0;
+	}
 
-	if (_sd_send_command(SDIO_READ_SINGLE_BLOCK, addr << 9) != SDIO_OK)
-		return 0;
+	_sd_wait_transfer();
 
-	while (!_dma_transfer_complete && !_sdio_transfer_complete && _transfer_error == SDIO_OK)
+	// an open-ended multiple block read has to be terminated by the host
+	if (count > 1 && _sd_send_command(SDIO_STOP_TRANSMISSION, 0) != SDIO_OK)
 	{
-		vTaskDelay(pdMS_TO_TICKS(1));
+		_sd_abort_transfer();
+		return 0;
 	}
 
-	SDCardState state;
-	do
+	// the card is back in the transfer state as soon as the data is out, data errors are caught by the SDIO
+	if (_transfer_error != SDIO_OK)
 	{
-		state = SD_GetStatus();
-	} while (state != SD_CARD_TRANSFER && state != SD_CARD_ERROR);
-
-	if (_transfer_error != SDIO_OK || state == SD_CARD_ERROR)
+		_sd_abort_transfer();
 		return 0;
+	}
 
 	return 1;
 }
 
-uint8_t SD_WriteBlock(uint32_t addr, const uint8_t *buf)
+static uint8_t _sd_write_blocks(uint32_t addr, const uint8_t *buf, uint32_t count)
 {
+	if (count == 0)
+		return 0;
+
 	SDIO->DCTRL = 0x0;
 
 	// set up DMA for transmitting
-	DMA_Cmd(SDIO_DMA_STREAM, DISABLE);
-	DMA_DeInit(SDIO_DMA_STREAM);
-	DMA_InitTypeDef DMAStruct;
-	DMA_StructInit(&DMAStruct);
-	DMAStruct.DMA_Channel = DMA_Channel_4;
-	DMAStruct.DMA_PeripheralBaseAddr = (uint32_t)&SDIO->FIFO;
-	DMAStruct.DMA_Memory0BaseAddr = (uint32_t)buf;
-	DMAStruct.DMA_DIR = DMA_DIR_MemoryToPeripheral;
-	DMAStruct.DMA_BufferSize = 512;
-	DMAStruct.DMA_MemoryInc = DMA_MemoryInc_Enable;
-	DMAStruct.DMA_PeripheralDataSize = DMA_PeripheralDataSize_Word;
-	DMAStruct.DMA_MemoryDataSize = DMA_MemoryDataSize_Word;
-	DMAStruct.DMA_Priority = DMA_Priority_VeryHigh;
-	DMAStruct.DMA_FIFOMode = DMA_FIFOMode_Enable;
-	DMAStruct.DMA_FIFOThreshold = DMA_FIFOThreshold_Full;
-	DMAStruct.DMA_PeripheralBurst = DMA_PeripheralBurst_INC4;
-	DMAStruct.DMA_MemoryBurst = DMA_MemoryBurst_INC4;
-	DMA_Init(SDIO_DMA_STREAM, &DMAStruct);
-	DMA_FlowControllerConfig(SDIO_DMA_STREAM, DMA_FlowCtrl_Peripheral);
-	DMA_Cmd(SDIO_DMA_STREAM, ENABLE);
+	_sd_setup_dma((uint32_t)(uintptr_t)buf, DMA_DIR_MemoryToPeripheral);
 
-	_dma_transfer_complete = 0;
-	_sdio_transfer_complete = 0;
+	_sd_start_transfer();
 	SDIO_ITConfig(SDIO_IT_DCRCFAIL | SDIO_IT_DTIMEOUT | SDIO_IT_DATAEND | SDIO_IT_TXUNDERR, ENABLE);
 	DMA_ClearFlag(SDIO_DMA_STREAM, DMA_FLAG_FEIF3 | DMA_FLAG_DMEIF3 | DMA_FLAG_TEIF3 | DMA_FLAG_HTIF3 | DMA_FLAG_TCIF3);
 	SDIO_DMACmd(ENABLE);
 
-	if (_sd_send_command(SDIO_SET_BLOCKLEN, 512) != SDIO_OK)
-		return 0;
+	// tell the card how many blocks are coming so it can erase them ahead of the data, only a hint,
+	// the write goes ahead without it
+	if (count > 1 && _sd_send_command(SDIO_APP_CMD, ((uint32_t)_rca) << 16) == SDIO_OK)
+		_sd_send_command(SDIO_APP_SET_WR_BLK_ERASE_COUNT, count & 0x007FFFFF);
 
-	if (_sd_send_command(SDIO_WRITE_SINGLE_BLOCK, addr << 9) != SDIO_OK)
+	if (_sd_send_command(count > 1 ? SDIO_WRITE_MULT_BLOCK : SDIO_WRITE_SINGLE_BLOCK, _sd_block_addr(addr)) != SDIO_OK)
+	{
+		_sd_abort_transfer();
 		return 0;
+	}
 
 	// set up SDIO data config for transmitting
-	SDIO_DataInitTypeDef SDIODataStruct;
-	SDIODataStruct.SDIO_DataTimeOut = 0xFFFFFFFF;
-	SDIODataStruct.SDIO_DataBlockSize = SDIO_DataBlockSize_512b;
-	SDIODataStruct.SDIO_DataLength = 512;
-	SDIODataStruct.SDIO_TransferMode = SDIO_TransferMode_Block;
-	SDIODataStruct.SDIO_TransferDir = SDIO_TransferDir_ToCard;
-	SDIODataStruct.SDIO_DPSM = SDIO_DPSM_Enable;
-	SDIO_DataConfig(&SDIODataStruct);
+	_sd_setup_data(count * 512, SDIO_TransferDir_ToCard);
 
-	while (!_dma_transfer_complete && !_sdio_transfer_complete && _transfer_error == SDIO_OK )
+	_sd_wait_transfer();
+
+	// an open-ended multiple block write has to be terminated by the host
+	if (count > 1 && _sd_send_command(SDIO_STOP_TRANSMISSION, 0) != SDIO_OK)
 	{
-		vTaskDelay(pdMS_TO_TICKS(1));
+		_sd_abort_transfer();
+		return 0;
 	}
 
-	SDCardState state;
-	do
+	if (_transfer_error != SDIO_OK)
 	{
-		state = SD_GetStatus();
-	} while (state != SD_CARD_TRANSFER && state != SD_CARD_ERROR);
+		_sd_abort_transfer();
+		return 0;
+	}
 
-	if (_transfer_error != SDIO_OK || state == SD_CARD_ERROR)
+	uint32_t busy_start = DWT->CYCCNT;
+	uint8_t not_busy = _sd_wait_not_busy(SDIO_BUSY_TIMEOUT_MS);
+	_stats.busy_us += _sd_cycles_to_us(DWT->CYCCNT - busy_start);
+	if (!not_busy)
 		return 0;
 
+	// one status check once programming is done to catch write errors reported by the card
+	if (SD_GetStatus() != SD_CARD_TRANSFER)
+		return 0;
+
+	_stats.sectors_written += count;
 
 	return 1;
 }
+
+static uint8_t _sd_erase(uint32_t start, uint32_t end)
+{
+	if (_sd_send_command(SDIO_ERASE_WR_BLK_START, _sd_block_addr(start)) != SDIO_OK
+		|| _sd_send_command(SDIO_ERASE_WR_BLK_END, _sd_block_addr(end)) != SDIO_OK
+		|| _sd_send_command(SDIO_ERASE, 0) != SDIO_OK)
+	{
+		return 0;
+	}
+
+	uint32_t busy_start = DWT->CYCCNT;
+	uint8_t not_busy = _sd_wait_not_busy(SDIO_ERASE_TIMEOUT_MS);
+	_stats.busy_us += _sd_cycles_to_us(DWT->CYCCNT - busy_start);
+	if (!not_busy)
+		return 0;
+
+	return SD_GetStatus() == SD_CARD_TRANSFER;
+}
+
+// a CRC error at the undivided clock drops the bus back to the divided clock, and the transfer is tried once more
+static uint8_t _sd_crc_fallback()
+{
+	if (_transfer_error != SDIO_CRCFAIL || _sdio_init.SDIO_ClockBypass != SDIO_ClockBypass_Enable)
+		return 0;
+
+	_sd_set_clock_bypass(DISABLE);
+	return 1;
+}
+
+uint8_t SD_ReadBlocks(uint32_t addr, uint8_t *buf, uint32_t count)
+{
+	uint32_t start = DWT->CYCCNT;
+
+	uint8_t ret = _sd_read_blocks(addr, buf, count)
+		|| (_sd_crc_fallback() && _sd_read_blocks(addr, buf, count));
+
+	_stats.read_us += _sd_cycles_to_us(DWT->CYCCNT - start);
+	if (ret)
+		_stats.sectors_read += count;
+	else
+		++_stats.errors;
+
+	return ret;
+}
+
+uint8_t SD_WriteBlocks(uint32_t addr, const uint8_t *buf, uint32_t count)
+{
+	uint32_t start = DWT->CYCCNT;
+
+	uint8_t ret = _sd_write_blocks(addr, buf, count)
+		|| (_sd_crc_fallback() && _sd_write_blocks(addr, buf, count));
+
+	_stats.write_us += _sd_cycles_to_us(DWT->CYCCNT - start);
+	if (!ret)
+		++_stats.errors;
+
+	return ret;
+}
+
+// Erase blocks start to end, inclusive. The card maps the blocks out and can hand them to later writes
+// without erasing them first. Standard capacity cards that can only erase whole sectors are left alone,
+// as erasing a sector would take the blocks around the range with it.
+uint8_t SD_Erase(uint32_t start, uint32_t end)
+{
+	uint32_t time_start = DWT->CYCCNT;
+	uint32_t chunk_end;
+	uint8_t ret;
+
+	if (end < start)
+		return 0;
+
+	if (_card_type != SDIO_HIGH_CAPACITY && !(_csd[2] & SDIO_CSD_ERASE_BLK_EN))
+		return 1;
+
+	// big ranges are erased a chunk at a time so each CMD38 finishes within its timeout, the chunks end on chunk
+	// boundaries so whole AUs are erased by one command and the card can take them as clean
+	for (;;)
+	{
+		chunk_end = (start / SDIO_ERASE_CHUNK + 1) * SDIO_ERASE_CHUNK - 1;
+		if (chunk_end > end)
+			chunk_end = end;
+		ret = _sd_erase(start, chunk_end);
+		if (!ret)
+			break;
+
+		_stats.sectors_erased += chunk_end - start + 1;
+		if (chunk_end == end)
+			break;
+		start = chunk_end + 1;
+	}
+
+	_stats.erase_us += _sd_cycles_to_us(DWT->CYCCNT - time_start);
+	if (!ret)
+		++_stats.errors;
+
+	return ret;
+}
+
+uint8_t SD_ReadBlock(uint32_t addr, uint8_t *buf)
+{
+	return SD_ReadBlocks(addr, buf, 1);
+}
+
+uint8_t SD_WriteBlock(uint32_t addr, const uint8_t *buf)
+{
+	return SD_WriteBlocks(addr, buf, 1);
+}
@@ -0,0 +1,435 @@
+/* boottest.c
+ * Host test of how SDTask brings up the card and keeps the log going when the card comes late or goes away,
+ * runs the driver on the SDIO simulation with the card handling of main.c
+ *
+ * Build: make build/boottest
+ * Usage: boottest [image file]
+ *
+ * The SD task below steps the card bring-up and handles failing log operations like SDTask does, while an IMU
+ * task submits numbered records at 200 Hz from boot on. The date comes 2 s after boot. Each case runs in a
+ * child process on a freshly formatted card without the measurement directory: the card in the slot at boot,
+ * the card inserted 7 s after boot, and the card pulled for 3 s while logging. Prints when the card was
+ * mounted and the log opened, then decodes the log and checks that the records in it are numbered without
+ * gaps within a session, that a card in the slot at boot gets every record from the first one on, that a card
+ * pulled while logging is brought up again and the session goes on in a new one appended to the log, and
+ * that the failed writes that had it dropped are in that one as an event. Exits with 1 if a check fails. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "stm32f4xx.h"
+#include "FreeRTOS.h"
+#include "task.h"
+#include "host.h"
+#include "card.h"
+#include "sdio.h"
+#include "fat.h"
+#include "ff.h"
+#include "diskio.h"
+#include "sd.h"
+#include "log.h"
+#include "volume.h"
+
+// the intervals of main.c
+#define LOG_PROCESS_INTERVAL_MS 100
+#define LOG_SYNC_INTERVAL_MS 30000
+#define LOG_SYNC_RECORDS 6500
+#define CARD_POLL_INTERVAL_MS 5
+#define CARD_RETRY_MIN_MS 50
+#define CARD_RETRY_MAX_MS 2000
+#define CARD_MAX_FAILURES 3
+#define AMG_SAMPLE_PERIOD_MS 5
+
+#define TEST_SECTORS 262144 // 128 MB
+#define TEST_CLUSTER_SECTORS 8
+#define TEST_DATE_MS 2000
+#define TEST_START_TIME 1500000000
+#define TEST_LOG_NAME "120000.dat"
+#define TEST_MAX_RECORDS 20000
+
+struct Case
+{
+	const char *name;
+	uint32_t seconds;
+	uint32_t insert_ms; // the card goes into the slot, 0 if it is there at boot
+	uint32_t pull_ms; // the card is pulled, 0 for never
+	uint32_t return_ms; // and put back
+};
+
+static const struct Case _cases[] =
+{
+	{"card in the slot at boot", 10, 0, 0, 0},
+	{"card inserted 7 s after boot", 15, 7000, 0, 0},
+	{"card pulled at 6 s for 3 s", 15, 0, 6000, 9000}
+};
+
+enum CardState
+{
+	CARD_INIT,
+	CARD_MOUNT,
+	CARD_READY
+};
+
+static const struct Case *_case;
+static volatile uint8_t _stop = 0;
+static uint32_t _submitted = 0;
+static uint32_t _mounted_ms[2];
+static uint32_t _num_mounts = 0;
+static uint32_t _opened_ms = 0;
+static uint32_t _dropped_ms = 0;
+static struct LogFmt_Record _records[TEST_MAX_RECORDS];
+
+static void _set_present(void *arg)
+{
+	Card_GetParams()->present = (uint32_t)(uintptr_t)arg;
+}
+
+// the IMU numbers its records, the first field counts them from boot
+static void _amg_task(void *arg)
+{
+	int32_t imu[LOGFMT_IMU_NUM_FIELDS] = {0};
+	TickType_t last_sample = xTaskGetTickCount();
+
+	(void)arg;
+	while (!_stop)
+	{
+		imu[LOGFMT_IMU_ACC_X] = (int32_t)_submitted++;
+		Log_Submit(LOGFMT_CHANNEL_IMU, imu, LOGFMT_IMU_NUM_FIELDS);
+		vTaskDelayUntil(&last_sample, pdMS_TO_TICKS(AMG_SAMPLE_PERIOD_MS));
+	}
+}
+
+// LogCardError
+static void _log_card_error(uint8_t operation, uint32_t failures)
+{
+	int32_t event[LOGFMT_EVENT_NUM_FIELDS] = {LOGFMT_EVENT_CARD_ERROR, operation, (int32_t)failures};
+
+	Log_Submit(LOGFMT_CHANNEL_EVENT, event, LOGFMT_EVENT_NUM_FIELDS);
+}
+
+// BringUpCard
+static uint32_t _bring_up_card(enum CardState *state, FATFS *fs, uint32_t *retry_ms)
+{
+	uint32_t wait;
+
+	switch (*state)
+	{
+	case CARD_INIT:
+		switch (SD_InitializeStep())
+		{
+		case SD_INIT_BUSY:
+			return CARD_POLL_INTERVAL_MS;
+		case SD_INIT_DONE:
+			*state = CARD_MOUNT;
+			return 0;
+		default:
+			break;
+		}
+		break;
+	case CARD_MOUNT:
+		if (f_mount(fs, "", 1) != FR_OK)
+		{
+			f_mount(NULL, "", 0);
+			*state = CARD_INIT;
+			break;
+		}
+
+		if (f_chdir("/Meas") != FR_OK && (f_mkdir("/Meas") != FR_OK || f_chdir("/Meas") != FR_OK))
+		{
+			f_mount(NULL, "", 0);
+			*state = CARD_INIT;
+			break;
+		}
+
+		if (!Log_Recover())
+			_log_card_error(LOGFMT_CARD_OP_RECOVER, 1);
+
+		*state = CARD_READY;
+		*retry_ms = CARD_RETRY_MIN_MS;
+		return 0;
+	case CARD_READY:
+		return 0;
+	}
+
+	wait = *retry_ms;
+	*retry_ms = *retry_ms * 2 > CARD_RETRY_MAX_MS ? CARD_RETRY_MAX_MS : *retry_ms * 2;
+	return wait;
+}
+
+// CardFailed
+static uint8_t _card_failed(uint8_t operation, uint32_t *failures)
+{
+	if (++*failures >= CARD_MAX_FAILURES)
+		return 1;
+
+	_log_card_error(operation, *failures);
+	return 0;
+}
+
+// DropCard
+static void _drop_card(enum CardState *state, uint8_t operation, uint32_t *failures)
+{
+	_dropped_ms = xTaskGetTickCount();
+	Log_Close();
+	Log_Start();
+	_log_card_error(operation, *failures);
+	f_mount(NULL, "", 0);
+	*state = CARD_INIT;
+	*failures = 0;
+}
+
+// SDTask, without the low voltage warning, the LED and the buffer peaks
+static void _sd_task(void *arg)
+{
+	FATFS fs;
+	struct Log_Stats stats;
+	uint32_t records_at_sync = 0;
+	enum CardState card = CARD_INIT;
+	uint32_t card_retry_ms = CARD_RETRY_MIN_MS;
+	uint32_t card_failures = 0;
+	TickType_t now, wake, next_process, next_card_step, last_sync, date, end;
+
+	(void)arg;
+	next_process = next_card_step = last_sync = xTaskGetTickCount();
+	date = next_process + pdMS_TO_TICKS(TEST_DATE_MS);
+	end = next_process + pdMS_TO_TICKS(_case->seconds * 1000);
+
+	for (;;)
+	{
+		now = xTaskGetTickCount();
+		wake = next_process;
+		if (card != CARD_READY && (int32_t)(next_card_step - wake) < 0)
+			wake = next_card_step;
+		if ((int32_t)(wake - now) > 0)
+			ulTaskNotifyTake(pdTRUE, wake - now);
+
+		now = xTaskGetTickCount();
+		if ((int32_t)(now - end) >= 0)
+			break;
+
+		if (card != CARD_READY && (int32_t)(next_card_step - now) <= 0)
+		{
+			next_card_step = now + pdMS_TO_TICKS(_bring_up_card(&card, &fs, &card_retry_ms));
+			if (card == CARD_READY && _num_mounts < 2)
+				_mounted_ms[_num_mounts++] = xTaskGetTickCount();
+		}
+
+		now = xTaskGetTickCount();
+		if ((int32_t)(next_process - now) > 0)
+			continue;
+		next_process += pdMS_TO_TICKS(LOG_PROCESS_INTERVAL_MS);
+
+		if (!Log_IsOpen() && card == CARD_READY && (int32_t)(now - date) >= 0)
+		{
+			if (Log_Open(TEST_LOG_NAME, TEST_START_TIME))
+			{
+				records_at_sync = 0;
+				last_sync = now;
+				card_failures = 0;
+				if (_opened_ms == 0)
+					_opened_ms = now;
+			}
+			else if (_card_failed(LOGFMT_CARD_OP_OPEN, &card_failures))
+			{
+				_drop_card(&card, LOGFMT_CARD_OP_OPEN, &card_failures);
+				next_card_step = now;
+			}
+		}
+
+		Log_GetStats(&stats);
+		if (Log_IsOpen() && (stats.records - records_at_sync >= LOG_SYNC_RECORDS
+			|| (now - last_sync) >= pdMS_TO_TICKS(LOG_SYNC_INTERVAL_MS)))
+		{
+			if (Log_Sync())
+				card_failures = 0;
+			else if (_card_failed(LOGFMT_CARD_OP_SYNC, &card_failures))
+			{
+				_drop_card(&card, LOGFMT_CARD_OP_SYNC, &card_failures);
+				next_card_step = now;
+			}
+
+			Log_GetStats(&stats);
+			records_at_sync = stats.records;
+			last_sync = now;
+		}
+		else if (Log_Process())
+		{
+			// there may have been nothing to write, only a block that reached the card shows it is good
+			uint32_t sectors_written = stats.sectors_written;
+			Log_GetStats(&stats);
+			if (Log_IsOpen() && stats.sectors_written != sectors_written)
+				card_failures = 0;
+		}
+		else if (_card_failed(LOGFMT_CARD_OP_WRITE, &card_failures))
+		{
+			_drop_card(&card, LOGFMT_CARD_OP_WRITE, &card_failures);
+			next_card_step = now;
+		}
+	}
+
+	_stop = 1;
+	Log_Close();
+	Host_Stop();
+}
+
+// decode a session of the log, returns the number of its records, the first of them at first
+static uint32_t _session(FSIZE_t base, uint32_t first, uint32_t *num_blocks)
+{
+	struct LogFmt_Header header;
+	uint32_t num_records;
+
+	if (!Volume_ReadLog(TEST_LOG_NAME, base, &header, &_records[first], TEST_MAX_RECORDS - first, &num_records, num_blocks)
+		|| first + num_records > TEST_MAX_RECORDS)
+		return 0;
+
+	return num_records;
+}
+
+// the IMU records from first to end are numbered one after the other, returns the number of the last one
+static uint8_t _numbered(uint32_t first, uint32_t end, int32_t *from, int32_t *to)
+{
+	uint32_t i;
+	int32_t n = -1;
+
+	for (i = first; i < end; ++i)
+	{
+		if (_records[i].channel != LOGFMT_CHANNEL_IMU)
+			continue;
+		if (n >= 0 && _records[i].value[LOGFMT_IMU_ACC_X] != n + 1)
+			return 0;
+		if (n < 0)
+			*from = _records[i].value[LOGFMT_IMU_ACC_X];
+		n = _records[i].value[LOGFMT_IMU_ACC_X];
+	}
+
+	*to = n;
+	return n >= 0;
+}
+
+// the card error event of an operation that failed so many times in a row is among the records
+static uint8_t _card_error(uint32_t first, uint32_t end, uint8_t operation, uint32_t failures)
+{
+	uint32_t i;
+
+	for (i = first; i < end; ++i)
+	{
+		if (_records[i].channel == LOGFMT_CHANNEL_EVENT && _records[i].value[LOGFMT_EVENT_CODE] == LOGFMT_EVENT_CARD_ERROR
+			&& _records[i].value[LOGFMT_EVENT_ARG] == operation && _records[i].value[LOGFMT_EVENT_VALUE] == (int32_t)failures)
+			return 1;
+	}
+
+	return 0;
+}
+
+static void _run(const char *image)
+{
+	struct Card_Params params;
+	struct Log_Stats stats;
+	FILINFO info;
+	uint32_t first_blocks, second_blocks, first_records, second_records;
+	int32_t from = 0, to = 0, second_from = 0, second_to = 0;
+	char what[80];
+	uint8_t ok;
+
+	Card_Defaults(&params);
+	params.sectors = TEST_SECTORS;
+	params.present = _case->insert_ms == 0;
+
+	unlink(image);
+	if (!Card_Open(image, &params) || !Fat_Format(TEST_CLUSTER_SECTORS))
+	{
+		printf("card bring-up failed\n");
+		fflush(stdout);
+		_exit(1);
+	}
+	Sdio_Attach();
+
+	if (_case->insert_ms > 0)
+		Host_At((uint64_t)_case->insert_ms * 1000, _set_present, (void *)1);
+	if (_case->pull_ms > 0)
+	{
+		Host_At((uint64_t)_case->pull_ms * 1000, _set_present, (void *)0);
+		Host_At((uint64_t)_case->return_ms * 1000, _set_present, (void *)1);
+	}
+
+	// main
+	ff_init_syncobj();
+	disk_init_lock();
+	Log_Init();
+	Log_Start();
+	xTaskCreate(_amg_task, "AMGTask", 256, NULL, 4, NULL);
+	xTaskCreate(_sd_task, "SDTask", 4096, NULL, 1, NULL);
+	vTaskStartScheduler();
+	Log_GetStats(&stats);
+
+	printf("%s\n", _case->name);
+	printf("  mounted at %u ms, log opened at %u ms, %u records submitted, %u blocks dropped from the backlog\n",
+		_mounted_ms[0], _opened_ms, _submitted, stats.dropped_blocks);
+
+	ok = Volume_Mount() && f_stat(TEST_LOG_NAME, &info) == FR_OK;
+	first_records = ok ? _session(0, 0, &first_blocks) : 0;
+	ok = ok && _numbered(0, first_records, &from, &to);
+
+	if (_case->pull_ms == 0)
+	{
+		snprintf(what, sizeof(what), "%s: one session numbered without gaps", _case->name);
+		Host_Check(ok && info.fsize == (FSIZE_t)(1 + first_blocks) * LOGFMT_BLOCK_SIZE, what);
+		printf("  records %d to %d in the log\n", from, to);
+	}
+
+	if (_case->insert_ms == 0 && _case->pull_ms == 0)
+	{
+		Host_Check(ok && from == 0 && stats.dropped_blocks == 0 && (uint32_t)to + 1 >= _submitted - 2 * LOG_PROCESS_INTERVAL_MS / AMG_SAMPLE_PERIOD_MS,
+			"card in the slot at boot: every record from the first one on");
+	}
+	else if (_case->insert_ms > 0)
+	{
+		Host_Check(ok && _mounted_ms[0] >= _case->insert_ms && _mounted_ms[0] <= _case->insert_ms + CARD_RETRY_MAX_MS + 1000
+			&& stats.dropped_blocks > 0, "card inserted late: mounted within the longest retry, backlog kept the latest blocks");
+	}
+	else
+	{
+		second_records = _session((FSIZE_t)(1 + first_blocks) * LOGFMT_BLOCK_SIZE, first_records, &second_blocks);
+		ok = ok && second_records > 0 && _numbered(first_records, first_records + second_records, &second_from, &second_to);
+		printf("  dropped at %u ms, mounted again at %u ms, records %d to %d and %d to %d in two sessions\n", _dropped_ms,
+			_mounted_ms[1], from, to, second_from, second_to);
+
+		Host_Check(ok && from == 0 && info.fsize == (FSIZE_t)(2 + first_blocks + second_blocks) * LOGFMT_BLOCK_SIZE,
+			"card pulled: log recovered, next session appended to it");
+		Host_Check(ok && _num_mounts == 2 && _dropped_ms > _case->pull_ms && _mounted_ms[1] >= _case->return_ms
+			&& _mounted_ms[1] <= _case->return_ms + CARD_RETRY_MAX_MS + 1000, "card pulled: dropped, brought up again once it is back");
+		Host_Check(ok && second_from > to && (uint32_t)second_to + 1 >= _submitted - 2 * LOG_PROCESS_INTERVAL_MS / AMG_SAMPLE_PERIOD_MS,
+			"card pulled: second session runs to the end");
+		Host_Check(_card_error(first_records, first_records + second_records, LOGFMT_CARD_OP_WRITE, CARD_MAX_FAILURES),
+			"card pulled: the writes that dropped it logged in the next session");
+	}
+
+	Card_Close();
+	fflush(stdout);
+	_exit(Host_Failed() ? 1 : 0);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *image = argc > 1 ? argv[1] : "boottest.img";
+	uint32_t i;
+	int status;
+	pid_t pid;
+
+	// every case in its own process, the scheduler and the driver start from scratch
+	for (i = 0; i < sizeof(_cases) / sizeof(_cases[0]); ++i)
+	{
+		fflush(stdout);
+		_case = &_cases[i];
+		pid = fork();
+		if (pid == 0)
+			_run(image);
+		if (pid < 0 || waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			Host_Check(0, _case->name);
+	}
+
+	return Host_Summary();
+}
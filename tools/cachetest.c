@@ -0,0 +1,171 @@
+/* cachetest.c
+ * Host test of the sector cache of the disk layer, runs FatFS and the logger on a simulated card and looks
+ * at what reached the card image
+ *
+ * Build: make build/cachetest
+ * Usage: cachetest [image file [image file of the card swapped in]]
+ *
+ * Checks that the blocks of a log extent are on the card as soon as Log_Process has written them, without
+ * going through the cache, that mounting the volume again writes out dirty sectors instead of dropping
+ * them, and that it drops them when another card was put in the slot. Exits with 1 if a check fails. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "stm32f4xx.h"
+#include "FreeRTOS.h"
+#include "host.h"
+#include "card.h"
+#include "ff.h"
+#include "diskio.h"
+#include "sd.h"
+#include "log.h"
+#include "volume.h"
+
+#define TEST_SECTORS 262144 // 128 MB
+#define TEST_CLUSTER_SECTORS 8
+#define TEST_START_TIME 1500000000
+#define TEST_FILE_SIZE (300 * 1024) // spans three FAT sectors
+#define TEST_DATA_SECTORS 2048 // start of the data area compared on the card swapped in, holds the files of the test
+
+
+static void _extent_blocks()
+{
+	static uint8_t block[LOGFMT_BLOCK_SIZE];
+	struct LogFmt_Header header;
+	struct LogFmt_BlockHeader block_header;
+	struct LogFmt_Record record = {LOGFMT_CHANNEL_IMU, 0, LOGFMT_IMU_NUM_FIELDS, {0}};
+	DISK_CACHE_STATS before, after;
+	DWORD lba;
+	FIL file;
+	uint32_t i, seq;
+	uint8_t ok;
+
+	ok = Log_Open("EXTENT.dat", TEST_START_TIME) && f_open(&file, "EXTENT.dat", FA_READ) == FR_OK;
+	lba = file.obj.fs->database + (file.obj.sclust - 2) * file.obj.fs->csize;
+	f_close(&file);
+
+	// the file header goes out with Log_Open
+	Host_Check(ok && Card_Load(lba, block, 1) && LogFmt_DecodeHeader(&header, block) != 0, "file header is on the card after Log_Open");
+
+	disk_ioctl(0, DISK_GET_CACHE_STATS, &before);
+	for (i = 0; ok && i < 2000; ++i)
+	{
+		record.time_ms = i * 5;
+		record.value[0] = (int32_t)(i * 7919 % 100000);
+		ok = Log_Append(&record) && Log_Process();
+	}
+	disk_ioctl(0, DISK_GET_CACHE_STATS, &after);
+
+	// every block up to the one being filled is on the card, the cache saw none of them
+	for (seq = 0; ok && Card_Load(lba + 1 + seq, block, 1) && LogFmt_CheckBlock(block, header.session, &block_header)
+		&& block_header.seq == seq; ++seq)
+	{
+	}
+	Host_Check(ok && seq >= 12 && after.hits + after.misses == before.hits + before.misses,
+		"log blocks are on the card once written, around the cache");
+	printf("  %u blocks on the card without a sync\n", seq);
+
+	Host_Check(Log_Close(), "log closed");
+}
+
+static void _remount()
+{
+	static uint8_t data[TEST_FILE_SIZE];
+	DISK_CACHE_STATS before, after;
+	struct SD_Stats stats;
+	FIL file;
+	UINT num;
+	uint8_t ok;
+
+	// the FAT sectors filled up by a long write are left dirty in the cache until the next sync
+	ok = f_open(&file, "REMOUNT.dat", FA_WRITE|FA_CREATE_ALWAYS) == FR_OK && f_write(&file, data, sizeof(data), &num) == FR_OK
+		&& num == sizeof(data);
+
+	// SDTask mounts again after it lost the card
+	disk_ioctl(0, DISK_GET_CACHE_STATS, &before);
+	SD_ResetStats();
+	ok = Volume_Mount() && ok;
+	disk_ioctl(0, DISK_GET_CACHE_STATS, &after);
+	SD_GetStats(&stats);
+
+	Host_Check(ok && after.writebacks > before.writebacks && stats.sectors_written >= after.writebacks - before.writebacks,
+		"mounting the volume again writes out dirty sectors");
+	printf("  %u dirty sectors written when mounting again\n", after.writebacks - before.writebacks);
+}
+
+static void _swap(const char *image, const struct Card_Params *params)
+{
+	static uint8_t data[TEST_FILE_SIZE];
+	DISK_CACHE_STATS before, after;
+	uint8_t *old_sectors, *new_sectors;
+	uint32_t num_sectors;
+	DWORD free_clusters;
+	FATFS *fs;
+	FIL file;
+	UINT num;
+	uint8_t ok;
+
+	// dirty FAT and directory sectors of this card, the area they would land in on the other card
+	ok = f_open(&file, "SWAP.dat", FA_WRITE|FA_CREATE_ALWAYS) == FR_OK && f_write(&file, data, sizeof(data), &num) == FR_OK
+		&& num == sizeof(data) && f_getfree("", &free_clusters, &fs) == FR_OK;
+	num_sectors = ok ? fs->database + TEST_DATA_SECTORS : 0;
+
+	// the card is pulled, SDTask sees it gone, and another one is put in
+	Card_GetParams()->present = 0;
+	ok = SD_GetStatus() == SD_CARD_ERROR && ok;
+	Card_Close();
+	old_sectors = malloc((size_t)num_sectors * 512);
+	new_sectors = malloc((size_t)num_sectors * 512);
+	ok = old_sectors != NULL && new_sectors != NULL && Card_Open(image, params) && Card_Load(0, old_sectors, num_sectors) && ok;
+
+	disk_ioctl(0, DISK_GET_CACHE_STATS, &before);
+	ok = Volume_Mount() && ok;
+	disk_ioctl(0, DISK_GET_CACHE_STATS, &after);
+
+	Host_Check(ok && Card_Load(0, new_sectors, num_sectors) && memcmp(old_sectors, new_sectors, (size_t)num_sectors * 512) == 0,
+		"mounting another card leaves it untouched");
+	Host_Check(ok && after.lost > before.lost && after.writebacks == before.writebacks,
+		"dirty sectors of a swapped card are dropped as lost");
+	printf("  %u dirty sectors lost to the swap\n", after.lost - before.lost);
+
+	free(old_sectors);
+	free(new_sectors);
+}
+
+int main(int argc, char *argv[])
+{
+	struct Card_Params params, swap_params;
+	const char *swap_image = argc > 2 ? argv[2] : "cachetest-swap.img";
+
+	Card_Defaults(&params);
+	params.sectors = TEST_SECTORS;
+	swap_params = params;
+	++swap_params.serial;
+
+	ff_init_syncobj();
+	disk_init_lock();
+	Log_Init();
+
+	// the card swapped in holds a file system of its own
+	if (!Volume_Create(swap_image, &swap_params, TEST_CLUSTER_SECTORS))
+	{
+		printf("card bring-up failed\n");
+		return 1;
+	}
+	Card_Close();
+
+	if (!Volume_Create(argc > 1 ? argv[1] : "cachetest.img", &params, TEST_CLUSTER_SECTORS))
+	{
+		printf("card bring-up failed\n");
+		return 1;
+	}
+
+	_extent_blocks();
+	_remount();
+	_swap(swap_image, &swap_params);
+
+	Card_Close();
+	return Host_Summary();
+}
@@ -0,0 +1,279 @@
+/* fragtest.c
+ * Host test of the pre-allocated log extent, logs to a fresh and to a fragmented FAT32 image on the
+ * simulated card and checks where the blocks went
+ *
+ * Build: make build/fragtest
+ * Usage: fragtest [-r seed] [image file]
+ *
+ * On the fresh image the log has to get one contiguous extent starting on an allocation unit, take one card
+ * write per block and nothing else while it lasts, carry on through f_write once the 16 MB extent is used
+ * up, and be cut to the logged length at close. Then the free space is broken up into runs of 1 to 12 MB
+ * between single cluster files, so no extent can be found, and the log has to fall back to f_write and
+ * still hold every record. Exits with 1 if a check fails. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "stm32f4xx.h"
+#include "FreeRTOS.h"
+#include "host.h"
+#include "card.h"
+#include "ff.h"
+#include "diskio.h"
+#include "sd.h"
+#include "log.h"
+#include "volume.h"
+
+#define TEST_SECTORS 262144 // 128 MB
+#define TEST_CLUSTER_SECTORS 8
+#define TEST_START_TIME 1500000000
+#define TEST_EXTENT_SIZE ((FSIZE_t)16 * 1024 * 1024) // LOG_EXTENT_SIZE of log.c
+#define TEST_MAX_RECORDS (1024 * 1024)
+#define TEST_MAX_FRAGMENTS 4096
+#define TEST_MIN_RUN_MB 1
+#define TEST_MAX_RUN_MB 12
+
+static struct LogFmt_Record _decoded[TEST_MAX_RECORDS];
+static DWORD _link_map[1 + 2 * TEST_MAX_FRAGMENTS];
+static uint32_t _seed = 1;
+
+static uint32_t _hash(uint32_t x)
+{
+	x ^= x >> 16;
+	x *= 0x7feb352d;
+	x ^= x >> 15;
+	x *= 0x846ca68b;
+	return x ^ (x >> 16);
+}
+
+// the n-th IMU record, the values are all over the place so blocks fill up fast
+static void _make_record(uint32_t n, struct LogFmt_Record *record)
+{
+	uint8_t i;
+
+	record->channel = LOGFMT_CHANNEL_IMU;
+	record->time_ms = n * 5;
+	record->num_fields = LOGFMT_IMU_NUM_FIELDS;
+	for (i = 0; i < LOGFMT_IMU_NUM_FIELDS; ++i)
+		record->value[i] = (int32_t)(_hash(n * LOGFMT_IMU_NUM_FIELDS + i) % 200001) - 100000;
+}
+
+// log records until the session holds at least size bytes, returns the number of records
+static uint32_t _log(const char *filename, FSIZE_t size, uint8_t *ok)
+{
+	struct LogFmt_Record record;
+	struct Log_Stats stats;
+	uint32_t n = 0;
+
+	*ok = Log_Open(filename, TEST_START_TIME);
+	do
+	{
+		_make_record(n++, &record);
+		*ok = Log_Append(&record) && Log_Process() && *ok;
+		Log_GetStats(&stats);
+	} while (*ok && (FSIZE_t)stats.sectors_written * LOG_BLOCK_SIZE < size);
+
+	return n;
+}
+
+static uint8_t _same_records(const char *filename, uint32_t count, uint32_t *num_blocks)
+{
+	struct LogFmt_Header header;
+	struct LogFmt_Record record;
+	uint32_t num_records, i;
+
+	if (!Volume_ReadLog(filename, 0, &header, _decoded, TEST_MAX_RECORDS, &num_records, num_blocks) || num_records != count)
+	{
+		printf("  %s: %u records decoded, %u logged\n", filename, num_records, count);
+		return 0;
+	}
+
+	for (i = 0; i < count; ++i)
+	{
+		_make_record(i, &record);
+		if (!Volume_SameRecord(&_decoded[i], &record))
+		{
+			printf("  %s: record %u differs\n", filename, i);
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+// fragments of the cluster chain of a file and the sector it starts at
+static uint32_t _fragments(const char *filename, FSIZE_t *size, DWORD *lba)
+{
+	FIL file;
+	uint32_t ret = 0;
+
+	if (f_open(&file, filename, FA_READ) != FR_OK)
+		return 0;
+
+	file.cltbl = _link_map;
+	_link_map[0] = sizeof(_link_map) / sizeof(_link_map[0]);
+	if (f_lseek(&file, CREATE_LINKMAP) == FR_OK)
+		ret = (_link_map[0] - 1) / 2;
+	*size = f_size(&file);
+	*lba = file.obj.fs->database + (file.obj.sclust - 2) * file.obj.fs->csize;
+
+	f_close(&file);
+	return ret;
+}
+
+static void _fresh_volume()
+{
+	struct SD_Stats sd_stats;
+	struct Log_Stats stats;
+	struct LogFmt_Header header;
+	struct LogFmt_Record record;
+	uint32_t count, num_blocks, num_records, synced_blocks, i;
+	FSIZE_t size;
+	DWORD lba;
+	uint8_t ok;
+
+	// a session that fits the extent, only the blocks go to the card between two syncs
+	count = _log("EXTENT.dat", 4 * 1024 * 1024, &ok);
+	ok = Log_Sync() && ok;
+	ok = Volume_ReadLog("EXTENT.dat", 0, &header, _decoded, TEST_MAX_RECORDS, &num_records, &synced_blocks) && ok;
+	SD_ResetStats();
+	for (i = 0; i < 20000; ++i, ++count)
+	{
+		_make_record(count, &record);
+		ok = Log_Append(&record) && Log_Process() && ok;
+	}
+	ok = Log_Sync() && ok;
+	SD_GetStats(&sd_stats);
+	Log_GetStats(&stats);
+	ok = Log_Close() && ok;
+
+	Host_Check(ok && _same_records("EXTENT.dat", count, &num_blocks), "file decodes to the records logged");
+	Host_Check(_fragments("EXTENT.dat", &size, &lba) == 1, "log is one contiguous extent");
+	Host_Check(lba % Card_GetParams()->au_sectors == 0, "extent starts on an allocation unit");
+	Host_Check(size == (FSIZE_t)(1 + num_blocks) * LOG_BLOCK_SIZE, "closed file is cut to the blocks logged");
+	// the block that was partial at the first sync is written again, the one partial at the second is new
+	Host_Check(sd_stats.sectors_written == num_blocks - synced_blocks + 1, "no sector but the blocks written between syncs");
+	printf("  %u blocks, %u sectors for the 20000 records between the syncs, longest block write %u us\n", num_blocks,
+		sd_stats.sectors_written, stats.max_write_us);
+
+	// a session longer than the extent
+	count = _log("LONG.dat", TEST_EXTENT_SIZE + 2 * 1024 * 1024, &ok);
+	Log_GetStats(&stats);
+	ok = Log_Close() && ok;
+
+	Host_Check(ok && _same_records("LONG.dat", count, &num_blocks), "log past the extent decodes to the records logged");
+	Host_Check(_fragments("LONG.dat", &size, &lba) >= 1 && size == (FSIZE_t)(1 + num_blocks) * LOG_BLOCK_SIZE
+		&& size > TEST_EXTENT_SIZE, "file grows through f_write once the extent is used up");
+	printf("  %u blocks, %llu bytes, longest block write %u us\n", num_blocks, (unsigned long long)size, stats.max_write_us);
+}
+
+// break the free space up into runs shorter than the extent, with a one cluster file after each
+static uint32_t _fragment_volume()
+{
+	FIL file;
+	UINT num;
+	char name[24];
+	uint32_t i, runs = 0;
+	FSIZE_t size;
+	FRESULT res = FR_OK;
+
+	f_mkdir("/Frag");
+	for (i = 0; res == FR_OK; ++i)
+	{
+		size = (FSIZE_t)(TEST_MIN_RUN_MB + (_seed = _seed * 1103515245 + 12345) % (TEST_MAX_RUN_MB - TEST_MIN_RUN_MB + 1)) * 1024 * 1024;
+		snprintf(name, sizeof(name), "/Frag/R%u", i);
+		if (f_open(&file, name, FA_WRITE|FA_CREATE_ALWAYS) != FR_OK)
+			break;
+		res = f_expand(&file, size, 1);
+		f_close(&file);
+		if (res != FR_OK)
+		{
+			f_unlink(name);
+			break;
+		}
+
+		snprintf(name, sizeof(name), "/Frag/G%u", i);
+		if (f_open(&file, name, FA_WRITE|FA_CREATE_ALWAYS) != FR_OK)
+			break;
+		res = f_write(&file, name, 1, &num);
+		f_close(&file);
+	}
+
+	// freeing the runs leaves the gap files in between
+	while (i-- > 0)
+	{
+		snprintf(name, sizeof(name), "/Frag/R%u", i);
+		if (f_unlink(name) == FR_OK)
+			++runs;
+	}
+
+	return runs;
+}
+
+static void _fragmented_volume()
+{
+	struct Log_Stats stats;
+	uint32_t count, num_blocks, runs;
+	FSIZE_t size;
+	DWORD lba, free_clusters;
+	FATFS *fs;
+	FIL file;
+	uint8_t ok;
+
+	runs = _fragment_volume();
+	ok = f_getfree("", &free_clusters, &fs) == FR_OK;
+	printf("  %u runs of %u to %u MB free, %lu MB free in all\n", runs, TEST_MIN_RUN_MB, TEST_MAX_RUN_MB,
+		(unsigned long)((uint64_t)free_clusters * fs->csize * 512 / (1024 * 1024)));
+
+	// f_expand finds no run as long as the extent
+	ok = ok && f_open(&file, "PROBE.dat", FA_WRITE|FA_CREATE_ALWAYS) == FR_OK;
+	Host_Check(ok && runs > 8 && f_expand(&file, TEST_EXTENT_SIZE, 0) == FR_DENIED, "free space is fragmented");
+	f_close(&file);
+	f_unlink("PROBE.dat");
+
+	count = _log("FRAG.dat", 24 * 1024 * 1024, &ok);
+	Log_GetStats(&stats);
+	ok = Log_Close() && ok;
+
+	Host_Check(ok && _same_records("FRAG.dat", count, &num_blocks), "log on a fragmented volume decodes to the records logged");
+	Host_Check(_fragments("FRAG.dat", &size, &lba) > 1 && size == (FSIZE_t)(1 + num_blocks) * LOG_BLOCK_SIZE,
+		"file is written through f_write over several runs");
+	printf("  %u blocks in %u fragments, longest block write %u us\n", num_blocks, _fragments("FRAG.dat", &size, &lba),
+		stats.max_write_us);
+}
+
+int main(int argc, char *argv[])
+{
+	struct Card_Params params;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "r:")) != -1)
+	{
+		if (opt != 'r')
+		{
+			printf("usage: fragtest [-r seed] [image file]\n");
+			return 1;
+		}
+		_seed = (uint32_t)strtoul(optarg, NULL, 0);
+	}
+
+	Card_Defaults(&params);
+	params.sectors = TEST_SECTORS;
+
+	ff_init_syncobj();
+	disk_init_lock();
+	Log_Init();
+	if (!Volume_Create(optind < argc ? argv[optind] : "fragtest.img", &params, TEST_CLUSTER_SECTORS))
+	{
+		printf("card bring-up failed\n");
+		return 1;
+	}
+
+	_fresh_volume();
+	_fragmented_volume();
+
+	Card_Close();
+	return Host_Summary();
+}
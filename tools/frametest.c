@@ -0,0 +1,355 @@
+/* frametest.c
+ * Host test of the receive path of gps.c, feeds a stream of sentences through the USART and DMA simulation
+ * of host/usart.c into the receive buffer of the real driver and takes them the way GPSTask does
+ *
+ * Build: make build/frametest
+ * Usage: frametest [-r seed]
+ *
+ * The stream starts halfway through a sentence, and between random sentences of 12 to 82 characters there
+ * is noise, sentences cut short by the next one, lines too long to be a sentence and sentences ended by a
+ * line feed alone. None of the sentences is one gps.c parses itself, so it hands every one to minmea in
+ * place in its receive buffer, and the minmea_sentence_id of this test compares it with the one expected
+ * next. The receiver sends the stream at 115200 baud in bursts with the line idle between them, and the GPS
+ * task frames and parses what came in at the receive interrupts. The receiver holds back while the task has
+ * not looked at as much as the receive buffer takes with a sentence being framed, so it never overruns,
+ * that is gpsreplay's to check.
+ *
+ * Checks that every sentence comes back byte for byte and in order, terminated in place, that the partial
+ * sentence at the start and the noise are skipped, that only the bad lines are counted as dropped, that
+ * sentences wrapped past the end of the receive buffer were among them, that the sentence queue filled up
+ * on the way, and that feeding the stream byte by byte, in random bursts with the task sleeping through
+ * some of the interrupts and in bursts as large as the buffer takes gives the same sentences. Exits with 1
+ * if a check fails. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+
+#include "stm32f4xx.h"
+#include "FreeRTOS.h"
+#include "task.h"
+#include "host.h"
+#include "usart.h"
+#include "gps.h"
+#include "nmea.h"
+#include "minmea.h"
+
+#define TEST_RING_LEN 512 // GPS_RX_BUF_LEN of gps.c
+#define TEST_QUEUE_LEN 8 // GPS_SENTENCE_QUEUE_LEN of gps.c
+#define TEST_RX_STREAM DMA2_Stream2 // the receive stream of gps.c
+#define TEST_BAUD_RATE 115200
+#define TEST_SENTENCES 20000
+#define TEST_MAX_SENTENCE_LEN 82
+#define TEST_MAX_BURST 200
+#define TEST_STREAM_LEN (TEST_SENTENCES * (TEST_MAX_SENTENCE_LEN + 2) * 2)
+// bytes that may come in between two looks of the task, the buffer less a sentence the framer holds on to
+#define TEST_ROOM (TEST_RING_LEN - NMEA_BUF_LEN)
+#define TEST_IDLE_US 200 // between bursts, long enough for the idle interrupt
+
+// how the stream is sent
+enum Feed
+{
+	FEED_BYTES, // a byte at a time, the task looks after each
+	FEED_BURSTS, // 1 to TEST_MAX_BURST bytes, the task sleeps through some of them
+	FEED_LARGEST // as many bytes as the buffer has room for
+};
+
+// what gps.c handed to minmea
+struct Framed
+{
+	uint32_t sentences; // matched the one expected next
+	uint32_t wrong; // did not
+	uint32_t wrapped; // ran past the end of the receive buffer
+	uint32_t dropped;
+	uint32_t bad; // failed the checksum
+	uint32_t overruns;
+};
+
+static char _stream[TEST_STREAM_LEN];
+static uint32_t _stream_len = 0;
+static char _expected[TEST_SENTENCES][TEST_MAX_SENTENCE_LEN + 1];
+static uint32_t _offsets[TEST_SENTENCES]; // where in the stream they start
+static uint32_t _num_expected = 0;
+static uint32_t _bad_lines = 0; // cut short or too long, the framer has to drop them
+static uint32_t _seed = 1;
+
+static char _preamble[TEST_MAX_SENTENCE_LEN + 3]; // what the receiver sends while GPS_Initialize looks for it
+static uint8_t _initialized = 0;
+static struct Framed _results[3];
+static struct GPS_Stats _stats;
+
+// the feed under way
+static enum Feed _feed;
+static struct Framed *_framed = NULL; // NULL while no stream is fed
+static uint32_t _pos = 0; // bytes of the stream sent
+static uint32_t _received_start = 0; // Usart_GetReceived when the stream started
+static uint32_t _looked = 0; // Usart_GetReceived when the task last looked
+static uint32_t _ring_start = 0; // where the stream starts in the receive buffer
+static uint8_t _held_back = 0; // the receiver waits for the task to look
+
+static uint32_t _random()
+{
+	_seed = _seed * 1103515245 + 12345;
+	return _seed >> 8;
+}
+
+static void _put(const char *s, uint32_t len)
+{
+	memcpy(&_stream[_stream_len], s, len);
+	_stream_len += len;
+}
+
+// a sentence of len characters from the '$' to the checksum, into s
+static void _sentence(char *s, uint32_t len)
+{
+	static const char fields[] = "0123456789.,ABCDEFGHIJKLMNOPQRSTUVWXYZ-";
+	uint8_t checksum = 0;
+	uint32_t i;
+
+	s[0] = '$';
+	for (i = 1; i < len - 3; ++i)
+	{
+		s[i] = i < 6 ? (char)('A' + _random() % 26) : fields[_random() % (sizeof(fields) - 1)];
+		// none of the RMC, GGA and VTG gps.c parses itself, all of them go to minmea
+		if (i == 3 && strchr("RGV", s[i]))
+			s[i] = 'X';
+		checksum ^= (uint8_t)s[i];
+	}
+	sprintf(&s[len - 3], "*%02X", checksum);
+}
+
+// noise between sentences, anything but the start of one
+static void _noise()
+{
+	uint32_t i, len = 1 + _random() % 20;
+	char c;
+
+	for (i = 0; i < len; ++i)
+	{
+		c = (char)(_random() % 256);
+		_put(c == '$' ? "#" : &c, 1);
+	}
+}
+
+static void _make_stream()
+{
+	char s[NMEA_BUF_LEN * 2];
+	uint32_t n, len, kind;
+
+	// picked up halfway through a sentence
+	_sentence(s, 60);
+	_put(&s[25], 35);
+	_put("\r\n", 2);
+
+	for (n = 0; n < TEST_SENTENCES; ++n)
+	{
+		kind = _random() % 100;
+		if (kind < 2)
+		{
+			// cut short by the next one
+			_sentence(s, 40);
+			_put(s, 5 + _random() % 30);
+			++_bad_lines;
+		}
+		else if (kind < 3)
+		{
+			// longer than any sentence
+			len = NMEA_BUF_LEN + _random() % NMEA_BUF_LEN;
+			_sentence(s, len);
+			_put(s, len);
+			_put("\r\n", 2);
+			++_bad_lines;
+		}
+		else if (kind < 6)
+		{
+			_noise();
+		}
+
+		len = 12 + _random() % (TEST_MAX_SENTENCE_LEN - 11);
+		_sentence(_expected[_num_expected], len);
+		_offsets[_num_expected] = _stream_len;
+		_put(_expected[_num_expected], len);
+		if (_random() % 10 == 0)
+			_put("\n", 1);
+		else
+			_put("\r\n", 2);
+		++_num_expected;
+	}
+}
+
+// gps.c hands every sentence that is not part of a fix to minmea, terminated in place in its receive buffer
+enum minmea_sentence_id minmea_sentence_id(const char *sentence, bool strict)
+{
+	const char *expected;
+	uint32_t start;
+
+	(void)strict;
+	if (_framed == NULL)
+		return MINMEA_UNKNOWN;
+
+	expected = _framed->sentences < _num_expected ? _expected[_framed->sentences] : "";
+	if (strcmp(sentence, expected) == 0)
+	{
+		start = (_ring_start + _offsets[_framed->sentences]) % TEST_RING_LEN;
+		if (start + strlen(expected) > TEST_RING_LEN)
+			++_framed->wrapped;
+		++_framed->sentences;
+	}
+	else
+	{
+		++_framed->wrong;
+	}
+
+	return MINMEA_UNKNOWN;
+}
+
+static void _send_preamble(void *arg)
+{
+	(void)arg;
+	if (_initialized)
+		return;
+
+	Usart_Send(_preamble, (uint32_t)strlen(_preamble));
+	Host_At(Host_Now() + 100000, _send_preamble, NULL);
+}
+
+// the receiver sends the next burst of the stream, if the task has looked at enough of what came before
+static void _send_burst(void *arg)
+{
+	uint32_t burst, room;
+
+	(void)arg;
+	room = TEST_ROOM - (_received_start + _pos - _looked);
+	if (_feed == FEED_BYTES)
+		burst = 1;
+	else if (_feed == FEED_BURSTS)
+		burst = 1 + _random() % TEST_MAX_BURST;
+	else
+		burst = room;
+	if (burst > _stream_len - _pos)
+		burst = _stream_len - _pos;
+
+	if (burst == 0 || burst > room)
+	{
+		_held_back = burst > 0;
+		return;
+	}
+
+	Host_At(Usart_Send(&_stream[_pos], burst) + TEST_IDLE_US, _send_burst, NULL);
+	_pos += burst;
+}
+
+static void _take(enum Feed feed, struct Framed *framed)
+{
+	struct GPS_Stats before;
+
+	GPS_GetStats(&before);
+	memset(framed, 0, sizeof(*framed));
+	_feed = feed;
+	_pos = 0;
+	_looked = _received_start = Usart_GetReceived();
+	_ring_start = (TEST_RING_LEN - TEST_RX_STREAM->NDTR) % TEST_RING_LEN;
+	_framed = framed;
+	Host_At(Host_Now(), _send_burst, NULL);
+
+	while (_looked - _received_start < _stream_len)
+	{
+		GPS_WaitForData(1000);
+
+		// the task may sleep through a few interrupts
+		if (feed == FEED_BURSTS && _random() % 3 == 0)
+			vTaskDelay(pdMS_TO_TICKS(1 + _random() % 3));
+
+		while (GPS_CheckForNewData())
+			;
+
+		_looked = Usart_GetReceived();
+		if (_held_back)
+		{
+			_held_back = 0;
+			Host_At(Host_Now(), _send_burst, NULL);
+		}
+	}
+
+	_framed = NULL;
+	GPS_GetStats(&_stats);
+	framed->dropped = _stats.dropped_sentences - before.dropped_sentences;
+	framed->bad = _stats.bad_sentences - before.bad_sentences;
+	framed->overruns = _stats.overruns - before.overruns;
+}
+
+static void _gps_task(void *param)
+{
+	(void)param;
+	_initialized = GPS_Initialize();
+	if (_initialized)
+	{
+		// let the line go quiet and take what is left of the preamble
+		vTaskDelay(pdMS_TO_TICKS(200));
+		while (GPS_CheckForNewData())
+			;
+
+		_take(FEED_BURSTS, &_results[FEED_BURSTS]);
+		_take(FEED_BYTES, &_results[FEED_BYTES]);
+		_take(FEED_LARGEST, &_results[FEED_LARGEST]);
+	}
+
+	Host_Stop();
+	vTaskDelay(portMAX_DELAY);
+}
+
+static void _print(const char *name, const struct Framed *framed)
+{
+	printf("  %-14s %6u sentences, %5u wrapped, %3u dropped, %u wrong, %u bad, %u overruns\n", name,
+		framed->sentences, framed->wrapped, framed->dropped, framed->wrong, framed->bad, framed->overruns);
+}
+
+static uint8_t _all_back(const struct Framed *framed)
+{
+	return framed->sentences == _num_expected && framed->wrong == 0 && framed->bad == 0 && framed->overruns == 0;
+}
+
+int main(int argc, char *argv[])
+{
+	struct Framed *bursts = &_results[FEED_BURSTS], *bytes = &_results[FEED_BYTES];
+	struct Framed *largest = &_results[FEED_LARGEST];
+	int opt;
+
+	while ((opt = getopt(argc, argv, "r:")) != -1)
+	{
+		if (opt != 'r')
+		{
+			printf("usage: frametest [-r seed]\n");
+			return 1;
+		}
+		_seed = (uint32_t)strtoul(optarg, NULL, 0);
+	}
+
+	_sentence(_preamble, 40);
+	strcat(_preamble, "\r\n");
+	_make_stream();
+	printf("  %u sentences, %u bad lines in %u bytes\n", _num_expected, _bad_lines, _stream_len);
+
+	Usart_Attach(TEST_BAUD_RATE);
+	Host_At(0, _send_preamble, NULL);
+	xTaskCreate(_gps_task, "GPSTask", 1024, NULL, 3, NULL);
+	vTaskStartScheduler();
+
+	_print("random bursts", bursts);
+	_print("byte by byte", bytes);
+	_print("largest bursts", largest);
+	printf("  at most %u sentences queued\n", _stats.max_queued_sentences);
+
+	Host_Check(_initialized, "receiver found");
+	Host_Check(_all_back(bursts), "every sentence back in order, byte for byte, random bursts");
+	Host_Check(bursts->dropped == _bad_lines, "only the bad lines dropped, the start and the noise skipped");
+	Host_Check(bursts->wrapped > 0, "sentences wrapped past the end of the receive buffer");
+	Host_Check(_stats.max_queued_sentences == TEST_QUEUE_LEN, "sentence queue filled up");
+	Host_Check(_all_back(bytes) && bytes->dropped == _bad_lines && _all_back(largest)
+		&& largest->dropped == _bad_lines, "same sentences byte by byte and in the largest bursts");
+
+	return Host_Summary();
+}
@@ -0,0 +1,235 @@
+/* gpsreplay.c
+ * Host replay of the GPS receive path, src/gps.c on the USART and DMA simulation of host/usart.c, with a
+ * receiver sending an RMC and a GGA sentence ten times a second at 115200 baud and a GPS task that is late
+ *
+ * Build: make build/gpsreplay
+ * Usage: gpsreplay [-s seconds] [-r seed]
+ *
+ * The task does what GPSTask does, it waits for a receive interrupt and takes the fixes with
+ * GPS_CheckForNewData until it returns 0. Every time it wakes up it is held off for a random time first, up
+ * to a latency that goes up every minute, or every given number of seconds, from none to the margin gps.c
+ * is good for and then a few steps beyond it. Every fix carries its number in both sentences, as the speed
+ * and as the altitude.
+ *
+ * Checks that up to the margin every fix comes back once and in order, one a call, made of the two
+ * sentences sent for it, with the tick of the first receive interrupt at or after its last byte or of the
+ * call that found it if that interrupt had not come yet, and that there is no overrun. Beyond the margin,
+ * that fixes are only lost to overruns that are counted, and that no sentence was overwritten while it was
+ * still needed without the overrun being noticed. Exits with 1 if a check fails. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "FreeRTOS.h"
+#include "task.h"
+#include "host.h"
+#include "usart.h"
+#include "gps.h"
+#include "nmea.h"
+
+#define REPLAY_BAUD_RATE 115200
+#define REPLAY_FIX_MS 100
+#define REPLAY_MARGIN_MS 250 // the latency gps.c is good for at 10 Hz, see its receive buffer
+#define REPLAY_PHASES (sizeof(_latencies_ms) / sizeof(_latencies_ms[0]))
+
+// a fix handed out by GPS_CheckForNewData
+struct Replayed
+{
+	uint32_t number;
+	uint32_t phase;
+	TickType_t tick;
+	uint64_t found_us; // time of the call that returned it
+	uint8_t parts_agree; // speed and altitude carry the same number
+	uint8_t after_overrun; // there was an overrun since the fix before, fixes in between are gone
+};
+
+// the task is held off up to this long in every phase, the last one is beyond the margin
+static const uint32_t _latencies_ms[] = {0, 50, 100, 150, 200, REPLAY_MARGIN_MS, 300, 320, 340, 360, 400};
+
+static uint32_t _seed = 1;
+static uint64_t _phase_us = 60000000;
+static uint64_t _start_us = 0;
+static uint8_t _initialized = 0;
+
+static uint64_t *_fix_end = NULL; // time the last byte of every fix sent is in
+static uint32_t _fixes_sent = 0;
+static uint32_t _max_fixes = 0;
+
+static struct Replayed *_replayed = NULL;
+static uint32_t _num_replayed = 0;
+static uint32_t _overruns[REPLAY_PHASES];
+static struct GPS_Stats _stats;
+
+static uint32_t _random()
+{
+	_seed = _seed * 1103515245 + 12345;
+	return _seed >> 8;
+}
+
+// a sentence with its checksum and terminator from the part between '$' and '*', returns its length
+static uint32_t _sentence(char *s, const char *body)
+{
+	uint8_t checksum = 0;
+	const char *c;
+
+	for (c = body; *c; ++c)
+		checksum ^= (uint8_t)*c;
+
+	return (uint32_t)sprintf(s, "$%s*%02X\r\n", body, checksum);
+}
+
+// the receiver sends fix number arg, and the next one a period later
+static void _send_fix(void *arg)
+{
+	uint32_t n = (uint32_t)(uintptr_t)arg;
+	uint32_t ms = 12 * 3600000 + n * REPLAY_FIX_MS;
+	char time[16], body[NMEA_BUF_LEN], burst[2 * NMEA_BUF_LEN];
+	uint32_t len;
+
+	if (n >= _max_fixes)
+		return;
+
+	snprintf(time, sizeof(time), "%02u%02u%02u.%03u", ms / 3600000, ms / 60000 % 60, ms / 1000 % 60, ms % 1000);
+	snprintf(body, sizeof(body), "GPRMC,%s,A,4807.038,N,01131.000,E,%u.%02u,084.4,230394,003.1,W,A", time,
+		n / 100, n % 100);
+	len = _sentence(burst, body);
+	snprintf(body, sizeof(body), "GPGGA,%s,4807.038,N,01131.000,E,1,08,0.9,%u.%02u,M,46.9,M,,", time, n / 100,
+		n % 100);
+	len += _sentence(&burst[len], body);
+
+	_fix_end[n] = Usart_Send(burst, len);
+	_fixes_sent = n + 1;
+	Host_At((uint64_t)(n + 1) * REPLAY_FIX_MS * 1000, _send_fix, (void *)(uintptr_t)(n + 1));
+}
+
+static void _gps_task(void *param)
+{
+	struct Replayed *replayed;
+	struct GPS_Fix fix;
+	uint32_t phase, floor, seen = 0, counted = 0;
+
+	(void)param;
+	_initialized = GPS_Initialize();
+	_start_us = Host_Now();
+
+	while (_initialized && (phase = (uint32_t)((Host_Now() - _start_us) / _phase_us)) < REPLAY_PHASES)
+	{
+		GPS_WaitForData(1000);
+
+		// held off by the tasks above it, or by its own work on the fixes before. Beyond the margin by more
+		// than the margin every time, so the overruns come often
+		floor = _latencies_ms[phase] > REPLAY_MARGIN_MS ? REPLAY_MARGIN_MS : 0;
+		vTaskDelay(pdMS_TO_TICKS(floor + _random() % (_latencies_ms[phase] - floor + 1)));
+
+		while (GPS_CheckForNewData())
+		{
+			GPS_GetStats(&_stats);
+			GPS_GetFix(&fix);
+			replayed = &_replayed[_num_replayed++];
+			replayed->number = (uint32_t)fix.speed;
+			replayed->phase = phase;
+			GPS_GetFixTick(&replayed->tick);
+			replayed->found_us = Host_Now();
+			replayed->parts_agree = fix.altitude == fix.speed;
+			replayed->after_overrun = _stats.overruns != seen;
+			seen = _stats.overruns;
+		}
+
+		GPS_GetStats(&_stats);
+		_overruns[phase] += _stats.overruns - counted;
+		counted = _stats.overruns;
+	}
+
+	Host_Stop();
+	vTaskDelay(portMAX_DELAY);
+}
+
+int main(int argc, char *argv[])
+{
+	uint32_t i, phase, missing, wrong_tick, misfits, fixes, overruns_within = 0, overruns_beyond = 0;
+	uint64_t interrupt_us, expected_us;
+	char commands[1024];
+	int opt;
+
+	while ((opt = getopt(argc, argv, "s:r:")) != -1)
+	{
+		if (opt == 's')
+			_phase_us = strtoull(optarg, NULL, 0) * 1000000;
+		else if (opt == 'r')
+			_seed = (uint32_t)strtoul(optarg, NULL, 0);
+		else
+		{
+			printf("usage: gpsreplay [-s seconds] [-r seed]\n");
+			return 1;
+		}
+	}
+
+	// a fix a period over the phases and the time GPS_Initialize takes
+	_max_fixes = (uint32_t)((REPLAY_PHASES * _phase_us + 10000000) / (REPLAY_FIX_MS * 1000));
+	_fix_end = calloc(_max_fixes, sizeof(_fix_end[0]));
+	_replayed = calloc(_max_fixes, sizeof(_replayed[0]));
+
+	// the receiver is up at the rate it was switched to, as after a warm restart
+	Usart_Attach(REPLAY_BAUD_RATE);
+	Host_At(0, _send_fix, (void *)(uintptr_t)0);
+	xTaskCreate(_gps_task, "GPSTask", 1024, NULL, 3, NULL);
+	vTaskStartScheduler();
+
+	Usart_GetCommands(commands, sizeof(commands) - 1);
+	commands[sizeof(commands) - 1] = '\0';
+	Host_Check(_initialized && GPS_GetBaudRate() == REPLAY_BAUD_RATE && strstr(commands, "$PMTK220,100*2F\r\n"),
+		"receiver found at 115200 baud and set to 10 Hz");
+
+	printf("  %u fixes sent, %u receive interrupts, at most %u bytes pending and %u sentences queued\n",
+		_fixes_sent, Usart_GetInterrupts(), _stats.max_pending_bytes, _stats.max_queued_sentences);
+	printf("  latency  fixes  missing  wrong tick  overruns\n");
+
+	for (phase = 0; phase < REPLAY_PHASES; ++phase)
+	{
+		fixes = missing = wrong_tick = misfits = 0;
+		for (i = 0; i < _num_replayed; ++i)
+		{
+			if (_replayed[i].phase != phase)
+				continue;
+			++fixes;
+
+			if (!_replayed[i].parts_agree || (i > 0 && _replayed[i].number <= _replayed[i - 1].number))
+				++misfits;
+			else if (i > 0 && _replayed[i].number != _replayed[i - 1].number + 1 && !_replayed[i].after_overrun)
+				missing += _replayed[i].number - _replayed[i - 1].number - 1;
+
+			// the fix has the time of the interrupt after its last byte, or of the call if that was first
+			interrupt_us = Usart_FirstInterrupt(_fix_end[_replayed[i].number]);
+			expected_us = interrupt_us <= _replayed[i].found_us ? interrupt_us : _replayed[i].found_us;
+			if (_replayed[i].tick != (TickType_t)(expected_us / 1000))
+				++wrong_tick;
+		}
+
+		printf("  %4u ms  %5u  %7u  %10u  %8u\n", _latencies_ms[phase], fixes, missing, wrong_tick,
+			_overruns[phase]);
+
+		if (_latencies_ms[phase] <= REPLAY_MARGIN_MS)
+		{
+			overruns_within += _overruns[phase];
+			Host_Check(fixes > 0 && missing == 0 && misfits == 0 && wrong_tick == 0,
+				_latencies_ms[phase] == 0 ? "every fix once, in order, whole, with its interrupt tick"
+				: _latencies_ms[phase] < REPLAY_MARGIN_MS ? "  the same with the task late"
+				: "  the same with the task late up to the margin");
+		}
+		else
+		{
+			overruns_beyond += _overruns[phase];
+			Host_Check(missing == 0 && misfits == 0, _latencies_ms[phase - 1] == REPLAY_MARGIN_MS
+				? "beyond the margin fixes lost only to counted overruns" : "  the same further beyond");
+		}
+	}
+
+	Host_Check(overruns_within == 0, "no overrun up to the margin");
+	Host_Check(overruns_beyond > 0, "overruns counted beyond it");
+	Host_Check(_stats.bad_sentences == 0, "no sentence overwritten unnoticed");
+
+	return Host_Summary();
+}
@@ -0,0 +1,42 @@
+/* FreeRTOS.h
+ * Host stand-in for the FreeRTOS kernel headers, the calls the firmware makes run on host.c */
+
+#ifndef HOST_FREERTOS_H
+#define HOST_FREERTOS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef long BaseType_t;
+typedef unsigned long UBaseType_t;
+typedef uint32_t TickType_t;
+typedef void (*TaskFunction_t)(void *);
+
+#define pdFALSE ((BaseType_t)0)
+#define pdTRUE ((BaseType_t)1)
+#define pdPASS pdTRUE
+#define pdFAIL pdFALSE
+
+#define configTICK_RATE_HZ ((TickType_t)1000)
+#define configMAX_PRIORITIES 5
+#define configMINIMAL_STACK_SIZE ((uint16_t)130)
+#define configASSERT(x) do { if (!(x)) Host_Assert(#x, __FILE__, __LINE__); } while (0)
+
+#define portMAX_DELAY ((TickType_t)0xffffffffUL)
+#define portTICK_PERIOD_MS ((TickType_t)1000 / configTICK_RATE_HZ)
+#define pdMS_TO_TICKS(ms) ((TickType_t)(((TickType_t)(ms) * (TickType_t)configTICK_RATE_HZ) / (TickType_t)1000))
+
+// a higher priority task woken by an interrupt gets the CPU once the interrupt is over anyway
+#define portYIELD_FROM_ISR(x) ((void)(x))
+
+// tasks only switch where they block, so the code between two blocking calls is a critical section already
+#define taskENTER_CRITICAL()
+#define taskEXIT_CRITICAL()
+#define taskENTER_CRITICAL_FROM_ISR() ((UBaseType_t)0)
+#define taskEXIT_CRITICAL_FROM_ISR(x) ((void)(x))
+#define taskDISABLE_INTERRUPTS()
+#define taskENABLE_INTERRUPTS()
+
+void Host_Assert(const char *expr, const char *file, int line);
+
+#endif
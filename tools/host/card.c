@@ -0,0 +1,329 @@
+/* card.c
+ * Host model of an SD card, see card.h */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "card.h"
+
+#define CARD_MAX_OPEN_AUS 16
+
+struct Card_Param
+{
+	const char *name;
+	size_t offset;
+};
+
+#define CARD_PARAM(name) {#name, offsetof(struct Card_Params, name)}
+
+static const struct Card_Param _params[] =
+{
+	CARD_PARAM(sectors),
+	CARD_PARAM(au_sectors),
+	CARD_PARAM(speed_class),
+	CARD_PARAM(present),
+	CARD_PARAM(ready_ms),
+	CARD_PARAM(bus_hz),
+	CARD_PARAM(bus_width),
+	CARD_PARAM(cmd_us),
+	CARD_PARAM(read_us),
+	CARD_PARAM(write_busy_us),
+	CARD_PARAM(program_us),
+	CARD_PARAM(open_aus),
+	CARD_PARAM(au_open_us),
+	CARD_PARAM(au_gc_us),
+	CARD_PARAM(erase_us),
+	CARD_PARAM(erase_au_us),
+	CARD_PARAM(used),
+	CARD_PARAM(cut_after),
+	CARD_PARAM(serial)
+};
+
+static struct Card_Params _card;
+static struct Card_Stats _stats;
+static int _fd = -1;
+static uint8_t *_au_dirty = NULL; // AUs written since they were last erased
+static uint32_t _open[CARD_MAX_OPEN_AUS]; // open AUs, most recently used first
+static uint32_t _num_open = 0;
+static uint8_t _powered = 1;
+
+void Card_Defaults(struct Card_Params *params)
+{
+	memset(params, 0, sizeof(*params));
+	params->sectors = 2 * 1024 * 2048; // 2 GB
+	params->au_sectors = 8192; // 4 MB
+	params->speed_class = 10;
+	params->present = 1;
+	params->ready_ms = 250;
+	params->bus_hz = 48000000;
+	params->bus_width = 4;
+	params->cmd_us = 5;
+	params->read_us = 100;
+	params->write_busy_us = 250;
+	params->program_us = 25;
+	params->open_aus = 2;
+	params->au_open_us = 3000;
+	params->au_gc_us = 40000;
+	params->erase_us = 2000;
+	params->erase_au_us = 500;
+	params->serial = 0x12345678;
+}
+
+uint8_t Card_SetParam(struct Card_Params *params, const char *assignment)
+{
+	const char *value = strchr(assignment, '=');
+	size_t i;
+
+	if (value == NULL)
+		return 0;
+
+	for (i = 0; i < sizeof(_params) / sizeof(_params[0]); ++i)
+	{
+		if (strlen(_params[i].name) == (size_t)(value - assignment)
+			&& strncmp(_params[i].name, assignment, value - assignment) == 0)
+		{
+			*(uint32_t *)((uint8_t *)params + _params[i].offset) = (uint32_t)strtoul(value + 1, NULL, 0);
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+void Card_PrintParams(const struct Card_Params *params)
+{
+	size_t i;
+
+	for (i = 0; i < sizeof(_params) / sizeof(_params[0]); ++i)
+	{
+		printf("%s%s=%u", i ? " " : "", _params[i].name,
+			*(const uint32_t *)((const uint8_t *)params + _params[i].offset));
+	}
+	printf("\n");
+}
+
+uint8_t Card_Open(const char *path, const struct Card_Params *params)
+{
+	uint32_t num_aus;
+
+	_card = *params;
+	if (_card.open_aus == 0 || _card.open_aus > CARD_MAX_OPEN_AUS)
+		_card.open_aus = _card.open_aus == 0 ? 1 : CARD_MAX_OPEN_AUS;
+	if (_card.au_sectors == 0)
+		_card.au_sectors = 8192;
+
+	_fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (_fd < 0)
+	{
+		perror(path);
+		return 0;
+	}
+
+	if (lseek(_fd, 0, SEEK_END) < (off_t)_card.sectors * 512 && ftruncate(_fd, (off_t)_card.sectors * 512) != 0)
+	{
+		perror(path);
+		return 0;
+	}
+
+	num_aus = (_card.sectors + _card.au_sectors - 1) / _card.au_sectors;
+	_au_dirty = malloc(num_aus);
+	memset(_au_dirty, _card.used ? 1 : 0, num_aus);
+	_num_open = 0;
+	_powered = 1;
+	memset(&_stats, 0, sizeof(_stats));
+
+	return 1;
+}
+
+void Card_Close()
+{
+	if (_fd >= 0)
+		close(_fd);
+	_fd = -1;
+	free(_au_dirty);
+	_au_dirty = NULL;
+}
+
+struct Card_Params *Card_GetParams()
+{
+	return &_card;
+}
+
+void Card_GetStats(struct Card_Stats *stats)
+{
+	*stats = _stats;
+}
+
+void Card_ResetStats()
+{
+	memset(&_stats, 0, sizeof(_stats));
+}
+
+void Card_GetCID(uint32_t cid[4])
+{
+	// manufacturer 3, "SD", "SU32G", revision 8.0, the serial number and a manufacturing date in 2010
+	cid[0] = 0x03534453;
+	cid[1] = 0x55333247;
+	cid[2] = 0x80000000 | (_card.serial >> 8);
+	cid[3] = (_card.serial << 24) | 0x0001A700;
+}
+
+uint8_t Card_IsPowered()
+{
+	return _powered && _card.present;
+}
+
+void Card_PowerOn()
+{
+	_powered = 1;
+	_card.cut_after = 0;
+	_num_open = 0;
+}
+
+uint8_t Card_Load(uint32_t lba, uint8_t *buf, uint32_t count)
+{
+	if ((uint64_t)lba + count > _card.sectors)
+		return 0;
+
+	return pread(_fd, buf, (size_t)count * 512, (off_t)lba * 512) == (ssize_t)count * 512;
+}
+
+uint8_t Card_Store(uint32_t lba, const uint8_t *buf, uint32_t count)
+{
+	if ((uint64_t)lba + count > _card.sectors)
+		return 0;
+
+	return pwrite(_fd, buf, (size_t)count * 512, (off_t)lba * 512) == (ssize_t)count * 512;
+}
+
+uint8_t Card_Read(uint32_t lba, uint8_t *buf, uint32_t count)
+{
+	if (!Card_IsPowered() || !Card_Load(lba, buf, count))
+		return 0;
+
+	_stats.sectors_read += count;
+	return 1;
+}
+
+// make au the most recently used open AU, returns the busy time it took to open it
+static uint32_t _open_au(uint32_t au, uint32_t covered)
+{
+	uint32_t i, busy = 0;
+
+	for (i = 0; i < _num_open && _open[i] != au; ++i)
+		;
+
+	if (i == _num_open)
+	{
+		busy = _card.au_open_us;
+		++_stats.au_opens;
+		if (_au_dirty[au])
+		{
+			// blocks announced with ACMD23 are erased ahead of the data and need no copying
+			busy += (uint32_t)((uint64_t)_card.au_gc_us * (_card.au_sectors - covered) / _card.au_sectors);
+			++_stats.au_cleans;
+		}
+
+		if (_num_open < _card.open_aus)
+			++_num_open;
+		i = _num_open - 1;
+	}
+
+	memmove(&_open[1], &_open[0], i * sizeof(_open[0]));
+	_open[0] = au;
+
+	return busy;
+}
+
+uint8_t Card_Write(uint32_t lba, const uint8_t *buf, uint32_t count, uint32_t pre_erase, uint32_t *busy_us)
+{
+	uint32_t busy = _card.write_busy_us + count * _card.program_us;
+	uint32_t i, au, covered;
+
+	*busy_us = 0;
+	if (!Card_IsPowered() || (uint64_t)lba + count > _card.sectors)
+		return 0;
+
+	for (i = 0; i < count; i += covered)
+	{
+		au = (lba + i) / _card.au_sectors;
+		covered = _card.au_sectors - (lba + i) % _card.au_sectors;
+		if (covered > count - i)
+			covered = count - i;
+
+		busy += _open_au(au, pre_erase >= count ? covered : 0);
+		_au_dirty[au] = 1;
+	}
+
+	if (_card.cut_after > 0 && count >= _card.cut_after)
+	{
+		// the power goes while the last sector is programmed, it ends up half old and half new
+		uint8_t torn[512];
+		uint32_t done = _card.cut_after - 1;
+
+		Card_Store(lba, buf, done);
+		Card_Load(lba + done, torn, 1);
+		memcpy(torn, &buf[done * 512], 256);
+		Card_Store(lba + done, torn, 1);
+
+		_stats.sectors_written += done;
+		_powered = 0;
+		return 0;
+	}
+
+	if (_card.cut_after > 0)
+		_card.cut_after -= count;
+
+	if (!Card_Store(lba, buf, count))
+		return 0;
+
+	_stats.sectors_written += count;
+	_stats.busy_us += busy;
+	*busy_us = busy;
+	return 1;
+}
+
+uint8_t Card_Erase(uint32_t start, uint32_t end, uint32_t *busy_us)
+{
+	uint32_t au, i;
+
+	*busy_us = 0;
+	if (!Card_IsPowered() || end < start || end >= _card.sectors)
+		return 0;
+
+	*busy_us = _card.erase_us;
+
+	// only AUs erased as a whole are clean afterwards, the card moves partial ones on the next write
+	for (au = (start + _card.au_sectors - 1) / _card.au_sectors; (uint64_t)(au + 1) * _card.au_sectors - 1 <= end; ++au)
+	{
+		_au_dirty[au] = 0;
+		*busy_us += _card.erase_au_us;
+		for (i = 0; i < _num_open; ++i)
+		{
+			if (_open[i] == au)
+			{
+				memmove(&_open[i], &_open[i + 1], (_num_open - i - 1) * sizeof(_open[0]));
+				--_num_open;
+				break;
+			}
+		}
+	}
+
+	// erased blocks read back as zeros
+	if (fallocate(_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t)start * 512, (off_t)(end - start + 1) * 512) != 0)
+	{
+		static const uint8_t zeros[512] = {0};
+		for (i = start; i <= end; ++i)
+			Card_Store(i, zeros, 1);
+	}
+
+	_stats.sectors_erased += end - start + 1;
+	_stats.busy_us += *busy_us;
+	return 1;
+}
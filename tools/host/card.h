@@ -0,0 +1,90 @@
+/* card.h
+ * Host model of an SD card, the sectors live in an image file and every operation reports how long the
+ * card takes for it
+ *
+ * The card writes into a few open allocation units at a time. Writing to an AU that is not open costs
+ * au_open_us, and au_gc_us on top of that if the AU holds data that was not erased since it was last
+ * written, as the card has to copy the old data out first. A write announced with ACMD23 saves the share
+ * of the garbage collection for the blocks it covers. Erasing whole AUs, with CMD38 or by trimming, makes
+ * them cheap to write again.
+ *
+ * The defaults are a generic class 10 card, they are not measured from any card in particular. */
+
+#ifndef CARD_H
+#define CARD_H
+
+#include <stdint.h>
+
+struct Card_Params
+{
+	uint32_t sectors; // capacity in 512 byte sectors
+	uint32_t au_sectors; // allocation unit
+	uint32_t speed_class; // MB/s reported in the SD status, 0, 2, 4, 6 or 10
+	uint32_t present; // 0 for a slot without a card, commands time out
+	uint32_t ready_ms; // time from the first ACMD41 until the card reports it has powered up
+	uint32_t bus_hz; // bus clock once the card is in transfer mode, for the models that do not run sd.c
+	uint32_t bus_width; // data lines, for the models that do not run sd.c
+	uint32_t cmd_us; // time the card takes to answer a command, on top of the bits on the bus
+	uint32_t read_us; // access time before the first sector of a read comes out
+	uint32_t write_busy_us; // programming time after every write command
+	uint32_t program_us; // programming time per sector written
+	uint32_t open_aus; // allocation units the card keeps open for writing
+	uint32_t au_open_us; // busy time to open an allocation unit
+	uint32_t au_gc_us; // busy time to clean an allocation unit that holds old data
+	uint32_t erase_us; // busy time of an erase command
+	uint32_t erase_au_us; // busy time per allocation unit erased
+	uint32_t used; // 1 if every allocation unit holds old data, 0 for a card fresh out of the factory
+	uint32_t cut_after; // the power is cut while this many more sectors are written, 0 for never
+	uint32_t serial; // product serial number in the CID, tells one card from another
+};
+
+struct Card_Stats
+{
+	uint32_t sectors_read;
+	uint32_t sectors_written;
+	uint32_t sectors_erased;
+	uint32_t au_opens;
+	uint32_t au_cleans;
+	uint64_t busy_us;
+};
+
+void Card_Defaults(struct Card_Params *params);
+
+// set a parameter from "name=value", returns 0 if there is no such parameter
+uint8_t Card_SetParam(struct Card_Params *params, const char *assignment);
+
+void Card_PrintParams(const struct Card_Params *params);
+
+// open the image, it is created empty or grown if it is smaller than the card
+uint8_t Card_Open(const char *path, const struct Card_Params *params);
+
+void Card_Close();
+
+struct Card_Params *Card_GetParams();
+
+void Card_GetStats(struct Card_Stats *stats);
+
+void Card_ResetStats();
+
+// the card identification register the card sends for CMD2
+void Card_GetCID(uint32_t cid[4]);
+
+// 0 once the power has been cut, until Card_PowerOn
+uint8_t Card_IsPowered();
+
+// power the card up again after a cut, the image keeps what made it to the card
+void Card_PowerOn();
+
+// move data without any timing, for formatting and for checking what ended up on the card
+uint8_t Card_Load(uint32_t lba, uint8_t *buf, uint32_t count);
+
+uint8_t Card_Store(uint32_t lba, const uint8_t *buf, uint32_t count);
+
+// the card operations, busy_us is the time the card holds D0 low afterwards
+uint8_t Card_Read(uint32_t lba, uint8_t *buf, uint32_t count);
+
+uint8_t Card_Write(uint32_t lba, const uint8_t *buf, uint32_t count, uint32_t pre_erase, uint32_t *busy_us);
+
+uint8_t Card_Erase(uint32_t start, uint32_t end, uint32_t *busy_us);
+
+#endif
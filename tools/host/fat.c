@@ -0,0 +1,140 @@
+/* fat.c
+ * FAT32 formatter for card images, see fat.h */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "card.h"
+#include "fat.h"
+
+#define FAT_MIN_CLUSTERS 65526 // fewer and FatFS takes the volume for FAT16
+#define FAT_RESERVED_MIN 32
+#define FAT_NUM_FATS 2
+#define FAT_ENTRIES_PER_SECTOR (512 / 4)
+#define FAT_ZERO_CHUNK 64
+
+static void _put16(uint8_t *out, uint16_t value)
+{
+	out[0] = (uint8_t)value;
+	out[1] = (uint8_t)(value >> 8);
+}
+
+static void _put32(uint8_t *out, uint32_t value)
+{
+	out[0] = (uint8_t)value;
+	out[1] = (uint8_t)(value >> 8);
+	out[2] = (uint8_t)(value >> 16);
+	out[3] = (uint8_t)(value >> 24);
+}
+
+static uint8_t _zero(uint32_t lba, uint32_t count)
+{
+	static const uint8_t zeros[FAT_ZERO_CHUNK * 512] = {0};
+	uint32_t n;
+
+	for (; count > 0; lba += n, count -= n)
+	{
+		n = count < FAT_ZERO_CHUNK ? count : FAT_ZERO_CHUNK;
+		if (!Card_Store(lba, zeros, n))
+			return 0;
+	}
+
+	return 1;
+}
+
+uint8_t Fat_Format(uint32_t max_cluster_sectors)
+{
+	const struct Card_Params *card = Card_GetParams();
+	uint32_t au = card->au_sectors;
+	uint32_t part_start = au;
+	uint32_t part_sectors, csize, fat_sectors = 0, reserved = 0, clusters = 0, data_start;
+	uint8_t sector[512];
+
+	if (card->sectors <= 2 * au)
+		return 0;
+	part_sectors = card->sectors - part_start;
+
+	// the largest clusters that still leave enough of them for FAT32
+	for (csize = max_cluster_sectors; csize >= 1; csize /= 2)
+	{
+		fat_sectors = ((part_sectors - FAT_RESERVED_MIN) / csize + 2 + FAT_ENTRIES_PER_SECTOR - 1) / FAT_ENTRIES_PER_SECTOR;
+		data_start = (part_start + FAT_RESERVED_MIN + FAT_NUM_FATS * fat_sectors + au - 1) / au * au;
+		reserved = data_start - part_start - FAT_NUM_FATS * fat_sectors;
+		clusters = (part_sectors - (data_start - part_start)) / csize;
+		if (clusters >= FAT_MIN_CLUSTERS)
+			break;
+	}
+	if (csize == 0)
+		return 0;
+
+	// partition table with a single FAT32 LBA partition
+	memset(sector, 0, sizeof(sector));
+	sector[446 + 1] = 0xFE;
+	sector[446 + 2] = 0xFF;
+	sector[446 + 3] = 0xFF;
+	sector[446 + 4] = 0x0C;
+	sector[446 + 5] = 0xFE;
+	sector[446 + 6] = 0xFF;
+	sector[446 + 7] = 0xFF;
+	_put32(&sector[446 + 8], part_start);
+	_put32(&sector[446 + 12], part_sectors);
+	sector[510] = 0x55;
+	sector[511] = 0xAA;
+	if (!_zero(0, part_start) || !Card_Store(0, sector, 1))
+		return 0;
+
+	// boot sector
+	memset(sector, 0, sizeof(sector));
+	memcpy(sector, "\xEB\x58\x90MSDOS5.0", 11);
+	_put16(&sector[11], 512);
+	sector[13] = (uint8_t)csize;
+	_put16(&sector[14], (uint16_t)reserved);
+	sector[16] = FAT_NUM_FATS;
+	sector[21] = 0xF8;
+	_put16(&sector[24], 63);
+	_put16(&sector[26], 255);
+	_put32(&sector[28], part_start);
+	_put32(&sector[32], part_sectors);
+	_put32(&sector[36], fat_sectors);
+	_put32(&sector[44], 2); // root directory cluster
+	_put16(&sector[48], 1); // FSInfo sector
+	_put16(&sector[50], 6); // backup boot sector
+	sector[64] = 0x80;
+	sector[66] = 0x29;
+	_put32(&sector[67], 0x12345678);
+	memcpy(&sector[71], "NO NAME    FAT32   ", 19);
+	sector[510] = 0x55;
+	sector[511] = 0xAA;
+	if (!_zero(part_start, reserved + FAT_NUM_FATS * fat_sectors) || !Card_Store(part_start, sector, 1)
+		|| !Card_Store(part_start + 6, sector, 1))
+	{
+		return 0;
+	}
+
+	// FSInfo, the root directory takes the first cluster
+	memset(sector, 0, sizeof(sector));
+	_put32(&sector[0], 0x41615252);
+	_put32(&sector[484], 0x61417272);
+	_put32(&sector[488], clusters - 1);
+	_put32(&sector[492], 2);
+	sector[510] = 0x55;
+	sector[511] = 0xAA;
+	if (!Card_Store(part_start + 1, sector, 1) || !Card_Store(part_start + 7, sector, 1))
+		return 0;
+
+	// media type, end of chain marker and the root directory cluster in both FATs
+	memset(sector, 0, sizeof(sector));
+	_put32(&sector[0], 0x0FFFFFF8);
+	_put32(&sector[4], 0x0FFFFFFF);
+	_put32(&sector[8], 0x0FFFFFFF);
+	if (!Card_Store(part_start + reserved, sector, 1) || !Card_Store(part_start + reserved + fat_sectors, sector, 1))
+		return 0;
+
+	data_start = part_start + reserved + FAT_NUM_FATS * fat_sectors;
+	if (!_zero(data_start, csize))
+		return 0;
+
+	printf("FAT32: partition at %u, %u sectors a cluster, %u clusters, data area at %u\n",
+		part_start, csize, clusters, data_start);
+	return 1;
+}
@@ -0,0 +1,17 @@
+/* fat.h
+ * FAT32 formatter for card images, the firmware builds FatFS without f_mkfs
+ *
+ * The layout is the one SD cards come with: the partition starts on the second allocation unit and the
+ * reserved sectors are padded so the data area, and with it every cluster, starts on an allocation unit
+ * boundary. */
+
+#ifndef FAT_H
+#define FAT_H
+
+#include <stdint.h>
+
+// format the card opened with Card_Open, clusters of up to max_cluster_sectors, returns 0 if the card is
+// too small for FAT32
+uint8_t Fat_Format(uint32_t max_cluster_sectors);
+
+#endif
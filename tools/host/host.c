@@ -0,0 +1,799 @@
+/* host.c
+ * Host side of the firmware for the tools, see host.h
+ *
+ * Every task is a thread, but only the one holding _cpu runs. The scheduler hands the CPU to the ready
+ * task of the highest priority, tasks of the same priority take turns. When no task is ready the clock
+ * moves to the next event or timeout. Code run from main before vTaskStartScheduler blocks by moving the
+ * clock itself. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <malloc.h>
+
+#include "stm32f4xx.h"
+#include "FreeRTOS.h"
+#include "task.h"
+#include "semphr.h"
+#include "message_buffer.h"
+#include "host.h"
+
+#define HOST_STACK_SIZE (1024 * 1024)
+#define HOST_NEVER UINT64_MAX
+#define HOST_YIELD_US 1 // a switch to another task and back
+
+SDIO_TypeDef Host_SDIO;
+DMA_TypeDef Host_DMA[2];
+DMA_Stream_TypeDef Host_DMAStream[16];
+USART_TypeDef Host_USART1;
+GPIO_TypeDef Host_GPIO[4];
+CRC_TypeDef Host_CRC;
+RCC_TypeDef Host_RCC;
+DWT_Type Host_DWT;
+CoreDebug_Type Host_CoreDebug;
+
+uint32_t SystemCoreClock = 180000000;
+
+enum Host_TaskState
+{
+	HOST_READY,
+	HOST_BLOCKED, // on an object, a timeout or both
+	HOST_SPENDING, // holds on to the CPU until wake
+	HOST_DONE
+};
+
+struct Host_Task
+{
+	pthread_t thread;
+	pthread_cond_t cond;
+	TaskFunction_t code;
+	void *param;
+	const char *name;
+	UBaseType_t priority;
+	enum Host_TaskState state;
+	uint64_t wake;
+	const void *wait; // object the task blocks on
+	uint64_t turn; // order among ready tasks of the same priority
+	uint32_t notify;
+	struct Host_Task *next;
+};
+
+struct Host_EventEntry
+{
+	uint64_t time;
+	uint64_t order;
+	Host_Event event;
+	void *arg;
+	struct Host_EventEntry *next;
+};
+
+struct Host_Semaphore
+{
+	UBaseType_t count;
+	UBaseType_t max_count;
+	uint8_t is_mutex;
+};
+
+struct Host_MessageBuffer
+{
+	uint8_t *data;
+	size_t size;
+	size_t head;
+	size_t used;
+};
+
+static pthread_mutex_t _cpu = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t _scheduler_cond = PTHREAD_COND_INITIALIZER;
+static uint8_t _cpu_taken = 0;
+static uint8_t _running = 0;
+static uint8_t _stop = 0;
+static struct Host_Task *_tasks = NULL;
+static struct Host_Task *_current = NULL; // task given the CPU, NULL while the scheduler or main has it
+static __thread struct Host_Task *_self = NULL;
+static uint64_t _turn = 0;
+static struct Host_EventEntry *_events = NULL;
+static uint64_t _event_order = 0;
+static uint64_t _now = 0;
+static uint32_t _failed = 0; // checks of the test
+static uint8_t _suspended = 0;
+
+void Host_Assert(const char *expr, const char *file, int line)
+{
+	fprintf(stderr, "%s:%d: assertion failed: %s\n", file, line, expr);
+	abort();
+}
+
+static void _take_cpu()
+{
+	if (!_cpu_taken)
+	{
+		pthread_mutex_lock(&_cpu);
+		_cpu_taken = 1;
+	}
+}
+
+uint64_t Host_Now()
+{
+	return _now;
+}
+
+void Host_At(uint64_t time_us, Host_Event event, void *arg)
+{
+	struct Host_EventEntry *entry = malloc(sizeof(*entry));
+	struct Host_EventEntry **p;
+
+	entry->time = time_us < _now ? _now : time_us;
+	entry->order = _event_order++;
+	entry->event = event;
+	entry->arg = arg;
+
+	for (p = &_events; *p != NULL && (*p)->time <= entry->time; p = &(*p)->next)
+		;
+	entry->next = *p;
+	*p = entry;
+}
+
+// the DMA address registers hold 32 bits, large blocks from malloc would be mapped above 4 GB
+__attribute__((constructor)) static void _low_heap()
+{
+	mallopt(M_MMAP_THRESHOLD, 32 * 1024 * 1024);
+}
+
+void *Host_Pointer(uint32_t addr)
+{
+	// a buffer on the stack of the calling thread, otherwise static data or the heap below 4 GB
+	uintptr_t local = (uintptr_t)&local;
+	uintptr_t stack = (local & ~(uintptr_t)0xffffffff) | addr;
+
+	if (stack > local - HOST_STACK_SIZE && stack < local + 8 * HOST_STACK_SIZE)
+		return (void *)stack;
+
+	return (void *)(uintptr_t)addr;
+}
+
+uint32_t Host_Rev(uint32_t value)
+{
+	return __builtin_bswap32(value);
+}
+
+void Host_Check(uint8_t ok, const char *what)
+{
+	printf("%-60s %s\n", what, ok ? "ok" : "FAILED");
+	if (!ok)
+		++_failed;
+}
+
+uint32_t Host_Failed()
+{
+	return _failed;
+}
+
+int Host_Summary()
+{
+	printf("\n%s\n", _failed ? "FAILED" : "all checks passed");
+	return _failed ? 1 : 0;
+}
+
+static void _set_time(uint64_t time)
+{
+	_now = time;
+	DWT->CYCCNT = (uint32_t)(_now * (SystemCoreClock / 1000000));
+}
+
+static void _make_ready(struct Host_Task *task)
+{
+	task->state = HOST_READY;
+	task->wait = NULL;
+	task->turn = _turn++;
+}
+
+// wake every task blocked on object, they check again what they were waiting for
+static uint8_t _wake(const void *object)
+{
+	struct Host_Task *task;
+	uint8_t higher = 0;
+
+	for (task = _tasks; task != NULL; task = task->next)
+	{
+		if (task->state == HOST_BLOCKED && task->wait == object)
+		{
+			_make_ready(task);
+			if (_self == NULL || task->priority > _self->priority)
+				higher = 1;
+		}
+	}
+
+	return higher;
+}
+
+static uint64_t _next_time()
+{
+	uint64_t next = _events != NULL ? _events->time : HOST_NEVER;
+	struct Host_Task *task;
+
+	for (task = _tasks; task != NULL; task = task->next)
+	{
+		if ((task->state == HOST_BLOCKED || task->state == HOST_SPENDING) && task->wake < next)
+			next = task->wake;
+	}
+
+	return next;
+}
+
+// move the clock to time, running the events on the way, and wake the tasks whose time has come
+static void _advance(uint64_t time)
+{
+	struct Host_Task *task;
+
+	while (_events != NULL && _events->time <= time)
+	{
+		struct Host_EventEntry *entry = _events;
+		_events = entry->next;
+		if (entry->time > _now)
+			_set_time(entry->time);
+		entry->event(entry->arg);
+		free(entry);
+	}
+
+	if (time > _now)
+		_set_time(time);
+
+	for (task = _tasks; task != NULL; task = task->next)
+	{
+		if ((task->state == HOST_BLOCKED || task->state == HOST_SPENDING) && task->wake <= _now)
+			_make_ready(task);
+	}
+}
+
+// give the CPU back to the scheduler and wait until it hands it to this task again
+static void _switch_out()
+{
+	_current = NULL;
+	pthread_cond_signal(&_scheduler_cond);
+	while (_current != _self)
+		pthread_cond_wait(&_self->cond, &_cpu);
+}
+
+// block until object is signalled or the clock gets to wake, callers check again for what they wait for
+static void _block(const void *object, uint64_t wake)
+{
+	if (_self == NULL)
+	{
+		uint64_t next = _next_time();
+		if (wake < next)
+			next = wake;
+		if (next == HOST_NEVER)
+			Host_Assert("blocked forever with no task or event to wake up", __FILE__, __LINE__);
+		_advance(next);
+		return;
+	}
+
+	_self->state = HOST_BLOCKED;
+	_self->wait = object;
+	_self->wake = wake;
+	_switch_out();
+}
+
+static void _yield()
+{
+	if (_self == NULL || _suspended)
+		return;
+
+	_make_ready(_self);
+	_switch_out();
+}
+
+static uint64_t _deadline(TickType_t ticks)
+{
+	if (ticks == portMAX_DELAY)
+		return HOST_NEVER;
+
+	return _now + (uint64_t)ticks * (1000000 / configTICK_RATE_HZ);
+}
+
+void Host_Spend(uint32_t us)
+{
+	_take_cpu();
+
+	if (_self == NULL)
+	{
+		_advance(_now + us);
+		return;
+	}
+
+	_self->state = HOST_SPENDING;
+	_self->wake = _now + us;
+	_switch_out();
+}
+
+void Host_Sleep(uint32_t us)
+{
+	uint64_t wake;
+
+	_take_cpu();
+	wake = _now + us;
+	while (_now < wake)
+		_block(NULL, wake);
+}
+
+void Host_Stop()
+{
+	_stop = 1;
+}
+
+static void *_task_entry(void *arg)
+{
+	struct Host_Task *task = arg;
+
+	pthread_mutex_lock(&_cpu);
+	_self = task;
+	while (_current != task)
+		pthread_cond_wait(&task->cond, &_cpu);
+
+	task->code(task->param);
+
+	task->state = HOST_DONE;
+	_current = NULL;
+	pthread_cond_signal(&_scheduler_cond);
+	pthread_mutex_unlock(&_cpu);
+	return NULL;
+}
+
+BaseType_t xTaskCreate(TaskFunction_t code, const char *name, uint16_t stack_depth, void *param,
+	UBaseType_t priority, TaskHandle_t *handle)
+{
+	struct Host_Task *task = calloc(1, sizeof(*task));
+	struct Host_Task **p;
+	pthread_attr_t attr;
+
+	(void)stack_depth;
+	_take_cpu();
+
+	task->code = code;
+	task->param = param;
+	task->name = name;
+	task->priority = priority;
+	pthread_cond_init(&task->cond, NULL);
+	_make_ready(task);
+
+	for (p = &_tasks; *p != NULL; p = &(*p)->next)
+		;
+	*p = task;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, HOST_STACK_SIZE);
+	if (pthread_create(&task->thread, &attr, _task_entry, task) != 0)
+		Host_Assert("pthread_create", __FILE__, __LINE__);
+	pthread_attr_destroy(&attr);
+
+	if (handle != NULL)
+		*handle = task;
+
+	// a task created by a task of lower priority runs right away
+	if (_self != NULL && priority > _self->priority)
+		_yield();
+
+	return pdPASS;
+}
+
+void vTaskDelete(TaskHandle_t task)
+{
+	if (task != NULL && task != _self)
+	{
+		task->state = HOST_DONE;
+		return;
+	}
+
+	if (_self == NULL)
+		return;
+
+	_self->state = HOST_DONE;
+	_current = NULL;
+	pthread_cond_signal(&_scheduler_cond);
+	pthread_mutex_unlock(&_cpu);
+	pthread_exit(NULL);
+}
+
+static struct Host_Task *_pick()
+{
+	struct Host_Task *task, *best = NULL, *spending = NULL;
+
+	for (task = _tasks; task != NULL; task = task->next)
+	{
+		if (task->state == HOST_READY && (best == NULL || task->priority > best->priority
+			|| (task->priority == best->priority && task->turn < best->turn)))
+		{
+			best = task;
+		}
+		else if (task->state == HOST_SPENDING && (spending == NULL || task->priority > spending->priority))
+		{
+			spending = task;
+		}
+	}
+
+	// a task spending time keeps lower and equal priority tasks off the CPU
+	if (best != NULL && spending != NULL && spending->priority >= best->priority)
+		return NULL;
+
+	return best;
+}
+
+void vTaskStartScheduler()
+{
+	struct Host_Task *task;
+	uint64_t next;
+
+	_take_cpu();
+	_running = 1;
+
+	while (!_stop)
+	{
+		task = _pick();
+		if (task != NULL)
+		{
+			_current = task;
+			pthread_cond_signal(&task->cond);
+			while (_current != NULL)
+				pthread_cond_wait(&_scheduler_cond, &_cpu);
+			continue;
+		}
+
+		next = _next_time();
+		if (next == HOST_NEVER)
+			break;
+		_advance(next);
+	}
+
+	_running = 0;
+}
+
+void vTaskDelay(TickType_t ticks)
+{
+	// the task wakes up on a tick, ticks from the last one
+	uint64_t tick_us = 1000000 / configTICK_RATE_HZ;
+	uint64_t wake;
+
+	_take_cpu();
+	wake = (_now / tick_us + ticks) * tick_us;
+	if (ticks == 0)
+	{
+		_yield();
+		return;
+	}
+
+	while (_now < wake)
+		_block(NULL, wake);
+}
+
+void vTaskDelayUntil(TickType_t *previous_wake, TickType_t increment)
+{
+	TickType_t now = xTaskGetTickCount();
+
+	*previous_wake += increment;
+	if ((TickType_t)(*previous_wake - now) <= increment)
+		vTaskDelay(*previous_wake - now);
+}
+
+TickType_t xTaskGetTickCount()
+{
+	return (TickType_t)(_now / (1000000 / configTICK_RATE_HZ));
+}
+
+TickType_t xTaskGetTickCountFromISR()
+{
+	return xTaskGetTickCount();
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle()
+{
+	return _self;
+}
+
+void vTaskSuspendAll()
+{
+	++_suspended;
+}
+
+BaseType_t xTaskResumeAll()
+{
+	--_suspended;
+	return pdFALSE;
+}
+
+// a yield takes the CPU for a moment, so a task that spins on yields moves the clock
+void taskYIELD()
+{
+	_take_cpu();
+	_yield();
+	Host_Spend(HOST_YIELD_US);
+}
+
+BaseType_t xTaskNotifyGive(TaskHandle_t task)
+{
+	++task->notify;
+	if (_wake(&task->notify))
+		_yield();
+	return pdPASS;
+}
+
+void vTaskNotifyGiveFromISR(TaskHandle_t task, BaseType_t *higher_priority_task_woken)
+{
+	++task->notify;
+	if (_wake(&task->notify) && higher_priority_task_woken != NULL)
+		*higher_priority_task_woken = pdTRUE;
+}
+
+uint32_t ulTaskNotifyTake(BaseType_t clear_on_exit, TickType_t ticks_to_wait)
+{
+	uint64_t deadline = _deadline(ticks_to_wait);
+	uint32_t value;
+
+	_take_cpu();
+	while (_self->notify == 0 && _now < deadline)
+		_block(&_self->notify, deadline);
+
+	value = _self->notify;
+	if (value > 0)
+		_self->notify = clear_on_exit ? 0 : value - 1;
+
+	return value;
+}
+
+static SemaphoreHandle_t _create_semaphore(UBaseType_t max_count, UBaseType_t count, uint8_t is_mutex)
+{
+	struct Host_Semaphore *semaphore = calloc(1, sizeof(*semaphore));
+
+	semaphore->max_count = max_count;
+	semaphore->count = count;
+	semaphore->is_mutex = is_mutex;
+
+	return semaphore;
+}
+
+SemaphoreHandle_t xSemaphoreCreateBinary()
+{
+	return _create_semaphore(1, 0, 0);
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutex()
+{
+	return _create_semaphore(1, 1, 1);
+}
+
+SemaphoreHandle_t xSemaphoreCreateCounting(UBaseType_t max_count, UBaseType_t initial_count)
+{
+	return _create_semaphore(max_count, initial_count, 0);
+}
+
+void vSemaphoreDelete(SemaphoreHandle_t semaphore)
+{
+	free(semaphore);
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t semaphore, TickType_t ticks_to_wait)
+{
+	uint64_t deadline;
+
+	_take_cpu();
+	deadline = _deadline(ticks_to_wait);
+	while (semaphore->count == 0)
+	{
+		if (_now >= deadline)
+			return pdFALSE;
+		_block(semaphore, deadline);
+	}
+
+	--semaphore->count;
+	return pdTRUE;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t semaphore)
+{
+	if (semaphore->count >= semaphore->max_count)
+		return pdFALSE;
+
+	++semaphore->count;
+	if (_wake(semaphore))
+		_yield();
+
+	return pdTRUE;
+}
+
+BaseType_t xSemaphoreGiveFromISR(SemaphoreHandle_t semaphore, BaseType_t *higher_priority_task_woken)
+{
+	if (semaphore->count >= semaphore->max_count)
+		return pdFALSE;
+
+	++semaphore->count;
+	if (_wake(semaphore) && higher_priority_task_woken != NULL)
+		*higher_priority_task_woken = pdTRUE;
+
+	return pdTRUE;
+}
+
+UBaseType_t uxSemaphoreGetCount(SemaphoreHandle_t semaphore)
+{
+	return semaphore->count;
+}
+
+MessageBufferHandle_t xMessageBufferCreate(size_t size)
+{
+	struct Host_MessageBuffer *buffer = calloc(1, sizeof(*buffer));
+
+	buffer->data = malloc(size);
+	buffer->size = size;
+
+	return buffer;
+}
+
+void vMessageBufferDelete(MessageBufferHandle_t buffer)
+{
+	free(buffer->data);
+	free(buffer);
+}
+
+static void _ring_put(MessageBufferHandle_t buffer, const void *data, size_t len)
+{
+	const uint8_t *p = data;
+	size_t i;
+
+	for (i = 0; i < len; ++i)
+		buffer->data[(buffer->head + buffer->used++) % buffer->size] = p[i];
+}
+
+static void _ring_get(MessageBufferHandle_t buffer, void *data, size_t len)
+{
+	uint8_t *p = data;
+	size_t i;
+
+	for (i = 0; i < len; ++i)
+	{
+		if (p != NULL)
+			p[i] = buffer->data[buffer->head];
+		buffer->head = (buffer->head + 1) % buffer->size;
+		--buffer->used;
+	}
+}
+
+static size_t _send(MessageBufferHandle_t buffer, const void *data, size_t len)
+{
+	uint32_t prefix = (uint32_t)len;
+
+	if (buffer->size - buffer->used < len + sizeof(prefix))
+		return 0;
+
+	_ring_put(buffer, &prefix, sizeof(prefix));
+	_ring_put(buffer, data, len);
+	return len;
+}
+
+size_t xMessageBufferSend(MessageBufferHandle_t buffer, const void *data, size_t len, TickType_t ticks_to_wait)
+{
+	uint64_t deadline;
+	size_t sent;
+
+	_take_cpu();
+	deadline = _deadline(ticks_to_wait);
+	while ((sent = _send(buffer, data, len)) == 0 && _now < deadline)
+		_block(buffer, deadline);
+
+	if (sent > 0 && _wake(buffer))
+		_yield();
+
+	return sent;
+}
+
+size_t xMessageBufferSendFromISR(MessageBufferHandle_t buffer, const void *data, size_t len,
+	BaseType_t *higher_priority_task_woken)
+{
+	size_t sent = _send(buffer, data, len);
+
+	if (sent > 0 && _wake(buffer) && higher_priority_task_woken != NULL)
+		*higher_priority_task_woken = pdTRUE;
+
+	return sent;
+}
+
+size_t xMessageBufferReceive(MessageBufferHandle_t buffer, void *data, size_t len, TickType_t ticks_to_wait)
+{
+	uint64_t deadline;
+	uint32_t prefix;
+
+	_take_cpu();
+	deadline = _deadline(ticks_to_wait);
+	while (buffer->used == 0)
+	{
+		if (_now >= deadline)
+			return 0;
+		_block(buffer, deadline);
+	}
+
+	// a message too long for the caller stays in the buffer
+	prefix = buffer->data[buffer->head] | buffer->data[(buffer->head + 1) % buffer->size] << 8
+		| buffer->data[(buffer->head + 2) % buffer->size] << 16 | (uint32_t)buffer->data[(buffer->head + 3) % buffer->size] << 24;
+	if (prefix > len)
+		return 0;
+
+	_ring_get(buffer, NULL, sizeof(prefix));
+	_ring_get(buffer, data, prefix);
+	if (_wake(buffer))
+		_yield();
+
+	return prefix;
+}
+
+size_t xMessageBufferSpaceAvailable(MessageBufferHandle_t buffer)
+{
+	return buffer->size - buffer->used;
+}
+
+BaseType_t xMessageBufferReset(MessageBufferHandle_t buffer)
+{
+	buffer->head = 0;
+	buffer->used = 0;
+	return pdPASS;
+}
+
+BaseType_t xMessageBufferIsEmpty(MessageBufferHandle_t buffer)
+{
+	return buffer->used == 0;
+}
+
+// Interrupt controller, DMA flags and CRC unit. The other peripherals are the StdPeriph drivers on the register
+// blocks above, and the simulations in sdio.c and usart.c.
+
+void NVIC_Init(NVIC_InitTypeDef *NVIC_InitStruct)
+{
+	(void)NVIC_InitStruct;
+}
+
+void NVIC_PriorityGroupConfig(uint32_t NVIC_PriorityGroup)
+{
+	(void)NVIC_PriorityGroup;
+}
+
+void Host_SyncDMA()
+{
+	uint8_t i;
+
+	for (i = 0; i < 2; ++i)
+	{
+		*(volatile uint32_t *)&Host_DMA[i].LISR &= ~Host_DMA[i].LIFCR;
+		*(volatile uint32_t *)&Host_DMA[i].HISR &= ~Host_DMA[i].HIFCR;
+		Host_DMA[i].LIFCR = 0;
+		Host_DMA[i].HIFCR = 0;
+	}
+}
+
+void CRC_ResetDR()
+{
+	CRC->DR = 0xffffffff;
+}
+
+uint32_t CRC_CalcCRC(uint32_t Data)
+{
+	uint32_t crc = CRC->DR ^ Data;
+	uint8_t bit;
+
+	for (bit = 0; bit < 32; ++bit)
+		crc = (crc & 0x80000000) ? (crc << 1) ^ 0x04C11DB7 : crc << 1;
+
+	CRC->DR = crc;
+	return crc;
+}
+
+uint32_t CRC_CalcBlockCRC(uint32_t pBuffer[], uint32_t BufferLength)
+{
+	uint32_t i;
+
+	for (i = 0; i < BufferLength; ++i)
+		CRC_CalcCRC(pBuffer[i]);
+
+	return CRC->DR;
+}
+
+uint32_t CRC_GetCRC()
+{
+	return CRC->DR;
+}
@@ -0,0 +1,49 @@
+/* host.h
+ * Host side of the firmware for the tools, a simulated clock, FreeRTOS tasks run one at a time on it, and the
+ * peripherals the sources touch
+ *
+ * Time only moves when every task is blocked, or when a task spends time with Host_Spend. Interrupts are
+ * events on the clock, they run between tasks, never in the middle of one, so a critical section is the
+ * code between two blocking calls. The DMA address registers hold 32 bits, the firmware writes the low 32
+ * bits of a uintptr_t to them. Link with -no-pie so static buffers are below 4 GB and those bits still point
+ * at them, see Host_Pointer. */
+
+#ifndef HOST_H
+#define HOST_H
+
+#include <stdint.h>
+
+typedef void (*Host_Event)(void *arg);
+
+// simulated time since start, in microseconds
+uint64_t Host_Now();
+
+// run event at time_us, or as soon as the clock gets there if that is in the past
+void Host_At(uint64_t time_us, Host_Event event, void *arg);
+
+// the calling task keeps the CPU for us, tasks of higher priority woken in the meantime get it first
+void Host_Spend(uint32_t us);
+
+// block the calling task for us without taking the CPU, like waiting on a transfer
+void Host_Sleep(uint32_t us);
+
+// stop the scheduler, vTaskStartScheduler returns once the calling task blocks or returns
+void Host_Stop();
+
+// the pointer a 32 bit DMA address stands for, see above
+void *Host_Pointer(uint32_t addr);
+
+// the write-1-to-clear flag registers of the DMA controllers are plain memory on the host, clear the flags
+// written to them, for the simulations to call before and after raising the DMA interrupts
+void Host_SyncDMA();
+
+// print a check of a test, ok or FAILED, and count it if it failed
+void Host_Check(uint8_t ok, const char *what);
+
+// checks failed so far
+uint32_t Host_Failed();
+
+// print whether every check passed, returns the exit status of the test
+int Host_Summary();
+
+#endif
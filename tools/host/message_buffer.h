@@ -0,0 +1,22 @@
+/* message_buffer.h
+ * Host stand-in for the FreeRTOS message buffer API. Every message takes a 4 byte length on top of its
+ * data, as it does on the target. */
+
+#ifndef HOST_MESSAGE_BUFFER_H
+#define HOST_MESSAGE_BUFFER_H
+
+#include "FreeRTOS.h"
+
+typedef struct Host_MessageBuffer *MessageBufferHandle_t;
+
+MessageBufferHandle_t xMessageBufferCreate(size_t size);
+void vMessageBufferDelete(MessageBufferHandle_t buffer);
+size_t xMessageBufferSend(MessageBufferHandle_t buffer, const void *data, size_t len, TickType_t ticks_to_wait);
+size_t xMessageBufferSendFromISR(MessageBufferHandle_t buffer, const void *data, size_t len,
+	BaseType_t *higher_priority_task_woken);
+size_t xMessageBufferReceive(MessageBufferHandle_t buffer, void *data, size_t len, TickType_t ticks_to_wait);
+size_t xMessageBufferSpaceAvailable(MessageBufferHandle_t buffer);
+BaseType_t xMessageBufferReset(MessageBufferHandle_t buffer);
+BaseType_t xMessageBufferIsEmpty(MessageBufferHandle_t buffer);
+
+#endif
@@ -0,0 +1,58 @@
+/* minmea.c
+ * Host stand-in for minmea, see minmea.h */
+
+#include <string.h>
+
+#include "minmea.h"
+
+__attribute__((weak)) enum minmea_sentence_id minmea_sentence_id(const char *sentence, bool strict)
+{
+	static const char *types[] = {"RMC", "GGA", "GSA", "GLL", "GST", "GSV", "VTG", "ZDA"};
+	uint8_t i;
+
+	(void)strict;
+	if (sentence[0] != '$' || strlen(sentence) < 6)
+		return MINMEA_INVALID;
+
+	for (i = 0; i < sizeof(types) / sizeof(types[0]); ++i)
+	{
+		if (memcmp(&sentence[3], types[i], 3) == 0)
+			return (enum minmea_sentence_id)(MINMEA_SENTENCE_RMC + i);
+	}
+
+	return MINMEA_UNKNOWN;
+}
+
+bool minmea_parse_gsa(struct minmea_sentence_gsa *frame, const char *sentence)
+{
+	(void)frame;
+	(void)sentence;
+	return false;
+}
+
+bool minmea_parse_vtg(struct minmea_sentence_vtg *frame, const char *sentence)
+{
+	(void)frame;
+	(void)sentence;
+	return false;
+}
+
+int minmea_gettime(struct timespec *ts, const struct minmea_date *date, const struct minmea_time *time_)
+{
+	struct tm tm;
+
+	if (date->year < 0 || time_->hours < 0)
+		return -1;
+
+	memset(&tm, 0, sizeof(tm));
+	tm.tm_year = date->year + 100;
+	tm.tm_mon = date->month - 1;
+	tm.tm_mday = date->day;
+	tm.tm_hour = time_->hours;
+	tm.tm_min = time_->minutes;
+	tm.tm_sec = time_->seconds;
+
+	ts->tv_sec = timegm(&tm);
+	ts->tv_nsec = time_->microseconds * 1000;
+	return 0;
+}
@@ -0,0 +1,76 @@
+/* minmea.h
+ * Host stand-in for minmea, which is not in the tree. gps.c hands it the sentences it does not parse itself,
+ * the stand-in tells them apart by their type and parses none of them. A tool that wants to see what gps.c
+ * hands over has its own minmea_sentence_id, the one here is weak. nmeatest built with MINMEA gets the real
+ * one. */
+
+#ifndef HOST_MINMEA_H
+#define HOST_MINMEA_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+enum minmea_sentence_id
+{
+	MINMEA_INVALID = -1,
+	MINMEA_UNKNOWN = 0,
+	MINMEA_SENTENCE_RMC,
+	MINMEA_SENTENCE_GGA,
+	MINMEA_SENTENCE_GSA,
+	MINMEA_SENTENCE_GLL,
+	MINMEA_SENTENCE_GST,
+	MINMEA_SENTENCE_GSV,
+	MINMEA_SENTENCE_VTG,
+	MINMEA_SENTENCE_ZDA
+};
+
+struct minmea_float
+{
+	int_least32_t value;
+	int_least32_t scale;
+};
+
+struct minmea_date
+{
+	int day;
+	int month;
+	int year;
+};
+
+struct minmea_time
+{
+	int hours;
+	int minutes;
+	int seconds;
+	int microseconds;
+};
+
+struct minmea_sentence_gsa
+{
+	char mode;
+	int fix_type;
+	int sats[12];
+	struct minmea_float pdop;
+	struct minmea_float hdop;
+	struct minmea_float vdop;
+};
+
+struct minmea_sentence_vtg
+{
+	struct minmea_float true_track_degrees;
+	struct minmea_float magnetic_track_degrees;
+	struct minmea_float speed_knots;
+	struct minmea_float speed_kph;
+};
+
+enum minmea_sentence_id minmea_sentence_id(const char *sentence, bool strict);
+
+bool minmea_parse_gsa(struct minmea_sentence_gsa *frame, const char *sentence);
+
+bool minmea_parse_vtg(struct minmea_sentence_vtg *frame, const char *sentence);
+
+// the date has years since 2000, as gps.c keeps it
+int minmea_gettime(struct timespec *ts, const struct minmea_date *date, const struct minmea_time *time_);
+
+#endif
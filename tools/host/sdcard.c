@@ -0,0 +1,277 @@
+/* sdcard.c
+ * Host model of the SD driver, the SD_* functions of inc/sd.h on the card model of card.h, for tools that
+ * run the file system and the logger without src/sd.c and the SDIO simulation
+ *
+ * Link it in place of ../src/sd.c and host/sdio.c. Every call sends the commands src/sd.c would send and
+ * takes the time they take: the CPU polls for each response, a block transfer blocks the calling task for
+ * the access time and the data on the bus, and the busy time after a write or an erase is waited out one
+ * tick at a time, like the driver polls D0. */
+
+#include <string.h>
+
+#include "stm32f4xx.h"
+#include "FreeRTOS.h"
+#include "task.h"
+#include "host.h"
+#include "card.h"
+#include "sd.h"
+
+#define SDCARD_INIT_HZ 400000 // bus clock during identification
+#define SDCARD_INIT_COMMANDS 12 // CMD0 up to the first ACMD41, and CMD2 up to CMD16 once the card is ready
+#define SDCARD_COMMAND_BITS (48 + 48 + 8) // command, response and the turnaround between them
+#define SDCARD_BLOCK_BITS (512 * 8) // data bits of a block, spread over the data lines
+#define SDCARD_BLOCK_OVERHEAD_BITS (16 + 2) // CRC, start and end bit on each line
+#define SDCARD_BUSY_TIMEOUT_MS 500
+#define SDCARD_ERASE_TIMEOUT_MS 2000
+#define SDCARD_ERASE_CHUNK 8192
+
+static struct SD_Stats _stats = {0};
+static uint8_t _is_up = 0;
+static uint8_t _is_starting = 0;
+static uint64_t _init_start = 0;
+static uint32_t _cid[4] = {0};
+
+static uint32_t _bus_hz()
+{
+	return _is_up ? Card_GetParams()->bus_hz : SDCARD_INIT_HZ;
+}
+
+static uint32_t _bits_us(uint64_t bits)
+{
+	return (uint32_t)((bits * 1000000 + _bus_hz() - 1) / _bus_hz());
+}
+
+// the CPU polls for the response, returns 0 if the card does not answer
+static uint8_t _command()
+{
+	++_stats.commands;
+	Host_Spend(_bits_us(SDCARD_COMMAND_BITS) + Card_GetParams()->cmd_us);
+
+	if (!Card_IsPowered())
+		_is_up = 0;
+
+	return _is_up;
+}
+
+// the task waits on the transfer interrupts while the blocks go over the bus
+static void _transfer(uint32_t count, uint32_t access_us)
+{
+	uint32_t width = Card_GetParams()->bus_width ? Card_GetParams()->bus_width : 1;
+
+	Host_Sleep(access_us + _bits_us((uint64_t)count * (SDCARD_BLOCK_BITS / width + SDCARD_BLOCK_OVERHEAD_BITS)));
+}
+
+// poll D0 once a tick until the card is done programming
+static uint8_t _wait_not_busy(uint32_t busy_us, uint32_t timeout_ms)
+{
+	uint64_t now = Host_Now();
+	uint64_t done = now + busy_us;
+	TickType_t start = xTaskGetTickCount();
+	uint8_t ret = 1;
+
+	while (Host_Now() < done)
+	{
+		if ((xTaskGetTickCount() - start) > pdMS_TO_TICKS(timeout_ms))
+		{
+			ret = 0;
+			break;
+		}
+
+		vTaskDelay(1);
+	}
+
+	// the driver counts the time it waited, which is rounded up to the tick
+	_stats.busy_us += (uint32_t)(Host_Now() - now);
+	return ret;
+}
+
+SDInitStatus SD_InitializeStep()
+{
+	if (!_is_starting)
+	{
+		// from CMD0 to the first ACMD41 at the identification clock
+		_is_up = 0;
+		_stats.commands += 4;
+		Host_Spend(4 * (_bits_us(SDCARD_COMMAND_BITS) + Card_GetParams()->cmd_us));
+		if (!Card_IsPowered())
+			return SD_INIT_FAILED;
+
+		_is_starting = 1;
+		_init_start = Host_Now();
+	}
+
+	// CMD55 and ACMD41 until the card reports it has powered up
+	_stats.commands += 2;
+	Host_Spend(2 * (_bits_us(SDCARD_COMMAND_BITS) + Card_GetParams()->cmd_us));
+	if (!Card_IsPowered())
+	{
+		_is_starting = 0;
+		return SD_INIT_FAILED;
+	}
+	if (Host_Now() - _init_start < (uint64_t)Card_GetParams()->ready_ms * 1000)
+		return SD_INIT_BUSY;
+
+	// identification, bus width and high speed, the card is warm from now on
+	_stats.commands += SDCARD_INIT_COMMANDS - 4;
+	Host_Spend((SDCARD_INIT_COMMANDS - 4) * (_bits_us(SDCARD_COMMAND_BITS) + Card_GetParams()->cmd_us));
+	Card_GetCID(_cid);
+	_is_starting = 0;
+	_is_up = 1;
+	return SD_INIT_DONE;
+}
+
+uint8_t SD_Initialize()
+{
+	SDInitStatus status;
+
+	while ((status = SD_InitializeStep()) == SD_INIT_BUSY)
+		vTaskDelay(pdMS_TO_TICKS(5));
+
+	return status == SD_INIT_DONE;
+}
+
+uint8_t SD_GetBusWidth()
+{
+	return _is_up ? (uint8_t)Card_GetParams()->bus_width : 1;
+}
+
+uint32_t SD_GetBusClockHz()
+{
+	return _bus_hz();
+}
+
+void SD_GetGeometry(struct SD_Geometry *geometry)
+{
+	if (geometry == NULL)
+		return;
+
+	memset(geometry, 0, sizeof(*geometry));
+	if (!_is_up)
+		return;
+
+	geometry->sectors = Card_GetParams()->sectors;
+	geometry->au_sectors = Card_GetParams()->au_sectors;
+	geometry->speed_class = (uint8_t)Card_GetParams()->speed_class;
+	geometry->uhs_speed_grade = 1;
+}
+
+void SD_GetCID(uint32_t cid[4])
+{
+	memcpy(cid, _cid, sizeof(_cid));
+}
+
+uint32_t SD_GetNumSectorsWritten()
+{
+	return _stats.sectors_written;
+}
+
+void SD_GetStats(struct SD_Stats *stats)
+{
+	if (stats != NULL)
+		*stats = _stats;
+}
+
+void SD_ResetStats()
+{
+	memset(&_stats, 0, sizeof(_stats));
+}
+
+SDCardState SD_GetStatus()
+{
+	if (!_is_up || !_command())
+		return SD_CARD_ERROR;
+
+	return SD_CARD_TRANSFER;
+}
+
+uint8_t SD_ReadBlocks(uint32_t addr, uint8_t *buf, uint32_t count)
+{
+	uint64_t start = Host_Now();
+	uint8_t ret = 0;
+
+	// CMD17, or CMD18 and CMD12
+	if (count > 0 && _command())
+	{
+		_transfer(count, Card_GetParams()->read_us);
+		ret = Card_Read(addr, buf, count) && (count == 1 || _command());
+	}
+
+	_stats.read_us += (uint32_t)(Host_Now() - start);
+	if (ret)
+		_stats.sectors_read += count;
+	else
+		++_stats.errors;
+
+	return ret;
+}
+
+uint8_t SD_WriteBlocks(uint32_t addr, const uint8_t *buf, uint32_t count)
+{
+	uint64_t start = Host_Now();
+	uint32_t pre_erase = 0;
+	uint32_t busy_us = 0;
+	uint8_t ret = 0;
+
+	// CMD55 and ACMD23 announce a run of blocks
+	if (count > 1 && _command() && _command())
+		pre_erase = count;
+
+	// CMD24, or CMD25 and CMD12, then CMD13 once the card is done
+	if (count > 0 && _command())
+	{
+		_transfer(count, 0);
+		ret = Card_Write(addr, buf, count, pre_erase, &busy_us) && (count == 1 || _command())
+			&& _wait_not_busy(busy_us, SDCARD_BUSY_TIMEOUT_MS) && SD_GetStatus() == SD_CARD_TRANSFER;
+	}
+
+	_stats.write_us += (uint32_t)(Host_Now() - start);
+	if (ret)
+		_stats.sectors_written += count;
+	else
+		++_stats.errors;
+
+	return ret;
+}
+
+uint8_t SD_ReadBlock(uint32_t addr, uint8_t *buf)
+{
+	return SD_ReadBlocks(addr, buf, 1);
+}
+
+uint8_t SD_WriteBlock(uint32_t addr, const uint8_t *buf)
+{
+	return SD_WriteBlocks(addr, buf, 1);
+}
+
+uint8_t SD_Erase(uint32_t start, uint32_t end)
+{
+	uint64_t time_start = Host_Now();
+	uint32_t chunk_end, busy_us;
+	uint8_t ret;
+
+	if (end < start)
+		return 0;
+
+	// CMD32, CMD33 and CMD38 for every chunk, like the driver does
+	for (;;)
+	{
+		chunk_end = (start / SDCARD_ERASE_CHUNK + 1) * SDCARD_ERASE_CHUNK - 1;
+		if (chunk_end > end)
+			chunk_end = end;
+		ret = _command() && _command() && _command() && Card_Erase(start, chunk_end, &busy_us)
+			&& _wait_not_busy(busy_us, SDCARD_ERASE_TIMEOUT_MS) && SD_GetStatus() == SD_CARD_TRANSFER;
+		if (!ret)
+			break;
+
+		_stats.sectors_erased += chunk_end - start + 1;
+		if (chunk_end == end)
+			break;
+		start = chunk_end + 1;
+	}
+
+	_stats.erase_us += (uint32_t)(Host_Now() - time_start);
+	if (!ret)
+		++_stats.errors;
+
+	return ret;
+}
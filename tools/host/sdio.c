@@ -0,0 +1,593 @@
+/* sdio.c
+ * Host simulation of the SDIO controller, see sdio.h
+ *
+ * The SDIO functions of the StdPeriph library are replaced by ones that act on the register block and pass
+ * the commands on to the card model. Responses are there as soon as SDIO_SendCommand returns, the time the
+ * command takes on the bus is spent by the caller, as the driver polls for the response. Block transfers
+ * run on the simulated clock and end with the DMA and SDIO interrupts, the DMA stream itself is the
+ * StdPeriph driver on the register block. */
+
+#include <string.h>
+
+#include "stm32f4xx.h"
+#include "host.h"
+#include "card.h"
+#include "sdio.h"
+
+#define SDIO_SIM_CLK_HZ 48000000
+#define SDIO_SIM_DMA_STREAM DMA2_Stream3
+#define SDIO_SIM_D0_PIN GPIO_Pin_8
+#define SDIO_SIM_REG(r) (*(volatile uint32_t *)&(r))
+#define SDIO_SIM_MAX_FIFO 16
+
+enum Sdio_CardState
+{
+	SDIO_SIM_IDLE = 0,
+	SDIO_SIM_READY = 1,
+	SDIO_SIM_IDENT = 2,
+	SDIO_SIM_STBY = 3,
+	SDIO_SIM_TRAN = 4
+};
+
+void DMA2_Stream3_IRQHandler(void);
+void SDIO_IRQHandler(void);
+
+static enum Sdio_CardState _state = SDIO_SIM_IDLE;
+static uint8_t _app = 0; // the last command was CMD55
+static uint8_t _warm = 0; // the card powered up before, ACMD41 reports ready right away
+static uint64_t _op_cond_start = 0;
+static uint8_t _op_cond_started = 0;
+static uint16_t _rca = 0x1234;
+static uint32_t _commands[128];
+static uint32_t _fail_command[128];
+static uint32_t _fail_data = 0;
+static uint32_t _pre_erase = 0; // from ACMD23, for the next write
+static uint32_t _erase_start = 0;
+static uint32_t _erase_end = 0;
+static uint64_t _busy_until = 0; // the card holds D0 low until then
+
+// a block transfer that has been set up, writes wait for the data path to be enabled
+static uint8_t _write_cmd = 0;
+static uint32_t _transfer_addr = 0;
+static uint32_t _transfer_id = 0;
+
+// words waiting in the FIFO for a polled read
+static uint32_t _fifo[SDIO_SIM_MAX_FIFO];
+static uint32_t _fifo_len = 0;
+static uint32_t _fifo_pos = 0;
+
+static uint32_t _clock_hz()
+{
+	if (SDIO->CLKCR & SDIO_CLKCR_BYPASS)
+		return SDIO_SIM_CLK_HZ;
+
+	return SDIO_SIM_CLK_HZ / ((SDIO->CLKCR & SDIO_CLKCR_CLKDIV) + 2);
+}
+
+static uint32_t _bus_width()
+{
+	return (SDIO->CLKCR & SDIO_CLKCR_WIDBUS_0) ? 4 : 1;
+}
+
+static uint32_t _bits_us(uint32_t bits)
+{
+	return (uint32_t)(((uint64_t)bits * 1000000 + _clock_hz() - 1) / _clock_hz());
+}
+
+// time a run of blocks takes on the data lines, with the CRC and the start and end bits of every block
+static uint32_t _data_us(uint32_t count)
+{
+	return _bits_us(count * (512 * 8 / _bus_width() + 16 + 2));
+}
+
+static void _set_d0(uint8_t high)
+{
+	if (high)
+		GPIOC->IDR |= SDIO_SIM_D0_PIN;
+	else
+		GPIOC->IDR &= ~SDIO_SIM_D0_PIN;
+}
+
+static void _release_d0(void *arg)
+{
+	// a later busy period moves the end out, only the last one lets go of the line
+	(void)arg;
+	if (Host_Now() >= _busy_until)
+		_set_d0(1);
+}
+
+static void _busy(uint32_t us)
+{
+	_set_d0(0);
+	_busy_until = Host_Now() + us;
+	Host_At(_busy_until, _release_d0, NULL);
+}
+
+void Sdio_Attach()
+{
+	memset(&Host_SDIO, 0, sizeof(Host_SDIO));
+	_state = SDIO_SIM_IDLE;
+	_warm = 0;
+	_op_cond_started = 0;
+	_set_d0(1);
+}
+
+uint32_t Sdio_GetCommands(uint8_t index)
+{
+	return _commands[index & 127];
+}
+
+uint32_t Sdio_GetTotalCommands()
+{
+	uint32_t total = 0;
+	uint8_t i;
+
+	for (i = 0; i < 128; ++i)
+		total += _commands[i];
+
+	return total;
+}
+
+void Sdio_ResetCommands()
+{
+	memset(_commands, 0, sizeof(_commands));
+}
+
+void Sdio_FailCommand(uint8_t index, uint32_t count)
+{
+	_fail_command[index & 127] = count;
+}
+
+void Sdio_FailData(uint32_t count)
+{
+	_fail_data = count;
+}
+
+static void _fifo_load(const uint8_t *data, uint32_t len)
+{
+	_fifo_len = len / 4;
+	_fifo_pos = 0;
+	memcpy(_fifo, data, len);
+	SDIO_SIM_REG(SDIO->STA) |= SDIO_FLAG_RXDAVL;
+}
+
+static void _interrupts()
+{
+	Host_SyncDMA();
+
+	if ((SDIO_SIM_DMA_STREAM->CR & DMA_SxCR_TCIE) && (DMA2->LISR & DMA_LISR_TCIF3))
+		DMA2_Stream3_IRQHandler();
+
+	if (SDIO->MASK & SDIO->STA & (SDIO_IT_DCRCFAIL | SDIO_IT_DTIMEOUT | SDIO_IT_DATAEND | SDIO_IT_TXUNDERR | SDIO_IT_RXOVERR))
+		SDIO_IRQHandler();
+
+	Host_SyncDMA();
+}
+
+// the DMA and the data path can be torn down while the transfer is on the bus, it only completes if
+// neither was
+static uint8_t _transfer_armed(uint32_t id)
+{
+	return id == _transfer_id && (SDIO->DCTRL & SDIO_DCTRL_DTEN) && (SDIO->DCTRL & SDIO_DCTRL_DMAEN)
+		&& (SDIO_SIM_DMA_STREAM->CR & DMA_SxCR_EN);
+}
+
+static void _complete(uint32_t data_flags)
+{
+	SDIO_SIM_REG(SDIO->STA) |= data_flags;
+	SDIO->DCTRL &= ~SDIO_DCTRL_DTEN;
+	if (data_flags & SDIO_FLAG_DATAEND)
+	{
+		SDIO_SIM_DMA_STREAM->CR &= ~DMA_SxCR_EN;
+		SDIO_SIM_REG(DMA2->LISR) |= DMA_LISR_TCIF3;
+	}
+
+	_interrupts();
+}
+
+static uint8_t _data_fails()
+{
+	if (_fail_data == 0)
+		return 0;
+
+	--_fail_data;
+	return 1;
+}
+
+static void _read_done(void *arg)
+{
+	uint32_t id = (uint32_t)(uintptr_t)arg;
+	uint32_t count = SDIO->DLEN / 512;
+
+	if (!_transfer_armed(id))
+		return;
+
+	if (_data_fails())
+		_complete(SDIO_FLAG_DCRCFAIL);
+	else if (!Card_Read(_transfer_addr, Host_Pointer(SDIO_SIM_DMA_STREAM->M0AR), count))
+		_complete(SDIO_FLAG_DTIMEOUT);
+	else
+		_complete(SDIO_FLAG_DATAEND | SDIO_FLAG_DBCKEND);
+}
+
+static void _write_done(void *arg)
+{
+	uint32_t id = (uint32_t)(uintptr_t)arg;
+	uint32_t count = SDIO->DLEN / 512;
+	uint32_t busy_us;
+
+	if (!_transfer_armed(id))
+		return;
+
+	if (_data_fails())
+	{
+		_complete(SDIO_FLAG_DCRCFAIL);
+		return;
+	}
+
+	if (!Card_Write(_transfer_addr, Host_Pointer(SDIO_SIM_DMA_STREAM->M0AR), count, _pre_erase, &busy_us))
+	{
+		_complete(SDIO_FLAG_DTIMEOUT);
+		return;
+	}
+
+	_pre_erase = 0;
+	_busy(busy_us);
+	_complete(SDIO_FLAG_DATAEND | SDIO_FLAG_DBCKEND);
+}
+
+static void _start_read(uint32_t addr)
+{
+	uint32_t count = SDIO->DLEN / 512;
+
+	_transfer_addr = addr;
+	++_transfer_id;
+	Host_At(Host_Now() + Card_GetParams()->read_us + _data_us(count), _read_done, (void *)(uintptr_t)_transfer_id);
+}
+
+static void _start_write()
+{
+	uint32_t count = SDIO->DLEN / 512;
+
+	++_transfer_id;
+	Host_At(Host_Now() + _data_us(count), _write_done, (void *)(uintptr_t)_transfer_id);
+}
+
+// the polled reads of the card registers, SCR, switch function status and SD status, MSB first
+static void _send_scr()
+{
+	static const uint8_t scr[8] = {0x02, 0x05, 0x80, 0x00, 0x00, 0x00, 0x00, 0x00}; // spec 2.0, 1 and 4 bit bus
+	_fifo_load(scr, sizeof(scr));
+}
+
+static void _send_switch_status(uint32_t arg)
+{
+	uint8_t status[64] = {0};
+
+	status[13] = 0x03; // group 1 supports default and high speed
+	status[16] = (arg & 0x0F) == 0x1 ? 0x01 : 0x00;
+	_fifo_load(status, sizeof(status));
+}
+
+static void _send_sd_status()
+{
+	static const uint8_t speed_class[] = {0, 0, 1, 0, 2, 0, 3, 0, 0, 0, 4}; // MB/s to the class code
+	uint8_t status[64] = {0};
+	uint32_t au = Card_GetParams()->au_sectors;
+	uint8_t au_size = 0;
+
+	status[8] = Card_GetParams()->speed_class <= 10 ? speed_class[Card_GetParams()->speed_class] : 0;
+	while (au_size < 9 && (32u << au_size) < au)
+		++au_size;
+	status[10] = (uint8_t)((au_size + 1) << 4);
+	status[14] = 0x10; // UHS speed grade 1
+	_fifo_load(status, sizeof(status));
+}
+
+static void _response(uint8_t cmd, uint32_t resp1)
+{
+	SDIO_SIM_REG(SDIO->RESPCMD) = cmd;
+	SDIO_SIM_REG(SDIO->RESP1) = resp1;
+	SDIO_SIM_REG(SDIO->STA) |= SDIO_FLAG_CMDREND;
+}
+
+static uint32_t _r1(uint8_t app)
+{
+	return ((uint32_t)_state << 9) | 0x100 | (app ? 0x20 : 0);
+}
+
+static void _long_response(const uint32_t *words)
+{
+	SDIO_SIM_REG(SDIO->RESPCMD) = 0x3F;
+	SDIO_SIM_REG(SDIO->RESP1) = words[0];
+	SDIO_SIM_REG(SDIO->RESP2) = words[1];
+	SDIO_SIM_REG(SDIO->RESP3) = words[2];
+	SDIO_SIM_REG(SDIO->RESP4) = words[3];
+	SDIO_SIM_REG(SDIO->STA) |= SDIO_FLAG_CMDREND;
+}
+
+static void _command(uint8_t cmd, uint32_t arg)
+{
+	struct Card_Params *card = Card_GetParams();
+	uint8_t app = _app && cmd != 55; // a second CMD55 is taken as CMD55 again
+	uint8_t index = (app ? SDIO_SIM_APP_CMD : 0) + cmd;
+	uint32_t busy_us;
+
+	_app = 0;
+	++_commands[index];
+
+	if (!Card_IsPowered() || _fail_command[index] > 0)
+	{
+		if (_fail_command[index] > 0)
+			--_fail_command[index];
+		if (!Card_IsPowered())
+			_warm = 0;
+		SDIO_SIM_REG(SDIO->STA) |= cmd == 0 ? SDIO_FLAG_CMDSENT : SDIO_FLAG_CTIMEOUT;
+		return;
+	}
+
+	switch (index)
+	{
+	case 0:
+		_state = SDIO_SIM_IDLE;
+		_op_cond_started = 0;
+		SDIO_SIM_REG(SDIO->STA) |= SDIO_FLAG_CMDSENT;
+		break;
+	case 2:
+		{
+			uint32_t cid[4];
+
+			Card_GetCID(cid);
+			_long_response(cid);
+			_state = SDIO_SIM_IDENT;
+		}
+		break;
+	case 3:
+		_state = SDIO_SIM_STBY;
+		_response(cmd, ((uint32_t)_rca << 16) | ((uint32_t)_state << 9) | 0x100);
+		break;
+	case 6:
+		_response(cmd, _r1(0));
+		if (SDIO->DCTRL & SDIO_DCTRL_DTEN)
+			_send_switch_status(arg);
+		break;
+	case 7:
+		_state = (arg >> 16) == _rca ? SDIO_SIM_TRAN : SDIO_SIM_STBY;
+		_response(cmd, _r1(0));
+		break;
+	case 8:
+		_response(cmd, arg & 0xFFF);
+		break;
+	case 9:
+		{
+			// CSD version 2.0, (C_SIZE + 1) * 512 KB, single blocks can be erased
+			uint32_t c_size = card->sectors / 1024 - 1;
+			uint32_t csd[4] = {0x400E0032, 0x5B590000 | (c_size >> 16), (c_size << 16) | 0x7F80 | 0x4000, 0x0A400000};
+			_long_response(csd);
+		}
+		break;
+	case 12:
+		_response(cmd, _r1(0));
+		break;
+	case 13:
+		_response(cmd, _r1(0));
+		break;
+	case 16:
+		_response(cmd, _r1(0));
+		break;
+	case 17:
+	case 18:
+		_response(cmd, _r1(0));
+		_start_read(arg);
+		break;
+	case 24:
+	case 25:
+		_response(cmd, _r1(0));
+		_write_cmd = cmd;
+		_transfer_addr = arg;
+		if (SDIO->DCTRL & SDIO_DCTRL_DTEN)
+			_start_write();
+		break;
+	case 32:
+		_erase_start = arg;
+		_response(cmd, _r1(0));
+		break;
+	case 33:
+		_erase_end = arg;
+		_response(cmd, _r1(0));
+		break;
+	case 38:
+		_response(cmd, _r1(0));
+		if (Card_Erase(_erase_start, _erase_end, &busy_us))
+			_busy(busy_us);
+		break;
+	case 55:
+		_app = 1;
+		_response(cmd, _r1(1));
+		break;
+	case SDIO_SIM_APP_CMD + 6:
+		_response(cmd, _r1(1));
+		break;
+	case SDIO_SIM_APP_CMD + 13:
+		_response(cmd, _r1(1));
+		if (SDIO->DCTRL & SDIO_DCTRL_DTEN)
+			_send_sd_status();
+		break;
+	case SDIO_SIM_APP_CMD + 23:
+		_pre_erase = arg & 0x007FFFFF;
+		_response(cmd, _r1(1));
+		break;
+	case SDIO_SIM_APP_CMD + 41:
+		{
+			uint32_t ocr = 0x00FF8000;
+			if (!_op_cond_started)
+			{
+				_op_cond_started = 1;
+				_op_cond_start = Host_Now();
+			}
+			if (_warm || Host_Now() - _op_cond_start >= (uint64_t)card->ready_ms * 1000)
+			{
+				ocr |= 0xC0000000; // powered up, high capacity
+				_warm = 1;
+				_state = SDIO_SIM_READY;
+			}
+			// R3 comes without a CRC, the controller flags it as failed
+			SDIO_SIM_REG(SDIO->RESPCMD) = 0x3F;
+			SDIO_SIM_REG(SDIO->RESP1) = ocr;
+			SDIO_SIM_REG(SDIO->STA) |= SDIO_FLAG_CCRCFAIL;
+		}
+		break;
+	case SDIO_SIM_APP_CMD + 51:
+		_response(cmd, _r1(1));
+		if (SDIO->DCTRL & SDIO_DCTRL_DTEN)
+			_send_scr();
+		break;
+	default:
+		SDIO_SIM_REG(SDIO->STA) |= SDIO_FLAG_CTIMEOUT;
+		break;
+	}
+}
+
+void SDIO_DeInit(void)
+{
+	memset(&Host_SDIO, 0, sizeof(Host_SDIO));
+}
+
+void SDIO_Init(SDIO_InitTypeDef *SDIO_InitStruct)
+{
+	SDIO->CLKCR = (SDIO->CLKCR & SDIO_CLKCR_CLKEN) | SDIO_InitStruct->SDIO_ClockDiv | SDIO_InitStruct->SDIO_ClockPowerSave
+		| SDIO_InitStruct->SDIO_ClockBypass | SDIO_InitStruct->SDIO_BusWide | SDIO_InitStruct->SDIO_ClockEdge
+		| SDIO_InitStruct->SDIO_HardwareFlowControl;
+}
+
+void SDIO_StructInit(SDIO_InitTypeDef *SDIO_InitStruct)
+{
+	SDIO_InitStruct->SDIO_ClockDiv = 0x00;
+	SDIO_InitStruct->SDIO_ClockEdge = SDIO_ClockEdge_Rising;
+	SDIO_InitStruct->SDIO_ClockBypass = SDIO_ClockBypass_Disable;
+	SDIO_InitStruct->SDIO_ClockPowerSave = SDIO_ClockPowerSave_Disable;
+	SDIO_InitStruct->SDIO_BusWide = SDIO_BusWide_1b;
+	SDIO_InitStruct->SDIO_HardwareFlowControl = SDIO_HardwareFlowControl_Disable;
+}
+
+void SDIO_ClockCmd(FunctionalState NewState)
+{
+	if (NewState == ENABLE)
+		SDIO->CLKCR |= SDIO_CLKCR_CLKEN;
+	else
+		SDIO->CLKCR &= ~SDIO_CLKCR_CLKEN;
+}
+
+void SDIO_SetPowerState(uint32_t SDIO_PowerState)
+{
+	SDIO->POWER = SDIO_PowerState;
+}
+
+void SDIO_SendCommand(SDIO_CmdInitTypeDef *SDIO_CmdInitStruct)
+{
+	uint32_t bits = 48 + 8;
+
+	SDIO->ARG = SDIO_CmdInitStruct->SDIO_Argument;
+	SDIO->CMD = SDIO_CmdInitStruct->SDIO_CmdIndex | SDIO_CmdInitStruct->SDIO_Response | SDIO_CmdInitStruct->SDIO_Wait
+		| SDIO_CmdInitStruct->SDIO_CPSM;
+
+	if (SDIO_CmdInitStruct->SDIO_Response == SDIO_Response_Short)
+		bits += 48;
+	else if (SDIO_CmdInitStruct->SDIO_Response == SDIO_Response_Long)
+		bits += 136;
+
+	Host_SyncDMA();
+	_command((uint8_t)SDIO_CmdInitStruct->SDIO_CmdIndex, SDIO_CmdInitStruct->SDIO_Argument);
+
+	// the driver spins on the status register until the response is in
+	Host_Spend(_bits_us(bits) + Card_GetParams()->cmd_us);
+}
+
+uint8_t SDIO_GetCommandResponse(void)
+{
+	return (uint8_t)SDIO->RESPCMD;
+}
+
+uint32_t SDIO_GetResponse(uint32_t SDIO_RESP)
+{
+	switch (SDIO_RESP)
+	{
+	case SDIO_RESP1:
+		return SDIO->RESP1;
+	case SDIO_RESP2:
+		return SDIO->RESP2;
+	case SDIO_RESP3:
+		return SDIO->RESP3;
+	default:
+		return SDIO->RESP4;
+	}
+}
+
+void SDIO_DataConfig(SDIO_DataInitTypeDef *SDIO_DataInitStruct)
+{
+	SDIO->DTIMER = SDIO_DataInitStruct->SDIO_DataTimeOut;
+	SDIO->DLEN = SDIO_DataInitStruct->SDIO_DataLength;
+	SDIO->DCTRL = (SDIO->DCTRL & SDIO_DCTRL_DMAEN) | SDIO_DataInitStruct->SDIO_DataBlockSize
+		| SDIO_DataInitStruct->SDIO_TransferDir | SDIO_DataInitStruct->SDIO_TransferMode | SDIO_DataInitStruct->SDIO_DPSM;
+
+	// a write goes out once the card has taken the command and the data path is enabled
+	Host_SyncDMA();
+	if ((SDIO->DCTRL & SDIO_DCTRL_DTEN) && !(SDIO->DCTRL & SDIO_DCTRL_DTDIR) && _write_cmd)
+	{
+		_write_cmd = 0;
+		_start_write();
+	}
+}
+
+uint32_t SDIO_ReadData(void)
+{
+	uint32_t word = 0;
+
+	if (_fifo_pos < _fifo_len)
+		word = _fifo[_fifo_pos++];
+
+	if (_fifo_pos >= _fifo_len)
+	{
+		SDIO_SIM_REG(SDIO->STA) &= ~SDIO_FLAG_RXDAVL;
+		SDIO_SIM_REG(SDIO->STA) |= SDIO_FLAG_DBCKEND | SDIO_FLAG_DATAEND;
+		SDIO->DCTRL &= ~SDIO_DCTRL_DTEN;
+	}
+
+	return word;
+}
+
+void SDIO_DMACmd(FunctionalState NewState)
+{
+	if (NewState == ENABLE)
+		SDIO->DCTRL |= SDIO_DCTRL_DMAEN;
+	else
+		SDIO->DCTRL &= ~SDIO_DCTRL_DMAEN;
+}
+
+void SDIO_ITConfig(uint32_t SDIO_IT, FunctionalState NewState)
+{
+	if (NewState == ENABLE)
+		SDIO->MASK |= SDIO_IT;
+	else
+		SDIO->MASK &= ~SDIO_IT;
+}
+
+FlagStatus SDIO_GetFlagStatus(uint32_t SDIO_FLAG)
+{
+	return (SDIO->STA & SDIO_FLAG) ? SET : RESET;
+}
+
+void SDIO_ClearFlag(uint32_t SDIO_FLAG)
+{
+	SDIO_SIM_REG(SDIO->STA) &= ~SDIO_FLAG;
+}
+
+ITStatus SDIO_GetITStatus(uint32_t SDIO_IT)
+{
+	return (SDIO->STA & SDIO_IT) ? SET : RESET;
+}
+
+void SDIO_ClearITPendingBit(uint32_t SDIO_IT)
+{
+	SDIO_SIM_REG(SDIO->STA) &= ~SDIO_IT;
+}
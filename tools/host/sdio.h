@@ -0,0 +1,28 @@
+/* sdio.h
+ * Host simulation of the SDIO controller and its DMA stream, with the card model of card.h on the bus, for
+ * running src/sd.c on the host */
+
+#ifndef SDIO_H
+#define SDIO_H
+
+#include <stdint.h>
+
+#define SDIO_SIM_APP_CMD 64 // added to the index of application commands for the counters
+
+// put the card on the bus, Card_Open first
+void Sdio_Attach();
+
+// commands the card received with this index, SDIO_SIM_APP_CMD + index for ACMDs
+uint32_t Sdio_GetCommands(uint8_t index);
+
+uint32_t Sdio_GetTotalCommands();
+
+void Sdio_ResetCommands();
+
+// the next count commands with this index get no response, SDIO_SIM_APP_CMD + index for ACMDs
+void Sdio_FailCommand(uint8_t index, uint32_t count);
+
+// the next count data transfers end with a data CRC error
+void Sdio_FailData(uint32_t count);
+
+#endif
@@ -0,0 +1,90 @@
+/* stm32f4xx.h
+ * Host stand-in for the device header, the real one with the peripherals the firmware uses moved to
+ * register blocks in host memory. Their addresses are pointers of the host, code that puts one in a 32 bit
+ * register casts it through uintptr_t, and Host_Pointer gets the pointer back */
+
+#ifndef HOST_STM32F4XX_H
+#define HOST_STM32F4XX_H
+
+#ifndef STM32F446xx
+#define STM32F446xx
+#endif
+#ifndef USE_STDPERIPH_DRIVER
+#define USE_STDPERIPH_DRIVER
+#endif
+
+#include "../../CMSIS/device/stm32f4xx.h"
+
+extern SDIO_TypeDef Host_SDIO;
+extern DMA_TypeDef Host_DMA[2];
+extern DMA_Stream_TypeDef Host_DMAStream[16]; // DMA1 streams, then DMA2 streams
+extern USART_TypeDef Host_USART1;
+extern GPIO_TypeDef Host_GPIO[4];
+extern CRC_TypeDef Host_CRC;
+extern RCC_TypeDef Host_RCC;
+extern DWT_Type Host_DWT;
+extern CoreDebug_Type Host_CoreDebug;
+
+#undef SDIO
+#define SDIO (&Host_SDIO)
+#undef DMA1
+#define DMA1 (&Host_DMA[0])
+#undef DMA2
+#define DMA2 (&Host_DMA[1])
+#undef DMA1_Stream0
+#define DMA1_Stream0 (&Host_DMAStream[0])
+#undef DMA1_Stream1
+#define DMA1_Stream1 (&Host_DMAStream[1])
+#undef DMA1_Stream2
+#define DMA1_Stream2 (&Host_DMAStream[2])
+#undef DMA1_Stream3
+#define DMA1_Stream3 (&Host_DMAStream[3])
+#undef DMA1_Stream4
+#define DMA1_Stream4 (&Host_DMAStream[4])
+#undef DMA1_Stream5
+#define DMA1_Stream5 (&Host_DMAStream[5])
+#undef DMA1_Stream6
+#define DMA1_Stream6 (&Host_DMAStream[6])
+#undef DMA1_Stream7
+#define DMA1_Stream7 (&Host_DMAStream[7])
+#undef DMA2_Stream0
+#define DMA2_Stream0 (&Host_DMAStream[8])
+#undef DMA2_Stream1
+#define DMA2_Stream1 (&Host_DMAStream[9])
+#undef DMA2_Stream2
+#define DMA2_Stream2 (&Host_DMAStream[10])
+#undef DMA2_Stream3
+#define DMA2_Stream3 (&Host_DMAStream[11])
+#undef DMA2_Stream4
+#define DMA2_Stream4 (&Host_DMAStream[12])
+#undef DMA2_Stream5
+#define DMA2_Stream5 (&Host_DMAStream[13])
+#undef DMA2_Stream6
+#define DMA2_Stream6 (&Host_DMAStream[14])
+#undef DMA2_Stream7
+#define DMA2_Stream7 (&Host_DMAStream[15])
+#undef USART1
+#define USART1 (&Host_USART1)
+#undef GPIOA
+#define GPIOA (&Host_GPIO[0])
+#undef GPIOB
+#define GPIOB (&Host_GPIO[1])
+#undef GPIOC
+#define GPIOC (&Host_GPIO[2])
+#undef GPIOD
+#define GPIOD (&Host_GPIO[3])
+#undef CRC
+#define CRC (&Host_CRC)
+#undef RCC
+#define RCC (&Host_RCC)
+#undef DWT
+#define DWT (&Host_DWT)
+#undef CoreDebug
+#define CoreDebug (&Host_CoreDebug)
+
+// the CMSIS intrinsics are ARM assembly
+uint32_t Host_Rev(uint32_t value);
+#undef __REV
+#define __REV Host_Rev
+
+#endif
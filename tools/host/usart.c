@@ -0,0 +1,307 @@
+/* usart.c
+ * Host simulation of USART1 and its DMA streams, see usart.h
+ *
+ * The USART functions of the StdPeriph library are replaced by ones that act on the register block, the
+ * DMA streams are the StdPeriph driver on theirs. Every byte from the receiver is an event on the clock, ten
+ * bits after the one before, written by the receive stream at the place NDTR points to, with the half and
+ * the end of the buffer raising the DMA interrupt. The line going idle for a character after the last byte
+ * raises the USART one. Bytes at another rate than the USART is set to are framing errors and do not come
+ * through. A command is out as soon as USART_DMACmd enables the transmit stream, the time it takes on the
+ * line is spent by the caller, as the driver spins until it can send the next one. */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "stm32f4xx.h"
+#include "host.h"
+#include "usart.h"
+
+#define USART_SIM_RX_STREAM DMA2_Stream2
+#define USART_SIM_TX_STREAM DMA2_Stream7
+#define USART_SIM_MAX_COMMANDS 4096
+
+void DMA2_Stream2_IRQHandler(void);
+void USART1_IRQHandler(void);
+
+static uint32_t _line_rate = 9600; // the receiver sends at it
+static uint32_t _baud_rate = 9600; // the USART receives at it
+static uint64_t _line_free = 0; // the receiver is done with what it was sending then
+static uint32_t _queued = 0; // bytes given to the receiver to send, counts on
+static uint32_t _received = 0;
+static uint32_t _rx_size = 0; // the receive stream starts over with this NDTR at the end of the buffer
+
+// times of the receive interrupts, in order
+static uint64_t *_interrupts = NULL;
+static uint32_t _interrupt_count = 0;
+static uint32_t _interrupt_room = 0;
+
+static char _commands[USART_SIM_MAX_COMMANDS];
+static uint32_t _commands_len = 0;
+
+static uint64_t _bytes_us(uint32_t count, uint32_t baud_rate)
+{
+	return ((uint64_t)count * 10 * 1000000 + baud_rate - 1) / baud_rate;
+}
+
+static void _interrupted()
+{
+	if (_interrupt_count == _interrupt_room)
+	{
+		_interrupt_room = _interrupt_room ? _interrupt_room * 2 : 1024;
+		_interrupts = realloc(_interrupts, _interrupt_room * sizeof(_interrupts[0]));
+	}
+
+	_interrupts[_interrupt_count++] = Host_Now();
+}
+
+static void _dma_interrupt()
+{
+	Host_SyncDMA();
+
+	if (((USART_SIM_RX_STREAM->CR & DMA_SxCR_HTIE) && (DMA2->LISR & DMA_LISR_HTIF2))
+		|| ((USART_SIM_RX_STREAM->CR & DMA_SxCR_TCIE) && (DMA2->LISR & DMA_LISR_TCIF2)))
+	{
+		_interrupted();
+		DMA2_Stream2_IRQHandler();
+	}
+
+	Host_SyncDMA();
+}
+
+static void _receive(void *arg)
+{
+	uint8_t *buf;
+
+	if (!(USART1->CR1 & USART_CR1_UE) || _baud_rate != _line_rate)
+		return;
+
+	USART1->DR = (uint8_t)(uintptr_t)arg;
+	++_received;
+	USART1->SR |= USART_SR_RXNE;
+	if (!(USART1->CR3 & USART_CR3_DMAR) || !(USART_SIM_RX_STREAM->CR & DMA_SxCR_EN))
+		return;
+
+	// the stream takes the byte right away, a circular one starts over where it was enabled at
+	if (_rx_size == 0)
+		_rx_size = USART_SIM_RX_STREAM->NDTR;
+	buf = Host_Pointer(USART_SIM_RX_STREAM->M0AR);
+	buf[_rx_size - USART_SIM_RX_STREAM->NDTR] = (uint8_t)USART1->DR;
+	USART1->SR &= ~USART_SR_RXNE;
+
+	if (--USART_SIM_RX_STREAM->NDTR == _rx_size / 2)
+		DMA2->LISR |= DMA_LISR_HTIF2;
+	else if (USART_SIM_RX_STREAM->NDTR == 0)
+	{
+		DMA2->LISR |= DMA_LISR_TCIF2;
+		if (USART_SIM_RX_STREAM->CR & DMA_SxCR_CIRC)
+			USART_SIM_RX_STREAM->NDTR = _rx_size;
+		else
+			USART_SIM_RX_STREAM->CR &= ~DMA_SxCR_EN;
+	}
+
+	_dma_interrupt();
+}
+
+// a character of silence after the byte queued as number arg, unless more were queued behind it
+static void _idle(void *arg)
+{
+	if ((uint32_t)(uintptr_t)arg != _queued || !(USART1->CR1 & USART_CR1_UE) || _baud_rate != _line_rate)
+		return;
+
+	USART1->SR |= USART_SR_IDLE;
+	if (USART1->CR1 & USART_CR1_IDLEIE)
+	{
+		_interrupted();
+		USART1_IRQHandler();
+	}
+}
+
+// the receiver takes up the commands it knows
+static void _command(const char *command, uint32_t len)
+{
+	if (_commands_len + len <= sizeof(_commands))
+	{
+		memcpy(&_commands[_commands_len], command, len);
+		_commands_len += len;
+	}
+
+	if (len > 9 && memcmp(command, "$PMTK251,", 9) == 0)
+		_line_rate = (uint32_t)strtoul(command + 9, NULL, 10);
+}
+
+static void _transmit()
+{
+	uint32_t len = USART_SIM_TX_STREAM->NDTR;
+
+	if (!(USART_SIM_TX_STREAM->CR & DMA_SxCR_EN) || len == 0)
+		return;
+
+	// the driver spins on its flag until the command is out
+	Host_Spend((uint32_t)_bytes_us(len, _baud_rate));
+	if (_baud_rate == _line_rate)
+		_command(Host_Pointer(USART_SIM_TX_STREAM->M0AR), len);
+
+	USART_SIM_TX_STREAM->NDTR = 0;
+	USART_SIM_TX_STREAM->CR &= ~DMA_SxCR_EN;
+	DMA2->HISR |= DMA_HISR_TCIF7;
+	Host_SyncDMA();
+
+	USART1->SR |= USART_SR_TC;
+	if (USART1->CR1 & USART_CR1_TCIE)
+		USART1_IRQHandler();
+}
+
+void Usart_Attach(uint32_t baud_rate)
+{
+	_line_rate = baud_rate;
+	_line_free = Host_Now();
+	_rx_size = 0;
+	_interrupt_count = 0;
+	_commands_len = 0;
+}
+
+uint64_t Usart_Send(const char *data, uint32_t len)
+{
+	uint64_t start = _line_free > Host_Now() ? _line_free : Host_Now();
+	uint32_t i;
+
+	for (i = 0; i < len; ++i)
+		Host_At(start + _bytes_us(i + 1, _line_rate), _receive, (void *)(uintptr_t)(uint8_t)data[i]);
+
+	_queued += len;
+	_line_free = start + _bytes_us(len, _line_rate);
+	Host_At(_line_free + _bytes_us(1, _line_rate), _idle, (void *)(uintptr_t)_queued);
+
+	return _line_free;
+}
+
+uint64_t Usart_FirstInterrupt(uint64_t time_us)
+{
+	uint32_t low = 0, high = _interrupt_count, mid;
+
+	while (low < high)
+	{
+		mid = (low + high) / 2;
+		if (_interrupts[mid] < time_us)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+
+	return low < _interrupt_count ? _interrupts[low] : USART_SIM_NONE;
+}
+
+uint32_t Usart_GetReceived()
+{
+	return _received;
+}
+
+uint32_t Usart_GetInterrupts()
+{
+	return _interrupt_count;
+}
+
+uint32_t Usart_GetCommands(char *buf, uint32_t max)
+{
+	uint32_t len = _commands_len < max ? _commands_len : max;
+
+	memcpy(buf, _commands, len);
+	return len;
+}
+
+// The USART functions of the StdPeriph library, on the register block
+
+void USART_DeInit(USART_TypeDef *USARTx)
+{
+	memset(USARTx, 0, sizeof(*USARTx));
+}
+
+void USART_Init(USART_TypeDef *USARTx, USART_InitTypeDef *USART_InitStruct)
+{
+	(void)USARTx;
+	_baud_rate = USART_InitStruct->USART_BaudRate;
+}
+
+void USART_StructInit(USART_InitTypeDef *USART_InitStruct)
+{
+	USART_InitStruct->USART_BaudRate = 9600;
+	USART_InitStruct->USART_WordLength = USART_WordLength_8b;
+	USART_InitStruct->USART_StopBits = USART_StopBits_1;
+	USART_InitStruct->USART_Parity = USART_Parity_No;
+	USART_InitStruct->USART_Mode = USART_Mode_Rx | USART_Mode_Tx;
+	USART_InitStruct->USART_HardwareFlowControl = USART_HardwareFlowControl_None;
+}
+
+void USART_Cmd(USART_TypeDef *USARTx, FunctionalState NewState)
+{
+	if (NewState != DISABLE)
+		USARTx->CR1 |= USART_CR1_UE;
+	else
+		USARTx->CR1 &= ~USART_CR1_UE;
+}
+
+// an interrupt is the register, 1 to 3 for CR1 to CR3, in bits 5 to 7 and the enable bit in bits 0 to 4,
+// its flag in the status register is in bits 8 to 15
+static volatile uint16_t *_it_register(USART_TypeDef *USARTx, uint16_t USART_IT)
+{
+	switch ((USART_IT >> 5) & 0x07)
+	{
+	case 1:
+		return &USARTx->CR1;
+	case 2:
+		return &USARTx->CR2;
+	default:
+		return &USARTx->CR3;
+	}
+}
+
+void USART_ITConfig(USART_TypeDef *USARTx, uint16_t USART_IT, FunctionalState NewState)
+{
+	uint16_t mask = (uint16_t)(1 << (USART_IT & 0x1F));
+
+	if (NewState != DISABLE)
+		*_it_register(USARTx, USART_IT) |= mask;
+	else
+		*_it_register(USARTx, USART_IT) &= ~mask;
+}
+
+ITStatus USART_GetITStatus(USART_TypeDef *USARTx, uint16_t USART_IT)
+{
+	if ((*_it_register(USARTx, USART_IT) & (1 << (USART_IT & 0x1F))) && (USARTx->SR & (1 << (USART_IT >> 8))))
+		return SET;
+
+	return RESET;
+}
+
+void USART_ClearITPendingBit(USART_TypeDef *USARTx, uint16_t USART_IT)
+{
+	USARTx->SR &= ~(1 << (USART_IT >> 8));
+}
+
+FlagStatus USART_GetFlagStatus(USART_TypeDef *USARTx, uint16_t USART_FLAG)
+{
+	return (USARTx->SR & USART_FLAG) ? SET : RESET;
+}
+
+void USART_ClearFlag(USART_TypeDef *USARTx, uint16_t USART_FLAG)
+{
+	USARTx->SR &= ~USART_FLAG;
+}
+
+// reading the data register after the status register clears the idle flag
+uint16_t USART_ReceiveData(USART_TypeDef *USARTx)
+{
+	USARTx->SR &= ~(USART_SR_IDLE | USART_SR_RXNE);
+	return USARTx->DR & 0x1FF;
+}
+
+void USART_DMACmd(USART_TypeDef *USARTx, uint16_t USART_DMAReq, FunctionalState NewState)
+{
+	if (NewState != DISABLE)
+		USARTx->CR3 |= USART_DMAReq;
+	else
+		USARTx->CR3 &= ~USART_DMAReq;
+
+	if (USARTx == USART1 && (USARTx->CR3 & USART_DMAReq_Tx))
+		_transmit();
+}
@@ -0,0 +1,31 @@
+/* usart.h
+ * Host simulation of USART1 and its DMA streams, with a GPS receiver on the line, for running src/gps.c on
+ * the host */
+
+#ifndef USART_H
+#define USART_H
+
+#include <stdint.h>
+
+#define USART_SIM_NONE UINT64_MAX
+
+// put the receiver on the line, sending at baud_rate until a PMTK251 command switches it
+void Usart_Attach(uint32_t baud_rate);
+
+// the receiver sends data after what it is sending already, returns the time its last byte is in
+uint64_t Usart_Send(const char *data, uint32_t len);
+
+// time of the first receive interrupt, at the half or the end of the DMA buffer or on the idle line, at or
+// after time_us, USART_SIM_NONE if there was none yet
+uint64_t Usart_FirstInterrupt(uint64_t time_us);
+
+// bytes the USART took in so far
+uint32_t Usart_GetReceived();
+
+// receive interrupts so far
+uint32_t Usart_GetInterrupts();
+
+// the commands the receiver got, one after the other, returns their length
+uint32_t Usart_GetCommands(char *buf, uint32_t max);
+
+#endif
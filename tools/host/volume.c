@@ -0,0 +1,92 @@
+/* volume.c
+ * Card images with a file system on them, see volume.h */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "FreeRTOS.h"
+#include "ff.h"
+#include "sd.h"
+#include "fat.h"
+#include "volume.h"
+
+static FATFS _fs;
+
+uint8_t Volume_Create(const char *image, const struct Card_Params *params, uint32_t cluster_sectors)
+{
+	// what an earlier run left on the image would change the layout
+	unlink(image);
+	if (!Card_Open(image, params))
+		return 0;
+
+	if (!Fat_Format(cluster_sectors))
+	{
+		printf("card too small for FAT32\n");
+		return 0;
+	}
+
+	return Volume_Mount();
+}
+
+uint8_t Volume_Mount()
+{
+	if (!SD_Initialize() || f_mount(&_fs, "", 1) != FR_OK)
+		return 0;
+
+	return f_chdir("/Meas") == FR_OK || (f_mkdir("/Meas") == FR_OK && f_chdir("/Meas") == FR_OK);
+}
+
+uint8_t Volume_ReadLog(const char *filename, FSIZE_t base, struct LogFmt_Header *header, struct LogFmt_Record *records,
+	uint32_t max, uint32_t *num_records, uint32_t *num_blocks)
+{
+	static uint8_t block[LOGFMT_BLOCK_SIZE];
+	struct LogFmt_BlockHeader block_header;
+	struct LogFmt_State state;
+	struct LogFmt_Record record;
+	FIL file;
+	UINT num_read;
+	uint16_t pos, len;
+	uint8_t ret = 1;
+
+	*num_records = *num_blocks = 0;
+	if (f_open(&file, filename, FA_READ) != FR_OK)
+		return 0;
+
+	if (f_lseek(&file, base) != FR_OK || f_read(&file, block, sizeof(block), &num_read) != FR_OK
+		|| num_read != sizeof(block) || LogFmt_DecodeHeader(header, block) == 0)
+	{
+		f_close(&file);
+		return 0;
+	}
+
+	LogFmt_Init(&state, header);
+	while (f_read(&file, block, sizeof(block), &num_read) == FR_OK && num_read == sizeof(block)
+		&& LogFmt_CheckBlock(block, header->session, &block_header) && block_header.seq == *num_blocks)
+	{
+		LogFmt_Reset(&state);
+		for (pos = 0; pos < block_header.used; pos += len)
+		{
+			len = LogFmt_Decode(&state, &record, &block[LOGFMT_BLOCK_HEADER_LEN + pos], block_header.used - pos);
+			if (len == 0)
+			{
+				// a block with a valid CRC holds whole records only
+				ret = 0;
+				break;
+			}
+			if (*num_records < max)
+				records[*num_records] = record;
+			++*num_records;
+		}
+		++*num_blocks;
+	}
+
+	f_close(&file);
+	return ret;
+}
+
+uint8_t Volume_SameRecord(const struct LogFmt_Record *a, const struct LogFmt_Record *b)
+{
+	return a->channel == b->channel && a->time_ms == b->time_ms && a->num_fields == b->num_fields
+		&& memcmp(a->value, b->value, a->num_fields * sizeof(int32_t)) == 0;
+}
@@ -0,0 +1,32 @@
+/* volume.h
+ * Card images with a file system on them for the tools that test the logger, and a reader that decodes
+ * the sessions it wrote back into records
+ *
+ * Link with host/card.c, host/fat.c, an SD driver (host/sdcard.c, or ../src/sd.c and host/sdio.c) and FatFS. */
+
+#ifndef VOLUME_H
+#define VOLUME_H
+
+#include <stdint.h>
+
+#include "ff.h"
+#include "logfmt.h"
+#include "card.h"
+
+// start from a fresh image, format it with clusters of up to cluster_sectors and mount it with /Meas as the
+// current directory, like SDTask finds the card, returns 0 on failure
+uint8_t Volume_Create(const char *image, const struct Card_Params *params, uint32_t cluster_sectors);
+
+// bring the card up and mount the volume again, after a power cut
+uint8_t Volume_Mount();
+
+// decode the session with its file header block at offset base of the file, block by block until the first
+// one that does not belong to it. Up to max records go to records, the number decoded is returned and the
+// valid data blocks are counted in num_blocks. Returns 0 if the file or the file header can not be read.
+uint8_t Volume_ReadLog(const char *filename, FSIZE_t base, struct LogFmt_Header *header, struct LogFmt_Record *records,
+	uint32_t max, uint32_t *num_records, uint32_t *num_blocks);
+
+// same fields and time of a record, as the decoder hands it back
+uint8_t Volume_SameRecord(const struct LogFmt_Record *a, const struct LogFmt_Record *b);
+
+#endif
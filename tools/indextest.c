@@ -0,0 +1,208 @@
+/* indextest.c
+ * Host test of the time index sidecar, logs on a simulated card and checks the .idx files next to the logs
+ *
+ * Build: make build/indextest
+ * Usage: indextest [image file]
+ *
+ * Checks that Log_Close writes the sidecar for every block of the log, and that after a power cut, when there
+ * is no sidecar, Log_Recover builds one for all the blocks that made it onto the card, with the interval
+ * doubled like it is while logging. The power cut is made in a child process, so the parent comes up with
+ * nothing of the logger or FatFS state in RAM, like the board after a reset. Every entry is checked against
+ * the block it points at.
+ * Exits with 1 if a check fails. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "stm32f4xx.h"
+#include "FreeRTOS.h"
+#include "host.h"
+#include "card.h"
+#include "ff.h"
+#include "diskio.h"
+#include "sd.h"
+#include "log.h"
+#include "volume.h"
+
+#define TEST_SECTORS 262144 // 128 MB
+#define TEST_CLUSTER_SECTORS 8
+#define TEST_START_TIME 1500000000
+#define TEST_INDEX_INTERVAL 8 // LOG_INDEX_INTERVAL of log.c
+#define TEST_INDEX_MAX_ENTRIES 256 // LOG_INDEX_MAX_ENTRIES of log.c
+#define TEST_MAX_INDEX_SIZE (LOGFMT_INDEX_HEADER_LEN + TEST_INDEX_MAX_ENTRIES * LOGFMT_INDEX_ENTRY_LEN + 4)
+#define TEST_CUT_BLOCKS 3000 // past the blocks the first interval covers
+
+
+static uint32_t _hash(uint32_t x)
+{
+	x ^= x >> 16;
+	x *= 0x7feb352d;
+	x ^= x >> 15;
+	x *= 0x846ca68b;
+	return x ^ (x >> 16);
+}
+
+static uint8_t _append(uint32_t n)
+{
+	struct LogFmt_Record record;
+	uint8_t i;
+
+	record.channel = LOGFMT_CHANNEL_IMU;
+	record.time_ms = n * 5;
+	record.num_fields = LOGFMT_IMU_NUM_FIELDS;
+	for (i = 0; i < LOGFMT_IMU_NUM_FIELDS; ++i)
+		record.value[i] = (int32_t)(_hash(n * LOGFMT_IMU_NUM_FIELDS + i) % 200001) - 100000;
+
+	return Log_Append(&record) && Log_Process();
+}
+
+// Read the sidecar of a log and check it against the log: the CRC, the session, one entry every interval
+// blocks from the first one on, each with the time of the first record of its block, and no entry past
+// num_blocks. Returns the number of entries, 0 if the sidecar does not check out.
+static uint32_t _check_index(const char *filename, const char *index_name, uint32_t num_blocks, uint32_t *interval)
+{
+	static uint8_t data[TEST_MAX_INDEX_SIZE];
+	static uint8_t block[LOGFMT_BLOCK_SIZE];
+	struct LogFmt_IndexHeader header;
+	struct LogFmt_IndexEntry entry;
+	struct LogFmt_Header log_header;
+	struct LogFmt_BlockHeader block_header;
+	FIL index, log;
+	UINT num_read = 0, len = 0;
+	uint32_t time_ms, i;
+	uint8_t ok;
+
+	if (f_open(&index, index_name, FA_READ) != FR_OK)
+		return 0;
+	ok = f_read(&index, data, sizeof(data), &len) == FR_OK && LogFmt_DecodeIndexHeader(&header, data)
+		&& len == LOGFMT_INDEX_HEADER_LEN + header.count * LOGFMT_INDEX_ENTRY_LEN + 4 && len == f_size(&index)
+		&& LogFmt_Crc32(data, len - 4) == (uint32_t)(data[len - 4] | data[len - 3] << 8 | data[len - 2] << 16
+			| (uint32_t)data[len - 1] << 24);
+	f_close(&index);
+
+	if (!ok || f_open(&log, filename, FA_READ) != FR_OK)
+		return 0;
+
+	ok = f_lseek(&log, header.base) == FR_OK && f_read(&log, block, sizeof(block), &num_read) == FR_OK
+		&& num_read == sizeof(block) && LogFmt_DecodeHeader(&log_header, block) != 0 && log_header.session == header.session
+		&& header.count > 0 && (header.count - 1) * header.interval < num_blocks;
+
+	for (i = 0; ok && i < header.count; ++i)
+	{
+		LogFmt_DecodeIndexEntry(&entry, &data[LOGFMT_INDEX_HEADER_LEN + i * LOGFMT_INDEX_ENTRY_LEN]);
+		ok = entry.offset == header.base + (1 + i * header.interval) * LOGFMT_BLOCK_SIZE
+			&& f_lseek(&log, entry.offset) == FR_OK && f_read(&log, block, sizeof(block), &num_read) == FR_OK
+			&& num_read == sizeof(block) && LogFmt_CheckBlock(block, header.session, &block_header)
+			&& block_header.seq == i * header.interval && LogFmt_GetBlockTime(block, &time_ms) && time_ms == entry.time_ms;
+	}
+	f_close(&log);
+
+	*interval = header.interval;
+	return ok ? header.count : 0;
+}
+
+static FSIZE_t _file_size(const char *filename)
+{
+	FILINFO info;
+
+	return f_stat(filename, &info) == FR_OK ? info.fsize : 0;
+}
+
+static void _closed_index()
+{
+	struct LogFmt_Header header;
+	struct LogFmt_Record record;
+	uint32_t n = 0, num_records, num_blocks, interval, count;
+	uint8_t ok;
+
+	ok = Log_Open("CLOSED.dat", TEST_START_TIME);
+	while (ok && n < 5000)
+		ok = _append(n++);
+	ok = Log_Close() && ok;
+
+	// the block that was filling at close is in the index too
+	ok = Volume_ReadLog("CLOSED.dat", 0, &header, &record, 1, &num_records, &num_blocks) && ok;
+	count = _check_index("CLOSED.dat", "CLOSED.idx", num_blocks, &interval);
+	Host_Check(ok && interval == TEST_INDEX_INTERVAL && count == (num_blocks + TEST_INDEX_INTERVAL - 1) / TEST_INDEX_INTERVAL,
+		"close writes the sidecar for every block of the log");
+	printf("  %u blocks, %u entries\n", num_blocks, count);
+}
+
+// the board, logging until the power goes away
+static void _log_until_cut()
+{
+	struct Log_Stats stats;
+	uint32_t n = 0;
+	uint8_t ok;
+
+	ok = Log_Open("CUT.dat", TEST_START_TIME);
+	do
+	{
+		ok = _append(n++) && ok;
+		Log_GetStats(&stats);
+	} while (ok && stats.sectors_written < TEST_CUT_BLOCKS);
+	ok = Log_Sync() && ok;
+
+	Card_GetParams()->cut_after = 200;
+	while (ok)
+		ok = _append(n++);
+
+	Card_Close();
+	_exit(Card_IsPowered() ? 1 : 0);
+}
+
+static void _recovered_index()
+{
+	struct LogFmt_Header header;
+	struct LogFmt_Record record;
+	FILINFO info;
+	uint32_t num_records, num_blocks, count, interval;
+	int status = 1;
+	pid_t pid;
+	uint8_t ok;
+
+	fflush(stdout);
+	pid = fork();
+	if (pid == 0)
+		_log_until_cut();
+	Host_Check(pid > 0 && waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0,
+		"power cut while logging");
+
+	// the board comes up again
+	ok = Volume_Mount() && f_stat("CUT.idx", &info) == FR_NO_FILE;
+	ok = Log_Recover() && ok;
+
+	ok = Volume_ReadLog("CUT.dat", 0, &header, &record, 1, &num_records, &num_blocks) && ok;
+	count = _check_index("CUT.dat", "CUT.idx", num_blocks, &interval);
+	Host_Check(ok && _file_size("CUT.dat") == (FSIZE_t)(1 + num_blocks) * LOGFMT_BLOCK_SIZE && num_blocks > TEST_CUT_BLOCKS,
+		"recovered log is cut to the blocks on the card");
+	Host_Check(count > 0 && interval > TEST_INDEX_INTERVAL && count == (num_blocks + interval - 1) / interval,
+		"recovery writes the sidecar for all of them");
+	printf("  %u blocks recovered, %u entries every %u blocks\n", num_blocks, count, interval);
+}
+
+int main(int argc, char *argv[])
+{
+	struct Card_Params params;
+
+	Card_Defaults(&params);
+	params.sectors = TEST_SECTORS;
+
+	ff_init_syncobj();
+	disk_init_lock();
+	Log_Init();
+	if (!Volume_Create(argc > 1 ? argv[1] : "indextest.img", &params, TEST_CLUSTER_SECTORS))
+	{
+		printf("card bring-up failed\n");
+		return 1;
+	}
+
+	_closed_index();
+	_recovered_index();
+
+	Card_Close();
+	return Host_Summary();
+}
@@ -0,0 +1,359 @@
+/* locktest.c
+ * Host test of the file system mutexes, a logger and another task share the volume on a simulated card while
+ * the logger unmounts and mounts it again between sessions
+ *
+ * Build: make build/locktest
+ * Usage: locktest [image file]
+ *
+ * Checks that mounting and the disk functions fail until main made the mutexes with ff_init_syncobj and
+ * disk_init_lock, so none is made on the fly by the first task to get there. Then the logger task writes
+ * TEST_SESSIONS logs, and after each one closes it, unmounts the volume and mounts it again like SDTask does
+ * when it drops the card. Another task reads a config file all along, like one that loads settings or exports
+ * logs would, at a higher priority like every task over SDTask. The logger unmounts while that task is in the
+ * middle of a read and holds the volume mutex, FatFS fails what is left of that read with FR_INT_ERR. Checks
+ * that every mount of the volume gets the same mutex, that the reads the volume was unmounted during come back
+ * with an error and no wrong data, that reads after the next mount get the volume again, so the mutex was
+ * given back, that no other read fails or comes back wrong, and that every log is on the card in full.
+ *
+ * Then, as a benchmark, a task exports a file next to the logger, reading it over and over in chunks of 512
+ * bytes up to a cluster, and the longest block write of the logger is reported for each chunk size, the time
+ * the logger waits for the card while a read holds it included. Each chunk size runs in its own process on
+ * its own image, <image file>.bench. Exits with 1 if a check fails. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "stm32f4xx.h"
+#include "FreeRTOS.h"
+#include "task.h"
+#include "host.h"
+#include "card.h"
+#include "ff.h"
+#include "diskio.h"
+#include "sd.h"
+#include "log.h"
+#include "volume.h"
+
+#define TEST_SECTORS 262144 // 128 MB
+#define TEST_CLUSTER_SECTORS 8
+#define TEST_START_TIME 1500000000
+#define TEST_SESSIONS 4
+#define TEST_SESSION_RECORDS 4000
+#define TEST_CONFIG_SIZE 3000 // a few sectors, so the read waits for the card
+#define TEST_READ_INTERVAL_MS 2
+#define TEST_EXPORT_SIZE (64 * 1024)
+
+// what the reader got back
+struct Reads
+{
+	uint32_t ok[TEST_SESSIONS]; // the file, by the session of the logger at the time
+	uint32_t unmounted; // FR_NOT_ENABLED, the volume was not mounted
+	uint32_t held; // reads the volume was unmounted during, that came back with the file or an error
+	uint32_t bad; // any other error, or the wrong data
+};
+
+static FF_SYNC_t _mutex[TEST_SESSIONS]; // of the volume in each mount
+static uint32_t _records[TEST_SESSIONS];
+static uint32_t _unmounts = 0;
+static uint8_t _reading = 0;
+static uint8_t _logger_done = 0;
+static uint8_t _logger_ok = 1;
+static struct Reads _reads;
+static uint32_t _chunk = 0; // bytes the export task reads at a time
+
+static uint32_t _hash(uint32_t x)
+{
+	x ^= x >> 16;
+	x *= 0x7feb352d;
+	x ^= x >> 15;
+	x *= 0x846ca68b;
+	return x ^ (x >> 16);
+}
+
+static void _config_data(uint8_t *data)
+{
+	uint32_t i;
+
+	for (i = 0; i < TEST_CONFIG_SIZE; ++i)
+		data[i] = (uint8_t)_hash(i);
+}
+
+static uint8_t _append(uint32_t n)
+{
+	struct LogFmt_Record record;
+	uint8_t i;
+
+	record.channel = LOGFMT_CHANNEL_IMU;
+	record.time_ms = n * 5;
+	record.num_fields = LOGFMT_IMU_NUM_FIELDS;
+	for (i = 0; i < LOGFMT_IMU_NUM_FIELDS; ++i)
+		record.value[i] = (int32_t)(_hash(n * LOGFMT_IMU_NUM_FIELDS + i) % 200001) - 100000;
+
+	return Log_Append(&record) && Log_Process();
+}
+
+// the mutex f_mount handed the volume
+static FF_SYNC_t _volume_mutex()
+{
+	FATFS *fs;
+	DWORD free_clusters;
+
+	return f_getfree("", &free_clusters, &fs) == FR_OK ? fs->sobj : NULL;
+}
+
+// writes the logs, drops the volume after each one and mounts it again
+static void _logger_task(void *param)
+{
+	char filename[16];
+	uint32_t session, n;
+	uint8_t ok = 1;
+
+	(void)param;
+	for (session = 0; ok && session < TEST_SESSIONS; ++session)
+	{
+		ok = (session == 0 || Volume_Mount()) && (_mutex[session] = _volume_mutex()) != NULL;
+
+		snprintf(filename, sizeof(filename), "LOG%u.dat", session);
+		ok = ok && Log_Open(filename, TEST_START_TIME + session);
+		for (n = 0; ok && n < TEST_SESSION_RECORDS; ++n)
+			ok = _append(n);
+		_records[session] = n;
+		ok = Log_Close() && ok;
+
+		// the reader only lets the logger run while it waits for the card or between reads, wait for the first
+		while (!_reading)
+			vTaskDelay(1);
+		ok = f_mount(NULL, "", 0) == FR_OK && ok;
+		++_unmounts;
+		vTaskDelay(pdMS_TO_TICKS(20));
+	}
+
+	_logger_ok = ok;
+	_logger_done = 1;
+	Host_Stop();
+	vTaskDelay(portMAX_DELAY);
+}
+
+// reads the config file, same is 0 if it is not what was written
+static FRESULT _read_config(uint8_t *same)
+{
+	static uint8_t expected[TEST_CONFIG_SIZE], data[TEST_CONFIG_SIZE + 1];
+	FIL file;
+	UINT num_read = 0;
+	FRESULT res;
+
+	*same = 0;
+	_config_data(expected);
+	res = f_open(&file, "/CONFIG.txt", FA_READ);
+	if (res != FR_OK)
+		return res;
+
+	res = f_read(&file, data, sizeof(data), &num_read);
+	f_close(&file);
+	*same = num_read == TEST_CONFIG_SIZE && memcmp(data, expected, TEST_CONFIG_SIZE) == 0;
+
+	return res;
+}
+
+static void _reader_task(void *param)
+{
+	uint32_t unmounts;
+	FRESULT res;
+	uint8_t same;
+
+	(void)param;
+	while (!_logger_done)
+	{
+		unmounts = _unmounts;
+		_reading = 1;
+		res = _read_config(&same);
+		_reading = 0;
+		if (res == FR_OK && !same)
+			++_reads.bad;
+		else if (_unmounts != unmounts)
+			++_reads.held;
+		else if (res == FR_OK && unmounts < TEST_SESSIONS)
+			++_reads.ok[unmounts];
+		else if (res == FR_NOT_ENABLED)
+			++_reads.unmounted;
+		else
+			++_reads.bad;
+
+		vTaskDelay(pdMS_TO_TICKS(TEST_READ_INTERVAL_MS));
+	}
+
+	vTaskDelay(portMAX_DELAY);
+}
+
+// logs a session as fast as it can while the export task reads
+static void _bench_logger_task(void *param)
+{
+	uint32_t n;
+	uint8_t ok;
+
+	(void)param;
+	ok = Log_Open("BENCH.dat", TEST_START_TIME);
+	for (n = 0; ok && n < TEST_SESSION_RECORDS; ++n)
+		ok = _append(n);
+	_records[0] = n;
+	_logger_ok = Log_Close() && ok;
+
+	_logger_done = 1;
+	Host_Stop();
+	vTaskDelay(portMAX_DELAY);
+}
+
+// reads the export file front to back, over and over, _chunk bytes at a time
+static void _export_task(void *param)
+{
+	static uint8_t data[TEST_CLUSTER_SECTORS * 512];
+	FIL file;
+	UINT num_read;
+
+	(void)param;
+	while (!_logger_done)
+	{
+		if (f_open(&file, "/EXPORT.dat", FA_READ) != FR_OK)
+		{
+			++_reads.bad;
+			vTaskDelay(portMAX_DELAY);
+		}
+		while (f_read(&file, data, _chunk, &num_read) == FR_OK && num_read == _chunk)
+			++_reads.ok[0];
+		f_close(&file);
+		vTaskDelay(1);
+	}
+
+	vTaskDelay(portMAX_DELAY);
+}
+
+// the logger next to the export task with chunk size _chunk, in a process of its own so the scheduler starts
+// from scratch
+static void _bench(const char *image)
+{
+	static uint8_t data[TEST_EXPORT_SIZE];
+	struct Card_Params params;
+	struct Log_Stats stats;
+	char what[64];
+	FIL file;
+	UINT num_written = 0;
+
+	Card_Defaults(&params);
+	params.sectors = TEST_SECTORS;
+
+	ff_init_syncobj();
+	disk_init_lock();
+	Log_Init();
+	if (!Volume_Create(image, &params, TEST_CLUSTER_SECTORS)
+		|| f_open(&file, "/EXPORT.dat", FA_WRITE|FA_CREATE_ALWAYS) != FR_OK
+		|| f_write(&file, data, sizeof(data), &num_written) != FR_OK || f_close(&file) != FR_OK)
+	{
+		printf("card bring-up failed\n");
+		fflush(stdout);
+		_exit(1);
+	}
+
+	xTaskCreate(_bench_logger_task, "SDTask", 4096, NULL, 1, NULL);
+	xTaskCreate(_export_task, "ExportTask", 1024, NULL, 2, NULL);
+	vTaskStartScheduler();
+
+	Log_GetStats(&stats);
+	printf("  reads of %4u bytes: longest block write %5u us, %u chunks read\n", _chunk, stats.max_write_us,
+		_reads.ok[0]);
+	snprintf(what, sizeof(what), "log in full next to reads of %u bytes", _chunk);
+	Host_Check(_logger_ok && _records[0] == TEST_SESSION_RECORDS && _reads.ok[0] > 0 && _reads.bad == 0, what);
+
+	Card_Close();
+	fflush(stdout);
+	_exit(Host_Failed() ? 1 : 0);
+}
+
+// the file system before main made the mutexes
+static void _no_mutexes()
+{
+	static FATFS fs;
+	static BYTE sector[FF_MAX_SS];
+
+	Host_Check(f_mount(&fs, "", 0) == FR_INT_ERR && disk_read(0, sector, 0, 1) == RES_ERROR,
+		"no mutex is made on the fly by the first mount or disk access");
+}
+
+int main(int argc, char *argv[])
+{
+	static uint8_t data[TEST_CONFIG_SIZE];
+	struct Card_Params params;
+	struct LogFmt_Header header;
+	struct LogFmt_Record record;
+	char filename[16];
+	FIL file;
+	UINT num_written = 0;
+	char bench_image[256];
+	uint32_t session, num_records, num_blocks, ok_reads = 1;
+	uint8_t ok;
+	int status;
+	pid_t pid;
+
+	// the benchmark first, the processes are forked before any task thread runs
+	snprintf(bench_image, sizeof(bench_image), "%s.bench", argc > 1 ? argv[1] : "locktest.img");
+	for (_chunk = 512; _chunk <= TEST_CLUSTER_SECTORS * 512; _chunk *= 2)
+	{
+		fflush(stdout);
+		pid = fork();
+		if (pid == 0)
+			_bench(bench_image);
+		if (pid < 0 || waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			Host_Check(0, "benchmark run");
+	}
+
+	Card_Defaults(&params);
+	params.sectors = TEST_SECTORS;
+
+	_no_mutexes();
+
+	ff_init_syncobj();
+	disk_init_lock();
+	Log_Init();
+	_config_data(data);
+	if (!Volume_Create(argc > 1 ? argv[1] : "locktest.img", &params, TEST_CLUSTER_SECTORS)
+		|| f_open(&file, "/CONFIG.txt", FA_WRITE|FA_CREATE_ALWAYS) != FR_OK
+		|| f_write(&file, data, sizeof(data), &num_written) != FR_OK || f_close(&file) != FR_OK)
+	{
+		printf("card bring-up failed\n");
+		return 1;
+	}
+
+	xTaskCreate(_logger_task, "SDTask", 4096, NULL, 1, NULL);
+	xTaskCreate(_reader_task, "ReaderTask", 1024, NULL, 2, NULL);
+	vTaskStartScheduler();
+
+	for (session = 0; session < TEST_SESSIONS; ++session)
+	{
+		printf("  session %u: %u reads of the config file\n", session, _reads.ok[session]);
+		if (_reads.ok[session] == 0)
+			ok_reads = 0;
+	}
+	printf("  %u reads found the volume unmounted, %u had it unmounted while they held it, %u bad\n",
+		_reads.unmounted, _reads.held, _reads.bad);
+
+	ok = _logger_ok;
+	for (session = 1; ok && session < TEST_SESSIONS; ++session)
+		ok = _mutex[session] == _mutex[0];
+	Host_Check(_logger_ok && ok && _mutex[0] != NULL, "every mount of the volume gets the mutex made at init");
+	Host_Check(_reads.held == TEST_SESSIONS && _reads.bad == 0, "reads holding the volume through an unmount come back");
+	Host_Check(ok_reads && _reads.bad == 0, "reader shares the volume with the logger, mount after mount");
+
+	ok = Volume_Mount();
+	for (session = 0; ok && session < TEST_SESSIONS; ++session)
+	{
+		snprintf(filename, sizeof(filename), "LOG%u.dat", session);
+		ok = Volume_ReadLog(filename, 0, &header, &record, 1, &num_records, &num_blocks)
+			&& num_records == _records[session] && header.start_time == TEST_START_TIME + session;
+	}
+	Host_Check(ok, "every log on the card in full");
+
+	Card_Close();
+	return Host_Summary();
+}
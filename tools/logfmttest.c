@@ -0,0 +1,301 @@
+/* logfmttest.c
+ * Host test of the log format, encodes records with src/logfmt.c and decodes them again
+ *
+ * Build: make build/logfmttest
+ * Usage: logfmttest [-r seed]
+ *
+ * Checks the bytes of a few records worked out by hand from the tag, varint and zig-zag rules at the top of
+ * logfmt.c, then round trips long random streams of every channel through the encoder and the decoder:
+ * smooth values, jumps, the extremes of int32, time going backwards and long gaps. Truncated records and
+ * deltas without their keyframe have to be refused. The file header and the block CRC are round tripped
+ * too, and the bytes a 1 Hz fix takes are compared with the 24 bytes a data point of the old .dat file
+ * took. Exits with 1 if a check fails. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "host.h"
+#include "logfmt.h"
+
+#define TEST_RECORDS 200000
+#define TEST_LEGACY_RECORD_SIZE 24 // time and five floats of the old .dat file
+#define TEST_FIXES 3600
+
+static uint32_t _seed = 1;
+
+static uint32_t _random()
+{
+	_seed = _seed * 1103515245 + 12345;
+	return _seed >> 8;
+}
+
+static int32_t _noise(int32_t range)
+{
+	return (int32_t)(_random() % (2 * (uint32_t)range + 1)) - range;
+}
+
+static uint8_t _same(const struct LogFmt_Record *a, const struct LogFmt_Record *b)
+{
+	return a->channel == b->channel && a->time_ms == b->time_ms && a->num_fields == b->num_fields
+		&& memcmp(a->value, b->value, a->num_fields * sizeof(int32_t)) == 0;
+}
+
+static uint8_t _encodes_to(struct LogFmt_State *state, const struct LogFmt_Record *record, const uint8_t *expected, uint16_t len)
+{
+	uint8_t out[LOGFMT_MAX_RECORD_LEN];
+	uint16_t i, out_len = LogFmt_Encode(state, record, out);
+
+	if (out_len == len && memcmp(out, expected, len) == 0)
+		return 1;
+
+	printf("  got");
+	for (i = 0; i < out_len; ++i)
+		printf(" %02X", out[i]);
+	printf("\n");
+	return 0;
+}
+
+// bytes worked out by hand
+static void _known_bytes()
+{
+	struct LogFmt_State state;
+	struct LogFmt_Record event = {LOGFMT_CHANNEL_EVENT, 300, LOGFMT_EVENT_NUM_FIELDS, {1, 2, -3}};
+	struct LogFmt_Record baro = {LOGFMT_CHANNEL_BARO, 0, LOGFMT_BARO_NUM_FIELDS, {101325, 2150, 350}};
+	// tag: keyframe of channel 3, time 300 = 0xAC 0x02, zig-zag 1, 2 and -3 = 2, 4 and 5
+	static const uint8_t event_key[] = {0x83, 0xAC, 0x02, 0x02, 0x04, 0x05};
+	// event period is 0 so the time is stored, 10 ms. Values are stored as they are, all fit in nibbles
+	static const uint8_t event_delta[] = {0x23, 0x0A, 0x42, 0x05};
+	// 101325 = 202650 zig-zag = 0x9A 0xAF 0x0C, 2150 = 4300 = 0xCC 0x21, 350 = 700 = 0xBC 0x05
+	static const uint8_t baro_key[] = {0x81, 0x00, 0x9A, 0xAF, 0x0C, 0xCC, 0x21, 0xBC, 0x05};
+	// one period later, differences +1, -1, 0 = zig-zag 2, 1, 0 packed into nibbles
+	static const uint8_t baro_packed[] = {0x61, 0x12, 0x00};
+	// two periods later, difference +20 = 40 does not fit a nibble, so the time and all three are varints
+	static const uint8_t baro_varint[] = {0x01, 0xE8, 0x07, 0x28, 0x00, 0x00};
+	// CRC unit result for the word 0x12345678, from a bit by bit computation of the same polynomial
+	static const uint8_t word[] = {0x78, 0x56, 0x34, 0x12};
+
+	LogFmt_Init(&state, NULL);
+	Host_Check(_encodes_to(&state, &event, event_key, sizeof(event_key)), "event keyframe");
+	event.time_ms = 310;
+	Host_Check(_encodes_to(&state, &event, event_delta, sizeof(event_delta)), "event with the time stored and values in nibbles");
+
+	Host_Check(_encodes_to(&state, &baro, baro_key, sizeof(baro_key)), "baro keyframe at time 0");
+	baro.time_ms += LogFmt_GetChannelDef(LOGFMT_CHANNEL_BARO)->period_ms;
+	baro.value[LOGFMT_BARO_PRESSURE] += 1;
+	baro.value[LOGFMT_BARO_TEMPERATURE] -= 1;
+	Host_Check(_encodes_to(&state, &baro, baro_packed, sizeof(baro_packed)), "baro one period later, packed differences");
+	baro.time_ms += 2 * LogFmt_GetChannelDef(LOGFMT_CHANNEL_BARO)->period_ms;
+	baro.value[LOGFMT_BARO_PRESSURE] += 20;
+	Host_Check(LogFmt_GetChannelDef(LOGFMT_CHANNEL_BARO)->period_ms == 500
+		&& _encodes_to(&state, &baro, baro_varint, sizeof(baro_varint)), "baro off period, varint differences");
+
+	Host_Check(LogFmt_Crc32(word, sizeof(word)) == 0xDF8A8A2B, "CRC of the word 0x12345678");
+}
+
+// the next record of a channel, mostly smooth with now and then something nasty
+static void _next_record(uint8_t channel, struct LogFmt_Record *record, int32_t *rate)
+{
+	const struct LogFmt_ChannelDef *def = LogFmt_GetChannelDef(channel);
+	uint32_t kind = _random() % 100;
+	uint8_t i;
+
+	record->channel = channel;
+	record->num_fields = def->num_fields;
+
+	if (kind < 2)
+		record->time_ms -= record->time_ms < 1000 ? record->time_ms : _random() % 1000; // backwards
+	else if (kind < 3)
+		record->time_ms += _random() % 0x40000000; // long gap
+	else if (kind < 80 && def->period_ms != 0)
+		record->time_ms += def->period_ms;
+	else
+		record->time_ms += _random() % 2000;
+
+	for (i = 0; i < def->num_fields; ++i)
+	{
+		if (kind == 3)
+			record->value[i] = _random() % 2 ? INT32_MAX : INT32_MIN;
+		else if (kind < 6)
+			record->value[i] = (int32_t)(_random() << 8);
+		else
+		{
+			rate[i] += _noise(3);
+			record->value[i] += rate[i] + _noise(2);
+		}
+	}
+}
+
+static void _round_trip()
+{
+	static struct LogFmt_Record records[TEST_RECORDS];
+	static uint8_t stream[TEST_RECORDS * LOGFMT_MAX_RECORD_LEN];
+	struct LogFmt_State encoder, decoder;
+	struct LogFmt_Record last[LOGFMT_NUM_CHANNELS] = {{0}};
+	struct LogFmt_Record record;
+	int32_t rate[LOGFMT_NUM_CHANNELS][LOGFMT_MAX_FIELDS] = {{0}};
+	uint32_t len = 0, pos, i, keyframes = 0, packed = 0, nominal = 0, decoded = 0;
+	uint16_t n;
+	uint8_t ok = 1;
+
+	LogFmt_Init(&encoder, NULL);
+	for (i = 0; i < TEST_RECORDS; ++i)
+	{
+		uint8_t c = (uint8_t)(_random() % LOGFMT_NUM_CHANNELS);
+		_next_record(c, &last[c], rate[c]);
+		records[i] = last[c];
+
+		n = LogFmt_Encode(&encoder, &records[i], &stream[len]);
+		if (n == 0 || n > LOGFMT_MAX_RECORD_LEN)
+			ok = 0;
+		keyframes += (stream[len] & 0x80) != 0;
+		nominal += (stream[len] & 0x40) != 0;
+		packed += (stream[len] & 0x20) != 0;
+		len += n;
+
+		// start over now and then, like the logger does at every block
+		if (_random() % 500 == 0)
+			LogFmt_Reset(&encoder);
+	}
+	Host_Check(ok, "every record encodes within LOGFMT_MAX_RECORD_LEN");
+
+	// the decoder does not see the resets, a keyframe is all it needs to start over
+	LogFmt_Init(&decoder, NULL);
+	for (i = 0, pos = 0; i < TEST_RECORDS; ++i, ++decoded, pos += n)
+	{
+		n = LogFmt_Decode(&decoder, &record, &stream[pos], (uint16_t)(len - pos > 0xFFFF ? 0xFFFF : len - pos));
+		if (n == 0 || !_same(&record, &records[i]))
+			break;
+	}
+	Host_Check(decoded == TEST_RECORDS && pos == len, "random streams of all channels decode to what was encoded");
+	printf("  %u records, %u keyframes, %u at the nominal period, %u packed\n", TEST_RECORDS, keyframes, nominal, packed);
+	Host_Check(keyframes > 0 && nominal > 0 && packed > 0, "all record kinds came up");
+}
+
+static void _refused()
+{
+	struct LogFmt_State state;
+	struct LogFmt_Record record = {LOGFMT_CHANNEL_FIX, 1000, LOGFMT_FIX_NUM_FIELDS, {481173000, 115166667, 3500, 900, 1200}};
+	uint8_t key[LOGFMT_MAX_RECORD_LEN], delta[LOGFMT_MAX_RECORD_LEN];
+	uint16_t key_len, delta_len, i;
+	uint8_t ok = 1;
+
+	LogFmt_Init(&state, NULL);
+	key_len = LogFmt_Encode(&state, &record, key);
+	record.time_ms += 1000;
+	record.value[LOGFMT_FIX_LONGITUDE] += 9200;
+	delta_len = LogFmt_Encode(&state, &record, delta);
+
+	// every cut short keyframe and delta
+	for (i = 0; i < key_len; ++i)
+	{
+		LogFmt_Init(&state, NULL);
+		ok = LogFmt_Decode(&state, &record, key, i) == 0 && ok;
+	}
+	for (i = 0; i < delta_len; ++i)
+	{
+		LogFmt_Init(&state, NULL);
+		ok = LogFmt_Decode(&state, &record, key, key_len) == key_len && LogFmt_Decode(&state, &record, delta, i) == 0 && ok;
+	}
+	Host_Check(ok, "truncated records are refused");
+
+	LogFmt_Init(&state, NULL);
+	Host_Check(LogFmt_Decode(&state, &record, delta, delta_len) == 0, "delta without its keyframe is refused");
+
+	key[0] = 0x80 | LOGFMT_NUM_CHANNELS;
+	Host_Check(LogFmt_Decode(&state, &record, key, key_len) == 0, "unknown channel is refused");
+
+	record.num_fields = 2;
+	Host_Check(LogFmt_Encode(&state, &record, key) == 0, "record with the wrong number of fields is not encoded");
+}
+
+static void _headers()
+{
+	static uint8_t block[LOGFMT_BLOCK_SIZE];
+	struct LogFmt_Header header, decoded;
+	struct LogFmt_BlockHeader block_header = {0, 0x1234ABCD, 42, 100}, checked;
+	uint16_t i;
+
+	LogFmt_InitHeader(&header, "1.2.3", 1500000000, 0x1234ABCD);
+	Host_Check(LogFmt_EncodeHeader(&header, block) == LOGFMT_BLOCK_SIZE && LogFmt_DecodeHeader(&decoded, block) == LOGFMT_BLOCK_SIZE
+		&& memcmp(&header, &decoded, sizeof(header)) == 0, "file header round trips");
+	block[100] ^= 0x10;
+	Host_Check(LogFmt_DecodeHeader(&decoded, block) == 0, "file header with a flipped bit is refused");
+
+	for (i = LOGFMT_BLOCK_HEADER_LEN; i < LOGFMT_BLOCK_SIZE; ++i)
+		block[i] = (uint8_t)i;
+	LogFmt_EncodeBlockHeader(&block_header, block);
+	block_header.crc = LogFmt_Crc32(&block[LOGFMT_BLOCK_CRC_START], LOGFMT_BLOCK_HEADER_LEN - LOGFMT_BLOCK_CRC_START + block_header.used);
+	LogFmt_EncodeBlockHeader(&block_header, block);
+	Host_Check(LogFmt_CheckBlock(block, 0x1234ABCD, &checked) && checked.seq == 42 && checked.used == 100, "data block checks out");
+	Host_Check(!LogFmt_CheckBlock(block, 0x1234ABCE, &checked), "data block of another session is refused");
+	block[LOGFMT_BLOCK_HEADER_LEN + 99] ^= 1;
+	Host_Check(!LogFmt_CheckBlock(block, 0x1234ABCD, &checked), "data block with a flipped payload bit is refused");
+	block[LOGFMT_BLOCK_HEADER_LEN + 99] ^= 1;
+	block[LOGFMT_BLOCK_HEADER_LEN + 100] ^= 1;
+	Host_Check(LogFmt_CheckBlock(block, 0x1234ABCD, &checked), "unused payload is not covered by the CRC");
+}
+
+// a 1 Hz fix stream of an aircraft in cruise, 120 kt east with a slow turn now and then
+static double _fix_bytes(int32_t position_noise)
+{
+	struct LogFmt_State state;
+	struct LogFmt_Record fix = {LOGFMT_CHANNEL_FIX, 0, LOGFMT_FIX_NUM_FIELDS, {481173000, 115166667, 3500, 900, 1200}};
+	uint8_t out[LOGFMT_MAX_RECORD_LEN];
+	uint32_t bytes = 0, i;
+	uint16_t period = LogFmt_GetChannelDef(LOGFMT_CHANNEL_FIX)->period_ms;
+
+	LogFmt_Init(&state, NULL);
+	for (i = 0; i < TEST_FIXES; ++i)
+	{
+		fix.time_ms += period;
+		fix.value[LOGFMT_FIX_LATITUDE] += (i / 600) % 2 ? 300 : 0;
+		fix.value[LOGFMT_FIX_LONGITUDE] += 8300 + _noise(position_noise);
+		fix.value[LOGFMT_FIX_ALTITUDE] = 3500 + _noise(1);
+		fix.value[LOGFMT_FIX_HEADING] = ((i / 600) % 2 ? 880 : 900) + _noise(2);
+		fix.value[LOGFMT_FIX_SPEED] = 1200 + _noise(2);
+		bytes += LogFmt_Encode(&state, &fix, out);
+
+		// the encoder starts over with every block, a block holds about this many fixes
+		if (i % 80 == 79)
+			LogFmt_Reset(&state);
+	}
+
+	return (double)bytes / TEST_FIXES;
+}
+
+static void _fix_size()
+{
+	double smooth, noisy;
+
+	smooth = _fix_bytes(5);
+	noisy = _fix_bytes(60);
+	printf("  1 Hz fix: %.2f bytes with 0.5 m of position noise, %.2f bytes with 6 m, the old file took %u\n",
+		smooth, noisy, TEST_LEGACY_RECORD_SIZE);
+	Host_Check(smooth * 4 <= TEST_LEGACY_RECORD_SIZE, "a 1 Hz fix in cruise takes a quarter of the old data point");
+}
+
+int main(int argc, char *argv[])
+{
+	int opt;
+
+	while ((opt = getopt(argc, argv, "r:")) != -1)
+	{
+		if (opt != 'r')
+		{
+			printf("usage: logfmttest [-r seed]\n");
+			return 1;
+		}
+		_seed = (uint32_t)strtoul(optarg, NULL, 0);
+	}
+
+	_known_bytes();
+	_round_trip();
+	_refused();
+	_headers();
+	_fix_size();
+
+	return Host_Summary();
+}
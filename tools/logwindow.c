@@ -0,0 +1,199 @@
+/* logwindow.c
+ * Host tool, prints the records of a flight log between two times
+ *
+ * Build: make build/logwindow
+ * Usage: logwindow <log file> <from s> <to s>
+ *
+ * Times are seconds since the start of the session. The time index sidecar next to the log is used to
+ * find the first block to read; if it is missing or does not belong to the log it is rebuilt from the
+ * log itself. Blocks that fail their check are skipped. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "logfmt.h"
+
+static struct LogFmt_IndexEntry *_index = NULL;
+static uint32_t _index_count = 0;
+
+static uint8_t _read_block(FILE *f, long offset, uint8_t *block)
+{
+	if (fseek(f, offset, SEEK_SET) != 0)
+		return 0;
+
+	return fread(block, LOGFMT_BLOCK_SIZE, 1, f) == 1;
+}
+
+// load the sidecar, it has to pass its CRC and belong to the session it points at
+static uint8_t _load_index(const char *filename, FILE *log, struct LogFmt_Header *header)
+{
+	char name[1024];
+	struct LogFmt_IndexHeader index_header;
+	uint8_t block[LOGFMT_BLOCK_SIZE];
+	uint8_t *data;
+	long len;
+	uint32_t i;
+	char *dot;
+
+	strncpy(name, filename, sizeof(name) - 5);
+	name[sizeof(name) - 5] = '\0';
+	dot = strrchr(name, '.');
+	strcpy(dot != NULL ? dot : &name[strlen(name)], ".idx");
+
+	FILE *f = fopen(name, "rb");
+	if (f == NULL)
+		return 0;
+
+	fseek(f, 0, SEEK_END);
+	len = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	if (len < LOGFMT_INDEX_HEADER_LEN + 4 || (data = malloc(len)) == NULL)
+	{
+		fclose(f);
+		return 0;
+	}
+
+	if (fread(data, len, 1, f) != 1
+		|| !LogFmt_DecodeIndexHeader(&index_header, data)
+		|| len != LOGFMT_INDEX_HEADER_LEN + (long)index_header.count * LOGFMT_INDEX_ENTRY_LEN + 4
+		|| LogFmt_Crc32(data, len - 4) != (uint32_t)(data[len - 4] | data[len - 3] << 8 | data[len - 2] << 16 | (uint32_t)data[len - 1] << 24)
+		|| !_read_block(log, index_header.base, block)
+		|| !LogFmt_DecodeHeader(header, block)
+		|| header->session != index_header.session)
+	{
+		free(data);
+		fclose(f);
+		return 0;
+	}
+
+	_index_count = index_header.count;
+	_index = malloc(_index_count * sizeof(*_index) + 1);
+	for (i = 0; i < _index_count; ++i)
+		LogFmt_DecodeIndexEntry(&_index[i], &data[LOGFMT_INDEX_HEADER_LEN + i * LOGFMT_INDEX_ENTRY_LEN]);
+
+	free(data);
+	fclose(f);
+	return 1;
+}
+
+// rebuild the index of the first session from the log, with an entry for every valid block
+static uint8_t _rebuild_index(FILE *log, struct LogFmt_Header *header)
+{
+	uint8_t block[LOGFMT_BLOCK_SIZE];
+	struct LogFmt_BlockHeader block_header;
+	uint32_t capacity = 1024;
+	uint32_t time_ms;
+	long offset;
+
+	if (!_read_block(log, 0, block) || !LogFmt_DecodeHeader(header, block))
+		return 0;
+
+	_index = malloc(capacity * sizeof(*_index));
+	_index_count = 0;
+	for (offset = LOGFMT_BLOCK_SIZE; _read_block(log, offset, block); offset += LOGFMT_BLOCK_SIZE)
+	{
+		if (!LogFmt_CheckBlock(block, header->session, &block_header) || !LogFmt_GetBlockTime(block, &time_ms))
+			continue;
+
+		if (_index_count == capacity)
+		{
+			capacity *= 2;
+			_index = realloc(_index, capacity * sizeof(*_index));
+		}
+		_index[_index_count].time_ms = time_ms;
+		_index[_index_count].offset = (uint32_t)offset;
+		++_index_count;
+	}
+
+	return 1;
+}
+
+static void _print_record(const struct LogFmt_Header *header, const struct LogFmt_Record *record)
+{
+	const struct LogFmt_ChannelDef *def = &header->channel[record->channel];
+	uint8_t i;
+
+	printf("%.3f,%.*s", record->time_ms / 1000.0, LOGFMT_NAME_LEN, def->name);
+	for (i = 0; i < record->num_fields; ++i)
+	{
+		int8_t scale = def->field[i].scale;
+		printf(",%.*s=%.*f", LOGFMT_NAME_LEN, def->field[i].name, scale < 0 ? -scale : 0, record->value[i] * pow(10, scale));
+	}
+	printf("\n");
+}
+
+int main(int argc, char *argv[])
+{
+	struct LogFmt_Header header;
+	struct LogFmt_BlockHeader block_header;
+	struct LogFmt_State state;
+	struct LogFmt_Record record;
+	uint8_t block[LOGFMT_BLOCK_SIZE];
+	uint32_t from_ms, to_ms, i, time_ms;
+	uint16_t pos, len;
+
+	if (argc != 4)
+	{
+		fprintf(stderr, "usage: %s <log file> <from s> <to s>\n", argv[0]);
+		return 1;
+	}
+
+	from_ms = (uint32_t)(atof(argv[2]) * 1000);
+	to_ms = (uint32_t)(atof(argv[3]) * 1000);
+
+	FILE *log = fopen(argv[1], "rb");
+	if (log == NULL)
+	{
+		perror(argv[1]);
+		return 1;
+	}
+
+	if (!_load_index(argv[1], log, &header))
+	{
+		fprintf(stderr, "no valid index, rebuilding it from the log\n");
+		if (!_rebuild_index(log, &header))
+		{
+			fprintf(stderr, "%s: no valid file header\n", argv[1]);
+			return 1;
+		}
+	}
+
+	fprintf(stderr, "firmware %.*s, session started at %u, %u index entries\n",
+		LOGFMT_FIRMWARE_LEN, header.firmware, header.start_time, _index_count);
+	if (_index_count == 0)
+		return 0;
+
+	// blocks before the entry found only hold records from before the window
+	i = LogFmt_FindIndexEntry(_index, _index_count, from_ms);
+	LogFmt_Init(&state, &header);
+
+	for (long offset = _index[i].offset; _read_block(log, offset, block); offset += LOGFMT_BLOCK_SIZE)
+	{
+		if (!LogFmt_CheckBlock(block, header.session, &block_header))
+		{
+			fprintf(stderr, "skipping bad block at %ld\n", offset);
+			continue;
+		}
+
+		if (LogFmt_GetBlockTime(block, &time_ms) && time_ms > to_ms)
+			break;
+
+		// every block starts over with keyframes
+		LogFmt_Reset(&state);
+		for (pos = 0; pos < block_header.used; pos += len)
+		{
+			len = LogFmt_Decode(&state, &record, &block[LOGFMT_BLOCK_HEADER_LEN + pos], block_header.used - pos);
+			if (len == 0)
+				break;
+
+			if (record.time_ms >= from_ms && record.time_ms <= to_ms)
+				_print_record(&header, &record);
+		}
+	}
+
+	fclose(log);
+	free(_index);
+	return 0;
+}
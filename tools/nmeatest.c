@@ -0,0 +1,475 @@
+/* nmeatest.c
+ * Host test and benchmark of the RMC, GGA and VTG parser, NMEA_ParseSentence
+ *
+ * Build: make build/nmeatest, with MINMEA=<minmea dir> to compare against minmea
+ * Usage: nmeatest [-n sentences] [capture file]
+ *
+ * The sentences the parser is checked with are the examples printed in the datasheet of the MTK3339
+ * receiver and in NMEA references, whose checksums check out, with the values of every field worked out by
+ * hand. Sentences made up for the cases those do not show get their checksum from the test. Checks that
+ * every sentence comes back as its type with those values, that sentences other than RMC, GGA and VTG are
+ * left to the general parser, that a field that does not scan as a number spoils the sentence, and that no
+ * sentence with a byte changed or cut short is taken as a fix.
+ *
+ * A capture file is what the receiver sent, a sentence a line. Checks that every RMC, GGA and VTG sentence
+ * in it with a good checksum is taken and that none with a bad one is. Built with minmea, checks that every
+ * field of those agrees with what minmea makes of it, coordinates to within the precision of the float of
+ * minmea_tocoord and hundredths to within one, as minmea rounds where the parser cuts off.
+ *
+ * The benchmark parses the sentences of the capture, or the examples without one, until -n sentences are
+ * parsed, a million by default, and prints the time a sentence. Built with minmea it also times what
+ * gps.c did before, minmea_sentence_id, the minmea parser and minmea_tocoord for the position. That is
+ * time on the host, the cycles it takes on the target are not measured here. Exits with 1 if a check
+ * fails. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#ifdef WITH_MINMEA
+#include <math.h>
+#include "minmea.h"
+#endif
+
+#include "host.h"
+#include "nmea.h"
+
+#define TEST_MAX_SENTENCES 100000
+#define TEST_LINE_LEN 1024
+#define TEST_DEFAULT_RUNS 1000000
+
+#define T NMEA_HAS_TIME
+#define D NMEA_HAS_DATE
+#define P NMEA_HAS_POSITION
+#define S NMEA_HAS_SPEED
+#define K NMEA_HAS_TRACK
+#define V NMEA_HAS_VARIATION
+#define A NMEA_HAS_ALTITUDE
+#define N NMEA_HAS_SATELLITES
+
+// a sentence and the fix it holds
+struct Example
+{
+	const char *sentence;
+	uint8_t type;
+	struct NMEA_Fix fix; // in the order of its members
+};
+
+static const struct Example _examples[] =
+{
+	{"$GPRMC,123519,A,4807.038,N,01131.000,E,022.4,084.4,230394,003.1,W*6A", NMEA_SENTENCE_RMC,
+		{T|D|P|S|K|V, 1, 45319000, 23, 3, 94, 481173000, 115166667, 2240, 8440, -310, 0, 0, 0}},
+	{"$GPGGA,123519,4807.038,N,01131.000,E,1,08,0.9,545.4,M,46.9,M,,*47", NMEA_SENTENCE_GGA,
+		{T|P|A|N, 1, 45319000, 0, 0, 0, 481173000, 115166667, 0, 0, 0, 54540, 'M', 8}},
+	{"$GPVTG,054.7,T,034.4,M,005.5,N,010.2,K*48", NMEA_SENTENCE_VTG,
+		{S|K, 1, 0, 0, 0, 0, 0, 0, 550, 5470, 0, 0, 0, 0}},
+	{"$GPVTG,054.7,T,034.4,M,005.5,N,010.2,K,A*25", NMEA_SENTENCE_VTG,
+		{S|K, 1, 0, 0, 0, 0, 0, 0, 550, 5470, 0, 0, 0, 0}},
+	{"$GPRMC,064951.000,A,2307.1256,N,12016.4438,E,0.03,165.48,260406,3.05,W,A*2C", NMEA_SENTENCE_RMC,
+		{T|D|P|S|K|V, 1, 24591000, 26, 4, 6, 231187600, 1202740633, 3, 16548, -305, 0, 0, 0}},
+	{"$GPGGA,064036.289,4836.5375,N,00740.9373,E,1,04,3.2,200.2,M,,,,0000*0E", NMEA_SENTENCE_GGA,
+		{T|P|A|N, 1, 24036289, 0, 0, 0, 486089583, 76822883, 0, 0, 0, 20020, 'M', 4}},
+	{"$GPRMC,081836,A,3751.65,S,14507.36,E,000.0,360.0,130998,011.3,E*62", NMEA_SENTENCE_RMC,
+		{T|D|P|S|K|V, 1, 29916000, 13, 9, 98, -378608333, 1451226667, 0, 36000, 1130, 0, 0, 0}},
+	{"$GPRMC,225446,A,4916.45,N,12311.12,W,000.5,054.7,191194,020.3,E*68", NMEA_SENTENCE_RMC,
+		{T|D|P|S|K|V, 1, 82486000, 19, 11, 94, 492741667, -1231853333, 50, 5470, 2030, 0, 0, 0}},
+	{"$GPRMC,092750.000,A,5321.6802,N,00630.3372,W,0.02,31.66,280511,,,A*43", NMEA_SENTENCE_RMC,
+		{T|D|P|S|K, 1, 34070000, 28, 5, 11, 533613367, -65056200, 2, 3166, 0, 0, 0, 0}},
+	{"$GPGGA,092750.000,5321.6802,N,00630.3372,W,1,8,1.03,61.7,M,55.2,M,,*76", NMEA_SENTENCE_GGA,
+		{T|P|A|N, 1, 34070000, 0, 0, 0, 533613367, -65056200, 0, 0, 0, 6170, 'M', 8}},
+	{"$GPGGA,172814.0,3723.46587704,N,12202.26957864,W,2,6,1.2,18.893,M,-25.669,M,2.0,0031*4F", NMEA_SENTENCE_GGA,
+		{T|P|A|N, 1, 62894000, 0, 0, 0, 373910980, -1220378263, 0, 0, 0, 1889, 'M', 6}},
+	{"$GNRMC,001031.00,A,4404.13993,N,12118.86023,W,0.146,,100117,,,A*7B", NMEA_SENTENCE_RMC,
+		{T|D|P|S, 1, 631000, 10, 1, 17, 440689988, -1213143372, 14, 0, 0, 0, 0, 0}},
+	{"$GPRMC,,V,,,,,,,,,,N*53", NMEA_SENTENCE_RMC,
+		{0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0}},
+	{"$GPGGA,,,,,,0,00,99.99,,,,,,*48", NMEA_SENTENCE_GGA,
+		{N, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0}},
+	{"$PMTK001,314,3*36", NMEA_SENTENCE_OTHER, {0}}
+};
+
+// made up, the checksum is added by the test
+static const struct
+{
+	const char *sentence;
+	uint8_t type;
+} _made_up[] =
+{
+	{"$GPVTG,054.7,034.4,005.5,010.2", NMEA_SENTENCE_OTHER}, // the old VTG without unit letters
+	{"$GPGSA,A,3,04,05,,09,12,,,24,,,,,2.5,1.3,2.1", NMEA_SENTENCE_OTHER},
+	{"$GPRMC,123519,A,48O7.038,N,01131.000,E,022.4,084.4,230394,003.1,W", NMEA_SENTENCE_INVALID},
+	{"$GPGGA,123519,4807.038,N,01131.000,E,1,O8,0.9,545.4,M,46.9,M,,", NMEA_SENTENCE_INVALID},
+	{"$GPRMC,123519,A,4867.038,N,01131.000,E,022.4,084.4,230394,003.1,W", NMEA_SENTENCE_INVALID}, // 67 minutes
+	{"$GPRMC,123519,A,4807.038,N,01131.000,E,022.4,084.4,230394,003.1,W", NMEA_SENTENCE_RMC}
+};
+
+static char _corpus[TEST_MAX_SENTENCES][NMEA_BUF_LEN];
+static uint8_t _corpus_len[TEST_MAX_SENTENCES];
+static uint32_t _num_corpus = 0;
+
+static uint8_t _is_fix(uint8_t type)
+{
+	return type == NMEA_SENTENCE_RMC || type == NMEA_SENTENCE_GGA || type == NMEA_SENTENCE_VTG;
+}
+
+static uint8_t _same_fix(const struct NMEA_Fix *a, const struct NMEA_Fix *b)
+{
+	return a->fields == b->fields && a->valid == b->valid && a->time_ms == b->time_ms && a->day == b->day
+		&& a->month == b->month && a->year == b->year && a->latitude == b->latitude && a->longitude == b->longitude
+		&& a->speed == b->speed && a->track == b->track && a->variation == b->variation
+		&& a->altitude == b->altitude && a->altitude_units == b->altitude_units && a->satellites == b->satellites;
+}
+
+static void _print_fix(const char *name, const struct NMEA_Fix *fix)
+{
+	printf("  %s: fields %03X valid %u time %u date %02u%02u%02u position %d %d speed %d track %d variation %d"
+		" altitude %d %c satellites %u\n", name, fix->fields, fix->valid, fix->time_ms, fix->day, fix->month,
+		fix->year, fix->latitude, fix->longitude, fix->speed, fix->track, fix->variation, fix->altitude,
+		fix->altitude_units ? fix->altitude_units : '-', fix->satellites);
+}
+
+// the sentence of the address and fields in body, with its checksum
+static uint8_t _with_checksum(const char *body, char *sentence)
+{
+	uint8_t checksum = 0;
+	uint32_t i;
+
+	for (i = 1; body[i] != '\0'; ++i)
+		checksum ^= (uint8_t)body[i];
+	return (uint8_t)sprintf(sentence, "%s*%02X", body, checksum);
+}
+
+static uint8_t _parse(const char *sentence, struct NMEA_Fix *fix)
+{
+	return NMEA_ParseSentence(sentence, (uint8_t)strlen(sentence), fix);
+}
+
+static void _examples_parse()
+{
+	char sentence[NMEA_BUF_LEN];
+	struct NMEA_Fix fix;
+	uint32_t i, wrong = 0, wrong_made_up = 0;
+	uint8_t type;
+
+	for (i = 0; i < sizeof(_examples) / sizeof(_examples[0]); ++i)
+	{
+		type = _parse(_examples[i].sentence, &fix);
+		if (type != _examples[i].type || (_is_fix(type) && !_same_fix(&fix, &_examples[i].fix)))
+		{
+			printf("  %s gives %u\n", _examples[i].sentence, type);
+			_print_fix("got     ", &fix);
+			_print_fix("expected", &_examples[i].fix);
+			++wrong;
+		}
+	}
+	Host_Check(wrong == 0, "examples parse to the values worked out by hand");
+
+	for (i = 0; i < sizeof(_made_up) / sizeof(_made_up[0]); ++i)
+	{
+		_with_checksum(_made_up[i].sentence, sentence);
+		type = _parse(sentence, &fix);
+		if (type != _made_up[i].type)
+		{
+			printf("  %s gives %u\n", sentence, type);
+			++wrong_made_up;
+		}
+	}
+	Host_Check(wrong_made_up == 0, "others left to minmea, fields that do not scan spoil it");
+}
+
+// every byte of every example changed to every other printable character, and every example cut short
+static void _examples_damaged()
+{
+	char sentence[NMEA_BUF_LEN];
+	struct NMEA_Fix fix;
+	uint32_t i, pos, len, changed = 0, changed_taken = 0, cut = 0, cut_taken = 0;
+	char c, was;
+
+	for (i = 0; i < sizeof(_examples) / sizeof(_examples[0]); ++i)
+	{
+		if (!_is_fix(_examples[i].type))
+			continue;
+		len = strlen(_examples[i].sentence);
+
+		for (pos = 1; pos < len; ++pos)
+		{
+			for (c = ' '; c <= '~'; ++c)
+			{
+				strcpy(sentence, _examples[i].sentence);
+				was = sentence[pos];
+				// a hex digit of the checksum in the other case is the same checksum
+				if (c == was || (pos >= len - 2 && c != was && (c | 0x20) == (was | 0x20) && was >= 'A'))
+					continue;
+				sentence[pos] = c;
+				++changed;
+				if (_is_fix(_parse(sentence, &fix)))
+				{
+					printf("  taken: %s\n", sentence);
+					++changed_taken;
+				}
+			}
+		}
+
+		for (pos = 1; pos < len; ++pos)
+		{
+			memcpy(sentence, _examples[i].sentence, pos);
+			sentence[pos] = '\0';
+			++cut;
+			if (_is_fix(_parse(sentence, &fix)))
+			{
+				printf("  taken: %s\n", sentence);
+				++cut_taken;
+			}
+		}
+	}
+
+	printf("  %u sentences with a byte changed, %u cut short\n", changed, cut);
+	Host_Check(changed_taken == 0, "no sentence with a byte changed is taken");
+	Host_Check(cut_taken == 0, "no sentence cut short is taken");
+}
+
+#ifdef WITH_MINMEA
+static uint8_t _same_time(const struct minmea_time *time, const struct NMEA_Fix *fix)
+{
+	if (!(fix->fields & NMEA_HAS_TIME))
+		return time->hours == -1;
+	return (uint32_t)((time->hours * 60 + time->minutes) * 60 + time->seconds) * 1000 + time->microseconds / 1000
+		== fix->time_ms;
+}
+
+static uint8_t _same_date(const struct minmea_date *date, const struct NMEA_Fix *fix)
+{
+	if (!(fix->fields & NMEA_HAS_DATE))
+		return date->day == -1;
+	return date->day == fix->day && date->month == fix->month && date->year == fix->year;
+}
+
+// 1e-7 deg, to within a float
+static uint8_t _same_coordinate(const struct minmea_float *f, uint8_t has, int32_t value)
+{
+	if (!has)
+		return f->scale == 0;
+	return fabs(minmea_tocoord(f) - value / 1e7) < 2e-5;
+}
+
+// hundredths, minmea rounds where the parser cuts off
+static uint8_t _same_hundredths(const struct minmea_float *f, uint8_t has, int32_t value)
+{
+	if (!has)
+		return f->scale == 0;
+	return abs(minmea_rescale(f, 100) - value) <= 1;
+}
+
+static uint8_t _same_as_minmea(const char *sentence, uint8_t type, const struct NMEA_Fix *fix)
+{
+	struct minmea_sentence_rmc rmc;
+	struct minmea_sentence_gga gga;
+	struct minmea_sentence_vtg vtg;
+	uint8_t has_position = (fix->fields & NMEA_HAS_POSITION) == NMEA_HAS_POSITION;
+
+	switch (type)
+	{
+	case NMEA_SENTENCE_RMC:
+		return minmea_parse_rmc(&rmc, sentence) && rmc.valid == fix->valid && _same_time(&rmc.time, fix)
+			&& _same_date(&rmc.date, fix) && _same_coordinate(&rmc.latitude, has_position, fix->latitude)
+			&& _same_coordinate(&rmc.longitude, has_position, fix->longitude)
+			&& _same_hundredths(&rmc.speed, fix->fields & NMEA_HAS_SPEED, fix->speed)
+			&& _same_hundredths(&rmc.course, fix->fields & NMEA_HAS_TRACK, fix->track)
+			&& _same_hundredths(&rmc.variation, fix->fields & NMEA_HAS_VARIATION, fix->variation);
+	case NMEA_SENTENCE_GGA:
+		return minmea_parse_gga(&gga, sentence) && (gga.fix_quality > 0) == fix->valid && _same_time(&gga.time, fix)
+			&& _same_coordinate(&gga.latitude, has_position, fix->latitude)
+			&& _same_coordinate(&gga.longitude, has_position, fix->longitude)
+			&& _same_hundredths(&gga.altitude, fix->fields & NMEA_HAS_ALTITUDE, fix->altitude)
+			&& (!(fix->fields & NMEA_HAS_ALTITUDE) || gga.altitude_units == fix->altitude_units)
+			&& gga.satellites_tracked == fix->satellites;
+	case NMEA_SENTENCE_VTG:
+		return minmea_parse_vtg(&vtg, sentence)
+			&& _same_hundredths(&vtg.true_track_degrees, fix->fields & NMEA_HAS_TRACK, fix->track)
+			&& _same_hundredths(&vtg.speed_knots, fix->fields & NMEA_HAS_SPEED, fix->speed);
+	}
+	return 0;
+}
+
+// what gps.c did with a sentence before, the position as floats
+static float _minmea(const char *sentence)
+{
+	struct minmea_sentence_rmc rmc;
+	struct minmea_sentence_gga gga;
+	struct minmea_sentence_vtg vtg;
+
+	switch (minmea_sentence_id(sentence, false))
+	{
+	case MINMEA_SENTENCE_RMC:
+		if (minmea_parse_rmc(&rmc, sentence))
+			return minmea_tocoord(&rmc.latitude) + minmea_tocoord(&rmc.longitude) + minmea_tofloat(&rmc.speed);
+		break;
+	case MINMEA_SENTENCE_GGA:
+		if (minmea_parse_gga(&gga, sentence))
+			return minmea_tocoord(&gga.latitude) + minmea_tocoord(&gga.longitude) + minmea_tofloat(&gga.altitude);
+		break;
+	case MINMEA_SENTENCE_VTG:
+		if (minmea_parse_vtg(&vtg, sentence))
+			return minmea_tofloat(&vtg.speed_knots);
+		break;
+	default:
+		break;
+	}
+	return 0;
+}
+#endif
+
+// an RMC, GGA or VTG sentence by its address, whatever its fields
+static uint8_t _has_fix_address(const char *sentence, uint8_t len)
+{
+	return len >= 7 && sentence[6] == ','
+		&& (strncmp(&sentence[3], "RMC", 3) == 0 || strncmp(&sentence[3], "GGA", 3) == 0
+		|| strncmp(&sentence[3], "VTG", 3) == 0);
+}
+
+// the sentences of a capture into the corpus
+static uint8_t _load_capture(const char *filename)
+{
+	char line[TEST_LINE_LEN];
+	struct NMEA_Fix fix;
+	FILE *f = fopen(filename, "r");
+	uint32_t len, lines = 0, skipped = 0, fixes = 0, not_taken = 0, bad = 0, bad_taken = 0, not_same = 0;
+	uint8_t type, good;
+
+	if (f == NULL)
+	{
+		printf("can not open %s\n", filename);
+		return 0;
+	}
+
+	while (fgets(line, sizeof(line), f) != NULL)
+	{
+		++lines;
+		len = strcspn(line, "\r\n");
+		line[len] = '\0';
+		if (line[0] != '$' || len > NMEA_BUF_LEN - 1 || _num_corpus == TEST_MAX_SENTENCES)
+		{
+			++skipped;
+			continue;
+		}
+
+		type = NMEA_ParseSentence(line, (uint8_t)len, &fix);
+		good = NMEA_CheckSentence(line, (uint8_t)len);
+		if (!good)
+		{
+			++bad;
+			if (_is_fix(type))
+			{
+				printf("  taken: %s\n", line);
+				++bad_taken;
+			}
+		}
+		else if (_has_fix_address(line, (uint8_t)len))
+		{
+			++fixes;
+			if (type == NMEA_SENTENCE_INVALID)
+			{
+				printf("  not taken: %s\n", line);
+				++not_taken;
+			}
+#ifdef WITH_MINMEA
+			else if (_is_fix(type) && !_same_as_minmea(line, type, &fix))
+			{
+				printf("  not as minmea has it: %s\n", line);
+				++not_same;
+			}
+#endif
+		}
+
+		memcpy(_corpus[_num_corpus], line, len + 1);
+		_corpus_len[_num_corpus++] = (uint8_t)len;
+	}
+	fclose(f);
+
+	printf("  %u lines, %u skipped, %u RMC, GGA and VTG, %u with a bad checksum\n", lines, skipped, fixes, bad);
+	Host_Check(fixes > 0 && not_taken == 0, "every RMC, GGA and VTG of the capture is taken");
+	Host_Check(bad_taken == 0, "no sentence of the capture with a bad checksum is taken");
+#ifdef WITH_MINMEA
+	Host_Check(not_same == 0, "every fix of the capture agrees with minmea");
+#else
+	(void)not_same;
+#endif
+	return 1;
+}
+
+static double _now_ns()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void _benchmark(uint32_t runs)
+{
+	struct NMEA_Fix fix;
+	volatile int32_t sink = 0;
+	double start, ns;
+	uint32_t n;
+#ifdef WITH_MINMEA
+	volatile float minmea_sink = 0;
+#endif
+
+	start = _now_ns();
+	for (n = 0; n < runs; ++n)
+	{
+		NMEA_ParseSentence(_corpus[n % _num_corpus], _corpus_len[n % _num_corpus], &fix);
+		sink += fix.latitude;
+	}
+	ns = _now_ns() - start;
+	printf("  NMEA_ParseSentence %8.1f ns a sentence, %u sentences\n", ns / runs, runs);
+
+#ifdef WITH_MINMEA
+	start = _now_ns();
+	for (n = 0; n < runs; ++n)
+		minmea_sink += _minmea(_corpus[n % _num_corpus]);
+	ns = _now_ns() - start;
+	printf("  minmea             %8.1f ns a sentence, %u sentences\n", ns / runs, runs);
+#endif
+	(void)sink;
+}
+
+int main(int argc, char *argv[])
+{
+	uint32_t runs = TEST_DEFAULT_RUNS, i;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:")) != -1)
+	{
+		if (opt != 'n' || (runs = (uint32_t)strtoul(optarg, NULL, 0)) == 0)
+		{
+			printf("usage: nmeatest [-n sentences] [capture file]\n");
+			return 1;
+		}
+	}
+
+	_examples_parse();
+	_examples_damaged();
+
+	if (optind < argc)
+	{
+		if (!_load_capture(argv[optind]))
+			return 1;
+	}
+	else
+	{
+		for (i = 0; i < sizeof(_examples) / sizeof(_examples[0]); ++i)
+		{
+			strcpy(_corpus[i], _examples[i].sentence);
+			_corpus_len[i] = (uint8_t)strlen(_examples[i].sentence);
+		}
+		_num_corpus = i;
+	}
+
+	if (_num_corpus > 0)
+		_benchmark(runs);
+
+	return Host_Summary();
+}
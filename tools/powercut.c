@@ -0,0 +1,330 @@
+/* powercut.c
+ * Host test of the recovery of logs cut short by a power loss, cuts the power of the simulated card at
+ * random points while logging and recovers the log like the firmware does at boot
+ *
+ * Build: make build/powercut
+ * Usage: powercut [-r seed] [-n cuts] [image file]
+ *
+ * Each round logs to a new file in a child process, syncing every so many records, until the card loses
+ * power after a random number of sectors; the last sector written is torn. The parent comes up with nothing
+ * of the logger or FatFS state in RAM, like the board after a reset, mounts the volume and runs Log_Recover.
+ * The log has to be cut to the run of valid blocks found by reading the extent from the start, decode to
+ * the records logged, and hold every record synced unless the cut tore the rewrite of the block that was
+ * partial at the last sync. LogFmt_FindEnd is run again on the image to count its block reads. The files
+ * are deleted after each round, so later extents reuse clusters full of blocks of earlier sessions. A cut
+ * while Log_Open allocates the extent leaves lost clusters in the FAT, and once there is no 16 MB run left
+ * the log goes through f_write; Log_Recover leaves such a log alone and it only has to hold what was
+ * synced. Exits with 1 if a check fails. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "stm32f4xx.h"
+#include "FreeRTOS.h"
+#include "host.h"
+#include "card.h"
+#include "ff.h"
+#include "diskio.h"
+#include "sd.h"
+#include "log.h"
+#include "volume.h"
+
+#define TEST_SECTORS 262144 // 128 MB
+#define TEST_CLUSTER_SECTORS 8
+#define TEST_START_TIME 1500000000
+#define TEST_EXTENT_BLOCKS 32767 // data blocks in LOG_EXTENT_SIZE of log.c
+#define TEST_MAX_RECORDS (256 * 1024)
+#define TEST_MAX_CUT 4000 // sectors written before the power goes
+#define TEST_MIN_SYNC 20 // records between syncs
+#define TEST_MAX_SYNC 2000
+
+// what the board had on the card at its last sync
+struct Synced
+{
+	uint32_t records;
+	uint32_t blocks; // valid blocks, the last one partial
+};
+
+struct Totals
+{
+	uint32_t max_reads; // block reads of LogFmt_FindEnd
+	uint32_t max_sectors_read; // by Log_Recover, with the FAT, the directory and the index rebuild
+	uint32_t torn_rewrites;
+	uint32_t without_extent;
+};
+
+static struct LogFmt_Record _decoded[TEST_MAX_RECORDS];
+static uint32_t _seed = 1;
+static uint32_t _extent_lba = 0;
+static uint32_t _num_reads = 0;
+
+static uint32_t _random(uint32_t min, uint32_t max)
+{
+	_seed = _seed * 1103515245 + 12345;
+	return min + (_seed >> 8) % (max - min + 1);
+}
+
+static uint32_t _hash(uint32_t x)
+{
+	x ^= x >> 16;
+	x *= 0x7feb352d;
+	x ^= x >> 15;
+	x *= 0x846ca68b;
+	return x ^ (x >> 16);
+}
+
+// the n-th record of a session, IMU with a baro record every 50
+static void _make_record(uint32_t session, uint32_t n, struct LogFmt_Record *record)
+{
+	const struct LogFmt_ChannelDef *def;
+	uint8_t i;
+
+	record->channel = n % 50 == 25 ? LOGFMT_CHANNEL_BARO : LOGFMT_CHANNEL_IMU;
+	record->time_ms = n * 5;
+	def = LogFmt_GetChannelDef(record->channel);
+	record->num_fields = def->num_fields;
+	for (i = 0; i < def->num_fields; ++i)
+		record->value[i] = (int32_t)(_hash(session * 7919 + n * LOGFMT_MAX_FIELDS + i) % 20001) - 10000;
+}
+
+// valid blocks of a log read through the file system, the ones before from are known to be valid
+static uint32_t _valid_blocks(const char *filename, uint32_t from)
+{
+	static uint8_t block[LOGFMT_BLOCK_SIZE];
+	struct LogFmt_Header header;
+	struct LogFmt_BlockHeader block_header;
+	FIL file;
+	UINT num_read = 0;
+	uint32_t seq = from;
+
+	if (f_open(&file, filename, FA_READ) != FR_OK)
+		return 0;
+
+	if (f_read(&file, block, sizeof(block), &num_read) == FR_OK && num_read == sizeof(block)
+		&& LogFmt_DecodeHeader(&header, block) != 0 && f_lseek(&file, (FSIZE_t)(1 + from) * LOG_BLOCK_SIZE) == FR_OK)
+	{
+		while (f_read(&file, block, sizeof(block), &num_read) == FR_OK && num_read == sizeof(block)
+			&& LogFmt_CheckBlock(block, header.session, &block_header) && block_header.seq == seq)
+			++seq;
+	}
+
+	f_close(&file);
+	return seq;
+}
+
+// the board, logs until the power goes away and tells the parent what it synced through fd
+static void _log_until_cut(const char *filename, uint32_t round, uint32_t cut_after, uint32_t sync_records, int fd)
+{
+	struct LogFmt_Record record;
+	struct Synced synced = {0, 0};
+	uint32_t n = 0;
+	uint8_t ok;
+
+	Card_GetParams()->cut_after = cut_after;
+	ok = Log_Open(filename, TEST_START_TIME);
+	while (ok)
+	{
+		_make_record(round, n, &record);
+		ok = Log_Append(&record) && Log_Process();
+		if (ok && ++n % sync_records == 0 && (ok = Log_Sync()))
+		{
+			// every record appended so far was taken, the block that was partial at the last sync was written
+			// again since
+			synced.records = n;
+			synced.blocks = _valid_blocks(filename, synced.blocks > 0 ? synced.blocks - 1 : 0);
+			if (write(fd, &synced, sizeof(synced)) != sizeof(synced))
+				break;
+		}
+	}
+
+	Card_Close();
+	_exit(Card_IsPowered() ? 1 : 0);
+}
+
+static uint8_t _read_block(void *context, uint32_t index, uint8_t *block)
+{
+	(void)context;
+	++_num_reads;
+	return Card_Load(_extent_lba + 1 + index, block, 1);
+}
+
+// the valid blocks of the extent, read one after the other from the start
+static uint32_t _scan(uint32_t session)
+{
+	static uint8_t block[LOGFMT_BLOCK_SIZE];
+	struct LogFmt_BlockHeader header;
+	uint32_t seq;
+
+	for (seq = 0; seq < TEST_EXTENT_BLOCKS && Card_Load(_extent_lba + 1 + seq, block, 1)
+		&& LogFmt_CheckBlock(block, session, &header) && header.seq == seq; ++seq)
+		;
+
+	return seq;
+}
+
+static uint8_t _same_records(uint32_t round, uint32_t count)
+{
+	struct LogFmt_Record record;
+	uint32_t i;
+
+	for (i = 0; i < count && i < TEST_MAX_RECORDS; ++i)
+	{
+		_make_record(round, i, &record);
+		if (!Volume_SameRecord(&_decoded[i], &record))
+			return 0;
+	}
+
+	return 1;
+}
+
+// one power cut, returns 0 if a check fails
+static uint8_t _round(uint32_t round, struct Totals *totals)
+{
+	static uint8_t block[LOGFMT_BLOCK_SIZE];
+	struct LogFmt_Header header;
+	struct Synced synced = {0, 0}, last;
+	struct SD_Stats sd_stats;
+	char filename[16], index_name[16];
+	uint32_t cut_after, sync_records, expected = 0, end = 0, num_records = 0, num_blocks = 0;
+	FSIZE_t size;
+	FILINFO info;
+	FIL file;
+	int fds[2], status = 1;
+	pid_t pid;
+	uint8_t has_extent, has_header = 0, ok;
+
+	cut_after = _random(1, TEST_MAX_CUT);
+	sync_records = _random(TEST_MIN_SYNC, TEST_MAX_SYNC);
+	snprintf(filename, sizeof(filename), "P%03u.dat", round % 1000);
+	snprintf(index_name, sizeof(index_name), "P%03u.idx", round % 1000);
+
+	fflush(stdout);
+	if (pipe(fds) != 0 || (pid = fork()) < 0)
+		return 0;
+	if (pid == 0)
+	{
+		close(fds[0]);
+		_log_until_cut(filename, round, cut_after, sync_records, fds[1]);
+	}
+	close(fds[1]);
+	while (read(fds[0], &last, sizeof(last)) == sizeof(last))
+		synced = last;
+	close(fds[0]);
+	ok = waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+
+	// the board comes up again, with the log as the cut left it on the card
+	ok = Volume_Mount() && ok;
+	size = f_stat(filename, &info) == FR_OK ? info.fsize : 0;
+	has_extent = size == (FSIZE_t)(1 + TEST_EXTENT_BLOCKS) * LOG_BLOCK_SIZE;
+	if (has_extent && f_open(&file, filename, FA_READ) == FR_OK)
+	{
+		_extent_lba = file.obj.fs->database + (file.obj.sclust - 2) * file.obj.fs->csize;
+		f_close(&file);
+
+		has_header = Card_Load(_extent_lba, block, 1) && LogFmt_DecodeHeader(&header, block) != 0;
+		if (has_header)
+		{
+			expected = _scan(header.session);
+			_num_reads = 0;
+			end = LogFmt_FindEnd(_read_block, NULL, header.session, TEST_EXTENT_BLOCKS, block);
+			if (_num_reads > totals->max_reads)
+				totals->max_reads = _num_reads;
+		}
+	}
+
+	SD_ResetStats();
+	ok = Log_Recover() && ok;
+	SD_GetStats(&sd_stats);
+	if (sd_stats.sectors_read > totals->max_sectors_read)
+		totals->max_sectors_read = sd_stats.sectors_read;
+
+	if (has_header || (size > 0 && !has_extent))
+	{
+		ok = Volume_ReadLog(filename, 0, &header, _decoded, TEST_MAX_RECORDS, &num_records, &num_blocks) && ok;
+		ok = ok && f_stat(filename, &info) == FR_OK && _same_records(round, num_records);
+		if (has_header)
+		{
+			ok = ok && end == expected && num_blocks == expected && info.fsize == (FSIZE_t)(1 + expected) * LOG_BLOCK_SIZE;
+		}
+		else
+		{
+			// No extent could be allocated and the log went through f_write. Log_Recover leaves it alone, the
+			// cut may have left blocks at its end that did not make it.
+			ok = ok && info.fsize == size;
+			++totals->without_extent;
+		}
+
+		// a torn rewrite of the partial block loses what the last sync put in it, nothing before it
+		if (num_blocks + 1 == synced.blocks)
+			++totals->torn_rewrites;
+		else
+			ok = ok && num_blocks >= synced.blocks && num_records >= synced.records;
+	}
+	else
+	{
+		// the cut came before the file header was on the card, a file left behind is emptied
+		ok = ok && synced.blocks == 0 && (size == 0 || (f_stat(filename, &info) == FR_OK && info.fsize == 0));
+	}
+
+	if (!ok)
+		printf("  round %u: cut after %u sectors, sync every %u records, %u records in %u blocks synced, %u blocks on the card, "
+			"%u found, %u records in %u blocks after recovery\n", round, cut_after, sync_records, synced.records,
+			synced.blocks, expected, end, num_records, num_blocks);
+
+	f_unlink(filename);
+	f_unlink(index_name);
+	return ok;
+}
+
+int main(int argc, char *argv[])
+{
+	struct Card_Params params;
+	struct Totals totals = {0, 0, 0, 0};
+	uint32_t cuts = 200, failed = 0, i;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "r:n:")) != -1)
+	{
+		if (opt == 'r')
+			_seed = (uint32_t)strtoul(optarg, NULL, 0);
+		else if (opt == 'n')
+			cuts = (uint32_t)strtoul(optarg, NULL, 0);
+		else
+		{
+			printf("usage: powercut [-r seed] [-n cuts] [image file]\n");
+			return 1;
+		}
+	}
+
+	Card_Defaults(&params);
+	params.sectors = TEST_SECTORS;
+
+	ff_init_syncobj();
+	disk_init_lock();
+	Log_Init();
+	if (!Volume_Create(optind < argc ? argv[optind] : "powercut.img", &params, TEST_CLUSTER_SECTORS))
+	{
+		printf("card bring-up failed\n");
+		return 1;
+	}
+
+	for (i = 0; i < cuts; ++i)
+	{
+		if (!_round(i, &totals))
+			++failed;
+	}
+
+	Host_Check(failed == 0, "every recovered log ends at the last valid block, nothing synced lost");
+	// a binary search over the extent reads ceil(log2(32768)) blocks
+	Host_Check(totals.max_reads <= 15, "end of the log found with a binary search over the extent");
+	printf("  %u cuts, %u of them tore the rewrite of the block partial at the last sync, %u logs without an extent\n",
+		cuts, totals.torn_rewrites, totals.without_extent);
+	printf("  at most %u block reads to find the end, %u sectors read by Log_Recover\n", totals.max_reads,
+		totals.max_sectors_read);
+
+	Card_Close();
+	return Host_Summary();
+}
@@ -0,0 +1,360 @@
+/* sdbench.c
+ * Host benchmark of the logger on the file system, replays the logging pattern of SDTask on a simulated card
+ *
+ * Build: make build/sdbench, or make build/sdbench-sdio for the real driver on the SDIO simulation
+ * Usage: sdbench [-s seconds] [-m log|legacy] [-o name=value]... [image file]
+ *
+ * The image is formatted and the card brought up like SDTask does it. In log mode the IMU submits at 200 Hz,
+ * the baro at 2 Hz and the GPS at 10 Hz, and the SD task drains and syncs the logger at the intervals of
+ * main.c. Legacy mode is the SDTask the logger replaced, which opened the file, appended one 24 byte data
+ * point and closed it again once a second. The card parameters are those of card.h, -o sets them, -o help
+ * lists them. Everything from boot, with the card bring-up, to closing the log is reported, in simulated
+ * time. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "stm32f4xx.h"
+#include "FreeRTOS.h"
+#include "task.h"
+#include "host.h"
+#include "card.h"
+#include "fat.h"
+#include "ff.h"
+#include "diskio.h"
+#include "sd.h"
+#include "log.h"
+
+// the intervals of main.c
+#define LOG_PROCESS_INTERVAL_MS 100
+#define LOG_SYNC_INTERVAL_MS 30000
+#define LOG_SYNC_RECORDS 6500
+#define AMG_SAMPLE_PERIOD_MS 5
+#define TPH_SAMPLE_PERIOD_MS 500
+#define GPS_PERIOD_MS 100
+#define LEGACY_PERIOD_MS 1000
+#define LEGACY_DATA_POINT_SIZE 24
+
+#define BENCH_DATE_MS 2000 // the GPS has a date this long after boot, the log is opened then
+#define BENCH_START_TIME 1500000000
+#define BENCH_CLUSTER_SECTORS 64
+
+static uint32_t _seconds = 60;
+static uint8_t _legacy = 0;
+static volatile uint8_t _stop = 0;
+static uint32_t _seed = 1;
+
+// what happened from boot until the log was closed
+static struct Log_Stats _log_stats;
+static struct SD_Stats _sd_stats;
+static struct Card_Stats _card_stats;
+static uint64_t _elapsed_us = 0;
+static uint32_t _records = 0;
+static uint32_t _failures = 0;
+
+static int32_t _noise(int32_t range)
+{
+	_seed = _seed * 1103515245 + 12345;
+	return (int32_t)((_seed >> 16) % (2 * range + 1)) - range;
+}
+
+static void _amg_task(void *arg)
+{
+	int32_t imu[LOGFMT_IMU_NUM_FIELDS];
+	TickType_t last_sample = xTaskGetTickCount();
+	uint8_t i;
+
+	(void)arg;
+	while (!_stop)
+	{
+		// a board at rest, gravity on z and sensor noise on everything
+		for (i = 0; i < LOGFMT_IMU_NUM_FIELDS; ++i)
+			imu[i] = _noise(12);
+		imu[LOGFMT_IMU_ACC_Z] += 16384;
+		imu[LOGFMT_IMU_MAG_X] += 1200;
+		Log_Submit(LOGFMT_CHANNEL_IMU, imu, LOGFMT_IMU_NUM_FIELDS);
+
+		vTaskDelayUntil(&last_sample, pdMS_TO_TICKS(AMG_SAMPLE_PERIOD_MS));
+	}
+}
+
+static void _tph_task(void *arg)
+{
+	int32_t baro[LOGFMT_BARO_NUM_FIELDS];
+	TickType_t last_sample = xTaskGetTickCount();
+
+	(void)arg;
+	while (!_stop)
+	{
+		baro[LOGFMT_BARO_PRESSURE] = 101325 + _noise(3);
+		baro[LOGFMT_BARO_TEMPERATURE] = 2150 + _noise(2);
+		baro[LOGFMT_BARO_ALTITUDE] = 350 + _noise(1);
+		Log_Submit(LOGFMT_CHANNEL_BARO, baro, LOGFMT_BARO_NUM_FIELDS);
+
+		vTaskDelayUntil(&last_sample, pdMS_TO_TICKS(TPH_SAMPLE_PERIOD_MS));
+	}
+}
+
+static void _gps_task(void *arg)
+{
+	int32_t fix[LOGFMT_FIX_NUM_FIELDS];
+	TickType_t last_fix = xTaskGetTickCount();
+	int32_t n = 0;
+
+	(void)arg;
+	while (!_stop)
+	{
+		// flying east at 120 kt
+		fix[LOGFMT_FIX_LATITUDE] = 481173000;
+		fix[LOGFMT_FIX_LONGITUDE] = 115166667 + n * 92;
+		fix[LOGFMT_FIX_ALTITUDE] = 3500 + _noise(2);
+		fix[LOGFMT_FIX_HEADING] = 900 + _noise(3);
+		fix[LOGFMT_FIX_SPEED] = 1200 + _noise(5);
+		Log_SubmitAt(LOGFMT_CHANNEL_FIX, fix, LOGFMT_FIX_NUM_FIELDS, last_fix);
+		++n;
+
+		vTaskDelayUntil(&last_fix, pdMS_TO_TICKS(GPS_PERIOD_MS));
+	}
+}
+
+// SD_Initialize, mount and enter the measurement directory, like BringUpCard
+static uint8_t _bring_up(FATFS *fs)
+{
+	if (!SD_Initialize() || f_mount(fs, "", 1) != FR_OK)
+		return 0;
+
+	if (f_chdir("/Meas") != FR_OK && (f_mkdir("/Meas") != FR_OK || f_chdir("/Meas") != FR_OK))
+		return 0;
+
+	return _legacy || Log_Recover();
+}
+
+static void _start_measuring()
+{
+	SD_ResetStats();
+	Card_ResetStats();
+	_elapsed_us = Host_Now();
+}
+
+static void _stop_measuring()
+{
+	_elapsed_us = Host_Now() - _elapsed_us;
+	SD_GetStats(&_sd_stats);
+	Card_GetStats(&_card_stats);
+}
+
+static void _legacy_task(void *arg)
+{
+	FATFS fs;
+	FIL file;
+	UINT num_written;
+	uint8_t data_point[LEGACY_DATA_POINT_SIZE] = {0};
+	TickType_t last_wake;
+	uint32_t i;
+
+	(void)arg;
+	_start_measuring();
+	if (!_bring_up(&fs))
+	{
+		printf("card bring-up failed\n");
+		++_failures;
+		Host_Stop();
+		return;
+	}
+
+	// the old SDTask waited for the date before it wrote anything
+	vTaskDelay(pdMS_TO_TICKS(BENCH_DATE_MS));
+	last_wake = xTaskGetTickCount();
+
+	for (i = 0; i < (_seconds * 1000 - BENCH_DATE_MS) / LEGACY_PERIOD_MS; ++i)
+	{
+		vTaskDelayUntil(&last_wake, pdMS_TO_TICKS(LEGACY_PERIOD_MS));
+
+		data_point[0] = (uint8_t)i;
+		if (f_open(&file, "120000.dat", FA_WRITE|FA_OPEN_APPEND) != FR_OK
+			|| f_write(&file, data_point, sizeof(data_point), &num_written) != FR_OK || num_written != sizeof(data_point)
+			|| f_close(&file) != FR_OK)
+		{
+			++_failures;
+		}
+		++_records;
+	}
+
+	_stop_measuring();
+	Host_Stop();
+}
+
+static void _sd_task(void *arg)
+{
+	FATFS fs;
+	uint32_t records_at_sync = 0;
+	TickType_t next_process, last_sync, date, end, now;
+	int32_t event[LOGFMT_EVENT_NUM_FIELDS];
+	struct SD_Geometry geometry;
+
+	(void)arg;
+	_start_measuring();
+	Log_Start();
+	next_process = last_sync = xTaskGetTickCount();
+	date = next_process + pdMS_TO_TICKS(BENCH_DATE_MS);
+	end = next_process + pdMS_TO_TICKS(_seconds * 1000);
+
+	// records wait in the backlog while the card comes up, SDTask drains them the whole time
+	if (!_bring_up(&fs))
+	{
+		printf("card bring-up failed\n");
+		++_failures;
+		Host_Stop();
+		return;
+	}
+
+	for (;;)
+	{
+		now = xTaskGetTickCount();
+		if ((int32_t)(next_process - now) > 0)
+			ulTaskNotifyTake(pdTRUE, next_process - now);
+
+		now = xTaskGetTickCount();
+		if ((int32_t)(now - end) >= 0)
+			break;
+		next_process += pdMS_TO_TICKS(LOG_PROCESS_INTERVAL_MS);
+
+		if (!Log_IsOpen() && (int32_t)(now - date) >= 0)
+		{
+			if (!Log_Open("120000.dat", BENCH_START_TIME))
+			{
+				printf("Log_Open failed\n");
+				++_failures;
+				break;
+			}
+			records_at_sync = 0;
+			last_sync = now;
+
+			// LogCardGeometry
+			SD_GetGeometry(&geometry);
+			event[LOGFMT_EVENT_CODE] = LOGFMT_EVENT_CARD_GEOMETRY;
+			event[LOGFMT_EVENT_ARG] = geometry.au_sectors;
+			event[LOGFMT_EVENT_VALUE] = geometry.sectors;
+			Log_Submit(LOGFMT_CHANNEL_EVENT, event, LOGFMT_EVENT_NUM_FIELDS);
+		}
+
+		Log_GetStats(&_log_stats);
+		if (Log_IsOpen() && (_log_stats.records - records_at_sync >= LOG_SYNC_RECORDS
+			|| (now - last_sync) >= pdMS_TO_TICKS(LOG_SYNC_INTERVAL_MS)))
+		{
+			if (!Log_Sync())
+				++_failures;
+
+			Log_GetStats(&_log_stats);
+			records_at_sync = _log_stats.records;
+			last_sync = now;
+		}
+		else if (!Log_Process())
+		{
+			++_failures;
+		}
+	}
+
+	_stop = 1;
+	if (Log_IsOpen() && !Log_Close())
+		++_failures;
+	Log_GetStats(&_log_stats);
+	_records = _log_stats.records;
+	_stop_measuring();
+	Host_Stop();
+}
+
+static void _usage()
+{
+	printf("usage: sdbench [-s seconds] [-m log|legacy] [-o name=value]... [image file]\n");
+}
+
+int main(int argc, char *argv[])
+{
+	struct Card_Params params;
+	const char *image = "sdbench.img";
+	double seconds, records;
+	int opt;
+
+	Card_Defaults(&params);
+	while ((opt = getopt(argc, argv, "s:m:o:h")) != -1)
+	{
+		switch (opt)
+		{
+		case 's':
+			_seconds = (uint32_t)strtoul(optarg, NULL, 0);
+			break;
+		case 'm':
+			if (strcmp(optarg, "legacy") == 0)
+				_legacy = 1;
+			else if (strcmp(optarg, "log") != 0)
+			{
+				_usage();
+				return 1;
+			}
+			break;
+		case 'o':
+			if (!Card_SetParam(&params, optarg))
+			{
+				Card_PrintParams(&params);
+				return 1;
+			}
+			break;
+		default:
+			_usage();
+			return 1;
+		}
+	}
+	if (optind < argc)
+		image = argv[optind];
+
+	// start from a fresh image every run, what the last run left behind would change the timing
+	unlink(image);
+	if (!Card_Open(image, &params))
+		return 1;
+	Card_PrintParams(Card_GetParams());
+	if (!Fat_Format(BENCH_CLUSTER_SECTORS))
+	{
+		printf("card too small for FAT32\n");
+		return 1;
+	}
+
+	ff_init_syncobj();
+	disk_init_lock();
+	Log_Init();
+	if (_legacy)
+	{
+		xTaskCreate(_legacy_task, "SDTask", 4096, NULL, 1, NULL);
+	}
+	else
+	{
+		xTaskCreate(_amg_task, "AMGTask", 256, NULL, 4, NULL);
+		xTaskCreate(_gps_task, "GPSTask", 8192, NULL, 3, NULL);
+		xTaskCreate(_tph_task, "TPHTask", 512, NULL, 3, NULL);
+		xTaskCreate(_sd_task, "SDTask", 4096, NULL, 1, NULL);
+	}
+	vTaskStartScheduler();
+
+	seconds = _elapsed_us / 1e6;
+	records = _records ? _records : 1;
+	printf("\n%s, %.1f s simulated\n", _legacy ? "legacy f_open/f_write/f_close a second" : "logger", seconds);
+	printf("records            %u (%.1f/s), dropped %u staged, %u submitted, %u blocks, failures %u\n", _records,
+		_records / seconds, _log_stats.dropped_records, _log_stats.dropped_submissions, _log_stats.dropped_blocks, _failures);
+	printf("sectors written    %u by the driver, %u by the card, %u read, %u erased\n", _sd_stats.sectors_written,
+		_card_stats.sectors_written, _sd_stats.sectors_read, _sd_stats.sectors_erased);
+	printf("card time          write %u us, read %u us, erase %u us, busy %u us, %u commands\n", _sd_stats.write_us,
+		_sd_stats.read_us, _sd_stats.erase_us, _sd_stats.busy_us, _sd_stats.commands);
+	printf("allocation units   %u opened, %u cleaned\n", _card_stats.au_opens, _card_stats.au_cleans);
+	printf("per record         %.1f bytes on the card, %.3f sectors written, %.1f us writing, %.2f commands\n",
+		_card_stats.sectors_written * 512.0 / records, _sd_stats.sectors_written / records,
+		_sd_stats.write_us / records, _sd_stats.commands / records);
+	printf("throughput         %.1f KB/s written, card busy with writes %.2f%% of the time\n",
+		_card_stats.sectors_written * 0.5 / seconds, _sd_stats.write_us / (seconds * 1e4));
+	if (!_legacy)
+		printf("longest block write %u us, %u syncs\n", _log_stats.max_write_us, _log_stats.syncs);
+
+	Card_Close();
+	return _failures ? 1 : 0;
+}
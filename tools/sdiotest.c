@@ -0,0 +1,189 @@
+/* sdiotest.c
+ * Host test of the SD driver, runs src/sd.c against a simulated SDIO controller and card
+ *
+ * Build: make build/sdiotest
+ * Usage: sdiotest [image file]
+ *
+ * Brings the card up, writes and reads back runs of blocks and counts the commands each run takes, checks
+ * that a block write returns once the card is done programming rather than a tick later, erases a range
+ * that is not AU aligned, then makes commands and transfers fail and checks that the driver leaves the DMA
+ * stream and the SDIO data path stopped and can carry on. Exits with 1 if a check fails. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "stm32f4xx.h"
+#include "FreeRTOS.h"
+#include "host.h"
+#include "card.h"
+#include "sdio.h"
+#include "sd.h"
+
+#define TEST_SECTORS 65536 // 32 MB
+#define TEST_MAX_COUNT 64
+#define TEST_BUS_US 100 // commands and a block on the bus
+
+static uint8_t _out[TEST_MAX_COUNT * 512];
+static uint8_t _in[TEST_MAX_COUNT * 512];
+
+static void _fill(uint32_t addr, uint32_t count, uint8_t seed)
+{
+	uint32_t i;
+
+	for (i = 0; i < count * 512; ++i)
+		_out[i] = (uint8_t)(addr * 7 + i * 13 + seed);
+}
+
+// nothing of a transfer may be left running, enabled or flagged once the driver returns, DMAEN may stay set
+// as it does after a good transfer, it does nothing without DTEN and the next data setup rewrites it
+static uint8_t _is_stopped()
+{
+	uint32_t dma_flags = (DMA2->LISR & ~DMA2->LIFCR) & (DMA_LISR_FEIF3 | DMA_LISR_DMEIF3 | DMA_LISR_TEIF3 | DMA_LISR_HTIF3 | DMA_LISR_TCIF3);
+
+	return !(DMA2_Stream3->CR & DMA_SxCR_EN) && SDIO->MASK == 0 && !(SDIO->DCTRL & SDIO_DCTRL_DTEN)
+		&& dma_flags == 0 && (SDIO->STA & 0x5FF) == 0;
+}
+
+static uint8_t _round_trip(uint32_t addr, uint32_t count, uint8_t seed)
+{
+	_fill(addr, count, seed);
+	memset(_in, 0, sizeof(_in));
+
+	return SD_WriteBlocks(addr, _out, count) && SD_ReadBlocks(addr, _in, count)
+		&& memcmp(_in, _out, count * 512) == 0;
+}
+
+static void _commands_per_run(const struct Card_Params *params)
+{
+	static const uint32_t counts[] = {1, 8, 64};
+	uint32_t i, write_commands, read_commands;
+	uint64_t start, write_us, read_us;
+	char what[80];
+
+	printf("\nblocks  write cmds  CMD24  CMD25  read cmds  CMD17  CMD18  write us  read us\n");
+	for (i = 0; i < sizeof(counts) / sizeof(counts[0]); ++i)
+	{
+		_fill(1000, counts[i], (uint8_t)i);
+
+		Sdio_ResetCommands();
+		start = Host_Now();
+		uint8_t written = SD_WriteBlocks(1000, _out, counts[i]);
+		write_us = Host_Now() - start;
+		write_commands = Sdio_GetTotalCommands();
+		uint32_t cmd24 = Sdio_GetCommands(24), cmd25 = Sdio_GetCommands(25);
+
+		Sdio_ResetCommands();
+		start = Host_Now();
+		uint8_t read = SD_ReadBlocks(1000, _in, counts[i]);
+		read_us = Host_Now() - start;
+		read_commands = Sdio_GetTotalCommands();
+
+		printf("%6u  %10u  %5u  %5u  %9u  %5u  %5u  %8llu  %7llu\n", counts[i], write_commands, cmd24, cmd25,
+			read_commands, Sdio_GetCommands(17), Sdio_GetCommands(18), (unsigned long long)write_us,
+			(unsigned long long)read_us);
+
+		snprintf(what, sizeof(what), "%u blocks: one data command each way, data comes back", counts[i]);
+		Host_Check(written && read && memcmp(_in, _out, counts[i] * 512) == 0
+			&& cmd24 + cmd25 == 1 && Sdio_GetCommands(17) + Sdio_GetCommands(18) == 1, what);
+
+		// the card is busy for a fraction of a tick, the write is done soon after
+		if (counts[i] == 1)
+			Host_Check(write_us < params->write_busy_us + params->program_us + TEST_BUS_US,
+				"block write waits out the card busy time, not a tick");
+	}
+	printf("\n");
+}
+
+// an erase that does not start on an AU still erases the whole AUs in its range with one command each, so the
+// card takes them as clean
+static void _erase(uint32_t au_sectors)
+{
+	struct Card_Stats stats;
+	uint32_t i, zeros = 1;
+	uint8_t ok;
+
+	ok = _round_trip(au_sectors, 1, 5) && _round_trip(2 * au_sectors, 1, 6) && _round_trip(3 * au_sectors + 50, 1, 7);
+
+	Sdio_ResetCommands();
+	ok = SD_Erase(au_sectors + 100, 3 * au_sectors + 99) && ok;
+	printf("erase over %u blocks: %u CMD38\n", 2 * au_sectors, Sdio_GetCommands(38));
+
+	memset(_in, 0xFF, 512);
+	ok = SD_ReadBlocks(2 * au_sectors, _in, 1) && ok;
+	for (i = 0; i < 512; ++i)
+		zeros = zeros && _in[i] == 0;
+
+	Card_ResetStats();
+	ok = _round_trip(2 * au_sectors + 1, 1, 8) && ok;
+	Card_GetStats(&stats);
+	Host_Check(ok && zeros && Sdio_GetCommands(38) == 3 && stats.au_cleans == 0, "erase on AU boundaries, the AU inside is clean");
+}
+
+static void _failing_command(uint8_t index, uint8_t is_write, uint32_t count, const char *what)
+{
+	uint8_t ret;
+
+	_fill(2000, count, index);
+	Sdio_FailCommand(index, 1);
+	ret = is_write ? SD_WriteBlocks(2000, _out, count) : SD_ReadBlocks(2000, _in, count);
+	Host_Check(!ret && _is_stopped(), what);
+}
+
+int main(int argc, char *argv[])
+{
+	struct Card_Params params;
+	struct SD_Geometry geometry;
+	struct SD_Stats stats;
+	uint64_t start;
+	uint8_t ok;
+
+	Card_Defaults(&params);
+	params.sectors = TEST_SECTORS;
+	if (!Card_Open(argc > 1 ? argv[1] : "sdiotest.img", &params))
+		return 1;
+	Sdio_Attach();
+
+	start = Host_Now();
+	ok = SD_Initialize();
+	printf("card up after %llu us and %u commands, %u bit bus at %u Hz\n", (unsigned long long)(Host_Now() - start),
+		Sdio_GetTotalCommands(), SD_GetBusWidth(), SD_GetBusClockHz());
+	SD_GetGeometry(&geometry);
+	Host_Check(ok && SD_GetStatus() == SD_CARD_TRANSFER, "card initializes and is in the transfer state");
+	Host_Check(geometry.sectors == TEST_SECTORS && geometry.au_sectors == params.au_sectors
+		&& geometry.speed_class == params.speed_class, "geometry from CSD and SD status");
+	Host_Check(SD_GetBusWidth() == 4 && SD_GetBusClockHz() == 48000000, "4 bit bus in high speed mode");
+
+	Host_Check(_round_trip(0, 1, 1), "single block round trip");
+	Host_Check(_round_trip(77, 8, 2), "8 block round trip");
+	Host_Check(_round_trip(TEST_SECTORS - TEST_MAX_COUNT, TEST_MAX_COUNT, 3), "64 block round trip at the end of the card");
+	Host_Check(_is_stopped(), "nothing left running after good transfers");
+
+	_commands_per_run(&params);
+	_erase(params.au_sectors);
+
+	// a command that gets no answer must not leave the DMA stream armed on the buffer
+	_failing_command(18, 0, 8, "CMD18 fails: DMA and data path stopped, interrupts masked");
+	_failing_command(17, 0, 1, "CMD17 fails: DMA and data path stopped, interrupts masked");
+	_failing_command(25, 1, 8, "CMD25 fails: DMA and data path stopped, interrupts masked");
+	_failing_command(24, 1, 1, "CMD24 fails: DMA and data path stopped, interrupts masked");
+	_failing_command(12, 0, 8, "CMD12 after a read fails: all stopped");
+	_failing_command(12, 1, 8, "CMD12 after a write fails: all stopped");
+	Host_Check(_round_trip(3000, 8, 4), "transfers work again after the failures");
+
+	// a CRC error at 48 MHz drops the clock to 24 MHz and the transfer goes through on the second try
+	Sdio_FailData(1);
+	memset(_in, 0, sizeof(_in));
+	_fill(3000, 8, 4);
+	ok = SD_ReadBlocks(3000, _in, 8);
+	Host_Check(ok && memcmp(_in, _out, 8 * 512) == 0 && SD_GetBusClockHz() == 24000000, "data CRC error falls back to the divided clock");
+	Host_Check(_is_stopped(), "nothing left running after the fallback");
+
+	SD_GetStats(&stats);
+	printf("\ncommands %u, read %u sectors in %u us, wrote %u sectors in %u us, busy %u us, errors %u\n",
+		stats.commands, stats.sectors_read, stats.read_us, stats.sectors_written, stats.write_us, stats.busy_us, stats.errors);
+	Host_Check(stats.errors == 6, "statistics count the failed transfers");
+
+	Card_Close();
+	return Host_Summary();
+}
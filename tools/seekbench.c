@@ -0,0 +1,301 @@
+/* seekbench.c
+ * Host benchmark of reading logs back with LogRead, compares its fast seeks through the cluster link map
+ * with seeks that follow the FAT chain, on the simulated card
+ *
+ * Build: make build/seekbench
+ * Usage: seekbench [-r seed] [-n seeks] [image file]
+ *
+ * Logs 10 MB with the logger, then copies the log into files of 8 and of 64 fragments by growing a gap file
+ * in between. For each file the same random blocks are read through LogRead and through a plain FIL that
+ * seeks along the FAT chain, and the card sectors read, the sector lookups in the disk layer and the card
+ * time per block are printed. Checks that both read the same data, that with the map every block costs the
+ * one sector it is in and no FAT sectors, that a file too fragmented for the map falls back to normal seeks,
+ * and that LogRead_FindTime and LogRead_Summarize agree with the log. Exits with 1 if a check fails. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "stm32f4xx.h"
+#include "FreeRTOS.h"
+#include "host.h"
+#include "card.h"
+#include "ff.h"
+#include "diskio.h"
+#include "sd.h"
+#include "log.h"
+#include "logread.h"
+#include "volume.h"
+
+#define TEST_SECTORS 262144 // 128 MB
+#define TEST_CLUSTER_SECTORS 8
+#define TEST_START_TIME 1500000000
+#define TEST_LOG_SIZE ((FSIZE_t)10 * 1024 * 1024)
+#define TEST_MAX_FRAGMENTS 256
+#define TEST_FIND_TIMES 200
+
+// what reading the random blocks of a file cost
+struct Cost
+{
+	uint32_t sectors_read; // on the card
+	uint32_t lookups; // sectors asked of the disk layer, from the cache or the card
+	uint32_t read_us; // card time
+};
+
+static DWORD _link_map[1 + 2 * TEST_MAX_FRAGMENTS];
+static uint32_t _seed = 1;
+static uint32_t _num_seeks = 20000;
+
+static uint32_t _random(uint32_t n)
+{
+	_seed = _seed * 1103515245 + 12345;
+	return (_seed >> 8) % n;
+}
+
+static uint32_t _hash(uint32_t x)
+{
+	x ^= x >> 16;
+	x *= 0x7feb352d;
+	x ^= x >> 15;
+	x *= 0x846ca68b;
+	return x ^ (x >> 16);
+}
+
+// a 200 Hz IMU stream with a baro record every 100 samples, returns the number of records logged
+static uint32_t _log(const char *filename, uint8_t *ok)
+{
+	struct LogFmt_Record record;
+	struct Log_Stats stats;
+	uint32_t n = 0;
+	uint8_t i;
+
+	*ok = Log_Open(filename, TEST_START_TIME);
+	do
+	{
+		record.channel = n % 100 == 50 ? LOGFMT_CHANNEL_BARO : LOGFMT_CHANNEL_IMU;
+		record.time_ms = n * 5;
+		record.num_fields = LogFmt_GetChannelDef(record.channel)->num_fields;
+		for (i = 0; i < record.num_fields; ++i)
+			record.value[i] = (int32_t)(_hash(n * LOGFMT_MAX_FIELDS + i) % 2001) - 1000;
+		++n;
+
+		*ok = Log_Append(&record) && Log_Process() && *ok;
+		Log_GetStats(&stats);
+	} while (*ok && (FSIZE_t)stats.sectors_written * LOGFMT_BLOCK_SIZE < TEST_LOG_SIZE);
+	*ok = Log_Close() && *ok;
+
+	return n;
+}
+
+static uint32_t _fragments(const char *filename)
+{
+	FIL file;
+	uint32_t ret = 0;
+
+	if (f_open(&file, filename, FA_READ) != FR_OK)
+		return 0;
+
+	file.cltbl = _link_map;
+	_link_map[0] = sizeof(_link_map) / sizeof(_link_map[0]);
+	if (f_lseek(&file, CREATE_LINKMAP) == FR_OK)
+		ret = (_link_map[0] - 1) / 2;
+
+	f_close(&file);
+	return ret;
+}
+
+// copy the log into a file of the given number of fragments, a gap file grows by a cluster between them
+static uint8_t _fragmented_copy(const char *from, const char *to, uint32_t fragments)
+{
+	static uint8_t buf[LOGFMT_BLOCK_SIZE];
+	FIL src, dst, gap;
+	FATFS *fs;
+	UINT num;
+	uint32_t blocks, chunk, cluster_blocks, i;
+	uint8_t ok;
+
+	if (f_open(&src, from, FA_READ) != FR_OK)
+		return 0;
+	fs = src.obj.fs;
+	cluster_blocks = fs->csize * 512 / LOGFMT_BLOCK_SIZE;
+	blocks = (uint32_t)(f_size(&src) / LOGFMT_BLOCK_SIZE);
+	chunk = (blocks / fragments + cluster_blocks) / cluster_blocks * cluster_blocks;
+
+	ok = f_open(&dst, to, FA_WRITE|FA_CREATE_ALWAYS) == FR_OK;
+	ok = f_open(&gap, "GAP.dat", FA_WRITE|FA_OPEN_APPEND) == FR_OK && ok;
+	for (i = 0; ok && i < blocks; ++i)
+	{
+		ok = f_read(&src, buf, sizeof(buf), &num) == FR_OK && num == sizeof(buf)
+			&& f_write(&dst, buf, sizeof(buf), &num) == FR_OK && num == sizeof(buf);
+
+		// the cluster after a chunk goes to the gap file, the copy carries on after it
+		if (ok && (i + 1) % chunk == 0)
+		{
+			memset(buf, 0, sizeof(buf));
+			while (ok && f_size(&gap) % (fs->csize * 512) != 0)
+				ok = f_write(&gap, buf, sizeof(buf), &num) == FR_OK;
+			ok = ok && f_write(&gap, buf, sizeof(buf), &num) == FR_OK && f_sync(&gap) == FR_OK;
+		}
+	}
+
+	f_close(&gap);
+	ok = f_close(&dst) == FR_OK && ok;
+	f_close(&src);
+	return ok;
+}
+
+// read the random blocks through LogRead, or along the FAT chain with a plain FIL, and compare them
+static uint8_t _read_blocks(const char *filename, uint8_t fast_seek, uint32_t seed, struct Cost *cost)
+{
+	static uint8_t block[LOGFMT_BLOCK_SIZE], plain[LOGFMT_BLOCK_SIZE];
+	DISK_CACHE_STATS before, after;
+	struct SD_Stats stats;
+	FIL file;
+	UINT num;
+	uint32_t num_blocks, index, i;
+	uint8_t ok;
+
+	if (!LogRead_Open(filename))
+		return 0;
+	num_blocks = LogRead_GetNumBlocks();
+	ok = f_open(&file, filename, FA_READ) == FR_OK;
+
+	_seed = seed;
+	disk_ioctl(0, DISK_GET_CACHE_STATS, &before);
+	SD_ResetStats();
+	for (i = 0; ok && i < _num_seeks; ++i)
+	{
+		index = _random(num_blocks);
+		if (fast_seek)
+			ok = LogRead_ReadBlock(index, block);
+		else
+			ok = f_lseek(&file, (FSIZE_t)(1 + index) * LOGFMT_BLOCK_SIZE) == FR_OK
+				&& f_read(&file, block, sizeof(block), &num) == FR_OK && num == sizeof(block);
+	}
+	SD_GetStats(&stats);
+	disk_ioctl(0, DISK_GET_CACHE_STATS, &after);
+	cost->sectors_read = stats.sectors_read;
+	cost->lookups = (after.hits + after.misses) - (before.hits + before.misses);
+	cost->read_us = stats.read_us;
+
+	// the same blocks again, the other way, outside the measurement
+	_seed = seed;
+	for (i = 0; ok && i < _num_seeks / 10; ++i)
+	{
+		index = _random(num_blocks);
+		ok = LogRead_ReadBlock(index, block) && f_lseek(&file, (FSIZE_t)(1 + index) * LOGFMT_BLOCK_SIZE) == FR_OK
+			&& f_read(&file, plain, sizeof(plain), &num) == FR_OK && num == sizeof(plain)
+			&& memcmp(block, plain, sizeof(block)) == 0;
+	}
+
+	f_close(&file);
+	LogRead_Close();
+	return ok;
+}
+
+static void _print(const char *filename, uint32_t fragments, const char *mode, const struct Cost *cost)
+{
+	printf("  %-10s %3u fragments  %-10s %6.2f sectors  %6.2f lookups  %7.1f us per block\n", filename, fragments, mode,
+		(double)cost->sectors_read / _num_seeks, (double)cost->lookups / _num_seeks, (double)cost->read_us / _num_seeks);
+}
+
+// the block LogRead_FindTime returns starts at or before the time and the next one after it
+static uint8_t _find_times(const char *filename, uint32_t last_time)
+{
+	static uint8_t block[LOGFMT_BLOCK_SIZE];
+	uint32_t time_ms, start, next, index, i;
+	uint8_t ok;
+
+	if (!LogRead_Open(filename))
+		return 0;
+
+	ok = 1;
+	for (i = 0; ok && i < TEST_FIND_TIMES; ++i)
+	{
+		time_ms = _random(last_time + 1);
+		ok = LogRead_FindTime(time_ms, &index) && LogRead_ReadBlock(index, block) && LogFmt_GetBlockTime(block, &start)
+			&& start <= time_ms && (index + 1 == LogRead_GetNumBlocks()
+				|| (LogRead_ReadBlock(index + 1, block) && LogFmt_GetBlockTime(block, &next) && next > time_ms));
+	}
+
+	LogRead_Close();
+	return ok;
+}
+
+static void _bench(const char *filename, uint32_t expect_fast_seek)
+{
+	struct Cost fast, chain;
+	uint32_t fragments = _fragments(filename);
+	uint32_t seed = _seed;
+	uint8_t ok;
+
+	ok = _read_blocks(filename, 0, seed, &chain);
+	ok = ok && LogRead_Open(filename);
+	ok = ok && LogRead_IsFastSeek() == expect_fast_seek;
+	LogRead_Close();
+	ok = ok && _read_blocks(filename, 1, seed, &fast);
+	_print(filename, fragments, "FAT chain", &chain);
+	_print(filename, fragments, expect_fast_seek ? "fast seek" : "LogRead", &fast);
+
+	if (expect_fast_seek)
+		Host_Check(ok && fast.lookups == _num_seeks && fast.sectors_read <= _num_seeks,
+			"one sector per block with the link map, no FAT reads");
+	else
+		Host_Check(ok, "too many fragments for the map, LogRead seeks normally");
+}
+
+int main(int argc, char *argv[])
+{
+	struct Card_Params params;
+	struct LogRead_Summary summary;
+	uint32_t count, records, c;
+	int opt;
+	uint8_t ok;
+
+	while ((opt = getopt(argc, argv, "r:n:")) != -1)
+	{
+		if (opt == 'r')
+			_seed = (uint32_t)strtoul(optarg, NULL, 0);
+		else if (opt == 'n')
+			_num_seeks = (uint32_t)strtoul(optarg, NULL, 0);
+		else
+		{
+			printf("usage: seekbench [-r seed] [-n seeks] [image file]\n");
+			return 1;
+		}
+	}
+
+	Card_Defaults(&params);
+	params.sectors = TEST_SECTORS;
+
+	ff_init_syncobj();
+	disk_init_lock();
+	Log_Init();
+	if (!Volume_Create(optind < argc ? argv[optind] : "seekbench.img", &params, TEST_CLUSTER_SECTORS))
+	{
+		printf("card bring-up failed\n");
+		return 1;
+	}
+
+	count = _log("LOG.dat", &ok);
+	Host_Check(ok && _fragments("LOG.dat") == 1, "10 MB log in one extent");
+	Host_Check(_fragmented_copy("LOG.dat", "FRAG8.dat", 8) && _fragments("FRAG8.dat") == 8, "copy in 8 fragments");
+	Host_Check(_fragmented_copy("LOG.dat", "FRAG64.dat", 64) && _fragments("FRAG64.dat") == 64, "copy in 64 fragments");
+
+	_bench("LOG.dat", 1);
+	_bench("FRAG8.dat", 1);
+	_bench("FRAG64.dat", 0);
+
+	Host_Check(_find_times("LOG.dat", (count - 1) * 5), "LogRead_FindTime finds the block of a time");
+
+	ok = LogRead_Open("FRAG8.dat") && LogRead_Summarize(&summary);
+	for (records = 0, c = 0; c < LOGFMT_NUM_CHANNELS; ++c)
+		records += summary.records[c];
+	Host_Check(ok && records == count && summary.bad_blocks == 0 && summary.blocks == LogRead_GetNumBlocks()
+		&& summary.duration_ms == (count - 1) * 5, "LogRead_Summarize counts every record");
+	LogRead_Close();
+
+	Card_Close();
+	return Host_Summary();
+}
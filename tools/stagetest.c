@@ -0,0 +1,345 @@
+/* stagetest.c
+ * Host test of the logger staging buffers, appends records to log files on a simulated card and decodes
+ * what ended up in the files
+ *
+ * Build: make build/stagetest
+ * Usage: stagetest [image file]
+ *
+ * Checks that full staging buffers go to the card as one sector each, that records are dropped and counted
+ * once both buffers are full and that the stream carries on after them, that Log_Sync writes the partial
+ * block and the block is written again once it fills, that a session appended to an existing file starts on
+ * the next block boundary, and that blocks staged before the log is opened become its first blocks. Logs
+ * fixes at 1, 5 and 10 Hz, with the period set like GPSTask does once the session has started, and checks
+ * that the fix channel period in the header follows it, so fixes at that rate store no time, and that a
+ * period set once fixes are logged waits for the next session. Every file is decoded and compared record by
+ * record with what was appended. Exits with 1 if a check fails. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "stm32f4xx.h"
+#include "FreeRTOS.h"
+#include "host.h"
+#include "card.h"
+#include "ff.h"
+#include "diskio.h"
+#include "sd.h"
+#include "log.h"
+#include "volume.h"
+
+#define TEST_SECTORS 262144 // 128 MB
+#define TEST_CLUSTER_SECTORS 8
+#define TEST_START_TIME 1500000000
+#define TEST_MAX_RECORDS 8192
+#define TEST_OLD_SIZE 700 // bytes in the file a session is appended to
+#define TEST_FIXES 2000
+
+static struct LogFmt_Record _appended[TEST_MAX_RECORDS]; // records Log_Append took
+static uint32_t _num_appended = 0;
+static struct LogFmt_Record _decoded[TEST_MAX_RECORDS];
+static uint32_t _seed = 1;
+
+static int32_t _noise(int32_t range)
+{
+	_seed = _seed * 1103515245 + 12345;
+	return (int32_t)((_seed >> 16) % (2 * range + 1)) - range;
+}
+
+// the n-th record of a 200 Hz IMU stream with a baro record every 100 and a fix every 20 samples in it
+static void _make_record(uint32_t n, struct LogFmt_Record *record)
+{
+	const struct LogFmt_ChannelDef *def;
+	uint8_t i;
+
+	record->channel = n % 100 == 50 ? LOGFMT_CHANNEL_BARO : n % 20 == 10 ? LOGFMT_CHANNEL_FIX : LOGFMT_CHANNEL_IMU;
+	record->time_ms = n * 5;
+	def = LogFmt_GetChannelDef(record->channel);
+	record->num_fields = def->num_fields;
+
+	// mostly small changes, which pack into nibbles, and now and then a jump
+	for (i = 0; i < def->num_fields; ++i)
+		record->value[i] = 1000 * i + _noise(n % 37 == 0 ? 100000 : 3);
+}
+
+// append the next record, it is kept for the comparison if the logger took it
+static uint8_t _append(uint32_t n)
+{
+	struct LogFmt_Record record;
+
+	_make_record(n, &record);
+	if (!Log_Append(&record))
+		return 0;
+
+	if (_num_appended < TEST_MAX_RECORDS)
+		_appended[_num_appended] = record;
+	++_num_appended;
+	return 1;
+}
+
+// the session decodes to exactly the records appended from first on
+static uint8_t _same_records(const char *filename, FSIZE_t base, uint32_t first, uint32_t *num_blocks)
+{
+	struct LogFmt_Header header;
+	uint32_t num_records, i;
+
+	if (!Volume_ReadLog(filename, base, &header, _decoded, TEST_MAX_RECORDS, &num_records, num_blocks)
+		|| num_records != _num_appended - first)
+	{
+		printf("  %s: %u records decoded, %u appended\n", filename, num_records, _num_appended - first);
+		return 0;
+	}
+
+	for (i = 0; i < num_records; ++i)
+	{
+		if (!Volume_SameRecord(&_decoded[i], &_appended[first + i]))
+		{
+			printf("  %s: record %u differs\n", filename, i);
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+// the n-th fix of a stream at rate_hz, kept for the comparison if the logger took it
+static uint8_t _append_fix(uint32_t n, uint8_t rate_hz)
+{
+	struct LogFmt_Record record;
+	uint8_t i;
+
+	record.channel = LOGFMT_CHANNEL_FIX;
+	record.time_ms = n * 1000 / rate_hz;
+	record.num_fields = LOGFMT_FIX_NUM_FIELDS;
+	for (i = 0; i < LOGFMT_FIX_NUM_FIELDS; ++i)
+		record.value[i] = 1000 * i + _noise(3);
+	if (!Log_Append(&record))
+		return 0;
+
+	if (_num_appended < TEST_MAX_RECORDS)
+		_appended[_num_appended] = record;
+	++_num_appended;
+	return 1;
+}
+
+// log TEST_FIXES fixes at fix_hz in a session started with the period of the schema, the period is set for
+// setup_hz before the log is opened, like GPSTask does after the session started at boot, and for late_hz
+// after the first fix if it is not 0. Returns the fix channel period of the header, 0 if the file does not
+// decode to the fixes.
+static uint16_t _log_fixes(const char *filename, uint8_t setup_hz, uint8_t late_hz, uint8_t fix_hz, uint32_t *num_blocks)
+{
+	struct LogFmt_Header header;
+	uint32_t num_records, n;
+	uint8_t ok;
+
+	_num_appended = 0;
+	_seed = 1;
+	ok = Log_Start() && Log_SetChannelPeriod(LOGFMT_CHANNEL_FIX, 1000 / setup_hz) && Log_Open(filename, TEST_START_TIME);
+	for (n = 0; ok && n < TEST_FIXES; ++n)
+	{
+		ok = _append_fix(n, fix_hz) && Log_Process();
+		if (n == 0 && late_hz > 0)
+			ok = Log_SetChannelPeriod(LOGFMT_CHANNEL_FIX, 1000 / late_hz) && ok;
+	}
+	ok = Log_Close() && ok;
+
+	ok = ok && Volume_ReadLog(filename, 0, &header, _decoded, 1, &num_records, num_blocks)
+		&& _same_records(filename, 0, 0, num_blocks);
+	return ok ? header.channel[LOGFMT_CHANNEL_FIX].period_ms : 0;
+}
+
+static void _fix_rate()
+{
+	uint32_t blocks_1hz, blocks_5hz, blocks_10hz, blocks_late;
+	uint16_t period_1hz, period_5hz, period_10hz, period_late;
+
+	period_1hz = _log_fixes("FIX1.dat", 1, 0, 1, &blocks_1hz);
+	period_5hz = _log_fixes("FIX5.dat", 5, 0, 5, &blocks_5hz);
+	period_10hz = _log_fixes("FIX10.dat", 10, 0, 10, &blocks_10hz);
+	Host_Check(period_1hz == 1000 && period_5hz == 200 && period_10hz == 100,
+		"fix channel period follows the period set for the session");
+
+	// the rate is only set once fixes are in the log, the session keeps storing their time
+	period_late = _log_fixes("FIXLATE.dat", 1, 10, 10, &blocks_late);
+	printf("  %u fixes at 10 Hz in %u blocks, %u with a 1 s period\n", TEST_FIXES, blocks_10hz, blocks_late);
+	Host_Check(blocks_1hz == blocks_10hz && blocks_5hz == blocks_10hz && blocks_10hz < blocks_late,
+		"fixes at the period set store no time");
+	Host_Check(period_late == 1000, "period set once fixes are logged waits for the next session");
+	Log_SetChannelPeriod(LOGFMT_CHANNEL_FIX, 1000);
+}
+
+static FSIZE_t _file_size(const char *filename)
+{
+	FILINFO info;
+
+	return f_stat(filename, &info) == FR_OK ? info.fsize : 0;
+}
+
+static void _whole_blocks()
+{
+	struct SD_Stats sd_stats;
+	struct Log_Stats stats;
+	uint32_t num_blocks, i;
+	uint8_t ok = 1;
+
+	_num_appended = 0;
+	Log_Open("BLOCKS.dat", TEST_START_TIME);
+	Log_Sync();
+	SD_ResetStats();
+
+	for (i = 0; i < 4000; ++i)
+	{
+		ok = _append(i) && Log_Process() && ok;
+	}
+	ok = Log_Sync() && ok;
+	SD_GetStats(&sd_stats);
+	Log_GetStats(&stats);
+	ok = Log_Close() && ok;
+
+	Host_Check(ok && stats.dropped_records == 0, "4000 records appended and written");
+	Host_Check(_same_records("BLOCKS.dat", 0, 0, &num_blocks), "file decodes to the records appended");
+	Host_Check(sd_stats.sectors_written == num_blocks, "one sector written per block, the last one by the sync");
+	Host_Check(_file_size("BLOCKS.dat") == (FSIZE_t)(1 + num_blocks) * LOG_BLOCK_SIZE, "closed file is cut to the blocks logged");
+	printf("  %u records in %u blocks, %.1f bytes a record\n", _num_appended, num_blocks,
+		(double)num_blocks * LOG_BLOCK_SIZE / _num_appended);
+}
+
+static void _dropped_records()
+{
+	struct Log_Stats before, stats;
+	uint32_t n = 0, taken, num_blocks, i;
+	uint8_t ok = 1;
+
+	_num_appended = 0;
+	Log_Open("DROPS.dat", TEST_START_TIME);
+	Log_GetStats(&before);
+
+	// the SD task does not get to the buffers until both are full
+	while (_append(n))
+		++n;
+	taken = _num_appended;
+	for (i = 1; i <= 10; ++i)
+		ok = !_append(n + i) && ok;
+	n += 11;
+	Log_GetStats(&stats);
+	Host_Check(ok && taken > 0 && _num_appended == taken, "both buffers full, Log_Append refuses records");
+	Host_Check(stats.dropped_records - before.dropped_records == 11, "every refused record is counted");
+
+	ok = Log_Process();
+	for (i = 0; i < 1000; ++i, ++n)
+		ok = _append(n) && Log_Process() && ok;
+	ok = Log_Close() && ok;
+
+	Host_Check(ok, "logging carries on once the buffers are written");
+	Host_Check(_same_records("DROPS.dat", 0, 0, &num_blocks), "file decodes to the records taken, in order");
+}
+
+static void _synced_tail()
+{
+	struct LogFmt_Header header;
+	uint32_t num_records, num_blocks, n;
+	uint8_t ok = 1;
+
+	_num_appended = 0;
+	Log_Open("SYNC.dat", TEST_START_TIME);
+	for (n = 0; n < 5; ++n)
+		ok = _append(n) && ok;
+	ok = Log_Sync() && ok;
+
+	// read back through the file system while the log is still open
+	Host_Check(ok && Volume_ReadLog("SYNC.dat", 0, &header, _decoded, TEST_MAX_RECORDS, &num_records, &num_blocks)
+		&& num_records == 5 && num_blocks == 1 && Volume_SameRecord(&_decoded[4], &_appended[4]),
+		"sync writes the partial block with the records so far");
+
+	// fill the block and move on to the next one
+	while (_append(n) && _num_appended < 200)
+		++n;
+	ok = Log_Process() && ok;
+	Host_Check(ok && Volume_ReadLog("SYNC.dat", 0, &header, _decoded, TEST_MAX_RECORDS, &num_records, &num_blocks)
+		&& num_blocks == 1 && num_records > 5 && Volume_SameRecord(&_decoded[num_records - 1], &_appended[num_records - 1]),
+		"the block is written again once it is full");
+
+	ok = Log_Close() && ok;
+	Host_Check(ok && _same_records("SYNC.dat", 0, 0, &num_blocks), "file decodes to the records appended");
+}
+
+static void _appended_session()
+{
+	uint8_t old[TEST_OLD_SIZE], buf[TEST_OLD_SIZE];
+	FSIZE_t base = (TEST_OLD_SIZE + LOG_BLOCK_SIZE - 1) / LOG_BLOCK_SIZE * LOG_BLOCK_SIZE;
+	uint32_t num_blocks, i;
+	UINT num;
+	FIL file;
+	uint8_t ok = 1;
+
+	for (i = 0; i < sizeof(old); ++i)
+		old[i] = (uint8_t)(i * 7);
+	Host_Check(f_open(&file, "OLD.dat", FA_WRITE|FA_CREATE_ALWAYS) == FR_OK && f_write(&file, old, sizeof(old), &num) == FR_OK
+		&& num == sizeof(old) && f_close(&file) == FR_OK, "file with 700 bytes in it");
+
+	_num_appended = 0;
+	ok = Log_Open("OLD.dat", TEST_START_TIME);
+	for (i = 0; i < 1000; ++i)
+		ok = _append(i) && Log_Process() && ok;
+	ok = Log_Close() && ok;
+
+	Host_Check(ok && _same_records("OLD.dat", base, 0, &num_blocks), "session starts on the next block boundary");
+	Host_Check(_file_size("OLD.dat") == base + (FSIZE_t)(1 + num_blocks) * LOG_BLOCK_SIZE, "file ends with the last block");
+	Host_Check(f_open(&file, "OLD.dat", FA_READ) == FR_OK && f_read(&file, buf, sizeof(buf), &num) == FR_OK
+		&& num == sizeof(buf) && memcmp(buf, old, sizeof(old)) == 0 && f_close(&file) == FR_OK, "what the file held is left alone");
+}
+
+static void _backlog()
+{
+	struct Log_Stats before, stats;
+	struct LogFmt_Header header;
+	uint32_t num_records, num_blocks, first, i;
+	uint8_t ok = 1;
+
+	// records come in while the card is not mounted yet
+	_num_appended = 0;
+	Log_GetStats(&before);
+	Log_Start();
+	for (i = 0; i < 2000; ++i)
+		ok = _append(i) && Log_Process() && ok;
+	Log_GetStats(&stats);
+	Host_Check(ok && stats.dropped_blocks > before.dropped_blocks, "backlog keeps the latest blocks once it is full");
+
+	ok = Log_Open("BACKLOG.dat", TEST_START_TIME);
+	for (; i < 2500; ++i)
+		ok = _append(i) && Log_Process() && ok;
+	ok = Log_Close() && ok;
+
+	// the file starts with the first record of the oldest block kept
+	Host_Check(ok && Volume_ReadLog("BACKLOG.dat", 0, &header, _decoded, 1, &num_records, &num_blocks) && num_records > 500
+		&& num_records < _num_appended, "backlog blocks are written first");
+	first = _num_appended - num_records;
+	Host_Check(_same_records("BACKLOG.dat", 0, first, &num_blocks), "file decodes to the latest records appended");
+}
+
+int main(int argc, char *argv[])
+{
+	struct Card_Params params;
+
+	Card_Defaults(&params);
+	params.sectors = TEST_SECTORS;
+
+	ff_init_syncobj();
+	disk_init_lock();
+	Log_Init();
+	if (!Volume_Create(argc > 1 ? argv[1] : "stagetest.img", &params, TEST_CLUSTER_SECTORS))
+	{
+		printf("card bring-up failed\n");
+		return 1;
+	}
+
+	_whole_blocks();
+	_dropped_records();
+	_synced_tail();
+	_appended_session();
+	_backlog();
+	_fix_rate();
+
+	Card_Close();
+	return Host_Summary();
+}
@@ -0,0 +1,239 @@
+/* trimbench.c
+ * Host benchmark of trimming freed clusters, logs a flight over the clusters of deleted ones on a simulated
+ * card that has been written all over, with and without the card being told they were freed
+ *
+ * Build: make build/trimbench
+ * Usage: trimbench [-o name=value]... [image file]
+ *
+ * The card has used=1, so every AU holds old data. A file over all the free clusters stands in for the flights
+ * of earlier days, it is deleted and a 32 MB log is written after a power up. FatFS is built with FF_USE_TRIM,
+ * so the delete erases the clusters. For the run without TRIM the tool writes a sector into every AU of the
+ * deleted file afterwards, which leaves the card holding old data there, as if it had never been told. The
+ * time of every Log_Process call that wrote to the card is measured, and with TRIM the time of the delete,
+ * where the erase goes. Checks that the log is on the card in full either way and that with TRIM fewer
+ * writes wait for the card to clean an AU. The card parameters are those of card.h, -o sets them. Exits with
+ * 1 if a check fails. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "stm32f4xx.h"
+#include "FreeRTOS.h"
+#include "host.h"
+#include "card.h"
+#include "ff.h"
+#include "diskio.h"
+#include "sd.h"
+#include "log.h"
+#include "volume.h"
+
+#define TEST_SECTORS 262144 // 128 MB
+#define TEST_CLUSTER_SECTORS 8
+#define TEST_START_TIME 1500000000
+#define TEST_LOG_SIZE ((uint32_t)32 * 1024 * 1024)
+#define TEST_MAX_FRAGMENTS 64
+#define TEST_SLOW_WRITE_US 10000 // longer than opening an AU, short of cleaning one
+
+// what logging the new flight cost
+struct Run
+{
+	uint32_t records;
+	uint32_t writes; // Log_Process calls that wrote to the card
+	uint64_t write_us; // time of those
+	uint32_t max_write_us;
+	uint32_t slow_writes; // Log_Process calls that took longer than TEST_SLOW_WRITE_US
+	uint32_t delete_us; // deleting the old flights
+	uint32_t sectors_erased;
+	uint32_t au_cleans;
+};
+
+static DWORD _link_map[1 + 2 * TEST_MAX_FRAGMENTS];
+static struct Card_Params _params;
+static const char *_image = "trimbench.img";
+
+static uint32_t _hash(uint32_t x)
+{
+	x ^= x >> 16;
+	x *= 0x7feb352d;
+	x ^= x >> 15;
+	x *= 0x846ca68b;
+	return x ^ (x >> 16);
+}
+
+// an IMU stream until the log holds TEST_LOG_SIZE, the time of every Log_Process that wrote goes to run
+static uint8_t _log(const char *filename, struct Run *run)
+{
+	struct LogFmt_Record record;
+	struct Log_Stats stats;
+	uint64_t start;
+	uint32_t n = 0, written = 0, us;
+	uint8_t i, ok;
+
+	ok = Log_Open(filename, TEST_START_TIME);
+	do
+	{
+		record.channel = LOGFMT_CHANNEL_IMU;
+		record.time_ms = n * 5;
+		record.num_fields = LOGFMT_IMU_NUM_FIELDS;
+		for (i = 0; i < LOGFMT_IMU_NUM_FIELDS; ++i)
+			record.value[i] = (int32_t)(_hash(n * LOGFMT_IMU_NUM_FIELDS + i) % 200001) - 100000;
+		++n;
+
+		start = Host_Now();
+		ok = Log_Append(&record) && Log_Process() && ok;
+		us = (uint32_t)(Host_Now() - start);
+
+		Log_GetStats(&stats);
+		if (run != NULL && stats.sectors_written != written)
+		{
+			++run->writes;
+			run->write_us += us;
+			if (us > run->max_write_us)
+				run->max_write_us = us;
+			if (us > TEST_SLOW_WRITE_US)
+				++run->slow_writes;
+		}
+		written = stats.sectors_written;
+	} while (ok && (uint64_t)written * LOGFMT_BLOCK_SIZE < TEST_LOG_SIZE);
+
+	if (run != NULL)
+		run->records = n;
+	return Log_Close() && ok;
+}
+
+// the AUs the clusters of a file are in, as a bitmap
+static uint8_t _file_aus(const char *filename, uint8_t *aus)
+{
+	FIL file;
+	FATFS *fs;
+	DWORD lba, end;
+	uint32_t i;
+	uint8_t ok;
+
+	if (f_open(&file, filename, FA_READ) != FR_OK)
+		return 0;
+
+	fs = file.obj.fs;
+	file.cltbl = _link_map;
+	_link_map[0] = sizeof(_link_map) / sizeof(_link_map[0]);
+	ok = f_lseek(&file, CREATE_LINKMAP) == FR_OK;
+	for (i = 1; ok && _link_map[i] != 0; i += 2)
+	{
+		lba = fs->database + (_link_map[i + 1] - 2) * fs->csize;
+		end = lba + _link_map[i] * fs->csize;
+		for (; lba < end; lba += _params.au_sectors - lba % _params.au_sectors)
+			aus[lba / _params.au_sectors] = 1;
+	}
+
+	f_close(&file);
+	return ok;
+}
+
+static uint8_t _run(uint8_t trim, struct Run *run)
+{
+	static const uint8_t zeros[512] = {0};
+	struct SD_Stats sd_stats;
+	struct Card_Stats card_stats;
+	uint8_t *aus = calloc(_params.sectors / _params.au_sectors, 1);
+	FATFS *fs;
+	FIL file;
+	DWORD free_clusters;
+	uint64_t start;
+	uint32_t au, busy_us;
+	uint8_t ok;
+
+	// the flights of earlier days fill the card, a file over all the free clusters stands in for them
+	memset(run, 0, sizeof(*run));
+	ok = aus != NULL && Volume_Create(_image, &_params, TEST_CLUSTER_SECTORS) && f_getfree("", &free_clusters, &fs) == FR_OK
+		&& f_open(&file, "OLD.dat", FA_WRITE|FA_CREATE_ALWAYS) == FR_OK;
+	ok = ok && f_expand(&file, (FSIZE_t)free_clusters * fs->csize * 512, 1) == FR_OK;
+	ok = f_close(&file) == FR_OK && ok && _file_aus("OLD.dat", aus);
+
+	SD_ResetStats();
+	start = Host_Now();
+	ok = ok && f_unlink("OLD.dat") == FR_OK;
+	run->delete_us = (uint32_t)(Host_Now() - start);
+	SD_GetStats(&sd_stats);
+	run->sectors_erased = sd_stats.sectors_erased;
+
+	// without TRIM the card still holds the old data
+	for (au = 0; ok && !trim && au < _params.sectors / _params.au_sectors; ++au)
+	{
+		if (aus[au])
+			ok = Card_Write(au * _params.au_sectors, zeros, 1, 0, &busy_us);
+	}
+
+	// the next flight, after a power up
+	Card_ResetStats();
+	ok = ok && Volume_Mount() && _log("NEW.dat", run);
+	Card_GetStats(&card_stats);
+	run->au_cleans = card_stats.au_cleans;
+
+	free(aus);
+	return ok;
+}
+
+static void _print(const char *name, const struct Run *run)
+{
+	printf("  %-13s %4u AU cleans, %6u writes, %6.1f us mean, max %6u us, %4u over %u us\n", name, run->au_cleans,
+		run->writes, (double)run->write_us / run->writes, run->max_write_us, run->slow_writes, TEST_SLOW_WRITE_US);
+}
+
+// every record of the new log is on the card
+static uint8_t _new_log(const struct Run *run, struct LogFmt_Record *first)
+{
+	struct LogFmt_Header header;
+	uint32_t num_records, num_blocks;
+
+	return Volume_ReadLog("NEW.dat", 0, &header, first, 1, &num_records, &num_blocks)
+		&& num_records == run->records;
+}
+
+int main(int argc, char *argv[])
+{
+	struct Run with_trim, without_trim;
+	struct LogFmt_Record first_with, first_without;
+	int opt;
+	uint8_t ok;
+
+	Card_Defaults(&_params);
+	_params.sectors = TEST_SECTORS;
+	_params.used = 1;
+
+	while ((opt = getopt(argc, argv, "o:")) != -1)
+	{
+		if (opt != 'o' || !Card_SetParam(&_params, optarg))
+		{
+			printf("usage: trimbench [-o name=value]... [image file]\n");
+			Card_PrintParams(&_params);
+			return 1;
+		}
+	}
+	if (optind < argc)
+		_image = argv[optind];
+
+	ff_init_syncobj();
+	disk_init_lock();
+	Log_Init();
+
+	ok = _run(0, &without_trim) && _new_log(&without_trim, &first_without);
+	Card_Close();
+	Host_Check(ok, "log over the old clusters without TRIM");
+
+	ok = _run(1, &with_trim) && _new_log(&with_trim, &first_with);
+	Host_Check(ok, "log over the old clusters with TRIM");
+
+	_print("without TRIM", &without_trim);
+	_print("with TRIM", &with_trim);
+	printf("  deleting the old flights erased %u sectors in %.1f ms\n", with_trim.sectors_erased, with_trim.delete_us / 1000.0);
+
+	Host_Check(with_trim.records == without_trim.records && Volume_SameRecord(&first_with, &first_without),
+		"same log either way");
+	Host_Check(with_trim.sectors_erased > 0 && with_trim.au_cleans < without_trim.au_cleans
+		&& with_trim.slow_writes < without_trim.slow_writes, "fewer block writes wait for a clean with TRIM");
+
+	Card_Close();
+	return Host_Summary();
+}